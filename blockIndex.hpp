@@ -0,0 +1,295 @@
+#pragma once
+
+#include <string>
+#include <fstream>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <cerrno>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <uhd/types/metadata.hpp>
+
+//==============================================================================
+// <file>_index.bin sits next to the _chanN.bin files and has one fixed size
+// entry per recv() block, so a device or GPS time can be turned into a byte
+// offset in any channel file without reading the samples. All fields are
+// little endian. readIndex.m reads the same layout.
+
+struct IndexHeader {
+	char magic[8];			// "USRPIDX1"
+	uint32_t headerSize;	// sizeof(IndexHeader)
+	uint32_t entrySize;		// sizeof(IndexEntry)
+	double rate;			// samples per second per channel
+	uint32_t numChannels;
+	uint32_t bytesPerSample;// 4 for interleaved IQ shorts, see sampleConvert.hpp for the others
+	int64_t gpsOffset;		// GPS seconds minus device seconds, 0 if unknown
+	uint32_t hasGpsOffset;	// 1 if gpsOffset is valid
+	uint32_t reserved;
+};
+
+struct IndexEntry {
+	uint64_t sampleOffset;	// first sample of this block in every channel file
+	int64_t fullSecs;		// device time of the first sample
+	double fracSecs;
+	uint32_t numSamples;	// samples per channel in this block
+	uint32_t flags;			// low byte is the uhd error code, FLAG_* above it
+};
+
+static_assert(sizeof(IndexHeader) == 48, "index header layout changed");
+static_assert(sizeof(IndexEntry) == 32, "index entry layout changed");
+
+enum IndexFlags {
+	INDEX_FLAG_ERROR_MASK	= 0xff,
+	INDEX_FLAG_HAS_TIME		= 1 << 8,	// fullSecs/fracSecs are valid
+	INDEX_FLAG_GAP			= 1 << 9,	// samples are missing between the previous block and this one
+	INDEX_FLAG_SHORT		= 1 << 10	// recv returned fewer samples than requested
+};
+
+//==============================================================================
+// Appends one entry per block, used by a single writer thread
+class IndexWriter {
+public:
+	IndexWriter (const std::string& fileName, double rate, uint32_t numChannels, uint32_t bytesPerSample = 4)
+		: fileName (fileName) {
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, "USRPIDX1", 8);
+		header.headerSize = sizeof(IndexHeader);
+		header.entrySize = sizeof(IndexEntry);
+		header.rate = rate;
+		header.numChannels = numChannels;
+		header.bytesPerSample = bytesPerSample;
+		out.open(fileName, std::ofstream::binary | std::ofstream::trunc);
+		if (not out) {
+			throw std::runtime_error("cannot open " + fileName);
+		}
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	}
+
+	~IndexWriter () {
+		close();
+	}
+
+	// GPS seconds minus device seconds, only known once the GPSDO has been read after the time was set
+	void setGpsOffset (int64_t offset) {
+		header.gpsOffset = offset;
+		header.hasGpsOffset = 1;
+	}
+
+	// record one block, numRequested is what was asked of recv()
+	void append (size_t sampleOffset, size_t numSamples, size_t numRequested, const uhd::rx_metadata_t& md) {
+		IndexEntry entry;
+		entry.sampleOffset = sampleOffset;
+		entry.numSamples = numSamples;
+		entry.flags = md.error_code & INDEX_FLAG_ERROR_MASK;
+		entry.fullSecs = 0;
+		entry.fracSecs = 0.0;
+		if (md.has_time_spec) {
+			entry.flags |= INDEX_FLAG_HAS_TIME;
+			entry.fullSecs = md.time_spec.get_full_secs();
+			entry.fracSecs = md.time_spec.get_frac_secs();
+			// compare against where the previous block said this one should start
+			long long ticks = md.time_spec.to_ticks(header.rate);
+			if (haveExpected and ticks != expectedTicks) {
+				entry.flags |= INDEX_FLAG_GAP;
+				numGaps++;
+				droppedSamples += ticks - expectedTicks;
+			}
+			expectedTicks = ticks + numSamples;
+			haveExpected = true;
+		}
+		if (numSamples < numRequested) {
+			entry.flags |= INDEX_FLAG_SHORT;
+		}
+		out.write(reinterpret_cast<const char*>(&entry), sizeof(entry));
+		numEntries++;
+	}
+
+	void close () {
+		if (not out.is_open()) {
+			return;
+		}
+		// the GPS offset is only known after the file was opened, so rewrite the header
+		out.seekp(0);
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		out.close();
+	}
+
+	size_t entries () const { return numEntries; }
+	size_t gaps () const { return numGaps; }
+	long long dropped () const { return droppedSamples; }
+
+private:
+	std::string fileName;
+	std::ofstream out;
+	IndexHeader header;
+	size_t numEntries = 0;
+	size_t numGaps = 0;
+	long long droppedSamples = 0;
+	long long expectedTicks = 0;
+	bool haveExpected = false;
+};
+
+//==============================================================================
+// Memory maps an index and answers time -> file offset queries. The entry for a
+// time is first guessed directly from the rate, which is right for any capture
+// without gaps; only if that misses does it fall back to a binary search.
+class IndexReader {
+public:
+	explicit IndexReader (const std::string& fileName) {
+		int fd = ::open(fileName.c_str(), O_RDONLY);
+		if (fd < 0) {
+			throw std::runtime_error("cannot open " + fileName + ": " + std::strerror(errno));
+		}
+		struct stat st;
+		fstat(fd, &st);
+		length = st.st_size;
+		if (length < sizeof(IndexHeader)) {
+			::close(fd);
+			throw std::runtime_error(fileName + " is not a recording index");
+		}
+		void* ptr = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (ptr == MAP_FAILED) {
+			throw std::runtime_error("cannot map " + fileName + ": " + std::strerror(errno));
+		}
+		base = static_cast<const char*>(ptr);
+		header = reinterpret_cast<const IndexHeader*>(base);
+		if (memcmp(header->magic, "USRPIDX1", 8) != 0 or header->entrySize != sizeof(IndexEntry)) {
+			munmap(const_cast<char*>(base), length);
+			throw std::runtime_error(fileName + " is not a recording index");
+		}
+		entries = reinterpret_cast<const IndexEntry*>(base + header->headerSize);
+		count = (length - header->headerSize) / sizeof(IndexEntry);
+		firstTimed = nextTimed(0, count);
+	}
+
+	~IndexReader () {
+		munmap(const_cast<char*>(base), length);
+	}
+
+	IndexReader (const IndexReader&) = delete;
+	IndexReader& operator= (const IndexReader&) = delete;
+
+	const IndexHeader& info () const { return *header; }
+	size_t size () const { return count; }
+	const IndexEntry& operator[] (size_t i) const { return entries[i]; }
+
+	// sample number in every channel file of the sample taken at device time seconds,
+	// returns false if the time is before the start, after the end or inside a gap
+	bool sampleForDeviceTime (double seconds, uint64_t& sample) const {
+		if (firstTimed == count or seconds < entryTime(entries[firstTimed])) {
+			return false;
+		}
+		const IndexEntry& entry = entries[entryForDeviceTime(seconds)];
+		if (not contains(entry, seconds)) {
+			return false;
+		}
+		sample = entry.sampleOffset + uint64_t(std::floor((seconds - entryTime(entry)) * header->rate + 1e-6));
+		return true;
+	}
+
+	// byte offset in every channel file, or -1 if the time was not recorded
+	long long byteOffsetForDeviceTime (double seconds) const {
+		uint64_t sample;
+		if (not sampleForDeviceTime(seconds, sample)) {
+			return -1;
+		}
+		return sample * header->bytesPerSample;
+	}
+
+	// same as above for a GPS time in seconds, needs a recording made with a GPSDO
+	long long byteOffsetForGpsTime (double gpsSeconds) const {
+		if (not header->hasGpsOffset) {
+			return -1;
+		}
+		return byteOffsetForDeviceTime(gpsSeconds - header->gpsOffset);
+	}
+
+	// the last timed entry starting at or before device time seconds, the first timed one for an earlier time
+	// and size() if no entry has a time
+	size_t entryForDeviceTime (double seconds) const {
+		if (firstTimed == count) {
+			return count;
+		}
+		const IndexEntry& first = entries[firstTimed];
+		// guess the entry assuming equal blocks and no gaps
+		double samplesIn = (seconds - entryTime(first)) * header->rate;
+		if (samplesIn < 0) {
+			return firstTimed;
+		}
+		double blocksIn = samplesIn / std::max<uint32_t>(first.numSamples, 1);
+		size_t guess = nextTimed(blocksIn >= count ? count - 1 : std::min(count - 1, firstTimed + size_t(blocksIn)), count);
+		if (guess < count and contains(entries[guess], seconds)) {
+			return guess;
+		}
+		size_t lo = firstTimed, hi = count;
+		while (hi - lo > 1) {
+			size_t mid = (lo + hi) / 2;
+			size_t probe = nextTimed(mid, hi);
+			if (probe == hi) {
+				// nothing timed in the upper half
+				hi = mid;
+			} else if (entryTime(entries[probe]) <= seconds) {
+				lo = probe;
+			} else {
+				hi = mid;
+			}
+		}
+		return lo;
+	}
+
+	// device time of a sample in every channel file, returns false if its block has no time or it was not recorded
+	bool deviceTimeForSample (uint64_t sample, double& seconds) const {
+		// the last entry starting at or before the sample, entries are in sample order
+		size_t i = std::upper_bound(entries, entries + count, sample,
+									[](uint64_t value, const IndexEntry& entry) { return value < entry.sampleOffset; }) - entries;
+		// timeouts carry no samples, the block before them does
+		while (i > 0 and entries[i - 1].numSamples == 0) {
+			i--;
+		}
+		if (i == 0) {
+			return false;
+		}
+		const IndexEntry& entry = entries[i - 1];
+		if (sample >= entry.sampleOffset + entry.numSamples or not (entry.flags & INDEX_FLAG_HAS_TIME)) {
+			return false;
+		}
+		seconds = entryTime(entry) + (sample - entry.sampleOffset) / header->rate;
+		return true;
+	}
+
+	// device time of an entry's first sample
+	static double entryTime (const IndexEntry& entry) {
+		return entry.fullSecs + entry.fracSecs;
+	}
+
+private:
+	// first entry at or after i (and before end) that carries samples and a time, end if there is none
+	size_t nextTimed (size_t i, size_t end) const {
+		while (i < end and (entries[i].numSamples == 0 or not (entries[i].flags & INDEX_FLAG_HAS_TIME))) {
+			i++;
+		}
+		return i;
+	}
+
+	bool contains (const IndexEntry& entry, double seconds) const {
+		double start = entryTime(entry);
+		// half a sample of slack for rounding in the stored time
+		double halfSample = 0.5 / header->rate;
+		return seconds >= start - halfSample and seconds < start + entry.numSamples / header->rate - halfSample;
+	}
+
+	const char* base = nullptr;
+	size_t length = 0;
+	const IndexHeader* header = nullptr;
+	const IndexEntry* entries = nullptr;
+	size_t count = 0;
+	size_t firstTimed = 0;
+};
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <chrono>
+#include <thread>
+#include <cstring>
+
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <linux/ethtool.h>
+#include <linux/sockios.h>
+
+#include <boost/format.hpp>
+
+#include <uhd/usrp/multi_usrp.hpp>
+
+//==============================================================================
+// Pieces of a faster start: a check whether the host network is already set up
+// the way usrp_x300_init.sh leaves it, so the script and its sudo calls can be
+// skipped, a GPS lock wait that polls every motherboard in the same second,
+// and a timer that breaks the start-up into phases.
+namespace bringup {
+
+// the settings usrp_x300_init.sh applies
+const int NETWORK_MTU = 9000;
+const unsigned RING_ENTRIES = 4092;
+const long SOCKET_BUFFER_BYTES = 50000000;
+
+// seconds ahead of the device time that timed channel settings and the fast start are scheduled,
+// enough for the commands to reach every board and for the metadata to be written before the first sample
+const double COMMAND_LEAD = 0.1;
+const double START_LEAD = 0.5;
+
+inline long readNumber (const std::string& path) {
+	std::ifstream in (path);
+	long value = -1;
+	in >> value;
+	return value;
+}
+
+// rx ring size of an interface through the ethtool ioctl, which does not need root, 0 if unknown
+inline unsigned ringEntries (const std::string& interface) {
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		return 0;
+	}
+	ethtool_ringparam ring = {};
+	ring.cmd = ETHTOOL_GRINGPARAM;
+	ifreq request = {};
+	strncpy(request.ifr_name, interface.c_str(), IFNAMSIZ - 1);
+	request.ifr_data = reinterpret_cast<char*>(&ring);
+	int ret = ioctl(fd, SIOCETHTOOL, &request);
+	close(fd);
+	return ret == 0 ? ring.rx_pending : 0;
+}
+
+// what still differs from usrp_x300_init.sh, empty when the script would change nothing
+inline std::vector<std::string> networkProblems (const std::vector<std::string>& interfaces) {
+	std::vector<std::string> problems;
+	for (const std::string& interface : interfaces) {
+		long mtu = readNumber("/sys/class/net/" + interface + "/mtu");
+		if (mtu < NETWORK_MTU) {
+			problems.push_back((boost::format("%s MTU %i") % interface % mtu).str());
+		}
+		unsigned ring = ringEntries(interface);
+		if (ring < RING_ENTRIES) {
+			problems.push_back((boost::format("%s rx ring %i") % interface % ring).str());
+		}
+	}
+	for (const char* name : {"rmem_max", "wmem_max"}) {
+		long bytes = readNumber(std::string("/proc/sys/net/core/") + name);
+		if (bytes < SOCKET_BUFFER_BYTES) {
+			problems.push_back((boost::format("net.core.%s %i") % name % bytes).str());
+		}
+	}
+	return problems;
+}
+
+// wait for GPS lock on every motherboard at once, returns the boards that locked
+inline std::vector<bool> waitForGpsLock (uhd::usrp::multi_usrp::sptr usrp, double timeout) {
+	const size_t numMboards = usrp->get_num_mboards();
+	std::vector<bool> locked (numMboards, false);
+	auto start = std::chrono::steady_clock::now();
+	for (size_t numLocked = 0; ; ) {
+		for (size_t mboard = 0; mboard < numMboards; mboard++) {
+			if (not locked[mboard] and usrp->get_mboard_sensor("gps_locked", mboard).to_bool()) {
+				locked[mboard] = true;
+				numLocked++;
+				std::cout << boost::format("\nGPS LOCKED on mboard: %i") % mboard << std::endl;
+			}
+		}
+		double waited = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (numLocked == numMboards or waited >= timeout) {
+			break;
+		}
+		std::cout << boost::format("%i/%i locked after %.0f/%.0f s\r") % numLocked % numMboards % waited % timeout << std::flush;
+		std::this_thread::sleep_for(std::chrono::milliseconds(250));
+	}
+	return locked;
+}
+
+// start-up phases in order, each one lasting from the previous mark to its own
+class PhaseTimer {
+public:
+	PhaseTimer () : start (std::chrono::steady_clock::now()), last (start) {}
+
+	void mark (const std::string& phase) {
+		auto now = std::chrono::steady_clock::now();
+		phases.emplace_back(phase, std::chrono::duration<double>(now - last).count());
+		last = now;
+	}
+
+	// seconds from construction to now
+	double elapsed () const {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	std::string report () const {
+		std::string text;
+		for (const auto& phase : phases) {
+			text += (boost::format("%s%s %.3f s") % (text.empty() ? "" : ", ") % phase.first % phase.second).str();
+		}
+		return text;
+	}
+
+private:
+	std::chrono::steady_clock::time_point start, last;
+	std::vector<std::pair<std::string, double>> phases;
+};
+
+}
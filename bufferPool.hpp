@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+#include <cstring>
+#include <cerrno>
+
+#include <sys/mman.h>
+
+#include "numaPlacement.hpp"
+
+//==============================================================================
+// One large anonymous mapping that all receive blocks are carved out of.
+// Explicit huge pages (MAP_HUGETLB) are used when the system has some reserved,
+// otherwise transparent huge pages are requested with madvise. Either way the
+// memory is page-aligned, so recv() can fill it and O_DIRECT can write it as is.
+// Given a NUMA node, the pages are placed on it, next to the NIC that fills them.
+class HugePageBuffer {
+public:
+	static const size_t HUGE_PAGE_SIZE = 2 << 20;
+
+	explicit HugePageBuffer (size_t numBytes, int numaNode = -1) {
+		length = (numBytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+		void* ptr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (ptr != MAP_FAILED) {
+			explicitHugePages = true;
+		} else {
+			ptr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (ptr == MAP_FAILED) {
+				throw std::runtime_error("cannot map " + std::to_string(length) + " bytes of sample buffers: " + std::strerror(errno));
+			}
+			madvise(ptr, length, MADV_HUGEPAGE);
+		}
+		base = static_cast<char*>(ptr);
+		if (numaNode >= 0) {
+			nodeBound = numa::bindMemory(base, length, numaNode);
+		}
+		// touch every page now so the recv thread never takes a page fault
+		memset(base, 0, length);
+	}
+
+	~HugePageBuffer () {
+		munmap(base, length);
+	}
+
+	HugePageBuffer (const HugePageBuffer&) = delete;
+	HugePageBuffer& operator= (const HugePageBuffer&) = delete;
+
+	char* data () const { return base; }
+	size_t size () const { return length; }
+	// true if backed by reserved huge pages, false if relying on transparent huge pages
+	bool hugePages () const { return explicitHugePages; }
+	// true if the pages were placed on the requested NUMA node
+	bool numaBound () const { return nodeBound; }
+
+private:
+	char* base = nullptr;
+	size_t length = 0;
+	bool explicitHugePages = false;
+	bool nodeBound = false;
+};
@@ -23,3 +23,6 @@ mkdir "$folder_name"
 
 # DVB Calibration
 ./usrpMultiSample --dev="addr0=192.168.40.2, addr1=192.168.50.2" --file="$folder_name/calibration" --duration="60" --rate="2.5e6" --freq="223.936e6" --gainAll="68" --wait="120" --chan="6" --ref="gpsdo" --pps="gpsdo" --print="n" --spb="2"
+
+# Delay, phase and gain of every channel against channel 0
+./usrpCalibrate --file="$folder_name/calibration" --rate="2.5e6"
@@ -0,0 +1,377 @@
+#pragma once
+
+#include <vector>
+#include <complex>
+#include <string>
+#include <sstream>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cmath>
+#include <ctime>
+#include <algorithm>
+#include <stdexcept>
+
+#include <boost/format.hpp>
+
+#include "sampleConvert.hpp"
+#include "fileWriter.hpp"
+#include "telemetry.hpp"
+
+//==============================================================================
+// Host-side digital down-conversion of selected sub-bands, so a wide capture
+// is stored as only the narrow streams that matter, e.g. one or more DAB
+// ensembles out of 12.5 MS/s. Every sub-band is mixed to 0 Hz by an NCO and
+// decimated by an integer factor through a polyphase lowpass. Only every
+// decimation-th output of the FIR is computed, which is the polyphase form.
+// The FIR dot product runs on split float arrays with AVX2 or NEON.
+//
+// A sub-band is given as channel:centre_Hz:bandwidth_Hz. Its decimation is
+// the largest integer that keeps the output rate at least 1.25 times the
+// bandwidth. The filter passes the bandwidth and has its transition in the
+// rest of the output band, so nothing inside the bandwidth is aliased.
+
+namespace ddc {
+
+// the taps times re and times im, the taps already reversed so both run forward
+inline void firScalar (const float* taps, const float* re, const float* im, size_t numTaps, float& outRe, float& outIm) {
+	float sumRe = 0.0f, sumIm = 0.0f;
+	for (size_t j = 0; j < numTaps; j++) {
+		sumRe += taps[j] * re[j];
+		sumIm += taps[j] * im[j];
+	}
+	outRe = sumRe;
+	outIm = sumIm;
+}
+
+#ifdef SAMPLE_CONVERT_X86
+__attribute__((target("avx2")))
+inline float horizontalSum (__m256 v) {
+	__m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+	return _mm_cvtss_f32(sum);
+}
+
+__attribute__((target("avx2")))
+inline void firAvx2 (const float* taps, const float* re, const float* im, size_t numTaps, float& outRe, float& outIm) {
+	// two accumulators per part so consecutive adds do not wait on each other
+	__m256 re0 = _mm256_setzero_ps(), re1 = _mm256_setzero_ps();
+	__m256 im0 = _mm256_setzero_ps(), im1 = _mm256_setzero_ps();
+	size_t j = 0;
+	for (; j + 16 <= numTaps; j += 16) {
+		__m256 t0 = _mm256_loadu_ps(taps + j), t1 = _mm256_loadu_ps(taps + j + 8);
+		re0 = _mm256_add_ps(re0, _mm256_mul_ps(t0, _mm256_loadu_ps(re + j)));
+		re1 = _mm256_add_ps(re1, _mm256_mul_ps(t1, _mm256_loadu_ps(re + j + 8)));
+		im0 = _mm256_add_ps(im0, _mm256_mul_ps(t0, _mm256_loadu_ps(im + j)));
+		im1 = _mm256_add_ps(im1, _mm256_mul_ps(t1, _mm256_loadu_ps(im + j + 8)));
+	}
+	float tailRe, tailIm;
+	firScalar(taps + j, re + j, im + j, numTaps - j, tailRe, tailIm);
+	outRe = horizontalSum(_mm256_add_ps(re0, re1)) + tailRe;
+	outIm = horizontalSum(_mm256_add_ps(im0, im1)) + tailIm;
+}
+#endif
+
+#ifdef SAMPLE_CONVERT_NEON
+inline void firNeon (const float* taps, const float* re, const float* im, size_t numTaps, float& outRe, float& outIm) {
+	float32x4_t re0 = vdupq_n_f32(0.0f), re1 = vdupq_n_f32(0.0f);
+	float32x4_t im0 = vdupq_n_f32(0.0f), im1 = vdupq_n_f32(0.0f);
+	size_t j = 0;
+	for (; j + 8 <= numTaps; j += 8) {
+		float32x4_t t0 = vld1q_f32(taps + j), t1 = vld1q_f32(taps + j + 4);
+		re0 = vmlaq_f32(re0, t0, vld1q_f32(re + j));
+		re1 = vmlaq_f32(re1, t1, vld1q_f32(re + j + 4));
+		im0 = vmlaq_f32(im0, t0, vld1q_f32(im + j));
+		im1 = vmlaq_f32(im1, t1, vld1q_f32(im + j + 4));
+	}
+	float tailRe, tailIm;
+	firScalar(taps + j, re + j, im + j, numTaps - j, tailRe, tailIm);
+	outRe = vaddvq_f32(vaddq_f32(re0, re1)) + tailRe;
+	outIm = vaddvq_f32(vaddq_f32(im0, im1)) + tailIm;
+}
+#endif
+
+// windowed-sinc lowpass with a Blackman window and unity gain at 0 Hz, cutoff as a fraction of the sample rate
+inline std::vector<float> lowpass (size_t numTaps, double cutoff) {
+	std::vector<double> taps (numTaps);
+	double sum = 0.0;
+	const double middle = (numTaps - 1) / 2.0;
+	for (size_t k = 0; k < numTaps; k++) {
+		double t = k - middle;
+		double sinc = t == 0.0 ? 2.0 * cutoff : std::sin(2.0 * M_PI * cutoff * t) / (M_PI * t);
+		double window = numTaps > 1 ? 0.42 - 0.5 * std::cos(2.0 * M_PI * k / (numTaps - 1)) + 0.08 * std::cos(4.0 * M_PI * k / (numTaps - 1)) : 1.0;
+		taps[k] = sinc * window;
+		sum += taps[k];
+	}
+	std::vector<float> normalized (numTaps);
+	for (size_t k = 0; k < numTaps; k++) {
+		normalized[k] = taps[k] / sum;
+	}
+	return normalized;
+}
+
+} // namespace ddc
+
+//==============================================================================
+struct SubBandSpec {
+	size_t channel;
+	double freq;		// centre in Hz
+	double bandwidth;	// Hz
+};
+
+// channel:centre:bandwidth entries separated by commas, e.g. 0:223.936e6:1.536e6,0:225.648e6:1.536e6
+inline std::vector<SubBandSpec> parseSubBands (const std::string& list) {
+	std::vector<SubBandSpec> specs;
+	std::stringstream entries (list);
+	std::string entry;
+	while (std::getline(entries, entry, ',')) {
+		SubBandSpec spec;
+		char colon1 = 0, colon2 = 0;
+		std::istringstream fields (entry);
+		if (not (fields >> spec.channel >> colon1 >> spec.freq >> colon2 >> spec.bandwidth) or colon1 != ':' or colon2 != ':' or spec.bandwidth <= 0) {
+			throw std::runtime_error("cannot read sub-band " + entry + " (channel:centre_Hz:bandwidth_Hz)");
+		}
+		specs.push_back(spec);
+	}
+	return specs;
+}
+
+//==============================================================================
+// One sub-band of one channel. process() is only ever called by one thread at a time.
+class SubBandDdc {
+public:
+	// FIR taps per output sample, 24 with the Blackman window keeps aliases below about -70 dB
+	static const size_t TAPS_PER_PHASE = 24;
+
+	SubBandDdc (const SubBandSpec& spec, double channelFreq, double rate, bool vectorized = true)
+		: spec (spec), rate (rate) {
+		decimation = std::max<size_t>(1, size_t(std::floor(rate / (1.25 * spec.bandwidth))));
+		if (std::abs(spec.freq - channelFreq) + spec.bandwidth / 2 > rate / 2) {
+			throw std::runtime_error((boost::format("sub-band %.6f MHz +- %.3f MHz is outside channel %i at %.6f MHz, %.3f Msps")
+									  % (spec.freq / 1e6) % (spec.bandwidth / 2e6) % spec.channel % (channelFreq / 1e6) % (rate / 1e6)).str());
+		}
+		// an odd length keeps the group delay at a whole number of input samples
+		const size_t numTaps = TAPS_PER_PHASE * decimation + 1;
+		std::vector<float> prototype = ddc::lowpass(numTaps, 0.5 / decimation);
+		taps.assign(prototype.rbegin(), prototype.rend());
+		// the first output has numTaps - 1 zeros before the first sample
+		re.assign(numTaps - 1, 0.0f);
+		im.assign(numTaps - 1, 0.0f);
+		step = std::polar(1.0, -2.0 * M_PI * (spec.freq - channelFreq) / rate);
+		fir = ddc::firScalar;
+		name = "scalar";
+		if (vectorized) {
+#if defined(SAMPLE_CONVERT_X86)
+			if (convert::haveAvx2()) {
+				fir = ddc::firAvx2;
+				name = "avx2";
+			}
+#elif defined(SAMPLE_CONVERT_NEON)
+			fir = ddc::firNeon;
+			name = "neon";
+#endif
+		}
+	}
+
+	// the output samples for count more input samples, at most count / decimation + 1 of them
+	size_t process (const std::complex<short>* in, size_t count, std::complex<short>* out) {
+		const size_t numTaps = taps.size();
+		const size_t have = re.size();
+		re.resize(have + count);
+		im.resize(have + count);
+		for (size_t k = 0; k < count; k++) {
+			std::complex<double> mixed = std::complex<double> (in[k].real(), in[k].imag()) * phasor;
+			re[have + k] = mixed.real();
+			im[have + k] = mixed.imag();
+			phasor *= step;
+		}
+		// keep the phasor on the unit circle, the rounding of a few million rotations would otherwise add up
+		phasor /= std::abs(phasor);
+
+		size_t numOut = 0, window = 0;
+		for (; window + numTaps <= re.size(); window += decimation) {
+			float outRe, outIm;
+			fir(taps.data(), re.data() + window, im.data() + window, numTaps, outRe, outIm);
+			out[numOut++] = std::complex<short> (saturate(outRe), saturate(outIm));
+		}
+		// the next window starts at window, everything before it is no longer needed
+		re.erase(re.begin(), re.begin() + window);
+		im.erase(im.begin(), im.begin() + window);
+		numOutput += numOut;
+		return numOut;
+	}
+
+	const SubBandSpec& specification () const { return spec; }
+	size_t decimationFactor () const { return decimation; }
+	double outputRate () const { return rate / decimation; }
+	size_t numTaps () const { return taps.size(); }
+	// input samples from an input sample to the output it is the middle of
+	double groupDelay () const { return (taps.size() - 1) / 2.0; }
+	uint64_t samplesOut () const { return numOutput; }
+	uint64_t clippedValues () const { return numClipped; }
+	const char* kernel () const { return name; }
+
+private:
+	short saturate (float value) {
+		long rounded = std::lround(value);
+		if (rounded > 32767 or rounded < -32768) {
+			numClipped++;
+			return rounded > 0 ? 32767 : -32768;
+		}
+		return short(rounded);
+	}
+
+	SubBandSpec spec;
+	double rate;
+	size_t decimation;
+	std::vector<float> taps;
+	std::vector<float> re, im;
+	std::complex<double> phasor {1.0, 0.0}, step;
+	uint64_t numOutput = 0, numClipped = 0;
+	void (*fir) (const float*, const float*, const float*, size_t, float&, float&);
+	const char* name;
+};
+
+//==============================================================================
+// Every sub-band with its output file. process() takes one block of one
+// channel and returns once all of that channel's sub-bands are written. It is
+// called by the writer thread that owns the channel, so different channels
+// run in parallel on the writers. A channel with several sub-bands also
+// spreads them over threads of its own, one per extra sub-band.
+class Channelizer {
+public:
+	Channelizer (const std::vector<SubBandSpec>& specs, const std::vector<double>& channelFreqs, double rate, const std::string& filePrefix,
+				 ChannelWriter::Mode mode, size_t ioSize, size_t ioDepth, double expectedSamples)
+		: byChannel (channelFreqs.size()) {
+		for (size_t k = 0; k < specs.size(); k++) {
+			if (specs[k].channel >= channelFreqs.size()) {
+				throw std::runtime_error((boost::format("sub-band %i is on channel %i, there are %i channels") % k % specs[k].channel % channelFreqs.size()).str());
+			}
+			std::unique_ptr<Band> band (new Band (specs[k], channelFreqs[specs[k].channel], rate));
+			band->fileName = (boost::format("%s_chan%i_sub%i.bin") % filePrefix % specs[k].channel % k).str();
+			band->writer.reset(new ChannelWriter (band->fileName, mode, ioSize, ioDepth,
+												  expectedSamples / band->ddc.decimationFactor() * sizeof(std::complex<short>)));
+			byChannel[specs[k].channel].push_back(band.get());
+			bands.push_back(std::move(band));
+		}
+		// the first sub-band of a channel runs on the writer thread itself
+		for (auto& channelBands : byChannel) {
+			for (size_t k = 1; k < channelBands.size(); k++) {
+				Band* band = channelBands[k];
+				band->thread = std::thread (&Channelizer::work, this, band);
+			}
+		}
+	}
+
+	~Channelizer () {
+		stopThreads();
+	}
+
+	Channelizer (const Channelizer&) = delete;
+	Channelizer& operator= (const Channelizer&) = delete;
+
+	void process (size_t channel, const std::complex<short>* samples, size_t count) {
+		std::vector<Band*>& channelBands = byChannel[channel];
+		if (channelBands.empty() or count == 0) {
+			return;
+		}
+		for (size_t k = 1; k < channelBands.size(); k++) {
+			std::lock_guard<std::mutex> lock (channelBands[k]->mutex);
+			channelBands[k]->input = samples;
+			channelBands[k]->count = count;
+			channelBands[k]->wake.notify_one();
+		}
+		run(*channelBands[0], samples, count);
+		for (size_t k = 1; k < channelBands.size(); k++) {
+			std::unique_lock<std::mutex> lock (channelBands[k]->mutex);
+			channelBands[k]->wake.wait(lock, [&] { return channelBands[k]->input == nullptr; });
+			if (not channelBands[k]->error.empty()) {
+				throw std::runtime_error(channelBands[k]->error);
+			}
+		}
+	}
+
+	// flush and trim every sub-band file
+	void finish () {
+		stopThreads();
+		for (auto& band : bands) {
+			band->writer->close();
+		}
+	}
+
+	size_t size () const { return bands.size(); }
+	const SubBandDdc& subBand (size_t k) const { return bands[k]->ddc; }
+	const std::string& fileName (size_t k) const { return bands[k]->fileName; }
+	double cpuTime (size_t k) const { return bands[k]->cpuTime; }
+
+private:
+	struct Band {
+		Band (const SubBandSpec& spec, double channelFreq, double rate) : ddc (spec, channelFreq, rate) {}
+
+		SubBandDdc ddc;
+		std::string fileName;
+		std::unique_ptr<ChannelWriter> writer;
+		std::vector<std::complex<short>> output;
+		double cpuTime = 0.0;
+		// hand-over to the band's own thread
+		std::thread thread;
+		std::mutex mutex;
+		std::condition_variable wake;
+		const std::complex<short>* input = nullptr;
+		size_t count = 0;
+		bool stop = false;
+		std::string error;
+	};
+
+	void run (Band& band, const std::complex<short>* samples, size_t count) {
+		timespec cpuStart, cpuEnd;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuStart);
+		band.output.resize(count / band.ddc.decimationFactor() + 1);
+		size_t numOut = band.ddc.process(samples, count, band.output.data());
+		band.writer->write(band.output.data(), numOut * sizeof(std::complex<short>));
+		// the output buffer is reused on the next block
+		band.writer->sync();
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuEnd);
+		band.cpuTime += (cpuEnd.tv_sec - cpuStart.tv_sec) + (cpuEnd.tv_nsec - cpuStart.tv_nsec) * 1e-9;
+	}
+
+	void work (Band* band) {
+		telemetry::nameThread("ddc" + std::to_string(band->ddc.specification().channel));
+		while (true) {
+			std::unique_lock<std::mutex> lock (band->mutex);
+			band->wake.wait(lock, [&] { return band->input != nullptr or band->stop; });
+			if (band->stop) {
+				return;
+			}
+			const std::complex<short>* samples = band->input;
+			size_t count = band->count;
+			lock.unlock();
+			try {
+				run(*band, samples, count);
+			} catch (const std::exception& e) {
+				band->error = e.what();
+			}
+			lock.lock();
+			band->input = nullptr;
+			band->wake.notify_one();
+		}
+	}
+
+	void stopThreads () {
+		for (auto& band : bands) {
+			if (band->thread.joinable()) {
+				{
+					std::lock_guard<std::mutex> lock (band->mutex);
+					band->stop = true;
+					band->wake.notify_one();
+				}
+				band->thread.join();
+			}
+		}
+	}
+
+	std::vector<std::unique_ptr<Band>> bands;
+	std::vector<std::vector<Band*>> byChannel;
+};
@@ -0,0 +1,276 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <mutex>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+
+#include <boost/format.hpp>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CHUNK_CHECKSUM_X86 1
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CHUNK_CHECKSUM_ARM 1
+#endif
+
+//==============================================================================
+// CRC32C (Castagnoli) of the channel files, one per chunk of a few MB, so a
+// copy on the NAS can be checked without the original and a bad checksum
+// points at a few seconds of one channel rather than a whole file.
+//
+// The writer threads checksum each block right after handing it to the
+// file, while it is still in their cache, so the samples are not read twice.
+// x86-64 uses the SSE4.2 crc32 instruction when the CPU has it, picked at
+// run time like the AVX2 conversion kernels; ARM uses the CRC32 instructions
+// when the build targets them (-march=armv8-a+crc, or any ARMv8.1 core).
+// Elsewhere a slicing-by-8 table does it about a fifth as fast.
+//
+// <file>_manifest.txt holds one tab separated line per chunk:
+//   # file  channel  byte offset  bytes  first sample  samples  crc32c
+// Chunks end on block boundaries, so they hold whole blocks and are at least
+// the chunk size, except the last one of a file. usrpVerify reads it back.
+namespace crc32c {
+
+const uint32_t POLYNOMIAL = 0x82f63b78;		// reversed Castagnoli polynomial
+
+// --- scalar --------------------------------------------------------------------
+
+// table[k][b] is the CRC of byte b followed by k zero bytes
+struct Tables {
+	uint32_t table[8][256];
+
+	Tables () {
+		for (uint32_t b = 0; b < 256; b++) {
+			uint32_t crc = b;
+			for (int bit = 0; bit < 8; bit++) {
+				crc = crc & 1 ? (crc >> 1) ^ POLYNOMIAL : crc >> 1;
+			}
+			table[0][b] = crc;
+		}
+		for (int k = 1; k < 8; k++) {
+			for (uint32_t b = 0; b < 256; b++) {
+				table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xff];
+			}
+		}
+	}
+};
+
+inline const Tables& tables () {
+	static const Tables instance;
+	return instance;
+}
+
+// eight bytes at a time through eight tables, little endian
+inline uint32_t updateScalar (uint32_t crc, const unsigned char* data, size_t numBytes) {
+	const Tables& t = tables();
+	for (; numBytes >= 8; numBytes -= 8, data += 8) {
+		uint64_t word;
+		memcpy(&word, data, sizeof(word));
+		word ^= crc;
+		crc = t.table[7][word & 0xff] ^ t.table[6][(word >> 8) & 0xff] ^ t.table[5][(word >> 16) & 0xff] ^ t.table[4][(word >> 24) & 0xff]
+			  ^ t.table[3][(word >> 32) & 0xff] ^ t.table[2][(word >> 40) & 0xff] ^ t.table[1][(word >> 48) & 0xff] ^ t.table[0][word >> 56];
+	}
+	for (; numBytes > 0; numBytes--, data++) {
+		crc = t.table[0][(crc ^ *data) & 0xff] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+// --- SSE4.2 --------------------------------------------------------------------
+
+#ifdef CHUNK_CHECKSUM_X86
+__attribute__((target("sse4.2")))
+inline uint32_t updateSse42 (uint32_t crc, const unsigned char* data, size_t numBytes) {
+	uint64_t state = crc;
+	for (; numBytes >= 8; numBytes -= 8, data += 8) {
+		uint64_t word;
+		memcpy(&word, data, sizeof(word));
+		state = _mm_crc32_u64(state, word);
+	}
+	crc = uint32_t(state);
+	for (; numBytes > 0; numBytes--, data++) {
+		crc = _mm_crc32_u8(crc, *data);
+	}
+	return crc;
+}
+
+inline bool haveSse42 () {
+	static const bool available = __builtin_cpu_supports("sse4.2");
+	return available;
+}
+#endif
+
+// --- ARMv8 CRC -----------------------------------------------------------------
+
+#ifdef CHUNK_CHECKSUM_ARM
+inline uint32_t updateArm (uint32_t crc, const unsigned char* data, size_t numBytes) {
+	for (; numBytes >= 8; numBytes -= 8, data += 8) {
+		uint64_t word;
+		memcpy(&word, data, sizeof(word));
+		crc = __crc32cd(crc, word);
+	}
+	for (; numBytes > 0; numBytes--, data++) {
+		crc = __crc32cb(crc, *data);
+	}
+	return crc;
+}
+#endif
+
+// continues a CRC over more bytes, crc is the running register (start with ~0, finish with ~)
+inline uint32_t update (uint32_t crc, const void* data, size_t numBytes, bool accelerated = true) {
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+#if defined(CHUNK_CHECKSUM_X86)
+	if (accelerated and haveSse42()) {
+		return updateSse42(crc, bytes, numBytes);
+	}
+#elif defined(CHUNK_CHECKSUM_ARM)
+	if (accelerated) {
+		return updateArm(crc, bytes, numBytes);
+	}
+#endif
+	return updateScalar(crc, bytes, numBytes);
+}
+
+inline uint32_t checksum (const void* data, size_t numBytes, bool accelerated = true) {
+	return ~update(~uint32_t(0), data, numBytes, accelerated);
+}
+
+// name of the kernel update() uses on this machine
+inline const char* kernel (bool accelerated = true) {
+#if defined(CHUNK_CHECKSUM_X86)
+	return accelerated and haveSse42() ? "sse4.2" : "scalar";
+#elif defined(CHUNK_CHECKSUM_ARM)
+	return accelerated ? "armv8 crc" : "scalar";
+#else
+	return "scalar";
+#endif
+}
+
+} // namespace crc32c
+
+//==============================================================================
+// One line of the manifest
+struct ManifestEntry {
+	std::string file;
+	size_t channel = 0;
+	uint64_t offset = 0;		// bytes into the file
+	uint64_t bytes = 0;
+	uint64_t firstSample = 0;	// in the recording, as in the index
+	uint64_t numSamples = 0;
+	uint32_t crc = 0;
+};
+
+// every chunk of a manifest in the order they were written
+inline std::vector<ManifestEntry> loadManifest (const std::string& fileName) {
+	std::ifstream in (fileName);
+	if (not in) {
+		throw std::runtime_error("cannot open " + fileName);
+	}
+	std::vector<ManifestEntry> entries;
+	std::string line;
+	for (size_t lineNumber = 1; std::getline(in, line); lineNumber++) {
+		if (line.empty() or line[0] == '#') {
+			continue;
+		}
+		std::istringstream fields (line);
+		ManifestEntry entry;
+		if (not std::getline(fields, entry.file, '\t') or not (fields >> entry.channel >> entry.offset >> entry.bytes >> entry.firstSample >> entry.numSamples >> std::hex >> entry.crc)) {
+			throw std::runtime_error((boost::format("%s:%i: not a manifest line") % fileName % lineNumber).str());
+		}
+		entries.push_back(entry);
+	}
+	return entries;
+}
+
+//==============================================================================
+// <file>_manifest.txt, appended to by every writer thread
+class ChecksumManifest {
+public:
+	ChecksumManifest (const std::string& fileName, uint64_t chunkBytes) : chunk (chunkBytes) {
+		out.open(fileName);
+		if (not out) {
+			throw std::runtime_error("cannot open " + fileName);
+		}
+		out << "# file\tchannel\tbyte offset\tbytes\tfirst sample\tsamples\tcrc32c" << std::endl;
+	}
+
+	void append (const ManifestEntry& entry) {
+		std::lock_guard<std::mutex> guard (lock);
+		out << boost::format("%s\t%i\t%i\t%i\t%i\t%i\t%08x\n") % entry.file % entry.channel % entry.offset % entry.bytes % entry.firstSample % entry.numSamples % entry.crc;
+		chunks++;
+	}
+
+	void close () {
+		std::lock_guard<std::mutex> guard (lock);
+		out.close();
+	}
+
+	uint64_t chunkBytes () const { return chunk; }
+	size_t numChunks () const { return chunks; }
+
+private:
+	std::ofstream out;
+	std::mutex lock;
+	uint64_t chunk;
+	size_t chunks = 0;
+};
+
+//==============================================================================
+// The running checksum of one channel's file, only used by the writer thread of the channel
+class ChunkChecksum {
+public:
+	ChunkChecksum (ChecksumManifest& manifest, size_t channel) : manifest (manifest) {
+		current.channel = channel;
+	}
+
+	~ChunkChecksum () {
+		finish();
+	}
+
+	ChunkChecksum (const ChunkChecksum&) = delete;
+	ChunkChecksum& operator= (const ChunkChecksum&) = delete;
+
+	// the channel goes on in a new file, the last chunk of the one before is done
+	void open (const std::string& fileName) {
+		finish();
+		current.file = fileName;
+		current.offset = 0;
+	}
+
+	// bytes as written to the file, holding numSamples samples from sampleOffset on
+	void add (const void* data, size_t numBytes, uint64_t sampleOffset, size_t numSamples) {
+		if (current.bytes == 0) {
+			current.firstSample = sampleOffset;
+		}
+		crc = crc32c::update(crc, data, numBytes);
+		current.bytes += numBytes;
+		current.numSamples += numSamples;
+		if (current.bytes >= manifest.chunkBytes()) {
+			finish();
+		}
+	}
+
+	// writes the chunk so far to the manifest
+	void finish () {
+		if (current.bytes == 0) {
+			return;
+		}
+		current.crc = ~crc;
+		manifest.append(current);
+		current.offset += current.bytes;
+		current.bytes = 0;
+		current.numSamples = 0;
+		crc = ~uint32_t(0);
+	}
+
+private:
+	ChecksumManifest& manifest;
+	ManifestEntry current;
+	uint32_t crc = ~uint32_t(0);
+};
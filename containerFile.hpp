@@ -0,0 +1,241 @@
+#pragma once
+
+#include <string>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <complex>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+//==============================================================================
+// <file>.usrp holds every channel of a run in one file:
+//
+//   0       ContainerHeader
+//   64      JSON metadata (Fc, BW, Fs and gain per channel, clock/PPS source, GPS fix, start time)
+//   65536   chunk 0: channel 0 samples, channel 1 samples, ... (chunkSamples each)
+//           chunk 1: ...
+//
+// Every chunk has the same size and every channel is contiguous inside a
+// chunk, so the position of any sample of any channel is
+//   dataOffset + chunk * chunkBytes + channel * chunkSamples * 4 + within * 4
+// and a channel/time range is one read per chunk or a single mmap. The last
+// chunk is zero-padded; numSamples says how much of it is real. Samples are
+// interleaved IQ shorts (SigMF ci16_le) exactly as in the _chanN.bin files.
+
+struct ContainerHeader {
+	char magic[8];			// "USRPCNT1"
+	uint32_t dataOffset;	// first chunk, also the space reserved for header and JSON
+	uint32_t jsonLength;
+	uint64_t chunkSamples;	// samples per channel per chunk
+	uint32_t numChannels;
+	uint32_t bytesPerSample;
+	uint64_t numSamples;	// samples per channel in the file
+	double rate;
+	char reserved[16];
+};
+
+static_assert(sizeof(ContainerHeader) == 64, "container header layout changed");
+
+//==============================================================================
+// Writes blocks into their chunk slots. Different channels can be written from
+// different writer threads at the same time since every write is a pwrite to
+// its own region.
+class ContainerWriter {
+public:
+	static const uint32_t DATA_OFFSET = 65536;
+
+	ContainerWriter (const std::string& fileName, uint32_t numChannels, uint64_t chunkSamples, double rate, uint64_t expectedSamples = 0)
+		: fileName (fileName) {
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, "USRPCNT1", 8);
+		header.dataOffset = DATA_OFFSET;
+		header.chunkSamples = chunkSamples;
+		header.numChannels = numChannels;
+		header.bytesPerSample = sizeof(std::complex<short>);
+		header.rate = rate;
+		chunkBytes = chunkSamples * numChannels * header.bytesPerSample;
+
+		fd = ::open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			throw std::runtime_error("cannot open " + fileName + ": " + std::strerror(errno));
+		}
+		if (expectedSamples > 0) {
+			uint64_t numChunks = (expectedSamples + chunkSamples - 1) / chunkSamples;
+			if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, DATA_OFFSET + numChunks * chunkBytes) != 0) {
+				preallocateError = errno;
+			}
+		}
+	}
+
+	~ContainerWriter () {
+		try {
+			close();
+		} catch (const std::exception& e) {
+			std::cerr << e.what() << std::endl;
+		}
+	}
+
+	ContainerWriter (const ContainerWriter&) = delete;
+	ContainerWriter& operator= (const ContainerWriter&) = delete;
+
+	// write numSamples samples of one channel starting at sample sampleOffset of the run
+	void write (uint32_t channel, uint64_t sampleOffset, const std::complex<short>* samples, size_t numSamples) {
+		while (numSamples > 0) {
+			uint64_t chunk = sampleOffset / header.chunkSamples;
+			uint64_t within = sampleOffset % header.chunkSamples;
+			size_t count = std::min<uint64_t>(numSamples, header.chunkSamples - within);
+			uint64_t offset = header.dataOffset + chunk * chunkBytes + (channel * header.chunkSamples + within) * header.bytesPerSample;
+			writeAll(reinterpret_cast<const char*>(samples), count * header.bytesPerSample, offset);
+			samples += count;
+			sampleOffset += count;
+			numSamples -= count;
+		}
+	}
+
+	// the JSON metadata, written into the header when the file is closed
+	void setMetadata (const boost::property_tree::ptree& tree) {
+		metadata = tree;
+	}
+
+	// record the final length and write the header, must be called after all writes
+	void close (uint64_t numSamples) {
+		header.numSamples = numSamples;
+		close();
+	}
+
+	void close () {
+		if (fd < 0) {
+			return;
+		}
+		std::ostringstream json;
+		boost::property_tree::write_json(json, metadata, false);
+		std::string text = json.str();
+		if (sizeof(header) + text.size() > header.dataOffset) {
+			throw std::runtime_error("container metadata does not fit in the header of " + fileName);
+		}
+		header.jsonLength = text.size();
+		writeAll(reinterpret_cast<const char*>(&header), sizeof(header), 0);
+		writeAll(text.data(), text.size(), sizeof(header));
+		// pad the last chunk so every chunk has the same size
+		uint64_t numChunks = (header.numSamples + header.chunkSamples - 1) / header.chunkSamples;
+		if (ftruncate(fd, header.dataOffset + numChunks * chunkBytes) != 0) {
+			int err = errno;
+			::close(fd);
+			fd = -1;
+			throw std::runtime_error("cannot truncate " + fileName + ": " + std::strerror(err));
+		}
+		::close(fd);
+		fd = -1;
+	}
+
+	int preallocateErrno () const { return preallocateError; }
+
+private:
+	void writeAll (const char* data, size_t length, uint64_t offset) {
+		while (length > 0) {
+			ssize_t ret = ::pwrite(fd, data, length, offset);
+			if (ret < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				throw std::runtime_error("write to " + fileName + " failed: " + std::strerror(errno));
+			}
+			data += ret;
+			length -= ret;
+			offset += ret;
+		}
+	}
+
+	std::string fileName;
+	ContainerHeader header;
+	boost::property_tree::ptree metadata;
+	uint64_t chunkBytes;
+	int fd = -1;
+	int preallocateError = 0;
+};
+
+//==============================================================================
+// Memory maps a container and copies channel/time ranges out of it
+class ContainerReader {
+public:
+	explicit ContainerReader (const std::string& fileName) {
+		int fd = ::open(fileName.c_str(), O_RDONLY);
+		if (fd < 0) {
+			throw std::runtime_error("cannot open " + fileName + ": " + std::strerror(errno));
+		}
+		struct stat st;
+		fstat(fd, &st);
+		length = st.st_size;
+		if (length < sizeof(ContainerHeader)) {
+			::close(fd);
+			throw std::runtime_error(fileName + " is not a recording container");
+		}
+		void* ptr = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (ptr == MAP_FAILED) {
+			throw std::runtime_error("cannot map " + fileName + ": " + std::strerror(errno));
+		}
+		base = static_cast<const char*>(ptr);
+		header = reinterpret_cast<const ContainerHeader*>(base);
+		if (memcmp(header->magic, "USRPCNT1", 8) != 0) {
+			munmap(const_cast<char*>(base), length);
+			throw std::runtime_error(fileName + " is not a recording container");
+		}
+		chunkBytes = header->chunkSamples * header->numChannels * header->bytesPerSample;
+		std::istringstream json (std::string(base + sizeof(ContainerHeader), header->jsonLength));
+		boost::property_tree::read_json(json, tree);
+	}
+
+	~ContainerReader () {
+		munmap(const_cast<char*>(base), length);
+	}
+
+	ContainerReader (const ContainerReader&) = delete;
+	ContainerReader& operator= (const ContainerReader&) = delete;
+
+	const ContainerHeader& info () const { return *header; }
+	const boost::property_tree::ptree& metadata () const { return tree; }
+
+	// copy up to count samples of one channel starting at sample start, returns the number copied
+	size_t read (uint32_t channel, uint64_t start, size_t count, std::complex<short>* out) const {
+		if (channel >= header->numChannels or start >= header->numSamples) {
+			return 0;
+		}
+		count = std::min<uint64_t>(count, header->numSamples - start);
+		size_t done = 0;
+		while (done < count) {
+			const std::complex<short>* src = samples(channel, start + done);
+			size_t within = (start + done) % header->chunkSamples;
+			size_t n = std::min<uint64_t>(count - done, header->chunkSamples - within);
+			memcpy(out + done, src, n * sizeof(std::complex<short>));
+			done += n;
+		}
+		return done;
+	}
+
+	// pointer to a sample in the mapping, valid until the end of its chunk
+	const std::complex<short>* samples (uint32_t channel, uint64_t sample) const {
+		uint64_t chunk = sample / header->chunkSamples;
+		uint64_t within = sample % header->chunkSamples;
+		return reinterpret_cast<const std::complex<short>*>(base + header->dataOffset + chunk * chunkBytes
+															 + (channel * header->chunkSamples + within) * header->bytesPerSample);
+	}
+
+private:
+	const char* base = nullptr;
+	size_t length = 0;
+	const ContainerHeader* header = nullptr;
+	uint64_t chunkBytes = 0;
+	boost::property_tree::ptree tree;
+};
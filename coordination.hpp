@@ -0,0 +1,290 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <sstream>
+#include <iostream>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+
+#include <poll.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <boost/format.hpp>
+
+#include "telemetry.hpp"
+
+//==============================================================================
+// A recording spread over several hosts. usrpCoordinator connects to a
+// usrpMultiRecord --agent on every host and they exchange one line of text per
+// message, a command followed by key=value fields:
+//   coordinator  ARM session=<id>
+//   agent        ARMED host=<name> channels=<n> rate=<Sps> time=<device s>     once its devices are set up
+//   coordinator  START at=<device s>                                           a whole second, so on a PPS edge
+//   agent        PROGRESS samples=<n> total=<n> overflows=<n> ...             every second while recording
+//   agent        DONE samples=<n> overflows=<n> ... first=<device s>
+// or ABORT reason=<text> from either side. The start only lines up if every
+// agent's device time counts the same seconds, which is why agents set their
+// devices to GPS (or host UTC) seconds instead of 0.
+namespace coord {
+
+// seconds a coordinator that connected has to send ARM
+const double ARM_TIMEOUT = 10.0;
+
+struct Message {
+	std::string command;
+	std::map<std::string, std::string> fields;
+
+	std::string get (const std::string& key, const std::string& fallback = "") const {
+		auto field = fields.find(key);
+		return field == fields.end() ? fallback : field->second;
+	}
+	double number (const std::string& key, double fallback = 0.0) const {
+		auto field = fields.find(key);
+		return field == fields.end() ? fallback : std::stod(field->second);
+	}
+};
+
+// values must not contain spaces, the agents' host names and session IDs do not
+inline Message parse (const std::string& line) {
+	Message message;
+	std::istringstream words (line);
+	words >> message.command;
+	std::string word;
+	while (words >> word) {
+		size_t equals = word.find('=');
+		if (equals != std::string::npos) {
+			message.fields[word.substr(0, equals)] = word.substr(equals + 1);
+		}
+	}
+	return message;
+}
+
+//==============================================================================
+// One TCP connection that carries lines
+class Connection {
+public:
+	explicit Connection (int fd) : fd (fd) {
+		int noDelay = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+	}
+	~Connection () { close(fd); }
+
+	Connection (const Connection&) = delete;
+	Connection& operator= (const Connection&) = delete;
+
+	// host:port, retried until the agent listens or the timeout has passed
+	static std::unique_ptr<Connection> connectTo (const std::string& address, double timeout) {
+		size_t colon = address.rfind(':');
+		if (colon == std::string::npos) {
+			throw std::runtime_error("expected host:port, got " + address);
+		}
+		const std::string host = address.substr(0, colon), port = address.substr(colon + 1);
+		auto start = std::chrono::steady_clock::now();
+		while (true) {
+			addrinfo hints = {}, *found = nullptr;
+			hints.ai_family = AF_UNSPEC;
+			hints.ai_socktype = SOCK_STREAM;
+			int ret = getaddrinfo(host.c_str(), port.c_str(), &hints, &found);
+			if (ret != 0) {
+				throw std::runtime_error("cannot resolve " + address + ": " + gai_strerror(ret));
+			}
+			for (addrinfo* candidate = found; candidate; candidate = candidate->ai_next) {
+				int fd = socket(candidate->ai_family, candidate->ai_socktype, candidate->ai_protocol);
+				if (fd >= 0 and ::connect(fd, candidate->ai_addr, candidate->ai_addrlen) == 0) {
+					freeaddrinfo(found);
+					return std::unique_ptr<Connection> (new Connection (fd));
+				}
+				if (fd >= 0) {
+					close(fd);
+				}
+			}
+			freeaddrinfo(found);
+			if (std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() >= timeout) {
+				throw std::runtime_error("cannot connect to " + address + ": " + std::strerror(errno));
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(250));
+		}
+	}
+
+	void send (const std::string& line) {
+		const std::string text = line + "\n";
+		for (size_t done = 0; done < text.size(); ) {
+			ssize_t ret = ::send(fd, text.data() + done, text.size() - done, MSG_NOSIGNAL);
+			if (ret <= 0) {
+				throw std::runtime_error(std::string("connection lost: ") + std::strerror(errno));
+			}
+			done += ret;
+		}
+	}
+
+	// the next line without its newline, false if none came within the timeout, throws once the other side has closed
+	bool receive (std::string& line, double timeout) {
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(timeout));
+		while (true) {
+			size_t newline = pending.find('\n');
+			if (newline != std::string::npos) {
+				line = pending.substr(0, newline);
+				pending.erase(0, newline + 1);
+				return true;
+			}
+			auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+			pollfd readable = {fd, POLLIN, 0};
+			if (left <= 0 or poll(&readable, 1, left) <= 0) {
+				return false;
+			}
+			char buffer[4096];
+			ssize_t length = ::recv(fd, buffer, sizeof(buffer), 0);
+			if (length <= 0) {
+				throw std::runtime_error("connection closed");
+			}
+			pending.append(buffer, length);
+		}
+	}
+
+	int descriptor () const { return fd; }
+
+private:
+	int fd;
+	std::string pending;
+};
+
+//==============================================================================
+// The recorder's side: listens from the start so the coordinator can connect
+// while the devices come up, answers ARM once they are ready and reports
+// progress from a thread of its own while the recording runs.
+class Agent {
+public:
+	explicit Agent (int port) : port (port) {
+		listenFd = socket(AF_INET6, SOCK_STREAM, 0);
+		int reuse = 1, v6Only = 0;
+		setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+		setsockopt(listenFd, IPPROTO_IPV6, IPV6_V6ONLY, &v6Only, sizeof(v6Only));
+		sockaddr_in6 address = {};
+		address.sin6_family = AF_INET6;
+		address.sin6_port = htons(port);
+		address.sin6_addr = in6addr_any;
+		if (listenFd < 0 or bind(listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 or listen(listenFd, 1) != 0) {
+			int err = errno;
+			if (listenFd >= 0) {
+				close(listenFd);
+			}
+			throw std::runtime_error((boost::format("cannot listen for the coordinator on port %i: %s") % port % std::strerror(err)).str());
+		}
+	}
+
+	~Agent () {
+		stopReporting();
+		close(listenFd);
+	}
+
+	Agent (const Agent&) = delete;
+	Agent& operator= (const Agent&) = delete;
+
+	// waits for ARM, answers with armed(), which carries the device time of the moment, and returns
+	// the START device time; session() holds the ID afterwards
+	double waitForStart (std::function<std::string ()> armed) {
+		std::cout << boost::format("Waiting for the coordinator on port %i") % port << std::endl;
+		while (not connection) {
+			pollfd waiting = {listenFd, POLLIN, 0};
+			if (poll(&waiting, 1, 1000) > 0) {
+				int fd = accept(listenFd, nullptr, nullptr);
+				if (fd >= 0) {
+					connection.reset(new Connection (fd));
+				}
+			}
+		}
+		std::string line;
+		if (not connection->receive(line, ARM_TIMEOUT)) {
+			throw std::runtime_error("the coordinator connected but did not arm");
+		}
+		Message arm = parse(line);
+		if (arm.command != "ARM" or arm.get("session").empty()) {
+			throw std::runtime_error("expected ARM session=<id> from the coordinator, got: " + line);
+		}
+		sessionId = arm.get("session");
+		connection->send("ARMED " + armed());
+		// the other agents may still be waiting for GPS lock, the coordinator aborts if one never arms
+		while (not connection->receive(line, 1.0)) {
+		}
+		Message start = parse(line);
+		if (start.command != "START") {
+			throw std::runtime_error("session " + sessionId + " not started: " + line);
+		}
+		return start.number("at");
+	}
+
+	const std::string& session () const { return sessionId; }
+
+	// sends "PROGRESS <status()>" every interval until finish
+	void report (double interval, std::function<std::string ()> status) {
+		reporter = std::thread ([this, interval, status] {
+			telemetry::nameThread("agent");
+			setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+			auto next = std::chrono::steady_clock::now();
+			while (not stopping) {
+				next += std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(interval));
+				while (not stopping and std::chrono::steady_clock::now() < next) {
+					std::this_thread::sleep_for(std::chrono::milliseconds(50));
+				}
+				if (not stopping) {
+					send("PROGRESS " + status());
+				}
+			}
+		});
+	}
+
+	void finish (const std::string& summary) {
+		stopReporting();
+		send("DONE " + summary);
+	}
+
+	void abort (const std::string& reason) {
+		stopReporting();
+		send("ABORT reason=" + reason);
+	}
+
+private:
+	void stopReporting () {
+		stopping = true;
+		if (reporter.joinable()) {
+			reporter.join();
+		}
+	}
+
+	// a coordinator that went away only costs it the reports, the recording goes on
+	void send (const std::string& line) {
+		if (not connection or lost) {
+			return;
+		}
+		try {
+			connection->send(line);
+		} catch (const std::exception& e) {
+			lost = true;
+			std::cerr << "\nCoordinator " << e.what() << ", recording on" << std::endl;
+		}
+	}
+
+	int port;
+	int listenFd = -1;
+	std::unique_ptr<Connection> connection;
+	std::string sessionId;
+	std::atomic<bool> stopping {false};
+	std::atomic<bool> lost {false};
+	std::thread reporter;
+};
+
+}
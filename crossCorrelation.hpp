@@ -0,0 +1,334 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <complex>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+#include <cmath>
+
+#include <boost/format.hpp>
+
+#include "sampleConvert.hpp"
+#include "spectrumMonitor.hpp"
+
+//==============================================================================
+// Delay, phase and gain of one channel against a reference channel, for
+// calibrating the array from a recording of a common signal (calibrate.sh).
+//
+// A block of each channel is zero padded to twice its length and transformed,
+// so the cross spectrum C * conj(R) is the spectrum of the linear cross
+// correlation. Its peak within the allowed lags gives the whole samples of
+// the delay, a parabola through the peak and its neighbours a first guess of
+// the fraction. A delay of d samples turns the phase of bin k of the cross
+// spectrum by 2*pi*k*d/FFT size, so with the guess taken out what remains is
+// a straight phase line over the band. The cross spectrum is summed in
+// SEGMENTS pieces across the band, which averages the noise of single bins
+// away, and a line fitted through the phases of those sums, weighted by their
+// size, corrects the guess; twice is plenty. The phase is then that of the
+// whole cross spectrum summed with the delay taken out, i.e. the phase
+// difference at the centre frequency. If
+//   channel[n] = 10^(gain/20) * exp(j*phase) * reference[n - delay]
+// then the estimates are exactly delay, phase and gain.
+//
+// The transforms are spectrum::Fft with AVX2 or NEON butterflies, and the
+// cross spectrum has kernels of its own here.
+
+namespace xcorr {
+
+// s = c * conj(r), split real and imaginary arrays
+inline void crossScalar (const float* cRe, const float* cIm, const float* rRe, const float* rIm, float* sRe, float* sIm, size_t n) {
+	for (size_t k = 0; k < n; k++) {
+		float re = cRe[k] * rRe[k] + cIm[k] * rIm[k];
+		float im = cIm[k] * rRe[k] - cRe[k] * rIm[k];
+		sRe[k] = re;
+		sIm[k] = im;
+	}
+}
+
+#ifdef SAMPLE_CONVERT_X86
+__attribute__((target("avx2")))
+inline void crossAvx2 (const float* cRe, const float* cIm, const float* rRe, const float* rIm, float* sRe, float* sIm, size_t n) {
+	size_t k = 0;
+	for (; k + 8 <= n; k += 8) {
+		__m256 cr = _mm256_loadu_ps(cRe + k), ci = _mm256_loadu_ps(cIm + k);
+		__m256 rr = _mm256_loadu_ps(rRe + k), ri = _mm256_loadu_ps(rIm + k);
+		_mm256_storeu_ps(sRe + k, _mm256_add_ps(_mm256_mul_ps(cr, rr), _mm256_mul_ps(ci, ri)));
+		_mm256_storeu_ps(sIm + k, _mm256_sub_ps(_mm256_mul_ps(ci, rr), _mm256_mul_ps(cr, ri)));
+	}
+	crossScalar(cRe + k, cIm + k, rRe + k, rIm + k, sRe + k, sIm + k, n - k);
+}
+#endif
+
+#ifdef SAMPLE_CONVERT_NEON
+inline void crossNeon (const float* cRe, const float* cIm, const float* rRe, const float* rIm, float* sRe, float* sIm, size_t n) {
+	size_t k = 0;
+	for (; k + 4 <= n; k += 4) {
+		float32x4_t cr = vld1q_f32(cRe + k), ci = vld1q_f32(cIm + k);
+		float32x4_t rr = vld1q_f32(rRe + k), ri = vld1q_f32(rIm + k);
+		vst1q_f32(sRe + k, vmlaq_f32(vmulq_f32(cr, rr), ci, ri));
+		vst1q_f32(sIm + k, vmlsq_f32(vmulq_f32(ci, rr), cr, ri));
+	}
+	crossScalar(cRe + k, cIm + k, rRe + k, rIm + k, sRe + k, sIm + k, n - k);
+}
+#endif
+
+inline void cross (const float* cRe, const float* cIm, const float* rRe, const float* rIm, float* sRe, float* sIm, size_t n) {
+#if defined(SAMPLE_CONVERT_X86)
+	if (convert::haveAvx2()) {
+		return crossAvx2(cRe, cIm, rRe, rIm, sRe, sIm, n);
+	}
+#elif defined(SAMPLE_CONVERT_NEON)
+	return crossNeon(cRe, cIm, rRe, rIm, sRe, sIm, n);
+#endif
+	crossScalar(cRe, cIm, rRe, rIm, sRe, sIm, n);
+}
+
+} // namespace xcorr
+
+struct ChannelEstimate {
+	double delay = 0.0;		// samples the channel is later than the reference
+	double phase = 0.0;		// radians, channel minus reference at the centre frequency
+	double gain = 0.0;		// dB, channel power over reference power
+	double coherence = 0.0;	// magnitude of the normalised correlation at the delay, 1 for a clean common signal
+};
+
+//==============================================================================
+// Estimates one block at a time, const so blocks can run on several threads
+// each with its own Scratch
+class Correlator {
+public:
+	struct Scratch {
+		explicit Scratch (size_t fftSize) : refRe (fftSize), refIm (fftSize), re (fftSize), im (fftSize), sRe (fftSize), sIm (fftSize) {}
+		std::vector<float> refRe, refIm, re, im, sRe, sIm;
+		double refEnergy = 0.0;
+	};
+
+	// delays beyond maxLag samples are not searched, they would only be found by chance in a block this short
+	Correlator (size_t blockSamples, size_t maxLag) : fft (fftSizeFor(blockSamples)), block (blockSamples), maxLag (std::min(maxLag, blockSamples - 1)) {}
+
+	// the reference block for the following estimates
+	void reference (const std::complex<float>* samples, Scratch& scratch) const {
+		load(samples, scratch.refRe, scratch.refIm);
+		fft.transform(scratch.refRe.data(), scratch.refIm.data());
+		scratch.refEnergy = energy(scratch.refRe, scratch.refIm);
+	}
+
+	ChannelEstimate estimate (const std::complex<float>* samples, Scratch& scratch) const {
+		const size_t n = fft.size();
+		load(samples, scratch.re, scratch.im);
+		fft.transform(scratch.re.data(), scratch.im.data());
+		const double channelEnergy = energy(scratch.re, scratch.im);
+		xcorr::cross(scratch.re.data(), scratch.im.data(), scratch.refRe.data(), scratch.refIm.data(), scratch.sRe.data(), scratch.sIm.data(), n);
+
+		// the correlation itself for the whole samples, the inverse transform is the forward one with re and im swapped
+		std::copy(scratch.sRe.begin(), scratch.sRe.end(), scratch.re.begin());
+		std::copy(scratch.sIm.begin(), scratch.sIm.end(), scratch.im.begin());
+		fft.transform(scratch.im.data(), scratch.re.data());
+		long lag = 0;
+		float peak = -1.0f;
+		for (long l = -long(maxLag); l <= long(maxLag); l++) {
+			size_t k = (l + n) % n;
+			float magnitude = scratch.re[k] * scratch.re[k] + scratch.im[k] * scratch.im[k];
+			if (magnitude > peak) {
+				peak = magnitude;
+				lag = l;
+			}
+		}
+		auto magnitudeAt = [&](long l) {
+			size_t k = (l + n) % n;
+			return std::sqrt(double(scratch.re[k]) * scratch.re[k] + double(scratch.im[k]) * scratch.im[k]);
+		};
+		const double before = magnitudeAt(lag - 1), at = magnitudeAt(lag), after = magnitudeAt(lag + 1);
+		const double curvature = before - 2 * at + after;
+		ChannelEstimate estimate;
+		estimate.delay = lag + (curvature < 0 ? std::max(-0.5, std::min(0.5, 0.5 * (before - after) / curvature)) : 0.0);
+
+		// the phase line left over across the band, the segments run from the lowest frequency to the highest
+		std::complex<double> segments[SEGMENTS];
+		for (int pass = 0; pass < 2; pass++) {
+			align(scratch, estimate.delay, segments);
+			std::complex<double> total (0.0, 0.0);
+			for (const std::complex<double>& segment : segments) {
+				total += segment;
+			}
+			double weights = 0.0, meanF = 0.0, meanPhase = 0.0;
+			double phases[SEGMENTS];
+			for (size_t g = 0; g < SEGMENTS; g++) {
+				phases[g] = std::arg(segments[g] * std::conj(total));
+				double weight = std::abs(segments[g]), f = g + 0.5 - SEGMENTS / 2.0;
+				weights += weight;
+				meanF += weight * f;
+				meanPhase += weight * phases[g];
+			}
+			if (weights <= 0.0) {
+				break;
+			}
+			meanF /= weights;
+			meanPhase /= weights;
+			double sfp = 0.0, sff = 0.0;
+			for (size_t g = 0; g < SEGMENTS; g++) {
+				double weight = std::abs(segments[g]), f = g + 0.5 - SEGMENTS / 2.0 - meanF;
+				sfp += weight * f * (phases[g] - meanPhase);
+				sff += weight * f * f;
+			}
+			// radians per segment, a segment being n / SEGMENTS bins
+			if (sff > 0.0) {
+				estimate.delay -= sfp / sff * SEGMENTS / (2 * M_PI);
+			}
+		}
+
+		// the cross spectrum with the delay taken out adds up to the phase and size of the correlation
+		align(scratch, estimate.delay, segments);
+		std::complex<double> sum (0.0, 0.0);
+		for (const std::complex<double>& segment : segments) {
+			sum += segment;
+		}
+		estimate.phase = std::arg(sum);
+		estimate.gain = 10 * std::log10(std::max(channelEnergy, 1e-30) / std::max(scratch.refEnergy, 1e-30));
+		estimate.coherence = std::abs(sum) / std::max(std::sqrt(channelEnergy * scratch.refEnergy), 1e-30);
+		return estimate;
+	}
+
+	size_t fftSize () const { return fft.size(); }
+	size_t blockSamples () const { return block; }
+	const char* kernel () const { return fft.kernel(); }
+
+private:
+	static size_t fftSizeFor (size_t blockSamples) {
+		if (blockSamples < 16 or (blockSamples & (blockSamples - 1)) != 0) {
+			throw std::runtime_error("the block has to be a power of two of at least 16 samples, not " + std::to_string(blockSamples));
+		}
+		return 2 * blockSamples;
+	}
+
+	void load (const std::complex<float>* samples, std::vector<float>& re, std::vector<float>& im) const {
+		for (size_t k = 0; k < block; k++) {
+			re[k] = samples[k].real();
+			im[k] = samples[k].imag();
+		}
+		std::fill(re.begin() + block, re.end(), 0.0f);
+		std::fill(im.begin() + block, im.end(), 0.0f);
+	}
+
+	// the cross spectrum with a delay taken out, summed in SEGMENTS pieces from -Nyquist up to +Nyquist
+	void align (const Scratch& scratch, double delay, std::complex<double>* segments) const {
+		const size_t n = fft.size(), width = n / SEGMENTS;
+		const std::complex<double> turn = std::polar(1.0, 2 * M_PI * delay / n);
+		for (size_t g = 0; g < SEGMENTS; g++) {
+			// bin k of the transform is frequency k for k < n/2 and k - n above
+			size_t first = (g * width + n / 2) % n;
+			long frequency = long(g * width) - long(n / 2);
+			std::complex<double> phasor = std::polar(1.0, 2 * M_PI * delay * frequency / n), sum (0.0, 0.0);
+			for (size_t k = first; k < first + width; k++, phasor *= turn) {
+				sum += std::complex<double> (scratch.sRe[k], scratch.sIm[k]) * phasor;
+			}
+			segments[g] = sum;
+		}
+	}
+
+	static double energy (const std::vector<float>& re, const std::vector<float>& im) {
+		double sum = 0.0;
+		for (size_t k = 0; k < re.size(); k++) {
+			sum += double(re[k]) * re[k] + double(im[k]) * im[k];
+		}
+		return sum;
+	}
+
+	static const size_t SEGMENTS = 64;
+
+	spectrum::Fft fft;
+	size_t block;
+	size_t maxLag;
+};
+
+//==============================================================================
+// The calibration usrpCalibrate writes, one line per channel after a line with
+// the device time the values hold at:
+//   time <device s>
+//   # channel  delay[samples]  phase[deg]  gain[dB]  delay drift[samples/s]  phase drift[deg/s]  coherence
+//   1  0.2513  -44.87  -1.02  1.2e-05  0.013  0.97
+// At device time t channel c carries the reference signal
+//   10^(gain/20) * exp(j*phase(t)) * reference[n - delay(t)]
+// with delay(t) = delay + delay drift * (t - time) and phase(t) likewise, so
+// a channel is aligned by advancing it by delay(t) and multiplying it by
+// 10^(-gain/20) * exp(-j*phase(t)). Lines starting with # are comments.
+struct ChannelCalibration {
+	size_t channel = 0;
+	double delay = 0.0;
+	double phase = 0.0;		// degrees
+	double gain = 0.0;		// dB
+	double delayDrift = 0.0;
+	double phaseDrift = 0.0;
+	double coherence = 0.0;
+
+	double delayAt (double time, double epoch) const { return delay + delayDrift * (time - epoch); }
+	double phaseAt (double time, double epoch) const { return phase + phaseDrift * (time - epoch); }
+};
+
+struct Calibration {
+	double time = 0.0;
+	std::vector<ChannelCalibration> channels;
+
+	// the entry of a channel, nullptr if it was not calibrated
+	const ChannelCalibration* find (size_t channel) const {
+		for (const ChannelCalibration& entry : channels) {
+			if (entry.channel == channel) {
+				return &entry;
+			}
+		}
+		return nullptr;
+	}
+
+	static Calibration load (const std::string& fileName) {
+		std::ifstream in (fileName);
+		if (not in) {
+			throw std::runtime_error("cannot open calibration " + fileName);
+		}
+		Calibration calibration;
+		std::string line;
+		for (size_t lineNumber = 1; std::getline(in, line); lineNumber++) {
+			line = line.substr(0, line.find('#'));
+			std::istringstream fields (line);
+			std::string first;
+			if (not (fields >> first)) {
+				continue;
+			}
+			if (first == "time") {
+				fields >> calibration.time;
+			} else {
+				ChannelCalibration entry;
+				try {
+					entry.channel = std::stoul(first);
+				} catch (const std::logic_error&) {
+					throw std::runtime_error(fileName + ":" + std::to_string(lineNumber) + ": expected time or a channel");
+				}
+				fields >> entry.delay >> entry.phase >> entry.gain >> entry.delayDrift >> entry.phaseDrift >> entry.coherence;
+				calibration.channels.push_back(entry);
+			}
+			if (fields.fail()) {
+				throw std::runtime_error(fileName + ":" + std::to_string(lineNumber) + ": cannot read " + line);
+			}
+		}
+		if (calibration.channels.empty()) {
+			throw std::runtime_error("no channels in calibration " + fileName);
+		}
+		return calibration;
+	}
+
+	void save (const std::string& fileName, const std::string& comment) const {
+		std::ofstream out (fileName);
+		if (not out) {
+			throw std::runtime_error("cannot write " + fileName);
+		}
+		out << comment;
+		out << boost::format("time %.6f\n") % time;
+		out << "# channel\tdelay[samples]\tphase[deg]\tgain[dB]\tdelay drift[samples/s]\tphase drift[deg/s]\tcoherence\n";
+		for (const ChannelCalibration& entry : channels) {
+			out << boost::format("%i\t%.5f\t%.3f\t%.3f\t%.4g\t%.4g\t%.3f\n")
+				   % entry.channel % entry.delay % entry.phase % entry.gain % entry.delayDrift % entry.phaseDrift % entry.coherence;
+		}
+	}
+};
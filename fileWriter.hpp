@@ -0,0 +1,299 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <cerrno>
+#include <iostream>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// Build with -DHAVE_LIBURING -luring to enable the io_uring write mode
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+//==============================================================================
+// Writes one output file for the whole run. The file is opened once,
+// preallocated with fallocate and written in large page-aligned chunks:
+//   buffered - plain write() straight from the caller's buffer through the page cache
+//   direct   - O_DIRECT, data is gathered into one aligned chunk and written synchronously
+//   uring    - O_DIRECT, aligned chunks are written asynchronously with io_uring
+// Page-aligned writes of whole pages skip the gather buffer and go to disk
+// straight from the caller's memory. bytesCopied() counts everything that did not.
+class ChannelWriter {
+public:
+	enum Mode { MODE_BUFFERED, MODE_DIRECT, MODE_URING };
+
+	// O_DIRECT needs the buffer, length and file offset aligned to the logical block size
+	static const size_t ALIGNMENT = 4096;
+
+	static Mode parseMode (const std::string& name) {
+		if (name == "buffered") {
+			return MODE_BUFFERED;
+		} else if (name == "direct") {
+			return MODE_DIRECT;
+		} else if (name == "uring") {
+#ifdef HAVE_LIBURING
+			return MODE_URING;
+#else
+			throw std::runtime_error("io_uring write mode requested but this build has no liburing (build with -DHAVE_LIBURING -luring)");
+#endif
+		}
+		throw std::runtime_error("unknown write mode: " + name + " (buffered, direct, uring)");
+	}
+
+	// ioSize is the size of every write to disk, ioDepth the number of writes in flight with io_uring,
+	// preallocateBytes the expected final size of the file (0 to skip preallocation)
+	ChannelWriter (const std::string& fileName, Mode mode = MODE_BUFFERED, size_t ioSize = 4 << 20, size_t ioDepth = 8, uint64_t preallocateBytes = 0)
+		: fileName (fileName), mode (mode) {
+		this->ioSize = (ioSize + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+		int flags = O_WRONLY | O_CREAT | O_TRUNC;
+		if (mode != MODE_BUFFERED) {
+			flags |= O_DIRECT;
+		}
+		fd = ::open(fileName.c_str(), flags, 0644);
+		if (fd < 0) {
+			throw std::runtime_error("cannot open " + fileName + ": " + std::strerror(errno));
+		}
+
+		// reserve the space up front so the filesystem does not have to find blocks while recording
+		if (preallocateBytes > 0) {
+			if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, preallocateBytes) != 0) {
+				preallocateError = errno;
+			}
+		}
+
+		size_t numStaging = 0;
+		if (mode == MODE_DIRECT) {
+			numStaging = 1;
+		} else if (mode == MODE_URING) {
+			numStaging = ioDepth > 0 ? ioDepth : 1;
+#ifdef HAVE_LIBURING
+			int ret = io_uring_queue_init(numStaging, &ring, 0);
+			if (ret < 0) {
+				::close(fd);
+				throw std::runtime_error("io_uring_queue_init failed: " + std::string(std::strerror(-ret)));
+			}
+#endif
+		}
+		for (size_t i = 0; i < numStaging; i++) {
+			void* buffer = nullptr;
+			if (posix_memalign(&buffer, ALIGNMENT, this->ioSize) != 0) {
+				throw std::runtime_error("cannot allocate write buffer for " + fileName);
+			}
+			staging.push_back(static_cast<char*>(buffer));
+			busy.push_back(false);
+			lengths.push_back(0);
+		}
+	}
+
+	~ChannelWriter () {
+		try {
+			close();
+		} catch (const std::exception& e) {
+			std::cerr << e.what() << std::endl;
+		}
+		for (size_t i = 0; i < staging.size(); i++) {
+			free(staging[i]);
+		}
+	}
+
+	ChannelWriter (const ChannelWriter&) = delete;
+	ChannelWriter& operator= (const ChannelWriter&) = delete;
+
+	// append numBytes to the file
+	void write (const void* data, size_t numBytes) {
+		const char* src = static_cast<const char*>(data);
+		logicalSize += numBytes;
+		if (mode == MODE_BUFFERED) {
+			writeAll(src, numBytes, fileOffset);
+			fileOffset += numBytes;
+			return;
+		}
+		// aligned whole pages at an aligned file offset can be written without gathering
+		if (fill == 0 and reinterpret_cast<uintptr_t>(src) % ALIGNMENT == 0 and numBytes % ALIGNMENT == 0) {
+			writeDirect(src, numBytes);
+			return;
+		}
+		// gather into the current aligned chunk and send it off whenever it is full
+		while (numBytes > 0) {
+			size_t count = std::min(numBytes, ioSize - fill);
+			memcpy(staging[current] + fill, src, count);
+			copied += count;
+			fill += count;
+			src += count;
+			numBytes -= count;
+			if (fill == ioSize) {
+				flushChunk(ioSize);
+			}
+		}
+	}
+
+	// wait until every write issued straight from the caller's memory has completed,
+	// after this the caller may reuse the buffers it passed to write()
+	void sync () {
+#ifdef HAVE_LIBURING
+		while (external > 0) {
+			reap();
+		}
+#endif
+	}
+
+	// write out what is left, wait for outstanding writes and trim the file to its real size
+	void close () {
+		if (fd < 0) {
+			return;
+		}
+		if (fill > 0) {
+			// O_DIRECT can only write whole blocks, so pad the tail and truncate afterwards
+			size_t padded = (fill + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+			memset(staging[current] + fill, 0, padded - fill);
+			flushChunk(padded);
+		}
+#ifdef HAVE_LIBURING
+		if (mode == MODE_URING) {
+			while (inFlight > 0) {
+				reap();
+			}
+			io_uring_queue_exit(&ring);
+		}
+#endif
+		if (ftruncate(fd, logicalSize) != 0) {
+			int err = errno;
+			::close(fd);
+			fd = -1;
+			throw std::runtime_error("cannot truncate " + fileName + ": " + std::strerror(err));
+		}
+		::close(fd);
+		fd = -1;
+	}
+
+	uint64_t size () const { return logicalSize; }
+	uint64_t bytesCopied () const { return copied; }
+	const std::string& name () const { return fileName; }
+	// errno of a failed fallocate, 0 if the preallocation worked or was not requested
+	int preallocateErrno () const { return preallocateError; }
+
+private:
+	// write the current chunk (length is a multiple of ALIGNMENT) at the end of the file
+	void flushChunk (size_t length) {
+		if (mode == MODE_DIRECT) {
+			writeAll(staging[current], length, fileOffset);
+		}
+#ifdef HAVE_LIBURING
+		if (mode == MODE_URING) {
+			struct io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+			while (sqe == nullptr) {
+				reap();
+				sqe = io_uring_get_sqe(&ring);
+			}
+			io_uring_prep_write(sqe, fd, staging[current], length, fileOffset);
+			io_uring_sqe_set_data(sqe, reinterpret_cast<void*>(current));
+			io_uring_submit(&ring);
+			busy[current] = true;
+			lengths[current] = length;
+			inFlight++;
+			// move on to the next chunk, waiting until its previous write has completed
+			current = (current + 1) % staging.size();
+			while (busy[current]) {
+				reap();
+			}
+		}
+#endif
+		fileOffset += length;
+		fill = 0;
+	}
+
+	// write caller memory that is already aligned, with io_uring the caller must sync() before reusing it
+	void writeDirect (const char* data, size_t length) {
+		if (mode == MODE_DIRECT) {
+			writeAll(data, length, fileOffset);
+		}
+#ifdef HAVE_LIBURING
+		if (mode == MODE_URING) {
+			struct io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+			while (sqe == nullptr) {
+				reap();
+				sqe = io_uring_get_sqe(&ring);
+			}
+			io_uring_prep_write(sqe, fd, data, length, fileOffset);
+			io_uring_sqe_set_data(sqe, reinterpret_cast<void*>(EXTERNAL_WRITE | length));
+			io_uring_submit(&ring);
+			external++;
+			inFlight++;
+		}
+#endif
+		fileOffset += length;
+	}
+
+#ifdef HAVE_LIBURING
+	// user data of a write straight from caller memory is this flag plus its length,
+	// otherwise it is the index of the staging buffer
+	static const size_t EXTERNAL_WRITE = size_t(1) << 63;
+
+	// wait for one write to complete
+	void reap () {
+		struct io_uring_cqe* cqe;
+		int ret = io_uring_wait_cqe(&ring, &cqe);
+		if (ret < 0) {
+			throw std::runtime_error("io_uring_wait_cqe failed on " + fileName + ": " + std::strerror(-ret));
+		}
+		size_t index = reinterpret_cast<size_t>(io_uring_cqe_get_data(cqe));
+		int res = cqe->res;
+		io_uring_cqe_seen(&ring, cqe);
+		inFlight--;
+		size_t expected;
+		if (index & EXTERNAL_WRITE) {
+			external--;
+			expected = index & ~EXTERNAL_WRITE;
+		} else {
+			busy[index] = false;
+			expected = lengths[index];
+		}
+		if (res < 0) {
+			throw std::runtime_error("write to " + fileName + " failed: " + std::strerror(-res));
+		}
+		if (static_cast<size_t>(res) != expected) {
+			throw std::runtime_error("short write to " + fileName);
+		}
+	}
+	struct io_uring ring;
+	size_t inFlight = 0;
+	size_t external = 0;	// writes in flight straight from caller memory
+#endif
+
+	void writeAll (const char* data, size_t length, uint64_t offset) {
+		while (length > 0) {
+			ssize_t ret = ::pwrite(fd, data, length, offset);
+			if (ret < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				throw std::runtime_error("write to " + fileName + " failed: " + std::strerror(errno));
+			}
+			data += ret;
+			length -= ret;
+			offset += ret;
+		}
+	}
+
+	std::string fileName;
+	Mode mode;
+	size_t ioSize;
+	int fd = -1;
+	int preallocateError = 0;
+	uint64_t fileOffset = 0;	// bytes handed to the kernel so far
+	uint64_t logicalSize = 0;	// bytes handed to write() so far
+	uint64_t copied = 0;		// bytes that went through a staging buffer
+	std::vector<char*> staging;
+	std::vector<bool> busy;
+	std::vector<size_t> lengths;
+	size_t current = 0;
+	size_t fill = 0;
+};
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+//==============================================================================
+// Per-channel gains chosen by usrpTune --chan, loaded by usrpMultiRecord
+// --gainprofile in place of --gainAll. One "channel gain_dB" pair per line,
+// anything after the gain and lines starting with # are ignored, so the
+// profile keeps the levels it was chosen from for whoever reads it later.
+inline std::map<size_t, double> loadGainProfile (const std::string& fileName) {
+	std::ifstream in (fileName);
+	if (not in) {
+		throw std::runtime_error("cannot open gain profile " + fileName);
+	}
+	std::map<size_t, double> gains;
+	std::string line;
+	for (size_t lineNumber = 1; std::getline(in, line); lineNumber++) {
+		if (line.empty() or line[0] == '#') {
+			continue;
+		}
+		std::istringstream fields (line);
+		size_t channel;
+		double gain;
+		if (not (fields >> channel >> gain)) {
+			throw std::runtime_error(fileName + ":" + std::to_string(lineNumber) + ": expected a channel and a gain");
+		}
+		gains[channel] = gain;
+	}
+	if (gains.empty()) {
+		throw std::runtime_error("no channels in gain profile " + fileName);
+	}
+	return gains;
+}
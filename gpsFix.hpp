@@ -0,0 +1,62 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <cstdlib>
+
+//==============================================================================
+// Position fix from the GPSDO's gps_gpgga sensor, e.g.
+// $GPGGA,123519.00,3355.5526,S,01828.2947,E,1,08,0.9,45.4,M,32.1,M,,*47
+struct GpsFix {
+	bool valid = false;			// quality > 0
+	std::string utc;			// hhmmss.ss
+	double latitude = 0.0;		// decimal degrees, south negative
+	double longitude = 0.0;		// decimal degrees, west negative
+	double altitude = 0.0;		// metres above mean sea level
+	int quality = 0;			// 0 invalid, 1 GPS, 2 DGPS
+	int satellites = 0;
+	double hdop = 0.0;
+};
+
+// ddmm.mmmm or dddmm.mmmm to decimal degrees
+inline double nmeaDegrees (const std::string& field, const std::string& hemisphere) {
+	if (field.empty()) {
+		return 0.0;
+	}
+	double value = std::atof(field.c_str());
+	int degrees = int(value / 100);
+	double result = degrees + (value - degrees * 100) / 60.0;
+	if (hemisphere == "S" or hemisphere == "W") {
+		result = -result;
+	}
+	return result;
+}
+
+inline GpsFix parseGpgga (const std::string& sensorValue) {
+	GpsFix fix;
+	size_t start = sensorValue.find("GGA,");
+	if (start == std::string::npos) {
+		return fix;
+	}
+	std::string sentence = sensorValue.substr(start);
+	sentence = sentence.substr(0, sentence.find('*'));
+	std::vector<std::string> fields;
+	std::stringstream stream (sentence);
+	std::string field;
+	while (std::getline(stream, field, ',')) {
+		fields.push_back(field);
+	}
+	if (fields.size() < 10) {
+		return fix;
+	}
+	fix.utc = fields[1];
+	fix.latitude = nmeaDegrees(fields[2], fields[3]);
+	fix.longitude = nmeaDegrees(fields[4], fields[5]);
+	fix.quality = std::atoi(fields[6].c_str());
+	fix.satellites = std::atoi(fields[7].c_str());
+	fix.hdop = std::atof(fields[8].c_str());
+	fix.altitude = std::atof(fields[9].c_str());
+	fix.valid = fix.quality > 0;
+	return fix;
+}
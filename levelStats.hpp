@@ -0,0 +1,139 @@
+#pragma once
+
+#include <complex>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+#include "sampleConvert.hpp"
+#include "triggerCapture.hpp"
+
+//==============================================================================
+// Signal level statistics of a run of sc16 samples, for choosing the gain:
+// mean power, peak, values at or above a clip level, and a histogram of the
+// ADC codes with 64 bins over the signed 16 bit range. Power uses the
+// detector kernel, peak and clip count their own AVX2/NEON kernel, so a
+// sweep can measure at the full sample rate as the samples arrive.
+
+namespace levels {
+
+// largest |I| or |Q| and the number of values with a magnitude of at least clipLevel
+inline uint16_t peakScalar (const int16_t* in, size_t numValues, uint16_t clipLevel, uint64_t& clipped) {
+	uint16_t peak = 0;
+	for (size_t k = 0; k < numValues; k++) {
+		uint16_t magnitude = in[k] < 0 ? uint16_t(-int32_t(in[k])) : uint16_t(in[k]);
+		peak = std::max(peak, magnitude);
+		clipped += magnitude >= clipLevel;
+	}
+	return peak;
+}
+
+#ifdef SAMPLE_CONVERT_X86
+__attribute__((target("avx2")))
+inline uint16_t peakAvx2 (const int16_t* in, size_t numValues, uint16_t clipLevel, uint64_t& clipped) {
+	// abs(-32768) stays 0x8000, which is right when the lanes are read as unsigned
+	const __m256i level = _mm256_set1_epi16(clipLevel);
+	__m256i peak = _mm256_setzero_si256();
+	size_t k = 0;
+	for (; k + 16 <= numValues; k += 16) {
+		__m256i magnitude = _mm256_abs_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + k)));
+		peak = _mm256_max_epu16(peak, magnitude);
+		__m256i over = _mm256_cmpeq_epi16(_mm256_max_epu16(magnitude, level), magnitude);
+		clipped += __builtin_popcount(_mm256_movemask_epi8(over)) / 2;
+	}
+	uint16_t lanes[16];
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), peak);
+	uint16_t result = *std::max_element(lanes, lanes + 16);
+	return std::max(result, peakScalar(in + k, numValues - k, clipLevel, clipped));
+}
+#endif
+
+#ifdef SAMPLE_CONVERT_NEON
+inline uint16_t peakNeon (const int16_t* in, size_t numValues, uint16_t clipLevel, uint64_t& clipped) {
+	const uint16x8_t level = vdupq_n_u16(clipLevel);
+	uint16x8_t peak = vdupq_n_u16(0);
+	uint16x8_t over = vdupq_n_u16(0);
+	size_t k = 0, rounds = 0;
+	for (; k + 8 <= numValues; k += 8) {
+		uint16x8_t magnitude = vreinterpretq_u16_s16(vabsq_s16(vld1q_s16(in + k)));
+		peak = vmaxq_u16(peak, magnitude);
+		// a lane counts up by one for every value at or above the level, flush before it can wrap
+		over = vsubq_u16(over, vcgeq_u16(magnitude, level));
+		if (++rounds == 0xffff) {
+			clipped += vaddlvq_u16(over);
+			over = vdupq_n_u16(0);
+			rounds = 0;
+		}
+	}
+	clipped += vaddlvq_u16(over);
+	return std::max(vmaxvq_u16(peak), peakScalar(in + k, numValues - k, clipLevel, clipped));
+}
+#endif
+
+inline uint16_t peak (const std::complex<short>* samples, size_t numSamples, uint16_t clipLevel, uint64_t& clipped) {
+	const int16_t* in = reinterpret_cast<const int16_t*>(samples);
+#if defined(SAMPLE_CONVERT_X86)
+	if (convert::haveAvx2()) {
+		return peakAvx2(in, 2 * numSamples, clipLevel, clipped);
+	}
+#elif defined(SAMPLE_CONVERT_NEON)
+	return peakNeon(in, 2 * numSamples, clipLevel, clipped);
+#endif
+	return peakScalar(in, 2 * numSamples, clipLevel, clipped);
+}
+
+} // namespace levels
+
+//==============================================================================
+struct LevelStats {
+	static const size_t HISTOGRAM_BINS = 64;
+
+	uint64_t numSamples = 0;
+	uint64_t sumPower = 0;		// sum of I*I + Q*Q
+	uint16_t peak = 0;			// largest |I| or |Q|
+	uint64_t clipped = 0;		// I and Q values at or above the clip level
+	uint64_t histogram[HISTOGRAM_BINS] = {};
+
+	void add (const std::complex<short>* samples, size_t count, uint16_t clipLevel) {
+		numSamples += count;
+		sumPower += detect::power(samples, count);
+		peak = std::max(peak, levels::peak(samples, count, clipLevel, clipped));
+		// four partial histograms so runs of similar codes do not wait on the same counter
+		uint32_t partial[4][HISTOGRAM_BINS] = {};
+		const int16_t* values = reinterpret_cast<const int16_t*>(samples);
+		size_t k = 0;
+		for (; k + 4 <= 2 * count; k += 4) {
+			partial[0][histogramBin(values[k])]++;
+			partial[1][histogramBin(values[k + 1])]++;
+			partial[2][histogramBin(values[k + 2])]++;
+			partial[3][histogramBin(values[k + 3])]++;
+		}
+		for (; k < 2 * count; k++) {
+			partial[0][histogramBin(values[k])]++;
+		}
+		for (size_t bin = 0; bin < HISTOGRAM_BINS; bin++) {
+			histogram[bin] += partial[0][bin] + partial[1][bin] + partial[2][bin] + partial[3][bin];
+		}
+	}
+
+	// mean power relative to a full-scale complex tone, the same scale as the live spectrum
+	double rmsDbfs () const {
+		return numSamples ? 10.0 * std::log10(std::max(double(sumPower) / numSamples, 1e-3) / (32768.0 * 32768.0)) : -INFINITY;
+	}
+	double peakDbfs () const {
+		return 20.0 * std::log10(std::max<double>(peak, 1e-3) / 32768.0);
+	}
+	// share of I and Q values at or above the clip level
+	double clipRatio () const {
+		return numSamples ? clipped / (2.0 * numSamples) : 0.0;
+	}
+	// bits the signal actually swings over, from the peak
+	double bitsUsed () const {
+		return peak ? std::log2(double(peak)) + 1.0 : 0.0;
+	}
+
+	// bin of a code, bin 0 holds -32768..-31745 and bin 63 holds 31744..32767
+	static size_t histogramBin (int16_t value) {
+		return (uint16_t(value) ^ 0x8000) >> 10;
+	}
+};
@@ -0,0 +1,431 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <complex>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <ctime>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <uhd/types/metadata.hpp>
+
+#include <boost/format.hpp>
+
+//==============================================================================
+// Live samples for other processes on the recording host. The recorder copies
+// every block it writes into a ring of slots per channel in a shared file
+// (usually in /dev/shm), and any number of subscribers map that file and read
+// the samples where they lie:
+//
+//   LiveRingHeader            one page, with the channel heads and the subscriber table
+//   channel 0, slot 0         LiveSlotHeader, then up to slotSamples sc16 samples
+//   channel 0, slot 1
+//   ...
+//   channel 1, slot 0 ...
+//
+// Block n of a channel goes to slot n % numSlots. The channel's head counts
+// the blocks published so far and each slot carries the block number it
+// holds, set to LIVE_SLOT_WRITING while it is rewritten. The recorder never
+// looks at the subscribers: a subscriber that falls a ring behind finds its
+// next block overwritten, counts the blocks it missed and continues from the
+// newest one. A subscriber reading in place checks after use that the slot
+// still holds its block, the way the spectrum frame is read.
+
+const uint64_t LIVE_SLOT_WRITING = ~uint64_t(0);
+
+struct LiveChannelHeader {
+	uint64_t head;			// blocks published
+	double frequency;		// centre frequency [Hz]
+	uint64_t samples;		// samples published
+	uint64_t reserved[5];
+};
+
+struct LiveSubscriberEntry {
+	int32_t pid;			// 0 when free
+	uint32_t channel;
+	uint64_t blocks;		// blocks read
+	uint64_t skipped;		// blocks overwritten before they were read
+	int64_t heartbeat;		// system time of the last read [s since the epoch]
+	uint64_t reserved[4];
+};
+
+struct LiveRingHeader {
+	static const size_t MAX_CHANNELS = 32;
+	static const size_t MAX_SUBSCRIBERS = 16;
+
+	char magic[4];			// "LIV1"
+	uint32_t numChannels;
+	uint32_t numSlots;		// slots per channel
+	uint32_t slotSamples;	// samples a slot holds, one recv block
+	uint64_t slotStride;	// bytes from one slot to the next, header included
+	double sampleRate;
+	int64_t started;		// system time the ring was created [s since the epoch]
+	uint32_t finished;		// set once the recording has ended
+	uint32_t recorderPid;
+	uint64_t detachedBlocks;	// read and missed by subscribers that have given their entry back
+	uint64_t detachedSkipped;
+	LiveChannelHeader channels[MAX_CHANNELS];
+	LiveSubscriberEntry subscribers[MAX_SUBSCRIBERS];
+};
+
+struct LiveSlotHeader {
+	uint64_t block;			// block number held, LIVE_SLOT_WRITING while rewritten
+	uint64_t sampleOffset;	// first sample since the start of the run
+	uint64_t numSamples;
+	int64_t fullSecs;		// device time of the first sample, if hasTime
+	double fracSecs;
+	uint32_t hasTime;
+	uint32_t errorCode;		// uhd::rx_metadata_t::error_code_t of the block
+	uint64_t reserved[2];
+};
+
+static_assert(sizeof(LiveChannelHeader) == 64, "live channel header layout changed");
+static_assert(sizeof(LiveSubscriberEntry) == 64, "live subscriber entry layout changed");
+static_assert(sizeof(LiveSlotHeader) == 64, "live slot header layout changed");
+static_assert(sizeof(LiveRingHeader) <= 4096, "live ring header outgrew its page");
+
+namespace live {
+
+const size_t HEADER_BYTES = 4096;
+
+inline int64_t now () {
+	return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// a subscriber whose process is gone gives its entry back
+inline bool alive (int32_t pid) {
+	return pid > 0 and (kill(pid, 0) == 0 or errno == EPERM);
+}
+
+} // namespace live
+
+//==============================================================================
+// The recorder's side: creates the ring and publishes blocks. Each channel is
+// only ever published by the writer thread that owns it, so publishing takes
+// no locks and costs one copy of the block whether or not anyone reads.
+class LivePublisher {
+public:
+	LivePublisher (const std::string& path, size_t numChannels, size_t slotSamples, size_t numSlots, double sampleRate,
+				   const std::vector<double>& frequencies)
+		: path (path) {
+		if (numChannels > LiveRingHeader::MAX_CHANNELS) {
+			throw std::runtime_error("the live ring holds at most " + std::to_string(size_t(LiveRingHeader::MAX_CHANNELS)) + " channels");
+		}
+		numSlots = std::max<size_t>(numSlots, 2);
+		slotStride = (sizeof(LiveSlotHeader) + slotSamples * sizeof(std::complex<short>) + 4095) / 4096 * 4096;
+		length = live::HEADER_BYTES + numChannels * numSlots * slotStride;
+		// a new file rather than truncating the old one, subscribers still mapping the last run's ring keep it
+		unlink(path.c_str());
+		int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+		if (fd < 0) {
+			throw std::runtime_error("cannot create " + path + ": " + std::strerror(errno));
+		}
+		// reserve the whole ring now, so a full /dev/shm shows here and not as a SIGBUS mid-run
+		int err = posix_fallocate(fd, 0, length);
+		void* ptr = err == 0 ? mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+		if (ptr == MAP_FAILED) {
+			err = err ? err : errno;
+			::close(fd);
+			unlink(path.c_str());
+			throw std::runtime_error((boost::format("cannot set up a %.1f MB live ring in %s: %s") % (length / 1e6) % path % std::strerror(err)).str());
+		}
+		::close(fd);
+		base = static_cast<char*>(ptr);
+		// touch every page now so the writers never take a page fault
+		memset(base, 0, length);
+		LiveRingHeader& header = info();
+		header.numChannels = numChannels;
+		header.numSlots = numSlots;
+		header.slotSamples = slotSamples;
+		header.slotStride = slotStride;
+		header.sampleRate = sampleRate;
+		header.started = live::now();
+		header.recorderPid = getpid();
+		for (size_t ch = 0; ch < numChannels and ch < frequencies.size(); ch++) {
+			header.channels[ch].frequency = frequencies[ch];
+		}
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		memcpy(header.magic, "LIV1", 4);
+	}
+
+	~LivePublisher () {
+		finish();
+		munmap(base, length);
+		// subscribers that are still reading keep their mapping, new ones find nothing to open
+		unlink(path.c_str());
+	}
+
+	LivePublisher (const LivePublisher&) = delete;
+	LivePublisher& operator= (const LivePublisher&) = delete;
+
+	// called by the thread that owns the channel, never waits
+	void publish (size_t channel, const std::complex<short>* samples, size_t numSamples, uint64_t sampleOffset, const uhd::rx_metadata_t& metadata) {
+		LiveRingHeader& header = info();
+		LiveChannelHeader& shared = header.channels[channel];
+		numSamples = std::min<size_t>(numSamples, header.slotSamples);
+		if (numSamples == 0) {
+			return;
+		}
+		const uint64_t block = __atomic_load_n(&shared.head, __ATOMIC_RELAXED);
+		LiveSlotHeader& slot = *reinterpret_cast<LiveSlotHeader*>(slotAddress(channel, block % header.numSlots));
+		__atomic_store_n(&slot.block, LIVE_SLOT_WRITING, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		slot.sampleOffset = sampleOffset;
+		slot.numSamples = numSamples;
+		slot.hasTime = metadata.has_time_spec;
+		slot.fullSecs = metadata.time_spec.get_full_secs();
+		slot.fracSecs = metadata.time_spec.get_frac_secs();
+		slot.errorCode = metadata.error_code;
+		memcpy(reinterpret_cast<char*>(&slot) + sizeof(LiveSlotHeader), samples, numSamples * sizeof(std::complex<short>));
+		__atomic_store_n(&slot.block, block, __ATOMIC_RELEASE);
+		__atomic_store_n(&shared.samples, shared.samples + numSamples, __ATOMIC_RELAXED);
+		__atomic_store_n(&shared.head, block + 1, __ATOMIC_RELEASE);
+	}
+
+	// tells the subscribers that no more blocks will come
+	void finish () {
+		__atomic_store_n(&info().finished, 1, __ATOMIC_RELEASE);
+	}
+
+	// subscribers whose process still runs, and what every subscriber of the run has read and missed,
+	// those that have detached or died included
+	size_t subscribers (uint64_t* blocksRead = nullptr, uint64_t* blocksSkipped = nullptr) const {
+		const LiveRingHeader& header = info();
+		size_t count = 0;
+		uint64_t read = __atomic_load_n(&header.detachedBlocks, __ATOMIC_RELAXED);
+		uint64_t skipped = __atomic_load_n(&header.detachedSkipped, __ATOMIC_RELAXED);
+		for (const LiveSubscriberEntry& entry : header.subscribers) {
+			int32_t pid = __atomic_load_n(&entry.pid, __ATOMIC_ACQUIRE);
+			if (pid == 0) {
+				continue;
+			}
+			// a dead process's entry still holds its counts until someone claims it
+			count += live::alive(pid);
+			read += __atomic_load_n(&entry.blocks, __ATOMIC_RELAXED);
+			skipped += __atomic_load_n(&entry.skipped, __ATOMIC_RELAXED);
+		}
+		if (blocksRead) {
+			*blocksRead = read;
+		}
+		if (blocksSkipped) {
+			*blocksSkipped = skipped;
+		}
+		return count;
+	}
+
+	uint64_t blocks (size_t channel) const {
+		return __atomic_load_n(&info().channels[channel].head, __ATOMIC_RELAXED);
+	}
+	size_t bytes () const { return length; }
+	// seconds of samples the ring holds
+	double seconds () const {
+		const LiveRingHeader& header = info();
+		return header.numSlots * double(header.slotSamples) / header.sampleRate;
+	}
+
+private:
+	LiveRingHeader& info () { return *reinterpret_cast<LiveRingHeader*>(base); }
+	const LiveRingHeader& info () const { return *reinterpret_cast<const LiveRingHeader*>(base); }
+
+	char* slotAddress (size_t channel, size_t slot) const {
+		return base + live::HEADER_BYTES + (channel * info().numSlots + slot) * slotStride;
+	}
+
+	std::string path;
+	char* base = nullptr;
+	size_t length = 0;
+	size_t slotStride = 0;
+};
+
+//==============================================================================
+// One block as a subscriber sees it, the samples still in the shared ring
+struct LiveBlock {
+	const std::complex<short>* samples = nullptr;
+	size_t numSamples = 0;
+	uint64_t block = 0;			// block number within the channel
+	uint64_t sampleOffset = 0;	// first sample since the start of the run
+	bool hasTime = false;
+	int64_t fullSecs = 0;		// device time of the first sample, if hasTime
+	double fracSecs = 0.0;
+	uint32_t errorCode = 0;
+	uint64_t skipped = 0;		// blocks lost to the ring right before this one
+};
+
+//==============================================================================
+// The subscriber library: follows one channel of a running recording. The
+// samples are mapped read-only and handed out in place, only the header page
+// is writable so the recorder can see who reads how much. A subscriber that
+// cannot keep up loses blocks, never the recorder.
+//
+//   LiveSubscriber live ("/dev/shm/usrpLive", 0);
+//   LiveBlock block;
+//   while (not live.finished() or live.behind() > 0) {
+//       if (live.next(block, 1.0)) {
+//           use(block.samples, block.numSamples);
+//           if (not live.valid(block)) { ... overwritten while in use, drop what came of it ... }
+//       }
+//   }
+class LiveSubscriber {
+public:
+	// fromOldest starts with the oldest block still in the ring instead of the next one to come
+	LiveSubscriber (const std::string& path, size_t channel, bool fromOldest = false) : channel (channel) {
+		int fd = ::open(path.c_str(), O_RDWR);
+		if (fd < 0) {
+			throw std::runtime_error("cannot open " + path + ": " + std::strerror(errno) + ", is usrpMultiRecord --live running?");
+		}
+		off_t size = lseek(fd, 0, SEEK_END);
+		length = size < 0 ? 0 : size;
+		void* samples = length >= live::HEADER_BYTES ? mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+		void* page = samples != MAP_FAILED ? mmap(nullptr, live::HEADER_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+		::close(fd);
+		if (page == MAP_FAILED) {
+			if (samples != MAP_FAILED) {
+				munmap(samples, length);
+			}
+			throw std::runtime_error(path + " is not a live ring");
+		}
+		base = static_cast<const char*>(samples);
+		header = static_cast<LiveRingHeader*>(page);
+		if (memcmp(header->magic, "LIV1", 4) != 0
+			or length < live::HEADER_BYTES + size_t(header->numChannels) * header->numSlots * header->slotStride) {
+			unmap();
+			throw std::runtime_error(path + " is not a live ring, or is still being set up");
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (channel >= header->numChannels) {
+			unmap();
+			throw std::runtime_error((boost::format("channel %i is not in %s (%i channels)") % channel % path % header->numChannels).str());
+		}
+		// claim a free entry, or one whose process has gone
+		const int32_t pid = getpid();
+		for (LiveSubscriberEntry& candidate : header->subscribers) {
+			int32_t owner = __atomic_load_n(&candidate.pid, __ATOMIC_ACQUIRE);
+			if ((owner == 0 or not live::alive(owner))
+				and __atomic_compare_exchange_n(&candidate.pid, &owner, pid, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+				entry = &candidate;
+				break;
+			}
+		}
+		if (not entry) {
+			unmap();
+			throw std::runtime_error((boost::format("%s already has %i subscribers") % path % size_t(LiveRingHeader::MAX_SUBSCRIBERS)).str());
+		}
+		// what a dead subscriber left in the entry goes to the run's totals
+		release();
+		entry->channel = channel;
+		__atomic_store_n(&entry->heartbeat, live::now(), __ATOMIC_RELAXED);
+		const uint64_t head = __atomic_load_n(&header->channels[channel].head, __ATOMIC_ACQUIRE);
+		position = fromOldest and head >= header->numSlots ? head - header->numSlots + 1 : (fromOldest ? 0 : head);
+	}
+
+	~LiveSubscriber () {
+		release();
+		__atomic_store_n(&entry->pid, 0, __ATOMIC_RELEASE);
+		unmap();
+	}
+
+	LiveSubscriber (const LiveSubscriber&) = delete;
+	LiveSubscriber& operator= (const LiveSubscriber&) = delete;
+
+	// the next block, false if none came within the timeout or the recording has finished and everything was read
+	bool next (LiveBlock& block, double timeout) {
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(timeout));
+		// polls at a quarter block, often enough to keep up and rare enough to cost nothing
+		auto poll = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(
+			std::min(0.25 * header->slotSamples / header->sampleRate, 0.005)));
+		const uint64_t numSlots = header->numSlots;
+		uint64_t lost = 0;
+		while (true) {
+			const uint64_t head = __atomic_load_n(&header->channels[channel].head, __ATOMIC_ACQUIRE);
+			if (head > position) {
+				// a ring behind, the slot is about to be or being rewritten: go on with the newest block
+				if (head - position >= numSlots) {
+					lost += head - 1 - position;
+					position = head - 1;
+				}
+				const LiveSlotHeader& slot = *slotAt(position);
+				if (__atomic_load_n(&slot.block, __ATOMIC_ACQUIRE) == position) {
+					block.samples = reinterpret_cast<const std::complex<short>*>(reinterpret_cast<const char*>(&slot) + sizeof(LiveSlotHeader));
+					block.numSamples = slot.numSamples;
+					block.block = position;
+					block.sampleOffset = slot.sampleOffset;
+					block.hasTime = slot.hasTime;
+					block.fullSecs = slot.fullSecs;
+					block.fracSecs = slot.fracSecs;
+					block.errorCode = slot.errorCode;
+					block.skipped = lost;
+					if (valid(block)) {
+						position++;
+						numSkipped += lost;
+						numBlocks++;
+						__atomic_store_n(&entry->blocks, numBlocks, __ATOMIC_RELAXED);
+						__atomic_store_n(&entry->skipped, numSkipped, __ATOMIC_RELAXED);
+						__atomic_store_n(&entry->heartbeat, live::now(), __ATOMIC_RELAXED);
+						return true;
+					}
+				}
+				// overwritten between the head and the slot, look again
+				continue;
+			}
+			if (finished() or std::chrono::steady_clock::now() >= deadline) {
+				numSkipped += lost;
+				__atomic_store_n(&entry->skipped, numSkipped, __ATOMIC_RELAXED);
+				return false;
+			}
+			std::this_thread::sleep_for(poll);
+		}
+	}
+
+	// true while the block's slot still holds it, check once done with the samples
+	bool valid (const LiveBlock& block) const {
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		return __atomic_load_n(&slotAt(block.block)->block, __ATOMIC_RELAXED) == block.block;
+	}
+
+	// the recorder has stopped, or is gone without saying so
+	bool finished () const {
+		return __atomic_load_n(&header->finished, __ATOMIC_ACQUIRE) or not live::alive(header->recorderPid);
+	}
+
+	const LiveRingHeader& info () const { return *header; }
+	double sampleRate () const { return header->sampleRate; }
+	double frequency () const { return header->channels[channel].frequency; }
+	uint64_t blocks () const { return numBlocks; }
+	uint64_t skipped () const { return numSkipped; }
+	// blocks published that this subscriber has not read yet
+	uint64_t behind () const { return __atomic_load_n(&header->channels[channel].head, __ATOMIC_ACQUIRE) - position; }
+
+private:
+	const LiveSlotHeader* slotAt (uint64_t block) const {
+		return reinterpret_cast<const LiveSlotHeader*>(base + live::HEADER_BYTES + (channel * header->numSlots + block % header->numSlots) * header->slotStride);
+	}
+
+	// moves the entry's counts into the header, so the recorder still sees them once the entry is free
+	void release () {
+		__atomic_fetch_add(&header->detachedBlocks, __atomic_exchange_n(&entry->blocks, 0, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+		__atomic_fetch_add(&header->detachedSkipped, __atomic_exchange_n(&entry->skipped, 0, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	}
+
+	void unmap () {
+		munmap(const_cast<char*>(base), length);
+		munmap(header, live::HEADER_BYTES);
+	}
+
+	size_t channel;
+	const char* base = nullptr;
+	size_t length = 0;
+	LiveRingHeader* header = nullptr;
+	LiveSubscriberEntry* entry = nullptr;
+	uint64_t position = 0;
+	uint64_t numBlocks = 0, numSkipped = 0;
+};
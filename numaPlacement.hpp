@@ -0,0 +1,109 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+//==============================================================================
+// NUMA placement for the receive path without linking libnuma. The node a
+// network interface hangs off and the CPUs of a node come from sysfs, threads
+// are pinned with their affinity mask and memory is bound with mbind before it
+// is first touched. On a machine without NUMA every lookup returns node -1 and
+// all online CPUs, so callers do not need a separate code path.
+namespace numa {
+
+// kernel cpu lists look like "0-7,16-23"
+inline std::vector<int> parseCpuList (const std::string& list) {
+	std::vector<int> cpus;
+	std::stringstream in (list);
+	std::string range;
+	while (std::getline(in, range, ',')) {
+		if (range.empty()) {
+			continue;
+		}
+		size_t dash = range.find('-');
+		int first = std::stoi(range.substr(0, dash));
+		int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+		for (int cpu = first; cpu <= last; cpu++) {
+			cpus.push_back(cpu);
+		}
+	}
+	return cpus;
+}
+
+// node the PCI device behind a network interface is attached to, -1 if unknown
+inline int interfaceNode (const std::string& interface) {
+	std::ifstream in ("/sys/class/net/" + interface + "/device/numa_node");
+	int node = -1;
+	if (not (in >> node)) {
+		return -1;
+	}
+	return node;
+}
+
+// CPUs of a node, every online CPU for node -1
+inline std::vector<int> nodeCpus (int node) {
+	std::ifstream in (node < 0 ? std::string("/sys/devices/system/cpu/online")
+						: "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+	std::string list;
+	std::getline(in, list);
+	std::vector<int> cpus = parseCpuList(list);
+	if (cpus.empty()) {
+		for (long cpu = 0; cpu < sysconf(_SC_NPROCESSORS_ONLN); cpu++) {
+			cpus.push_back(cpu);
+		}
+	}
+	return cpus;
+}
+
+// CPUs the calling thread may run on
+inline std::vector<int> threadCpus () {
+	std::vector<int> cpus;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) == 0) {
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (CPU_ISSET(cpu, &set)) {
+				cpus.push_back(cpu);
+			}
+		}
+	}
+	return cpus;
+}
+
+// restrict the calling thread to cpus, threads it starts afterwards inherit the mask
+inline bool pinThread (const std::vector<int>& cpus) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int cpu : cpus) {
+		if (cpu >= 0 and cpu < CPU_SETSIZE) {
+			CPU_SET(cpu, &set);
+		}
+	}
+	return CPU_COUNT(&set) > 0 and pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+// prefer node for the pages of a mapping, must be called before they are first touched
+inline bool bindMemory (void* address, size_t length, int node) {
+#ifdef SYS_mbind
+	const int MPOL_PREFERRED = 1;
+	const int MAX_NODES = 1024;
+	if (node < 0 or node >= MAX_NODES) {
+		return false;
+	}
+	unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))] = {};
+	mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+	return syscall(SYS_mbind, address, length, MPOL_PREFERRED, mask, MAX_NODES, 0) == 0;
+#else
+	return false;
+#endif
+}
+
+}
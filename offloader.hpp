@@ -0,0 +1,213 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+//==============================================================================
+// Copies or moves finished files to a second volume (/mnt/fatty, the NAS
+// mount, or any local directory) on a background thread while recording goes
+// on, like backupToFatty.sh but without waiting for the end of the run.
+//
+// The thread runs at the lowest CPU and idle I/O priority and can be capped to
+// a bandwidth, so it only uses what the recording leaves over. Each file is
+// copied to <name>.part, synced and renamed, so the destination never shows a
+// partial file under its real name; in move mode the source is removed only
+// after that.
+class Offloader {
+public:
+	// bytesPerSecond 0 copies as fast as the volumes allow
+	Offloader (const std::string& destination, double bytesPerSecond, bool move)
+		: destination (destination), bytesPerSecond (bytesPerSecond), move (move), buffer (CHUNK_BYTES) {
+		makeDirectories(destination);
+		thread = std::thread (&Offloader::run, this);
+	}
+
+	~Offloader () {
+		finish();
+	}
+
+	Offloader (const Offloader&) = delete;
+	Offloader& operator= (const Offloader&) = delete;
+
+	// queue a closed file, returns immediately
+	void add (const std::string& fileName) {
+		std::lock_guard<std::mutex> guard (lock);
+		queue.push_back(fileName);
+		wake.notify_one();
+	}
+
+	// wait until everything queued so far has been offloaded and stop the thread
+	void finish () {
+		if (not thread.joinable()) {
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> guard (lock);
+			stopping = true;
+			wake.notify_one();
+		}
+		thread.join();
+	}
+
+	size_t pending () const {
+		std::lock_guard<std::mutex> guard (lock);
+		return queue.size() + (busy ? 1 : 0);
+	}
+	size_t filesDone () const { return numFiles; }
+	size_t filesFailed () const { return numFailed; }
+	uint64_t bytesDone () const { return numBytes; }
+	// seconds spent copying, for the average rate
+	double busyTime () const { return busySeconds; }
+
+	// mkdir -p
+	static void makeDirectories (const std::string& path) {
+		for (size_t pos = path.find('/', 1); ; pos = path.find('/', pos + 1)) {
+			std::string part = path.substr(0, pos);
+			if (not part.empty() and mkdir(part.c_str(), 0755) != 0 and errno != EEXIST) {
+				throw std::runtime_error("cannot create " + part + ": " + std::strerror(errno));
+			}
+			if (pos == std::string::npos) {
+				break;
+			}
+		}
+	}
+
+private:
+	static const size_t CHUNK_BYTES = 4 << 20;
+
+	void run () {
+		// stay out of the way of the recv and writer threads
+		pthread_setname_np(pthread_self(), "offload");
+		setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+#ifdef SYS_ioprio_set
+		const int IOPRIO_CLASS_IDLE = 3, IOPRIO_WHO_PROCESS = 1, IOPRIO_CLASS_SHIFT = 13;
+		syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, syscall(SYS_gettid), IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+#endif
+		while (true) {
+			std::string fileName;
+			{
+				std::unique_lock<std::mutex> guard (lock);
+				wake.wait(guard, [this] { return stopping or not queue.empty(); });
+				if (queue.empty()) {
+					return;
+				}
+				fileName = queue.front();
+				queue.pop_front();
+				busy = true;
+			}
+			auto start = std::chrono::steady_clock::now();
+			try {
+				offload(fileName);
+				numFiles++;
+			} catch (const std::exception& e) {
+				std::cerr << "\nOffload of " << fileName << " failed: " << e.what() << std::endl;
+				numFailed++;
+			}
+			busySeconds = busySeconds + std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			std::lock_guard<std::mutex> guard (lock);
+			busy = false;
+		}
+	}
+
+	void offload (const std::string& fileName) {
+		std::string target = destination + "/" + fileName.substr(fileName.rfind('/') + 1);
+		std::string partial = target + ".part";
+		int in = ::open(fileName.c_str(), O_RDONLY);
+		if (in < 0) {
+			throw std::runtime_error(std::string("cannot open: ") + std::strerror(errno));
+		}
+		int out = ::open(partial.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (out < 0) {
+			int err = errno;
+			::close(in);
+			throw std::runtime_error("cannot create " + partial + ": " + std::strerror(err));
+		}
+		posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+		try {
+			auto start = std::chrono::steady_clock::now();
+			uint64_t copied = 0;
+			while (true) {
+				ssize_t count = ::read(in, buffer.data(), buffer.size());
+				if (count < 0) {
+					if (errno == EINTR) {
+						continue;
+					}
+					throw std::runtime_error(std::string("read failed: ") + std::strerror(errno));
+				}
+				if (count == 0) {
+					break;
+				}
+				for (ssize_t done = 0; done < count; ) {
+					ssize_t ret = ::write(out, buffer.data() + done, count - done);
+					if (ret < 0) {
+						if (errno == EINTR) {
+							continue;
+						}
+						throw std::runtime_error("write to " + partial + " failed: " + std::strerror(errno));
+					}
+					done += ret;
+				}
+				// the recording will not read this back, keep it out of the page cache
+				posix_fadvise(in, copied, count, POSIX_FADV_DONTNEED);
+				copied += count;
+				numBytes += count;
+				if (bytesPerSecond > 0) {
+					// sleep until the average since the start of the file is back under the limit
+					std::chrono::duration<double> due (copied / bytesPerSecond);
+					std::this_thread::sleep_until(start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(due));
+				}
+			}
+			if (fsync(out) != 0) {
+				throw std::runtime_error("sync of " + partial + " failed: " + std::strerror(errno));
+			}
+		} catch (...) {
+			::close(in);
+			::close(out);
+			unlink(partial.c_str());
+			throw;
+		}
+		::close(in);
+		if (::close(out) != 0) {
+			throw std::runtime_error("close of " + partial + " failed: " + std::strerror(errno));
+		}
+		if (rename(partial.c_str(), target.c_str()) != 0) {
+			throw std::runtime_error("cannot rename " + partial + ": " + std::strerror(errno));
+		}
+		if (move and unlink(fileName.c_str()) != 0) {
+			throw std::runtime_error(std::string("cannot remove the source: ") + std::strerror(errno));
+		}
+	}
+
+	std::string destination;
+	double bytesPerSecond;
+	bool move;
+	std::vector<char> buffer;
+
+	mutable std::mutex lock;
+	std::condition_variable wake;
+	std::deque<std::string> queue;
+	bool stopping = false;
+	bool busy = false;
+	std::atomic<size_t> numFiles {0};
+	std::atomic<size_t> numFailed {0};
+	std::atomic<uint64_t> numBytes {0};
+	std::atomic<double> busySeconds {0.0};
+	std::thread thread;
+};
@@ -0,0 +1,317 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <complex>
+#include <memory>
+#include <fstream>
+#include <sstream>
+#include <random>
+#include <chrono>
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include <boost/format.hpp>
+
+#include "fileWriter.hpp"
+#include "sampleConvert.hpp"
+#include "sampleCodec.hpp"
+#include "chunkChecksum.hpp"
+
+//==============================================================================
+// A short check before the recorder arms that the host can take what it is
+// asked for. The write test runs ChannelWriter in the run's own mode with
+// its block size and number of files, into the target directory, and
+// includes the final flush to disk, so the page cache does not flatter a
+// buffered run. It takes a few seconds, so the result is kept per mount (and
+// write pattern) in a small cache file and reused for a while. Copying,
+// storage conversion and checksums are timed on one core for a fraction of a
+// second on every start, they are quick.
+namespace preflight {
+
+// long enough to get past the drive's own cache, short enough not to matter for a day's recording
+const double WRITE_SECONDS = 3.0;
+const uint64_t WRITE_BYTES = uint64_t(4) << 30;
+const double CPU_SECONDS = 0.2;
+const size_t COPY_SPAN = 64 << 20;
+
+struct Mount {
+	std::string point;
+	std::string device;
+	std::string type;
+};
+
+// /proc/self/mounts writes spaces and the like in paths as \040
+inline std::string unescape (const std::string& field) {
+	std::string out;
+	for (size_t i = 0; i < field.size(); i++) {
+		if (field[i] == '\\' and i + 3 < field.size()) {
+			out += char(std::stoi(field.substr(i + 1, 3), nullptr, 8));
+			i += 3;
+		} else {
+			out += field[i];
+		}
+	}
+	return out;
+}
+
+// the filesystem a directory is on, the last mount over the longest matching mount point
+inline Mount mountOf (const std::string& directory) {
+	char resolved[PATH_MAX];
+	const std::string path = realpath(directory.c_str(), resolved) ? resolved : directory;
+	std::ifstream mounts ("/proc/self/mounts");
+	Mount best;
+	std::string line;
+	while (std::getline(mounts, line)) {
+		std::istringstream fields (line);
+		Mount mount;
+		if (not (fields >> mount.device >> mount.point >> mount.type)) {
+			continue;
+		}
+		mount.point = unescape(mount.point);
+		const bool inside = path == mount.point or mount.point == "/" or path.compare(0, mount.point.size() + 1, mount.point + "/") == 0;
+		if (inside and mount.point.size() >= best.point.size()) {
+			best = mount;
+		}
+	}
+	if (best.point.empty()) {
+		best.point = path;
+	}
+	return best;
+}
+
+inline uint64_t freeBytes (const std::string& directory) {
+	struct statvfs info;
+	if (statvfs(directory.c_str(), &info) != 0) {
+		throw std::runtime_error("cannot stat " + directory + ": " + std::strerror(errno));
+	}
+	return uint64_t(info.f_bavail) * info.f_frsize;
+}
+
+//==============================================================================
+// Measured write bandwidths, one tab separated line per mount and write
+// pattern: key, bytes per second, unix time of the measurement
+class WriteCache {
+public:
+	explicit WriteCache (const std::string& fileName = defaultFile()) : fileName (fileName) {}
+
+	static std::string defaultFile () {
+		const char* cache = getenv("XDG_CACHE_HOME");
+		const char* home = getenv("HOME");
+		std::string directory = cache and *cache ? cache : home and *home ? std::string(home) + "/.cache" : "/tmp";
+		mkdir(directory.c_str(), 0755);
+		return directory + "/usrpPreflight.txt";
+	}
+
+	static std::string key (const Mount& mount, const std::string& mode, size_t ioSize, size_t blockBytes, size_t numFiles) {
+		return (boost::format("%s|%s|%s|%s|%i|%i|%i") % mount.point % mount.device % mount.type % mode % ioSize % blockBytes % numFiles).str();
+	}
+
+	// a measurement at most maxAge seconds old, age set to how old it is
+	bool find (const std::string& key, double maxAge, double& bytesPerSecond, double& age) const {
+		std::ifstream in (fileName);
+		std::string line;
+		while (std::getline(in, line)) {
+			std::istringstream fields (line);
+			std::string entry;
+			double rate, when;
+			if (std::getline(fields, entry, '\t') and entry == key and fields >> rate >> when) {
+				age = now() - when;
+				if (age >= 0 and age <= maxAge) {
+					bytesPerSecond = rate;
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+
+	// replaces the key's line, a cache that cannot be written only costs the next start its measurement
+	void store (const std::string& key, double bytesPerSecond) const {
+		std::vector<std::string> lines;
+		std::ifstream in (fileName);
+		std::string line;
+		while (std::getline(in, line)) {
+			if (line.compare(0, key.size() + 1, key + "\t") != 0) {
+				lines.push_back(line);
+			}
+		}
+		in.close();
+		const std::string temporary = fileName + "." + std::to_string(getpid());
+		std::ofstream out (temporary);
+		for (const std::string& kept : lines) {
+			out << kept << "\n";
+		}
+		out << boost::format("%s\t%.0f\t%.0f\n") % key % bytesPerSecond % now();
+		out.close();
+		if (not out or rename(temporary.c_str(), fileName.c_str()) != 0) {
+			unlink(temporary.c_str());
+		}
+	}
+
+	const std::string& name () const { return fileName; }
+
+private:
+	static double now () {
+		return std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+	}
+
+	std::string fileName;
+};
+
+//==============================================================================
+// Sustained bytes per second into directory, numFiles files written a block of
+// blockBytes at a time in turn the way the writer threads do, flushed to disk
+// at the end. The test files are removed again whatever happens.
+inline double measureWrite (const std::string& directory, ChannelWriter::Mode mode, size_t ioSize, size_t ioDepth,
+							size_t blockBytes, size_t numFiles, uint64_t maxBytes, double seconds) {
+	struct TestFiles {
+		std::vector<std::string> names;
+		std::vector<std::unique_ptr<ChannelWriter>> writers;
+		~TestFiles () {
+			writers.clear();
+			for (const std::string& name : names) {
+				unlink(name.c_str());
+			}
+		}
+	} files;
+	blockBytes = (blockBytes + ChannelWriter::ALIGNMENT - 1) / ChannelWriter::ALIGNMENT * ChannelWriter::ALIGNMENT;
+	void* memory = nullptr;
+	if (posix_memalign(&memory, ChannelWriter::ALIGNMENT, blockBytes) != 0) {
+		throw std::runtime_error("cannot allocate the preflight write buffer");
+	}
+	std::unique_ptr<char, decltype(&free)> buffer (static_cast<char*>(memory), &free);
+	// noise, so a compressing filesystem cannot make the test look faster than the samples will be
+	std::mt19937 random (1);
+	for (size_t k = 0; k + sizeof(uint32_t) <= blockBytes; k += sizeof(uint32_t)) {
+		uint32_t value = random();
+		memcpy(buffer.get() + k, &value, sizeof(value));
+	}
+	for (size_t i = 0; i < numFiles; i++) {
+		files.names.push_back((boost::format("%s/.usrpPreflight_%i_%i.tmp") % directory % getpid() % i).str());
+		files.writers.emplace_back(new ChannelWriter (files.names.back(), mode, ioSize, ioDepth, maxBytes / numFiles + blockBytes));
+	}
+
+	uint64_t written = 0;
+	auto start = std::chrono::steady_clock::now();
+	while (written < maxBytes and std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() < seconds) {
+		for (auto& writer : files.writers) {
+			writer->write(buffer.get(), blockBytes);
+		}
+		for (auto& writer : files.writers) {
+			writer->sync();
+		}
+		written += numFiles * blockBytes;
+	}
+	for (size_t i = 0; i < numFiles; i++) {
+		files.writers[i]->close();
+		int fd = ::open(files.names[i].c_str(), O_WRONLY);
+		if (fd >= 0) {
+			fdatasync(fd);
+			::close(fd);
+		}
+	}
+	return written / std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// bytes per second one core copies blocks of this size, as the page cache and the live ring do, over
+// COPY_SPAN bytes of blocks so they come from memory like the block pool's and not from the cache
+inline double measureCopy (size_t blockBytes, double seconds) {
+	const size_t numBlocks = std::max<size_t>(1, COPY_SPAN / blockBytes);
+	std::vector<char> from (numBlocks * blockBytes, 1), to (numBlocks * blockBytes);
+	uint64_t copied = 0;
+	auto start = std::chrono::steady_clock::now();
+	double elapsed = 0.0;
+	while (elapsed < seconds) {
+		for (size_t k = 0; k < numBlocks; k++) {
+			memcpy(to.data() + k * blockBytes, from.data() + k * blockBytes, blockBytes);
+		}
+		copied += numBlocks * blockBytes;
+		elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+	return copied / elapsed;
+}
+
+// bytes per second one core checksums, over COPY_SPAN bytes of blocks like measureCopy
+inline double measureChecksum (size_t blockBytes, double seconds) {
+	const size_t numBlocks = std::max<size_t>(1, COPY_SPAN / blockBytes);
+	std::vector<char> blocks (numBlocks * blockBytes, 1);
+	uint64_t done = 0;
+	uint32_t crc = 0;
+	auto start = std::chrono::steady_clock::now();
+	double elapsed = 0.0;
+	while (elapsed < seconds) {
+		for (size_t k = 0; k < numBlocks; k++) {
+			crc = crc32c::update(crc, blocks.data() + k * blockBytes, blockBytes);
+		}
+		done += numBlocks * blockBytes;
+		elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+	// keeps the loop from being optimised away
+	blocks[0] = char(crc);
+	return done / elapsed;
+}
+
+// samples per second one core turns into the storage format, or compresses
+inline double measureStore (StoreFormat format, unsigned shift, bool compress, size_t samplesPerBlock, double seconds) {
+	std::vector<std::complex<short>> samples (samplesPerBlock);
+	std::mt19937 random (2);
+	std::normal_distribution<float> noise (0.0f, 300.0f);
+	for (auto& sample : samples) {
+		sample = std::complex<short> (short(noise(random)), short(noise(random)));
+	}
+	SampleConverter converter (format, shift);
+	ChannelCompressor compressor (samplesPerBlock);
+	std::vector<char> out (samplesPerBlock * storeBytesPerSample(format) + CONVERT_SLACK);
+	uint64_t done = 0;
+	auto start = std::chrono::steady_clock::now();
+	double elapsed = 0.0;
+	while (elapsed < seconds) {
+		for (int k = 0; k < 16; k++) {
+			size_t frameBytes;
+			if (compress) {
+				compressor.compress(samples.data(), samplesPerBlock, done, frameBytes);
+			} else {
+				converter.convert(samples.data(), samplesPerBlock, out.data());
+			}
+			done += samplesPerBlock;
+		}
+		elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+	return done / elapsed;
+}
+
+//==============================================================================
+// One line of the margin report, margin being what the host can do over what
+// the run needs
+struct Check {
+	std::string name;
+	std::string measured;
+	std::string needed;
+	double margin = std::numeric_limits<double>::infinity();
+};
+
+// ok at or above the required margin, TIGHT below it, SHORT when the host cannot keep up at all
+inline const char* verdict (double margin, double required) {
+	return margin >= required ? "ok" : margin >= 1.0 ? "TIGHT" : "SHORT";
+}
+
+inline void printReport (std::ostream& out, const std::vector<Check>& checks, double required) {
+	for (const Check& check : checks) {
+		out << boost::format("  %-8s %-58s need %-12s %s") % check.name % check.measured % check.needed
+			   % (std::isinf(check.margin) ? std::string("ok") : (boost::format(check.margin < 10 ? "%.2fx %s" : "%.0fx %s") % check.margin % verdict(check.margin, required)).str()) << std::endl;
+	}
+}
+
+} // namespace preflight
@@ -1,9 +1,32 @@
-function data = readData(filename, dataLength, offset)
+function data = readData(filename, dataLength, offset, format)
+    % format is the usrpMultiRecord --store format: sc16 (default), sc12, sc8 or fc32
+    % dataLength counts I and Q values, offset is in bytes
+    if nargin < 4
+        format = 'sc16';
+    end
     fprintf('Reading BIN file..\n')
     fid = fopen(filename, 'r', 'ieee-le');
     fseek(fid, offset, 'bof'); % fileID, Offset in Bytes, Start point
 
-    rawData = fread(fid, dataLength, 'short', 0, 'ieee-le');
+    switch format
+        case 'sc16'
+            rawData = fread(fid, dataLength, 'short', 0, 'ieee-le');
+        case 'sc8'
+            rawData = fread(fid, dataLength, 'int8', 0, 'ieee-le');
+        case 'fc32'
+            rawData = fread(fid, dataLength, 'single', 0, 'ieee-le');
+        case 'sc12'
+            % 3 bytes per sample: I[7:0], I[11:8] | Q[3:0] << 4, Q[11:4]
+            bytes = fread(fid, [3, floor(dataLength/2)], 'uint8');
+            I = bytes(1,:) + mod(bytes(2,:), 16)*256;
+            Q = floor(bytes(2,:)/16) + bytes(3,:)*16;
+            I = I - 4096*(I >= 2048);
+            Q = Q - 4096*(Q >= 2048);
+            rawData = reshape([I; Q], [], 1);
+        otherwise
+            error('unknown sample format %s', format);
+    end
+    fclose(fid);
 
     if mod(length(rawData),2) == 0
         data = rawData(1:2:end) + 1i*rawData(2:2:end);
@@ -11,4 +34,4 @@ function data = readData(filename, dataLength, offset)
         data = rawData(1:2:end-1) + 1i*rawData(2:2:end);
     end
     fprintf('Complete\n')
-end
\ No newline at end of file
+end
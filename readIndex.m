@@ -0,0 +1,47 @@
+function [offset, index] = readIndex(filename, deviceTime)
+    % Reads a <file>_index.bin written by usrpMultiRecord (layout in blockIndex.hpp)
+    % and returns the byte offset of deviceTime [s] in every _chanN.bin file,
+    % e.g. data = readData('DAB_chan0.bin', 2*2.5e6, readIndex('DAB_index.bin', 100.0));
+    fprintf('Reading index file..\n')
+    fid = fopen(filename, 'r', 'ieee-le');
+    magic = fread(fid, 8, '*char')';
+    if ~strcmp(magic, 'USRPIDX1')
+        error('%s is not a recording index', filename);
+    end
+    headerSize = fread(fid, 1, 'uint32');
+    fread(fid, 1, 'uint32'); % entry size
+    index.rate = fread(fid, 1, 'double');
+    index.numChannels = fread(fid, 1, 'uint32');
+    index.bytesPerSample = fread(fid, 1, 'uint32');
+    index.gpsOffset = fread(fid, 1, 'int64');
+    index.hasGpsOffset = fread(fid, 1, 'uint32');
+
+    fseek(fid, headerSize, 'bof');
+    sampleOffset = fread(fid, Inf, 'uint64', 24, 'ieee-le');
+    fseek(fid, headerSize + 8, 'bof');
+    fullSecs = fread(fid, Inf, 'int64', 24, 'ieee-le');
+    fseek(fid, headerSize + 16, 'bof');
+    fracSecs = fread(fid, Inf, 'double', 24, 'ieee-le');
+    fseek(fid, headerSize + 24, 'bof');
+    numSamples = fread(fid, Inf, 'uint32', 28, 'ieee-le');
+    fseek(fid, headerSize + 28, 'bof');
+    flags = fread(fid, Inf, 'uint32', 28, 'ieee-le');
+    fclose(fid);
+
+    index.sampleOffset = sampleOffset;
+    index.time = fullSecs + fracSecs;
+    index.numSamples = numSamples;
+    index.errorCode = bitand(flags, 255);
+    index.hasTime = bitand(flags, 256) > 0;
+    index.gap = bitand(flags, 512) > 0;
+
+    offset = -1;
+    if nargin > 1
+        valid = find(index.hasTime & index.numSamples > 0);
+        k = valid(find(index.time(valid) <= deviceTime, 1, 'last'));
+        if ~isempty(k) && deviceTime < index.time(k) + index.numSamples(k)/index.rate
+            offset = (index.sampleOffset(k) + floor((deviceTime - index.time(k))*index.rate)) * index.bytesPerSample;
+        end
+    end
+    fprintf('Complete\n')
+end
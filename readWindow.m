@@ -0,0 +1,48 @@
+function [data, valid] = readWindow(file, start, numSamples, channels, unit)
+    % Reads numSamples of several channels of a usrpMultiRecord recording at once
+    % through librecordingreader.so (recordingReader.h), which maps the _chanN.bin
+    % files and converts them on every core.
+    % file is the recorder's --file, e.g. '/mnt/speedy/20200101/DAB'
+    % start is a device time [s] (unit 'time', the default, aligned by the index)
+    % or a sample number in the files (unit 'sample')
+    % channels are numbered as in the file names, all of them when empty or omitted
+    % data is numSamples x numel(channels) complex single scaled to +-1.0,
+    % valid the samples recorded on every channel, the rest is zero
+    % e.g. data = readWindow('DAB', 100.0, 600*2.5e6);
+    if nargin < 4
+        channels = [];
+    end
+    if nargin < 5
+        unit = 'time';
+    end
+    if ~libisloaded('librecordingreader')
+        loadlibrary('librecordingreader', 'recordingReader.h');
+    end
+    fprintf('Reading window..\n')
+    reader = calllib('librecordingreader', 'usrp_reader_open', file, 0);
+    if isNull(reader)
+        error(calllib('librecordingreader', 'usrp_reader_error'));
+    end
+    if isempty(channels)
+        channels = 0:calllib('librecordingreader', 'usrp_reader_channels', reader)-1;
+    end
+    out = libpointer('singlePtr', zeros(2*numSamples*numel(channels), 1, 'single'));
+    switch unit
+        case 'time'
+            valid = calllib('librecordingreader', 'usrp_reader_read_time', reader, start, numSamples, int32(channels), numel(channels), out);
+        case 'sample'
+            valid = calllib('librecordingreader', 'usrp_reader_read_samples', reader, start, numSamples, int32(channels), numel(channels), out);
+        otherwise
+            calllib('librecordingreader', 'usrp_reader_close', reader);
+            error('unit is time or sample, not %s', unit);
+    end
+    message = calllib('librecordingreader', 'usrp_reader_error');
+    calllib('librecordingreader', 'usrp_reader_close', reader);
+    if valid < 0
+        error(message);
+    end
+
+    raw = out.Value;
+    data = reshape(complex(raw(1:2:end), raw(2:2:end)), numSamples, numel(channels));
+    fprintf('Complete\n')
+end
@@ -0,0 +1,104 @@
+#include <string>
+#include <vector>
+#include <complex>
+#include <stdexcept>
+
+#include "recordingReader.h"
+#include "recordingReader.hpp"
+
+//==============================================================================
+// The C interface of recordingReader.h, exceptions become return values and
+// a per-thread error message.
+
+struct usrp_reader {
+	explicit usrp_reader (const std::string& prefix, size_t numThreads) : reader (prefix, numThreads) {}
+	RecordingReader reader;
+};
+
+static thread_local std::string lastError;
+
+static std::vector<size_t> channelList (const int* channels, int numChannels) {
+	std::vector<size_t> list;
+	for (int c = 0; channels and c < numChannels; c++) {
+		if (channels[c] < 0) {
+			throw std::runtime_error("channel numbers start at 0");
+		}
+		list.push_back(channels[c]);
+	}
+	return list;
+}
+
+extern "C" {
+
+usrp_reader* usrp_reader_open (const char* prefix, int num_threads) {
+	try {
+		return new usrp_reader (prefix, num_threads > 0 ? num_threads : 0);
+	} catch (const std::exception& e) {
+		lastError = e.what();
+		return nullptr;
+	}
+}
+
+void usrp_reader_close (usrp_reader* reader) {
+	delete reader;
+}
+
+const char* usrp_reader_error (void) {
+	return lastError.c_str();
+}
+
+int usrp_reader_channels (const usrp_reader* reader) {
+	return reader->reader.channels();
+}
+
+double usrp_reader_rate (const usrp_reader* reader) {
+	return reader->reader.rate();
+}
+
+int64_t usrp_reader_samples (const usrp_reader* reader) {
+	return reader->reader.samples();
+}
+
+int usrp_reader_time_range (const usrp_reader* reader, double* first, double* end) {
+	if (not reader->reader.timeRange(*first, *end)) {
+		lastError = "the recording has no timed index";
+		return -1;
+	}
+	return 0;
+}
+
+int usrp_reader_gps_offset (const usrp_reader* reader, int64_t* offset) {
+	int64_t value;
+	if (not reader->reader.gpsOffset(value)) {
+		lastError = "the recording was made without a GPSDO";
+		return -1;
+	}
+	*offset = value;
+	return 0;
+}
+
+int64_t usrp_reader_read_samples (usrp_reader* reader, int64_t first_sample, int64_t count, const int* channels, int num_channels, float* out) {
+	try {
+		if (first_sample < 0 or count < 0) {
+			throw std::runtime_error("the first sample and the count cannot be negative");
+		}
+		return reader->reader.readSamples(first_sample, count, channelList(channels, num_channels), reinterpret_cast<std::complex<float>*>(out));
+	} catch (const std::exception& e) {
+		lastError = e.what();
+		return -1;
+	}
+}
+
+int64_t usrp_reader_read_time (usrp_reader* reader, double device_time, int64_t count, const int* channels, int num_channels, float* out) {
+	try {
+		if (count < 0) {
+			throw std::runtime_error("the count cannot be negative");
+		}
+		return reader->reader.readTime(device_time, count, channelList(channels, num_channels), reinterpret_cast<std::complex<float>*>(out));
+	} catch (const std::exception& e) {
+		lastError = e.what();
+		return -1;
+	}
+}
+
+}
@@ -0,0 +1,54 @@
+#ifndef RECORDING_READER_H
+#define RECORDING_READER_H
+
+/*
+ * C interface to RecordingReader (recordingReader.hpp) for MATLAB, Python and
+ * anything else that can load a shared library. Build it with
+ *   g++ -std=c++17 -O2 -shared -fPIC -pthread recordingReader.cpp -o librecordingreader.so
+ *
+ * Samples come back as complex float scaled to +-1.0, interleaved I and Q,
+ * channel after channel: out holds 2 * count * num_channels floats and
+ * sample k of the c-th requested channel is at out[2 * (c * count + k)].
+ * That is a count x num_channels complex single matrix in MATLAB and a
+ * (num_channels, count) complex64 array in numpy. Channels are numbered as
+ * in the file names; channels = NULL or num_channels = 0 reads all of them.
+ *
+ * Functions returning a pointer give NULL on failure, the others a negative
+ * value; usrp_reader_error() then says why.
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct usrp_reader usrp_reader;
+
+/* prefix is the recorder's --file, num_threads 0 uses every core */
+usrp_reader* usrp_reader_open (const char* prefix, int num_threads);
+void usrp_reader_close (usrp_reader* reader);
+
+/* the last error of the calling thread */
+const char* usrp_reader_error (void);
+
+int usrp_reader_channels (const usrp_reader* reader);
+double usrp_reader_rate (const usrp_reader* reader);
+/* samples in the shortest channel file */
+int64_t usrp_reader_samples (const usrp_reader* reader);
+/* device times every channel has samples for, 0 on success */
+int usrp_reader_time_range (const usrp_reader* reader, double* first, double* end);
+/* GPS seconds minus device seconds, 0 on success, -1 without a GPSDO */
+int usrp_reader_gps_offset (const usrp_reader* reader, int64_t* offset);
+
+/* count samples from first_sample on, returns the samples read per channel, the rest of the window is zero */
+int64_t usrp_reader_read_samples (usrp_reader* reader, int64_t first_sample, int64_t count, const int* channels, int num_channels, float* out);
+/* count samples from device_time on, aligned by the index; returns the samples recorded on every channel,
+   samples in gaps, before the start or after the end are zero */
+int64_t usrp_reader_read_time (usrp_reader* reader, double device_time, int64_t count, const int* channels, int num_channels, float* out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,525 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <complex>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <algorithm>
+#include <stdexcept>
+#include <cmath>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <boost/format.hpp>
+
+#include "blockIndex.hpp"
+#include "sampleConvert.hpp"
+#include "volumeSet.hpp"
+
+//==============================================================================
+// Reads the _chanN.bin files of a recording for post-processing, in place of
+// readData.m going through one channel file after another. The files are
+// mapped, and a window of any channels is converted to complex float scaled
+// to +-1.0 (as UHD's fc32) with the AVX2 or NEON kernels of sampleConvert.hpp.
+// The window is cut into pieces of a few MB that a pool of threads converts
+// in parallel, and the kernel is told to read the whole window ahead, so a
+// long window is limited by the disks and not by the conversion.
+//
+// A window can start at a sample number, the same in every file, or at a
+// device time. For the latter every block is put at its place in time from
+// the index of its motherboard (<file>_index.bin, <file>_index_mb1.bin ...),
+// so channels on different boards stay aligned across overflows, and
+// samples that were not recorded read as zero. recordingReader.h makes the
+// same available to C, MATLAB (readWindow.m) and Python.
+//
+// A run made with --segment has a list of <file>_segNNNN_chanN.bin files per
+// channel, as many as <file>_segments.txt lists. Sample numbers go on across
+// them, each segment starting where the one before ended, so a window that
+// spans a boundary is read from both files.
+
+//==============================================================================
+// A fixed set of threads that runs the tasks of one call at a time
+class WorkerPool {
+public:
+	// 0 threads uses every core, the calling thread always helps
+	explicit WorkerPool (size_t numThreads = 0) {
+		if (numThreads == 0) {
+			numThreads = std::max(1u, std::thread::hardware_concurrency());
+		}
+		for (size_t t = 1; t < numThreads; t++) {
+			threads.emplace_back(&WorkerPool::work, this);
+		}
+	}
+
+	~WorkerPool () {
+		{
+			std::lock_guard<std::mutex> lock (mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (auto& thread : threads) {
+			thread.join();
+		}
+	}
+
+	WorkerPool (const WorkerPool&) = delete;
+	WorkerPool& operator= (const WorkerPool&) = delete;
+
+	// task(k) for every k below count, returns once all have run and rethrows the first exception
+	void run (size_t count, const std::function<void (size_t)>& task) {
+		std::unique_lock<std::mutex> lock (mutex);
+		current = &task;
+		numTasks = count;
+		nextTask = 0;
+		numDone = 0;
+		failure = nullptr;
+		generation++;
+		wake.notify_all();
+		const uint64_t mine = generation;
+		lock.unlock();
+		runTasks(task, count, mine);
+		lock.lock();
+		done.wait(lock, [this] { return numDone == numTasks; });
+		current = nullptr;
+		if (failure) {
+			std::rethrow_exception(failure);
+		}
+	}
+
+	size_t size () const { return threads.size() + 1; }
+
+private:
+	void work () {
+		uint64_t seen = 0;
+		std::unique_lock<std::mutex> lock (mutex);
+		while (true) {
+			wake.wait(lock, [&] { return stopping or (generation != seen and current); });
+			if (stopping) {
+				return;
+			}
+			seen = generation;
+			const std::function<void (size_t)>& task = *current;
+			const size_t count = numTasks;
+			lock.unlock();
+			runTasks(task, count, seen);
+			lock.lock();
+		}
+	}
+
+	// takes tasks of its call until none are left, a thread that wakes late must not take the next call's
+	void runTasks (const std::function<void (size_t)>& task, size_t count, uint64_t call) {
+		while (true) {
+			size_t k;
+			{
+				std::lock_guard<std::mutex> lock (mutex);
+				if (generation != call or nextTask >= count) {
+					return;
+				}
+				k = nextTask++;
+			}
+			try {
+				task(k);
+			} catch (...) {
+				std::lock_guard<std::mutex> lock (mutex);
+				if (not failure) {
+					failure = std::current_exception();
+				}
+			}
+			std::lock_guard<std::mutex> lock (mutex);
+			if (++numDone == numTasks) {
+				done.notify_all();
+			}
+		}
+	}
+
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	const std::function<void (size_t)>* current = nullptr;
+	size_t numTasks = 0, nextTask = 0, numDone = 0;
+	uint64_t generation = 0;
+	bool stopping = false;
+	std::exception_ptr failure;
+};
+
+//==============================================================================
+class RecordingReader {
+public:
+	// samples converted per task, small enough to spread a window over the threads
+	static const size_t TASK_SAMPLES = 1 << 19;
+
+	// prefix is the recorder's --file, e.g. /mnt/speedy/20200101/DAB for DAB_chan0.bin ...
+	explicit RecordingReader (const std::string& prefix, size_t numThreads = 0) : pool (numThreads) {
+		// the indexes say how many channels each motherboard's stream carried
+		for (size_t mboard = 0; ; mboard++) {
+			std::string indexName = mboard == 0 ? prefix + "_index.bin" : (boost::format("%s_index_mb%i.bin") % prefix % mboard).str();
+			struct stat st;
+			if (stat(indexName.c_str(), &st) != 0) {
+				break;
+			}
+			indexes.emplace_back(new IndexReader (indexName));
+		}
+		bytesPerSample = indexes.empty() ? sizeof(std::complex<short>) : indexes[0]->info().bytesPerSample;
+		if (bytesPerSample != sizeof(std::complex<short>) and bytesPerSample != sizeof(std::complex<float>)) {
+			throw std::runtime_error((boost::format("%s was stored with %i bytes per sample, only sc16 and fc32 recordings can be read") % prefix % bytesPerSample).str());
+		}
+		const std::vector<Placement> placement = loadPlacement(prefix);
+		const size_t numSegments = segmentCount(prefix);
+		// a reader that fails to open is never destroyed, so what was mapped by then is given back here
+		try {
+			for (size_t channel = 0; ; channel++) {
+				files.emplace_back();
+				ChannelFile& file = files.back();
+				for (size_t segment = 0; segment < std::max<size_t>(numSegments, 1); segment++) {
+					std::string fileName = numSegments == 0 ? prefix + "_chan" + std::to_string(channel) + ".bin"
+															: (boost::format("%s_seg%04i_chan%i.bin") % prefix % segment % channel).str();
+					// striped over several volumes the file is wherever the placement says, a compressed
+					// one as the .bin usrpDecompress wrote next to it
+					const std::string placed = placedFile(placement, segment, channel);
+					if (not placed.empty()) {
+						const size_t dot = placed.rfind('.');
+						fileName = dot != std::string::npos and placed.compare(dot, std::string::npos, ".sc16z") == 0 ? placed.substr(0, dot) + ".bin" : placed;
+						if (access(fileName.c_str(), F_OK) != 0) {
+							fileName = besidePrefix(prefix, fileName);
+						}
+					}
+					int fd = ::open(fileName.c_str(), O_RDONLY);
+					if (fd < 0) {
+						// past the last channel, a missing segment of a channel that is there would shift the ones after it
+						if (channel > 0 and segment == 0) {
+							break;
+						}
+						int err = errno;
+						throw std::runtime_error("cannot open " + fileName + ": " + std::strerror(err));
+					}
+					struct stat st;
+					fstat(fd, &st);
+					SegmentFile part;
+					part.length = st.st_size;
+					part.firstSample = file.numSamples;
+					part.numSamples = part.length / bytesPerSample;
+					if (part.length > 0) {
+						void* ptr = mmap(nullptr, part.length, PROT_READ, MAP_SHARED, fd, 0);
+						if (ptr == MAP_FAILED) {
+							int err = errno;
+							::close(fd);
+							throw std::runtime_error("cannot map " + fileName + ": " + std::strerror(err));
+						}
+						part.data = static_cast<const char*>(ptr);
+					}
+					::close(fd);
+					file.segments.push_back(part);
+					file.numSamples += part.numSamples;
+				}
+				if (file.segments.empty()) {
+					files.pop_back();
+					break;
+				}
+			}
+		} catch (...) {
+			for (ChannelFile& file : files) {
+				unmap(file);
+			}
+			throw;
+		}
+		// channel i belongs to the board whose stream it was in, the boards count their channels in order
+		for (size_t mboard = 0, first = 0; mboard < indexes.size(); first += indexes[mboard]->info().numChannels, mboard++) {
+			for (size_t channel = first; channel < first + indexes[mboard]->info().numChannels and channel < files.size(); channel++) {
+				files[channel].mboard = mboard;
+			}
+		}
+	}
+
+	~RecordingReader () {
+		for (ChannelFile& file : files) {
+			unmap(file);
+		}
+	}
+
+	RecordingReader (const RecordingReader&) = delete;
+	RecordingReader& operator= (const RecordingReader&) = delete;
+
+	size_t channels () const { return files.size(); }
+	double rate () const { return indexes.empty() ? 0.0 : indexes[0]->info().rate; }
+	// samples in the shortest channel file
+	uint64_t samples () const {
+		uint64_t shortest = UINT64_MAX;
+		for (const ChannelFile& file : files) {
+			shortest = std::min(shortest, file.numSamples);
+		}
+		return shortest;
+	}
+
+	// the device times every board has samples for, false without timed indexes and first and end left as they were
+	bool timeRange (double& first, double& end) const {
+		if (indexes.empty()) {
+			return false;
+		}
+		double from = -INFINITY, to = INFINITY;
+		for (auto& index : indexes) {
+			size_t entry = index->entryForDeviceTime(-INFINITY);
+			if (entry == index->size()) {
+				return false;
+			}
+			from = std::max(from, IndexReader::entryTime((*index)[entry]));
+			const IndexEntry& last = (*index)[index->entryForDeviceTime(INFINITY)];
+			to = std::min(to, IndexReader::entryTime(last) + last.numSamples / index->info().rate);
+		}
+		first = from;
+		end = to;
+		return true;
+	}
+
+	// GPS seconds minus device seconds, false if the recording had no GPSDO
+	bool gpsOffset (int64_t& offset) const {
+		if (indexes.empty() or not indexes[0]->info().hasGpsOffset) {
+			return false;
+		}
+		offset = indexes[0]->info().gpsOffset;
+		return true;
+	}
+
+	// count samples of each channel from firstSample on, channel after channel in out, which holds
+	// channels.size() * count values; empty channels reads them all. Returns the samples read per channel,
+	// the rest up to count is zero.
+	size_t readSamples (uint64_t firstSample, size_t count, std::vector<size_t> channels, std::complex<float>* out) {
+		checkChannels(channels);
+		std::vector<Piece> pieces;
+		size_t valid = count;
+		for (size_t c = 0; c < channels.size(); c++) {
+			const uint64_t available = files[channels[c]].numSamples;
+			size_t length = firstSample < available ? std::min<uint64_t>(count, available - firstSample) : 0;
+			addPiece(pieces, c, firstSample, 0, length, count);
+			valid = std::min(valid, length);
+		}
+		convert(pieces, channels, count, out);
+		return valid;
+	}
+
+	// count samples of each channel from device time on, every block placed by its board's index;
+	// returns the samples that were recorded on every channel, the others are zero
+	size_t readTime (double deviceTime, size_t count, std::vector<size_t> channels, std::complex<float>* out) {
+		checkChannels(channels);
+		if (indexes.empty()) {
+			throw std::runtime_error("the recording has no index, read it by sample number");
+		}
+		std::vector<Piece> pieces;
+		size_t valid = count;
+		for (size_t c = 0; c < channels.size(); c++) {
+			const ChannelFile& file = files[channels[c]];
+			const IndexReader& index = *indexes[file.mboard];
+			const double rate = index.info().rate, end = deviceTime + count / rate;
+			size_t recorded = 0, windowEnd = 0;
+			for (size_t e = index.entryForDeviceTime(deviceTime); e < index.size(); e++) {
+				const IndexEntry& entry = index[e];
+				if (entry.numSamples == 0 or not (entry.flags & INDEX_FLAG_HAS_TIME)) {
+					continue;
+				}
+				const double time = IndexReader::entryTime(entry);
+				if (time >= end) {
+					break;
+				}
+				// where the block lands in the window, a block over a gap starts later than the previous one ended
+				const long long position = std::llround((time - deviceTime) * rate);
+				const long long low = std::max<long long>(std::max<long long>(position, 0), windowEnd);
+				const long long high = std::min<long long>(position + entry.numSamples, count);
+				if (low >= high or entry.sampleOffset + (low - position) >= file.numSamples) {
+					continue;
+				}
+				const size_t length = std::min<uint64_t>(high - low, file.numSamples - entry.sampleOffset - (low - position));
+				addPiece(pieces, c, entry.sampleOffset + (low - position), low, length, count);
+				recorded += length;
+				windowEnd = low + length;
+			}
+			valid = std::min(valid, recorded);
+		}
+		convert(pieces, channels, count, out);
+		return valid;
+	}
+
+	const char* kernel () const {
+		if (bytesPerSample == sizeof(std::complex<float>)) {
+			return "copy";
+		}
+#if defined(SAMPLE_CONVERT_X86)
+		return convert::haveAvx2() ? "avx2" : "scalar";
+#elif defined(SAMPLE_CONVERT_NEON)
+		return "neon";
+#else
+		return "scalar";
+#endif
+	}
+	size_t threads () const { return pool.size(); }
+
+	// segments in <file>_segments.txt, 0 for a run that was not segmented
+	static size_t segmentCount (const std::string& prefix) {
+		std::ifstream in (prefix + "_segments.txt");
+		size_t count = 0;
+		std::string line;
+		while (std::getline(in, line)) {
+			std::istringstream fields (line);
+			std::string word;
+			size_t segment;
+			if (fields >> word >> segment and word == "Segment") {
+				count = std::max(count, segment + 1);
+			}
+		}
+		return count;
+	}
+
+private:
+	// one file of a channel, its sample 0 is sample firstSample of the channel
+	struct SegmentFile {
+		const char* data = nullptr;
+		size_t length = 0;
+		uint64_t firstSample = 0;
+		uint64_t numSamples = 0;
+	};
+
+	struct ChannelFile {
+		std::vector<SegmentFile> segments;
+		uint64_t numSamples = 0;
+		size_t mboard = 0;
+	};
+
+	static void unmap (ChannelFile& file) {
+		for (SegmentFile& segment : file.segments) {
+			if (segment.data) {
+				munmap(const_cast<char*>(segment.data), segment.length);
+			}
+		}
+		file.segments.clear();
+	}
+
+	// the segment holding sample of the channel, the last one starting at or before it
+	static const SegmentFile& segmentOf (const ChannelFile& file, uint64_t sample) {
+		auto after = std::upper_bound(file.segments.begin(), file.segments.end(), sample,
+									  [](uint64_t value, const SegmentFile& segment) { return value < segment.firstSample; });
+		return *(after - 1);
+	}
+
+	// samples of one channel going to one place in the window
+	struct Piece {
+		size_t channel;			// position in the requested channels
+		uint64_t fileSample;	// sample of the channel, counted across its segments
+		size_t windowSample;
+		size_t length;
+	};
+
+	void checkChannels (std::vector<size_t>& channels) const {
+		if (channels.empty()) {
+			for (size_t channel = 0; channel < files.size(); channel++) {
+				channels.push_back(channel);
+			}
+		}
+		for (size_t channel : channels) {
+			if (channel >= files.size()) {
+				throw std::runtime_error((boost::format("channel %i is not in the recording (%i channels)") % channel % files.size()).str());
+			}
+		}
+	}
+
+	// continues the channel's last piece when the samples follow on in the file, so a window without gaps is one piece
+	static void addPiece (std::vector<Piece>& pieces, size_t channel, uint64_t fileSample, size_t windowSample, size_t length, size_t count) {
+		if (length == 0 or windowSample >= count) {
+			return;
+		}
+		if (not pieces.empty()) {
+			Piece& last = pieces.back();
+			if (last.channel == channel and last.fileSample + last.length == fileSample and last.windowSample + last.length == windowSample) {
+				last.length += length;
+				return;
+			}
+		}
+		pieces.push_back(Piece {channel, fileSample, windowSample, length});
+	}
+
+	// f(segment, sample, length) for the part of samples [first, first + length) of the channel in each segment
+	template <typename F>
+	static void spans (const ChannelFile& file, uint64_t first, size_t length, F f) {
+		for (const uint64_t end = first + length; first < end; ) {
+			const SegmentFile& segment = segmentOf(file, first);
+			const size_t part = std::min(end, segment.firstSample + segment.numSamples) - first;
+			f(segment, first, part);
+			first += part;
+		}
+	}
+
+	void convert (const std::vector<Piece>& pieces, const std::vector<size_t>& channels, size_t count, std::complex<float>* out) {
+		// let the disks read the whole window at once rather than fault it in page by page
+		for (const Piece& piece : pieces) {
+			spans(files[channels[piece.channel]], piece.fileSample, piece.length, [&](const SegmentFile& segment, uint64_t sample, size_t length) {
+				size_t begin = (sample - segment.firstSample) * bytesPerSample / 4096 * 4096;
+				madvise(const_cast<char*>(segment.data) + begin, (sample - segment.firstSample + length) * bytesPerSample - begin, MADV_WILLNEED);
+			});
+		}
+		// whatever no piece covers stays zero, cleared by the tasks in window order so the pages stay with the threads
+		std::vector<Piece> tasks;
+		for (size_t c = 0; c < channels.size(); c++) {
+			size_t covered = 0;
+			auto zeroUntil = [&](size_t sample) {
+				for (; covered < sample; covered = std::min(sample, covered + TASK_SAMPLES)) {
+					tasks.push_back(Piece {c, UINT64_MAX, covered, std::min(sample, covered + TASK_SAMPLES) - covered});
+				}
+			};
+			for (const Piece& piece : pieces) {
+				if (piece.channel != c) {
+					continue;
+				}
+				zeroUntil(piece.windowSample);
+				// a task never crosses a segment boundary, its samples lie in one file
+				spans(files[channels[c]], piece.fileSample, piece.length, [&](const SegmentFile&, uint64_t sample, size_t length) {
+					for (size_t done = 0; done < length; done += TASK_SAMPLES) {
+						tasks.push_back(Piece {c, sample + done, piece.windowSample + (sample - piece.fileSample) + done, std::min(length - done, size_t(TASK_SAMPLES))});
+					}
+				});
+				covered = piece.windowSample + piece.length;
+			}
+			zeroUntil(count);
+		}
+		pool.run(tasks.size(), [&](size_t k) {
+			const Piece& task = tasks[k];
+			std::complex<float>* target = out + task.channel * count + task.windowSample;
+			if (task.fileSample == UINT64_MAX) {
+				std::fill(target, target + task.length, std::complex<float> ());
+				return;
+			}
+			const SegmentFile& segment = segmentOf(files[channels[task.channel]], task.fileSample);
+			const char* source = segment.data + (task.fileSample - segment.firstSample) * bytesPerSample;
+			if (bytesPerSample == sizeof(std::complex<float>)) {
+				memcpy(target, source, task.length * sizeof(std::complex<float>));
+				return;
+			}
+			const int16_t* in = reinterpret_cast<const int16_t*>(source);
+			float* values = reinterpret_cast<float*>(target);
+#if defined(SAMPLE_CONVERT_X86)
+			if (convert::haveAvx2()) {
+				convert::toFc32Avx2(in, 2 * task.length, values);
+				return;
+			}
+#elif defined(SAMPLE_CONVERT_NEON)
+			convert::toFc32Neon(in, 2 * task.length, values);
+			return;
+#endif
+			convert::toFc32Scalar(in, 2 * task.length, values);
+		});
+	}
+
+	WorkerPool pool;
+	std::vector<std::unique_ptr<IndexReader>> indexes;
+	std::vector<ChannelFile> files;
+	size_t bytesPerSample = sizeof(std::complex<short>);
+};
@@ -0,0 +1,265 @@
+#pragma once
+
+#include <vector>
+#include <complex>
+#include <istream>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+
+#include <time.h>
+
+//==============================================================================
+// Lossless compression of interleaved IQ shorts, fast enough to run on the
+// writer threads at the full recording rate.
+//
+// A compressed channel file (<file>_chanN.sc16z) is a sequence of frames, one
+// per recv() block so every frame can be decoded on its own:
+//
+//   CodecFrameHeader
+//   groups of up to GROUP_VALUES shorts (I and Q counted separately):
+//     1 byte   bit 7 set if the group is delta coded, bits 0-4 the packed width
+//     packed   GROUP_VALUES * width bits, little endian, zigzag coded
+//
+// Every group is stored either as the values themselves or as the difference
+// to the previous I (or Q) value, whichever needs fewer bits, and then packed
+// to the bits actually in use. Recordings at moderate gain use far fewer
+// than 16 bits, and oversampled narrowband signals gain a few more bits from
+// the delta. Noise-like wideband signals fall back to the raw width, so the
+// worst case is one byte per 256 values plus the frame header.
+// Assumes a little endian host like the rest of the recorder.
+
+struct CodecFrameHeader {
+	char magic[4];			// "SCZ1"
+	uint32_t numSamples;	// complex samples in this frame
+	uint32_t payloadBytes;	// bytes of groups following the header
+	uint32_t reserved;
+	uint64_t sampleOffset;	// first sample of the frame in the channel, matches the block index
+};
+
+static_assert(sizeof(CodecFrameHeader) == 24, "codec frame header layout changed");
+
+class SampleCodec {
+public:
+	static const size_t GROUP_VALUES = 256;
+	static const uint8_t GROUP_DELTA = 0x80;
+
+	// upper bound of compress() output for a block of numSamples
+	static size_t maxFrameBytes (size_t numSamples) {
+		size_t numGroups = (2 * numSamples + GROUP_VALUES - 1) / GROUP_VALUES;
+		return sizeof(CodecFrameHeader) + numGroups * (1 + GROUP_VALUES * sizeof(int16_t));
+	}
+
+	// encode one block into out (at least maxFrameBytes long), returns the frame size
+	static size_t compress (const std::complex<short>* samples, size_t numSamples, uint64_t sampleOffset, char* out) {
+		const int16_t* values = reinterpret_cast<const int16_t*>(samples);
+		const size_t numValues = 2 * numSamples;
+		uint8_t* pos = reinterpret_cast<uint8_t*>(out) + sizeof(CodecFrameHeader);
+		int16_t previous[2] = {0, 0};
+		uint16_t zigzag[GROUP_VALUES], delta[GROUP_VALUES];
+
+		for (size_t first = 0; first < numValues; first += GROUP_VALUES) {
+			const size_t n = std::min(size_t(GROUP_VALUES), numValues - first);
+			const int16_t* group = values + first;
+			// both candidates in one pass, OR-ing them gives the widest value
+			uint16_t rawBits = 0, deltaBits = 0;
+			zigzag[0] = encode(group[0]);
+			delta[0] = encode(int16_t(group[0] - previous[0]));
+			zigzag[1] = encode(group[1]);
+			delta[1] = encode(int16_t(group[1] - previous[1]));
+			for (size_t k = 2; k < n; k++) {
+				zigzag[k] = encode(group[k]);
+				delta[k] = encode(int16_t(group[k] - group[k - 2]));
+			}
+			for (size_t k = 0; k < n; k++) {
+				rawBits |= zigzag[k];
+				deltaBits |= delta[k];
+			}
+			unsigned rawWidth = width(rawBits), deltaWidth = width(deltaBits);
+			if (deltaWidth < rawWidth) {
+				*pos++ = GROUP_DELTA | deltaWidth;
+				pos = pack(delta, n, deltaWidth, pos);
+			} else {
+				*pos++ = rawWidth;
+				pos = pack(zigzag, n, rawWidth, pos);
+			}
+			previous[0] = group[n - 2];
+			previous[1] = group[n - 1];
+		}
+
+		CodecFrameHeader header;
+		memcpy(header.magic, "SCZ1", 4);
+		header.numSamples = numSamples;
+		header.payloadBytes = pos - reinterpret_cast<uint8_t*>(out) - sizeof(CodecFrameHeader);
+		header.reserved = 0;
+		header.sampleOffset = sampleOffset;
+		memcpy(out, &header, sizeof(header));
+		return sizeof(header) + header.payloadBytes;
+	}
+
+	// decode the groups of one frame, throws if they do not add up to the header
+	static void decompress (const CodecFrameHeader& header, const char* payload, std::complex<short>* samples) {
+		int16_t* values = reinterpret_cast<int16_t*>(samples);
+		const size_t numValues = 2 * size_t(header.numSamples);
+		const uint8_t* pos = reinterpret_cast<const uint8_t*>(payload);
+		const uint8_t* end = pos + header.payloadBytes;
+		int16_t previous[2] = {0, 0};
+		uint16_t zigzag[GROUP_VALUES];
+
+		for (size_t first = 0; first < numValues; first += GROUP_VALUES) {
+			const size_t n = std::min(size_t(GROUP_VALUES), numValues - first);
+			if (pos >= end) {
+				throw std::runtime_error("compressed frame is truncated");
+			}
+			uint8_t mode = *pos++;
+			unsigned bits = mode & 0x1f;
+			if (bits > 16 or pos + (n * bits + 7) / 8 > end) {
+				throw std::runtime_error("compressed frame is corrupt");
+			}
+			pos = unpack(pos, n, bits, zigzag);
+			int16_t* group = values + first;
+			if (mode & GROUP_DELTA) {
+				group[0] = int16_t(previous[0] + decode(zigzag[0]));
+				group[1] = int16_t(previous[1] + decode(zigzag[1]));
+				for (size_t k = 2; k < n; k++) {
+					group[k] = int16_t(group[k - 2] + decode(zigzag[k]));
+				}
+			} else {
+				for (size_t k = 0; k < n; k++) {
+					group[k] = decode(zigzag[k]);
+				}
+			}
+			previous[0] = group[n - 2];
+			previous[1] = group[n - 1];
+		}
+		if (pos != end) {
+			throw std::runtime_error("compressed frame has trailing bytes");
+		}
+	}
+
+private:
+	static uint16_t encode (int16_t value) {
+		return uint16_t(value << 1) ^ uint16_t(value >> 15);
+	}
+
+	static int16_t decode (uint16_t value) {
+		return int16_t((value >> 1) ^ -(value & 1));
+	}
+
+	static unsigned width (uint16_t bits) {
+		return bits ? 32 - __builtin_clz(bits) : 0;
+	}
+
+	static uint8_t* pack (const uint16_t* values, size_t n, unsigned bits, uint8_t* out) {
+		if (bits == 0) {
+			return out;
+		}
+		uint64_t buffer = 0;
+		unsigned filled = 0;
+		for (size_t k = 0; k < n; k++) {
+			buffer |= uint64_t(values[k]) << filled;
+			filled += bits;
+			if (filled >= 32) {
+				uint32_t word = uint32_t(buffer);
+				memcpy(out, &word, 4);
+				out += 4;
+				buffer >>= 32;
+				filled -= 32;
+			}
+		}
+		while (filled > 0) {
+			*out++ = uint8_t(buffer);
+			buffer >>= 8;
+			filled = filled > 8 ? filled - 8 : 0;
+		}
+		return out;
+	}
+
+	static const uint8_t* unpack (const uint8_t* in, size_t n, unsigned bits, uint16_t* values) {
+		if (bits == 0) {
+			memset(values, 0, n * sizeof(uint16_t));
+			return in;
+		}
+		const uint64_t mask = (1u << bits) - 1;
+		uint64_t buffer = 0;
+		unsigned filled = 0;
+		for (size_t k = 0; k < n; k++) {
+			while (filled < bits) {
+				buffer |= uint64_t(*in++) << filled;
+				filled += 8;
+			}
+			values[k] = uint16_t(buffer & mask);
+			buffer >>= bits;
+			filled -= bits;
+		}
+		return in;
+	}
+};
+
+//==============================================================================
+// Per channel compression buffer and statistics, used only by the writer
+// thread that owns the channel
+class ChannelCompressor {
+public:
+	explicit ChannelCompressor (size_t samplesPerBlock) : frame (SampleCodec::maxFrameBytes(samplesPerBlock)) {}
+
+	// compress one block, the frame stays valid until the next call
+	const char* compress (const std::complex<short>* samples, size_t numSamples, uint64_t sampleOffset, size_t& frameBytes) {
+		timespec start, end;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+		frameBytes = SampleCodec::compress(samples, numSamples, sampleOffset, frame.data());
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+		cpuSeconds += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+		rawBytes += numSamples * sizeof(std::complex<short>);
+		compressedBytes += frameBytes;
+		return frame.data();
+	}
+
+	double ratio () const { return compressedBytes ? double(rawBytes) / compressedBytes : 0.0; }
+	double cpuTime () const { return cpuSeconds; }
+	uint64_t inputBytes () const { return rawBytes; }
+	uint64_t outputBytes () const { return compressedBytes; }
+
+private:
+	std::vector<char> frame;
+	uint64_t rawBytes = 0;
+	uint64_t compressedBytes = 0;
+	double cpuSeconds = 0.0;
+};
+
+//==============================================================================
+// Reads frames one at a time from a compressed channel file
+class FrameReader {
+public:
+	explicit FrameReader (std::istream& in) : in (in) {}
+
+	// decode the next frame into samples, returns false at the end of the file
+	bool next (std::vector<std::complex<short>>& samples, uint64_t& sampleOffset) {
+		CodecFrameHeader header;
+		if (not in.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+			if (in.gcount() != 0) {
+				throw std::runtime_error("compressed file ends inside a frame header");
+			}
+			return false;
+		}
+		if (memcmp(header.magic, "SCZ1", 4) != 0) {
+			throw std::runtime_error("not a compressed sample frame");
+		}
+		payload.resize(header.payloadBytes);
+		if (not in.read(payload.data(), payload.size())) {
+			throw std::runtime_error("compressed file ends inside a frame");
+		}
+		samples.resize(header.numSamples);
+		SampleCodec::decompress(header, payload.data(), samples.data());
+		sampleOffset = header.sampleOffset;
+		bytes += sizeof(header) + header.payloadBytes;
+		return true;
+	}
+
+	uint64_t bytesRead () const { return bytes; }
+
+private:
+	std::istream& in;
+	std::vector<char> payload;
+	uint64_t bytes = 0;
+};
@@ -0,0 +1,312 @@
+#pragma once
+
+#include <string>
+#include <complex>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SAMPLE_CONVERT_X86 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SAMPLE_CONVERT_NEON 1
+#endif
+
+//==============================================================================
+// Storage formats for recorded samples and the kernels that convert received
+// sc16 blocks into them on the writer threads:
+//
+//   sc16  interleaved IQ shorts, written as received (4 bytes per sample)
+//   sc12  I and Q saturated to 12 bits and packed into 3 bytes per sample:
+//         byte 0 = I[7:0], byte 1 = I[11:8] | Q[3:0] << 4, byte 2 = Q[11:4]
+//   sc8   I and Q saturated to signed bytes (2 bytes per sample)
+//   fc32  interleaved IQ floats scaled to +-1.0 like UHD's fc32 (8 bytes per sample)
+//
+// sc12 and sc8 first shift the samples right by a configurable number of bits,
+// so they can keep either the low bits of a weak signal or the top bits of a
+// strong one. Samples that do not fit are clipped and counted.
+//
+// Every kernel has a scalar version. The x86 build picks AVX2 at run time if
+// the CPU has it, so no special compiler flags are needed. ARM builds use NEON,
+// which every 64-bit ARM core has.
+
+enum StoreFormat {STORE_SC16, STORE_SC12, STORE_SC8, STORE_FC32};
+
+inline StoreFormat parseStoreFormat (const std::string& name) {
+	if (name == "sc16") {
+		return STORE_SC16;
+	} else if (name == "sc12") {
+		return STORE_SC12;
+	} else if (name == "sc8") {
+		return STORE_SC8;
+	} else if (name == "fc32") {
+		return STORE_FC32;
+	}
+	throw std::runtime_error("unknown storage format: " + name + " (sc16, sc12, sc8, fc32)");
+}
+
+inline const char* storeFormatName (StoreFormat format) {
+	static const char* names[] = {"sc16", "sc12", "sc8", "fc32"};
+	return names[format];
+}
+
+inline size_t storeBytesPerSample (StoreFormat format) {
+	static const size_t sizes[] = {4, 3, 2, 8};
+	return sizes[format];
+}
+
+// kernels may write this many bytes past the end of their output
+static const size_t CONVERT_SLACK = 32;
+
+namespace convert {
+
+// --- scalar --------------------------------------------------------------------
+
+inline int16_t saturate (int value, int low, int high, size_t& clipped) {
+	if (value < low) {
+		clipped++;
+		return low;
+	} else if (value > high) {
+		clipped++;
+		return high;
+	}
+	return value;
+}
+
+inline size_t toSc8Scalar (const int16_t* in, size_t numValues, unsigned shift, int8_t* out) {
+	size_t clipped = 0;
+	for (size_t k = 0; k < numValues; k++) {
+		out[k] = saturate(in[k] >> shift, -128, 127, clipped);
+	}
+	return clipped;
+}
+
+inline size_t toSc12Scalar (const int16_t* in, size_t numSamples, unsigned shift, uint8_t* out) {
+	size_t clipped = 0;
+	for (size_t n = 0; n < numSamples; n++) {
+		uint16_t i = saturate(in[2 * n] >> shift, -2048, 2047, clipped) & 0xfff;
+		uint16_t q = saturate(in[2 * n + 1] >> shift, -2048, 2047, clipped) & 0xfff;
+		out[3 * n] = i & 0xff;
+		out[3 * n + 1] = (i >> 8) | ((q & 0xf) << 4);
+		out[3 * n + 2] = q >> 4;
+	}
+	return clipped;
+}
+
+inline void toFc32Scalar (const int16_t* in, size_t numValues, float* out) {
+	for (size_t k = 0; k < numValues; k++) {
+		out[k] = in[k] * (1.0f / 32768.0f);
+	}
+}
+
+// --- AVX2 ----------------------------------------------------------------------
+
+#ifdef SAMPLE_CONVERT_X86
+__attribute__((target("avx2")))
+inline size_t toSc8Avx2 (const int16_t* in, size_t numValues, unsigned shift, int8_t* out) {
+	const __m128i count = _mm_cvtsi32_si128(shift);
+	const __m256i high = _mm256_set1_epi16(127), low = _mm256_set1_epi16(-128);
+	size_t clipped = 0, k = 0;
+	for (; k + 32 <= numValues; k += 32) {
+		__m256i a = _mm256_sra_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + k)), count);
+		__m256i b = _mm256_sra_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + k + 16)), count);
+		// every out of range 16 bit value sets two mask bits
+		__m256i overA = _mm256_or_si256(_mm256_cmpgt_epi16(a, high), _mm256_cmpgt_epi16(low, a));
+		__m256i overB = _mm256_or_si256(_mm256_cmpgt_epi16(b, high), _mm256_cmpgt_epi16(low, b));
+		clipped += (__builtin_popcount(_mm256_movemask_epi8(overA)) + __builtin_popcount(_mm256_movemask_epi8(overB))) / 2;
+		// packs works per 128 bit lane, put the quadwords back in order
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(a, b), 0xd8);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + k), packed);
+	}
+	return clipped + toSc8Scalar(in + k, numValues - k, shift, out + k);
+}
+
+__attribute__((target("avx2")))
+inline size_t toSc12Avx2 (const int16_t* in, size_t numSamples, unsigned shift, uint8_t* out) {
+	const __m128i count = _mm_cvtsi32_si128(shift);
+	const __m256i high = _mm256_set1_epi16(2047), low = _mm256_set1_epi16(-2048);
+	const __m256i mask12 = _mm256_set1_epi32(0xfff);
+	// keep bytes 0-2 of every 32 bit sample, 12 bytes per 128 bit lane
+	const __m256i squeeze = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+											 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	size_t clipped = 0, n = 0;
+	for (; n + 8 <= numSamples; n += 8) {
+		__m256i v = _mm256_sra_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + 2 * n)), count);
+		__m256i over = _mm256_or_si256(_mm256_cmpgt_epi16(v, high), _mm256_cmpgt_epi16(low, v));
+		clipped += __builtin_popcount(_mm256_movemask_epi8(over)) / 2;
+		v = _mm256_max_epi16(_mm256_min_epi16(v, high), low);
+		// I in the low and Q in the high half of each 32 bit lane -> 24 bit I | Q << 12
+		__m256i i = _mm256_and_si256(v, mask12);
+		__m256i q = _mm256_and_si256(_mm256_srli_epi32(v, 16), mask12);
+		__m256i packed = _mm256_shuffle_epi8(_mm256_or_si256(i, _mm256_slli_epi32(q, 12)), squeeze);
+		// each store writes 4 bytes of zeros past its 12, the next store or the slack covers them
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + 3 * n), _mm256_castsi256_si128(packed));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + 3 * n + 12), _mm256_extracti128_si256(packed, 1));
+	}
+	return clipped + toSc12Scalar(in + 2 * n, numSamples - n, shift, out + 3 * n);
+}
+
+__attribute__((target("avx2")))
+inline void toFc32Avx2 (const int16_t* in, size_t numValues, float* out) {
+	const __m256 scale = _mm256_set1_ps(1.0f / 32768.0f);
+	size_t k = 0;
+	for (; k + 16 <= numValues; k += 16) {
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + k));
+		__m256 a = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_castsi256_si128(v)));
+		__m256 b = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_extracti128_si256(v, 1)));
+		_mm256_storeu_ps(out + k, _mm256_mul_ps(a, scale));
+		_mm256_storeu_ps(out + k + 8, _mm256_mul_ps(b, scale));
+	}
+	toFc32Scalar(in + k, numValues - k, out + k);
+}
+
+inline bool haveAvx2 () {
+	static const bool available = __builtin_cpu_supports("avx2");
+	return available;
+}
+#endif
+
+// --- NEON ----------------------------------------------------------------------
+
+#ifdef SAMPLE_CONVERT_NEON
+inline size_t toSc8Neon (const int16_t* in, size_t numValues, unsigned shift, int8_t* out) {
+	const int16x8_t count = vdupq_n_s16(-int(shift));
+	const int16x8_t high = vdupq_n_s16(127), low = vdupq_n_s16(-128);
+	uint16x8_t over = vdupq_n_u16(0);
+	size_t clipped = 0, k = 0;
+	for (; k + 16 <= numValues; k += 16) {
+		int16x8_t a = vshlq_s16(vld1q_s16(in + k), count);
+		int16x8_t b = vshlq_s16(vld1q_s16(in + k + 8), count);
+		// count in 16 bit lanes, emptied every 1024 iterations so they cannot overflow
+		over = vsubq_u16(over, vorrq_u16(vcgtq_s16(a, high), vcltq_s16(a, low)));
+		over = vsubq_u16(over, vorrq_u16(vcgtq_s16(b, high), vcltq_s16(b, low)));
+		vst1q_s8(out + k, vcombine_s8(vqmovn_s16(a), vqmovn_s16(b)));
+		if ((k & 0x3fff) == 0) {
+			clipped += vaddlvq_u16(over);
+			over = vdupq_n_u16(0);
+		}
+	}
+	clipped += vaddlvq_u16(over);
+	return clipped + toSc8Scalar(in + k, numValues - k, shift, out + k);
+}
+
+inline size_t toSc12Neon (const int16_t* in, size_t numSamples, unsigned shift, uint8_t* out) {
+	const int16x8_t count = vdupq_n_s16(-int(shift));
+	const int16x8_t high = vdupq_n_s16(2047), low = vdupq_n_s16(-2048);
+	size_t clipped = 0, n = 0;
+	for (; n + 8 <= numSamples; n += 8) {
+		// deinterleave 8 samples into I and Q
+		int16x8x2_t iq = vld2q_s16(in + 2 * n);
+		int16x8_t i = vshlq_s16(iq.val[0], count);
+		int16x8_t q = vshlq_s16(iq.val[1], count);
+		uint16x8_t overI = vorrq_u16(vcgtq_s16(i, high), vcltq_s16(i, low));
+		uint16x8_t overQ = vorrq_u16(vcgtq_s16(q, high), vcltq_s16(q, low));
+		clipped += vaddvq_u16(vaddq_u16(vshrq_n_u16(overI, 15), vshrq_n_u16(overQ, 15)));
+		uint16x8_t ui = vreinterpretq_u16_s16(vmaxq_s16(vminq_s16(i, high), low));
+		uint16x8_t uq = vreinterpretq_u16_s16(vmaxq_s16(vminq_s16(q, high), low));
+		// three byte planes, interleaved by the store
+		uint8x8x3_t bytes;
+		bytes.val[0] = vmovn_u16(ui);
+		bytes.val[1] = vmovn_u16(vorrq_u16(vandq_u16(vshrq_n_u16(ui, 8), vdupq_n_u16(0xf)), vshlq_n_u16(uq, 4)));
+		bytes.val[2] = vmovn_u16(vandq_u16(vshrq_n_u16(uq, 4), vdupq_n_u16(0xff)));
+		vst3_u8(out + 3 * n, bytes);
+	}
+	return clipped + toSc12Scalar(in + 2 * n, numSamples - n, shift, out + 3 * n);
+}
+
+inline void toFc32Neon (const int16_t* in, size_t numValues, float* out) {
+	const float32x4_t scale = vdupq_n_f32(1.0f / 32768.0f);
+	size_t k = 0;
+	for (; k + 8 <= numValues; k += 8) {
+		int16x8_t v = vld1q_s16(in + k);
+		vst1q_f32(out + k, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))), scale));
+		vst1q_f32(out + k + 4, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v))), scale));
+	}
+	toFc32Scalar(in + k, numValues - k, out + k);
+}
+#endif
+
+} // namespace convert
+
+//==============================================================================
+// Converts sc16 blocks into one storage format, returns the number of clipped
+// I or Q values. out must hold numSamples * storeBytesPerSample + CONVERT_SLACK.
+class SampleConverter {
+public:
+	SampleConverter (StoreFormat format, unsigned shift, bool vectorized = true)
+		: format (format), shift (shift), vectorized (vectorized) {
+		if (shift > 15) {
+			throw std::runtime_error("storage shift must be between 0 and 15 bits");
+		}
+	}
+
+	size_t convert (const std::complex<short>* samples, size_t numSamples, void* out) const {
+		const int16_t* in = reinterpret_cast<const int16_t*>(samples);
+		switch (format) {
+			case STORE_SC16:
+				memcpy(out, in, numSamples * sizeof(std::complex<short>));
+				return 0;
+			case STORE_SC12:
+#if defined(SAMPLE_CONVERT_X86)
+				if (vectorized and convert::haveAvx2()) {
+					return convert::toSc12Avx2(in, numSamples, shift, static_cast<uint8_t*>(out));
+				}
+#elif defined(SAMPLE_CONVERT_NEON)
+				if (vectorized) {
+					return convert::toSc12Neon(in, numSamples, shift, static_cast<uint8_t*>(out));
+				}
+#endif
+				return convert::toSc12Scalar(in, numSamples, shift, static_cast<uint8_t*>(out));
+			case STORE_SC8:
+#if defined(SAMPLE_CONVERT_X86)
+				if (vectorized and convert::haveAvx2()) {
+					return convert::toSc8Avx2(in, 2 * numSamples, shift, static_cast<int8_t*>(out));
+				}
+#elif defined(SAMPLE_CONVERT_NEON)
+				if (vectorized) {
+					return convert::toSc8Neon(in, 2 * numSamples, shift, static_cast<int8_t*>(out));
+				}
+#endif
+				return convert::toSc8Scalar(in, 2 * numSamples, shift, static_cast<int8_t*>(out));
+			case STORE_FC32:
+#if defined(SAMPLE_CONVERT_X86)
+				if (vectorized and convert::haveAvx2()) {
+					convert::toFc32Avx2(in, 2 * numSamples, static_cast<float*>(out));
+					return 0;
+				}
+#elif defined(SAMPLE_CONVERT_NEON)
+				if (vectorized) {
+					convert::toFc32Neon(in, 2 * numSamples, static_cast<float*>(out));
+					return 0;
+				}
+#endif
+				convert::toFc32Scalar(in, 2 * numSamples, static_cast<float*>(out));
+				return 0;
+		}
+		return 0;
+	}
+
+	// name of the kernel convert() uses on this machine
+	const char* kernel () const {
+		if (not vectorized or format == STORE_SC16) {
+			return format == STORE_SC16 ? "copy" : "scalar";
+		}
+#if defined(SAMPLE_CONVERT_X86)
+		return convert::haveAvx2() ? "avx2" : "scalar";
+#elif defined(SAMPLE_CONVERT_NEON)
+		return "neon";
+#else
+		return "scalar";
+#endif
+	}
+
+	StoreFormat storeFormat () const { return format; }
+
+private:
+	StoreFormat format;
+	unsigned shift;
+	bool vectorized;
+};
@@ -0,0 +1,270 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <complex>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <memory>
+#include <string>
+
+#include <pthread.h>
+
+#include <uhd/types/metadata.hpp>
+
+#include "bufferPool.hpp"
+
+//==============================================================================
+// Bounded single-producer/single-consumer queue. The recv thread is the only
+// producer and a single writer thread is the only consumer, so head and tail
+// only need acquire/release ordering and no locks.
+template <typename T>
+class SpscQueue {
+public:
+	explicit SpscQueue (size_t minCapacity) {
+		size_t capacity = 1;
+		while (capacity < minCapacity) {
+			capacity <<= 1;
+		}
+		slots.resize(capacity);
+		mask = capacity - 1;
+	}
+
+	// producer side, returns false if the queue is full
+	bool push (const T& item) {
+		const size_t head = headIdx.load(std::memory_order_relaxed);
+		const size_t tail = tailIdx.load(std::memory_order_acquire);
+		if (head - tail > mask) {
+			return false;
+		}
+		slots[head & mask] = item;
+		headIdx.store(head + 1, std::memory_order_release);
+		// only the producer writes the high-water mark
+		const size_t depth = head + 1 - tail;
+		if (depth > highWaterMark.load(std::memory_order_relaxed)) {
+			highWaterMark.store(depth, std::memory_order_relaxed);
+		}
+		return true;
+	}
+
+	// consumer side, returns false if the queue is empty
+	bool pop (T& item) {
+		const size_t tail = tailIdx.load(std::memory_order_relaxed);
+		const size_t head = headIdx.load(std::memory_order_acquire);
+		if (tail == head) {
+			return false;
+		}
+		item = slots[tail & mask];
+		tailIdx.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	// safe to call from any thread, but only a snapshot
+	size_t size () const {
+		return headIdx.load(std::memory_order_acquire) - tailIdx.load(std::memory_order_acquire);
+	}
+	size_t capacity () const { return mask + 1; }
+	size_t highWater () const { return highWaterMark.load(std::memory_order_relaxed); }
+
+private:
+	std::vector<T> slots;
+	size_t mask;
+	alignas(64) std::atomic<size_t> headIdx {0};
+	alignas(64) std::atomic<size_t> tailIdx {0};
+	alignas(64) std::atomic<size_t> highWaterMark {0};
+};
+
+//==============================================================================
+// One recv() worth of samples for every channel, pre-allocated and recycled.
+// The channel buffers point into the pipeline's huge page pool and each one
+// starts on a page boundary, so recv() fills them and the writers write them
+// to disk without any intermediate copy.
+struct SampleBlock {
+	SampleBlock (char* memory, size_t numChannels, size_t samplesPerBlock, size_t channelStride)
+		: capacity (samplesPerBlock) {
+		for (unsigned int i = 0; i < numChannels; i++) {
+			buffPtrs.push_back(reinterpret_cast<std::complex<short> *>(memory + i * channelStride));
+		}
+	}
+
+	std::vector<std::complex<short> *> buffPtrs;
+	size_t capacity;
+	size_t numSamples = 0;
+	// samples per channel asked of recv() for this block
+	size_t numRequested = 0;
+	// sample offset of the first sample in this block since the start of the run
+	size_t sampleOffset = 0;
+	uhd::rx_metadata_t metadata;
+	// host time recv() returned this block
+	std::chrono::steady_clock::time_point received;
+	// number of writers that still have to consume this block
+	std::atomic<size_t> pending {0};
+};
+
+struct PipelineStats {
+	size_t numBlocks = 0;
+	size_t queueCapacity = 0;
+	size_t queueDepth = 0;		// deepest writer queue right now
+	size_t queueHighWater = 0;	// deepest any writer queue has ever been
+	size_t blocksSubmitted = 0;
+	size_t poolStalls = 0;		// times recv had to wait for a free block
+};
+
+//==============================================================================
+// Moves blocks from the recv thread to the writer threads. Each writer owns a
+// contiguous range of channels and has its own queue, so every channel file is
+// only ever touched by one thread and stays in order. Blocks are returned to
+// the recv thread through a per-writer queue once the last writer is done.
+class BlockPipeline {
+public:
+	// handler(block, firstChannel, endChannel) is called on the writer thread
+	typedef std::function<void (const SampleBlock&, size_t, size_t)> WriteHandler;
+
+	// page alignment of every channel buffer in the pool
+	static const size_t BUFFER_ALIGNMENT = 4096;
+
+	// numaNode places the sample pool on that node, -1 leaves it to the kernel; writer threads are
+	// named threadPrefix and the first channel they write, so pipelines of several boards stay apart
+	BlockPipeline (size_t numChannels, size_t samplesPerBlock, size_t numBlocks, size_t numWriters, WriteHandler writeHandler, int numaNode = -1,
+				   const std::string& threadPrefix = "writer")
+		: numChannels (numChannels), handler (writeHandler), threadPrefix (threadPrefix),
+		  channelStride ((samplesPerBlock * sizeof(std::complex<short>) + BUFFER_ALIGNMENT - 1) / BUFFER_ALIGNMENT * BUFFER_ALIGNMENT),
+		  pool (numBlocks * numChannels * channelStride, numaNode) {
+		numWriters = std::min(numWriters, numChannels);
+		for (size_t i = 0; i < numBlocks; i++) {
+			blocks.emplace_back(new SampleBlock (pool.data() + i * numChannels * channelStride, numChannels, samplesPerBlock, channelStride));
+			freeBlocks.push_back(blocks.back().get());
+		}
+		for (size_t w = 0; w < numWriters; w++) {
+			writers.emplace_back(new Writer (numBlocks));
+			writers[w]->firstChannel = w * numChannels / numWriters;
+			writers[w]->endChannel = (w + 1) * numChannels / numWriters;
+		}
+		for (size_t w = 0; w < writers.size(); w++) {
+			writers[w]->thread = std::thread (&BlockPipeline::writerLoop, this, writers[w].get());
+		}
+	}
+
+	~BlockPipeline () {
+		finish();
+	}
+
+	// recv thread: get an empty block, waiting for the writers if none are free
+	SampleBlock* acquire () {
+		collectFreeBlocks();
+		if (freeBlocks.empty()) {
+			poolStalls.store(poolStalls.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			while (freeBlocks.empty()) {
+				std::this_thread::sleep_for(std::chrono::microseconds(50));
+				collectFreeBlocks();
+			}
+		}
+		SampleBlock* block = freeBlocks.back();
+		freeBlocks.pop_back();
+		return block;
+	}
+
+	// recv thread: hand a filled block to the writers
+	void submit (SampleBlock* block) {
+		blocksSubmitted.store(blocksSubmitted.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		// with no writer threads the recv thread writes the block itself
+		if (writers.empty()) {
+			handler(*block, 0, numChannels);
+			freeBlocks.push_back(block);
+			return;
+		}
+		block->pending.store(writers.size(), std::memory_order_relaxed);
+		for (size_t w = 0; w < writers.size(); w++) {
+			// a writer queue can hold every block so this never spins for long
+			while (not writers[w]->queue.push(block)) {
+				std::this_thread::yield();
+			}
+		}
+	}
+
+	// drain all queued blocks and stop the writer threads
+	void finish () {
+		done.store(true, std::memory_order_release);
+		for (size_t w = 0; w < writers.size(); w++) {
+			if (writers[w]->thread.joinable()) {
+				writers[w]->thread.join();
+			}
+		}
+	}
+
+	// safe to call from any thread, but only a snapshot
+	PipelineStats stats () const {
+		PipelineStats s;
+		s.numBlocks = blocks.size();
+		s.blocksSubmitted = blocksSubmitted.load(std::memory_order_relaxed);
+		s.poolStalls = poolStalls.load(std::memory_order_relaxed);
+		for (size_t w = 0; w < writers.size(); w++) {
+			s.queueCapacity = writers[w]->queue.capacity();
+			s.queueDepth = std::max(s.queueDepth, writers[w]->queue.size());
+			s.queueHighWater = std::max(s.queueHighWater, writers[w]->queue.highWater());
+		}
+		return s;
+	}
+
+	size_t numWriterThreads () const { return writers.size(); }
+	size_t poolBytes () const { return pool.size(); }
+	bool hugePages () const { return pool.hugePages(); }
+	bool numaBound () const { return pool.numaBound(); }
+
+private:
+	struct Writer {
+		explicit Writer (size_t numBlocks) : queue (numBlocks), returned (numBlocks) {}
+		SpscQueue<SampleBlock*> queue;		// recv thread -> writer
+		SpscQueue<SampleBlock*> returned;	// writer -> recv thread
+		size_t firstChannel = 0;
+		size_t endChannel = 0;
+		std::thread thread;
+	};
+
+	void writerLoop (Writer* writer) {
+		// shows up in top -H and the telemetry per-thread CPU time
+		pthread_setname_np(pthread_self(), (threadPrefix + std::to_string(writer->firstChannel)).substr(0, 15).c_str());
+		SampleBlock* block;
+		while (true) {
+			if (writer->queue.pop(block)) {
+				handler(*block, writer->firstChannel, writer->endChannel);
+				// the last writer to finish with a block gives it back
+				if (block->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+					writer->returned.push(block);
+				}
+			} else if (done.load(std::memory_order_acquire)) {
+				// make sure nothing was pushed between the pop and the flag
+				if (writer->queue.size() == 0) {
+					break;
+				}
+			} else {
+				std::this_thread::sleep_for(std::chrono::microseconds(50));
+			}
+		}
+	}
+
+	void collectFreeBlocks () {
+		SampleBlock* block;
+		for (size_t w = 0; w < writers.size(); w++) {
+			while (writers[w]->returned.pop(block)) {
+				freeBlocks.push_back(block);
+			}
+		}
+	}
+
+	size_t numChannels;
+	WriteHandler handler;
+	std::string threadPrefix;
+	size_t channelStride;
+	HugePageBuffer pool;
+	std::vector<std::unique_ptr<SampleBlock>> blocks;
+	std::vector<std::unique_ptr<Writer>> writers;
+	// only touched by the recv thread
+	std::vector<SampleBlock*> freeBlocks;
+	// only written by the recv thread, atomic so stats() can be read while it runs
+	std::atomic<size_t> blocksSubmitted {0};
+	std::atomic<size_t> poolStalls {0};
+	std::atomic<bool> done {false};
+};
@@ -5,4 +5,8 @@
 # 2TB NVME /mnt/speedy
 # 4TB SSD /mnt/fatty
 
-./rx_ascii_art_dft --args="addr0=192.168.40.2" --rate="10e6" --freq="490.1666e6" --gain="70"
+# Live spectrum of a running recording started with --spectrum=/dev/shm/usrpSpectrum
+./usrpSpectrum --file="/dev/shm/usrpSpectrum" --width="100" --height="10"
+
+# Without a recording running the UHD example can open the device itself
+#./rx_ascii_art_dft --args="addr0=192.168.40.2" --rate="10e6" --freq="490.1666e6" --gain="70"
@@ -0,0 +1,366 @@
+#pragma once
+
+#include <vector>
+#include <complex>
+#include <string>
+#include <fstream>
+#include <random>
+#include <thread>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <stdexcept>
+
+#include <uhd/stream.hpp>
+#include <uhd/types/device_addr.hpp>
+#include <uhd/types/metadata.hpp>
+
+//==============================================================================
+// Hardware-free sample sources. They implement uhd::rx_streamer so the
+// recorder and the benchmark drive them exactly like a real X300 stream.
+// Both are configured with a device-address-style string, e.g.
+//   --sim="mode=synth,tone=100e3,noise=20,overflow=1e-4"
+//   --sim="mode=replay,file=/mnt/speedy/20200101/DAB"
+// Common keys:
+//   spp       samples per packet reported by get_max_num_samps (default 1996)
+//   realtime  1 to pace samples at the configured rate like a device does,
+//             0 to deliver them as fast as the caller can take them (default 1)
+//   fifo      seconds of samples the simulated device can buffer before it
+//             overflows when the caller falls behind in realtime mode (default 0.1)
+//   overflow  probability per recv call of an injected ERROR_CODE_OVERFLOW
+//   late      probability per recv call of an injected ERROR_CODE_LATE_COMMAND
+//   seed      random seed for noise and fault injection
+//   clock     host to keep the host's UTC time as device time like a GPS-disciplined
+//             device, so timed starts wait for their time and recorders on one host
+//             share a clock; run for a device time that starts at the stream command (default)
+// setGain puts a front-end gain in front of the source, so gain sweeps can be
+// tried without a device; samples saturate at the ADC limits like the real one.
+class SimStreamer : public uhd::rx_streamer {
+public:
+	SimStreamer (size_t numChannels, double rate, const uhd::device_addr_t& args)
+		: numChannels (numChannels), rate (rate),
+		  samplesPerPacket (std::stoul(args.get("spp", "1996"))),
+		  rng (std::stoul(args.get("seed", "1"))),
+		  realtime (args.get("realtime", "1") != "0"),
+		  fifoSamples (std::stod(args.get("fifo", "0.1")) * rate),
+		  overflowProbability (std::stod(args.get("overflow", "0"))),
+		  lateProbability (std::stod(args.get("late", "0"))),
+		  hostClock (args.get("clock", "run") == "host"),
+		  gainEvents (numChannels), gains (numChannels, 1.0) {}
+
+	size_t get_num_channels () const override { return numChannels; }
+	size_t get_max_num_samps () const override { return samplesPerPacket; }
+
+	void issue_stream_cmd (const uhd::stream_cmd_t& streamCmd) override {
+		if (streamCmd.stream_mode == uhd::stream_cmd_t::STREAM_MODE_STOP_CONTINUOUS) {
+			streaming = false;
+			return;
+		}
+		streaming = true;
+		// the device clock starts at the requested time, with the host clock it waits for that time
+		startTime = streamCmd.stream_now ? (hostClock ? deviceTime() : 0.0) : streamCmd.time_spec.get_real_secs();
+		startWallClock = std::chrono::steady_clock::now();
+		if (hostClock) {
+			startWallClock += std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(startTime - deviceTime()));
+		}
+		sampleCount = 0;
+	}
+
+	// seconds of device time, the host's UTC time with clock=host
+	double deviceTime () const {
+		if (hostClock) {
+			return std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+		}
+		return streaming ? startTime + elapsed() : 0.0;
+	}
+
+	size_t recv (const buffs_type& buffs, const size_t numSamples, uhd::rx_metadata_t& metadata,
+				 const double timeout = 0.1, const bool onePacket = false) override {
+		metadata.reset();
+		if (not streaming) {
+			metadata.error_code = uhd::rx_metadata_t::ERROR_CODE_TIMEOUT;
+			return 0;
+		}
+		size_t count = onePacket ? std::min(numSamples, samplesPerPacket) : numSamples;
+
+		if (hostClock and elapsed() < 0) {
+			// nothing arrives before the start time
+			if (-elapsed() > timeout) {
+				std::this_thread::sleep_for(std::chrono::duration<double>(timeout));
+				metadata.error_code = uhd::rx_metadata_t::ERROR_CODE_TIMEOUT;
+				return 0;
+			}
+			std::this_thread::sleep_for(std::chrono::duration<double>(-elapsed()));
+		}
+		if (realtime) {
+			// wait until the device would have produced these samples
+			double ahead = (sampleCount + count) / rate - elapsed();
+			if (ahead > timeout) {
+				std::this_thread::sleep_for(std::chrono::duration<double>(timeout));
+				metadata.error_code = uhd::rx_metadata_t::ERROR_CODE_TIMEOUT;
+				return 0;
+			} else if (ahead > 0) {
+				std::this_thread::sleep_for(std::chrono::duration<double>(ahead));
+			}
+			// the caller fell further behind than the device buffer holds
+			double behind = elapsed() * rate - sampleCount;
+			if (behind > fifoSamples) {
+				sampleCount = size_t(elapsed() * rate);
+				return overflow(metadata);
+			}
+		}
+		if (overflowProbability > 0 and uniform(rng) < overflowProbability) {
+			// drop a packet worth of samples like the device does when its buffer fills
+			sampleCount += samplesPerPacket;
+			return overflow(metadata);
+		}
+		if (lateProbability > 0 and uniform(rng) < lateProbability) {
+			metadata.error_code = uhd::rx_metadata_t::ERROR_CODE_LATE_COMMAND;
+			return 0;
+		}
+
+		metadata.has_time_spec = true;
+		metadata.time_spec = uhd::time_spec_t(startTime) + uhd::time_spec_t::from_ticks(sampleCount, rate);
+		metadata.start_of_burst = (sampleCount == 0);
+		count = fill(buffs, count);
+		// a source that has run out ends the burst, the way a device ends a finite stream
+		metadata.end_of_burst = ended;
+		if (useGain) {
+			applyGain(buffs, count);
+		}
+		sampleCount += count;
+		return count;
+	}
+
+	size_t overflows () const { return numOverflows; }
+
+	// gain of a channel from the device time at on, 0 dB passes the source through unchanged
+	void setGain (size_t channel, double gainDb, double at = 0.0) {
+		auto& events = gainEvents.at(channel);
+		auto later = std::find_if(events.begin(), events.end(), [at](const GainEvent& event) { return event.time > at; });
+		events.insert(later, GainEvent {at, std::pow(10.0, gainDb / 20.0)});
+		useGain = true;
+	}
+
+protected:
+	// write count samples for every channel, returns how many were written
+	virtual size_t fill (const buffs_type& buffs, size_t count) = 0;
+
+	size_t numChannels;
+	double rate;
+	size_t samplesPerPacket;
+	std::mt19937 rng;
+	bool ended = false;		// set by fill once no samples will follow
+
+private:
+	double elapsed () const {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - startWallClock).count();
+	}
+
+	size_t overflow (uhd::rx_metadata_t& metadata) {
+		numOverflows++;
+		metadata.error_code = uhd::rx_metadata_t::ERROR_CODE_OVERFLOW;
+		metadata.has_time_spec = true;
+		metadata.time_spec = uhd::time_spec_t(startTime) + uhd::time_spec_t::from_ticks(sampleCount, rate);
+		return 0;
+	}
+
+	// scale each channel by the gain in effect at every sample, saturating like the ADC
+	void applyGain (const buffs_type& buffs, size_t count) {
+		for (size_t ch = 0; ch < numChannels; ch++) {
+			std::complex<short>* out = static_cast<std::complex<short>*>(buffs[ch]);
+			auto& events = gainEvents[ch];
+			for (size_t done = 0; done < count; ) {
+				const size_t sample = sampleCount + done;
+				while (not events.empty() and dueSample(events.front().time) <= sample) {
+					gains[ch] = events.front().linear;
+					events.pop_front();
+				}
+				size_t chunk = count - done;
+				if (not events.empty()) {
+					chunk = std::min<size_t>(chunk, dueSample(events.front().time) - sample);
+				}
+				if (gains[ch] != 1.0) {
+					short* values = reinterpret_cast<short*>(out + done);
+					for (size_t k = 0; k < 2 * chunk; k++) {
+						values[k] = short(std::max(-32768.0, std::min(32767.0, std::round(values[k] * gains[ch]))));
+					}
+				}
+				done += chunk;
+			}
+		}
+	}
+
+	size_t dueSample (double time) const {
+		return std::max<long long>(0, std::llround((time - startTime) * rate));
+	}
+
+	struct GainEvent {
+		double time;
+		double linear;
+	};
+
+	bool realtime;
+	double fifoSamples;
+	double overflowProbability;
+	double lateProbability;
+	bool hostClock;
+	std::uniform_real_distribution<double> uniform {0.0, 1.0};
+	bool streaming = false;
+	double startTime = 0.0;
+	std::chrono::steady_clock::time_point startWallClock;
+	size_t sampleCount = 0;
+	size_t numOverflows = 0;
+	std::vector<std::deque<GainEvent>> gainEvents;
+	std::vector<double> gains;
+	bool useGain = false;
+};
+
+//==============================================================================
+// Tone plus gaussian noise on every channel. Keys:
+//   tone       tone offset from the centre frequency in Hz (default rate/10)
+//   amplitude  tone amplitude in ADC codes (default 2000)
+//   noise      noise standard deviation in ADC codes (default 20)
+//   burst      seconds from one burst of the tone to the next, 0 for a continuous tone (default 0)
+//   burstlen   seconds the tone is on in every burst period (default 0.1)
+//   spread     dB the tone gets weaker from one channel to the next (default 0)
+// Each channel gets a different phase so cross-channel tools have something to find.
+// The waveform is precomputed once and copied out, so generating it costs about as
+// much as a memcpy and does not limit the benchmark.
+class SyntheticStreamer : public SimStreamer {
+public:
+	SyntheticStreamer (size_t numChannels, double rate, const uhd::device_addr_t& args)
+		: SimStreamer (numChannels, rate, args) {
+		double tone = std::stod(args.get("tone", std::to_string(rate / 10)));
+		double amplitude = std::stod(args.get("amplitude", "2000"));
+		double noise = std::stod(args.get("noise", "20"));
+		burstPeriod = std::llround(std::stod(args.get("burst", "0")) * rate);
+		burstLength = std::llround(std::stod(args.get("burstlen", "0.1")) * rate);
+		double spread = std::stod(args.get("spread", "0"));
+		// a whole number of tone periods so the table wraps without a phase jump
+		const size_t tableLength = 1 << 16;
+		double cycles = std::round(tone / rate * tableLength);
+		std::normal_distribution<double> gaussian (0.0, noise);
+		tables.resize(numChannels, std::vector<std::complex<short>> (tableLength));
+		quietTables.resize(burstPeriod > 0 ? numChannels : 0, std::vector<std::complex<short>> (tableLength));
+		for (size_t ch = 0; ch < numChannels; ch++) {
+			double phase = 2 * M_PI * ch / std::max<size_t>(numChannels, 1);
+			double level = amplitude * std::pow(10.0, -spread * ch / 20.0);
+			for (size_t n = 0; n < tableLength; n++) {
+				double arg = 2 * M_PI * cycles * n / tableLength + phase;
+				tables[ch][n] = std::complex<short> (
+					short(std::lround(level * std::cos(arg) + gaussian(rng))),
+					short(std::lround(level * std::sin(arg) + gaussian(rng))));
+			}
+			for (size_t n = 0; burstPeriod > 0 and n < tableLength; n++) {
+				quietTables[ch][n] = std::complex<short> (short(std::lround(gaussian(rng))), short(std::lround(gaussian(rng))));
+			}
+		}
+	}
+
+protected:
+	size_t fill (const buffs_type& buffs, size_t count) override {
+		const size_t tableLength = tables[0].size();
+		for (size_t ch = 0; ch < numChannels; ch++) {
+			std::complex<short>* out = static_cast<std::complex<short>*>(buffs[ch]);
+			size_t pos = position;
+			uint64_t sample = generated;
+			size_t done = 0;
+			while (done < count) {
+				size_t chunk = std::min(count - done, tableLength - pos);
+				const std::vector<std::complex<short>>* table = &tables[ch];
+				if (burstPeriod > 0) {
+					// switch tables where the burst starts or ends
+					uint64_t phase = sample % burstPeriod;
+					bool on = phase < burstLength;
+					chunk = std::min<uint64_t>(chunk, on ? burstLength - phase : burstPeriod - phase);
+					table = on ? &tables[ch] : &quietTables[ch];
+				}
+				memcpy(out + done, &(*table)[pos], chunk * sizeof(std::complex<short>));
+				done += chunk;
+				sample += chunk;
+				pos = (pos + chunk) % tableLength;
+			}
+		}
+		position = (position + count) % tableLength;
+		generated += count;
+		return count;
+	}
+
+private:
+	std::vector<std::vector<std::complex<short>>> tables;
+	std::vector<std::vector<std::complex<short>>> quietTables;
+	uint64_t burstPeriod = 0;
+	uint64_t burstLength = 0;
+	uint64_t generated = 0;
+	size_t position = 0;
+};
+
+//==============================================================================
+// Plays back an existing recording (<file>_chanN.bin), from file firstChannel on
+// so each board of a --perboard run replays its own channels. Keys:
+//   file   recording prefix as passed to --file when it was made
+//   loop   1 to start again at the beginning when the files run out (default 1),
+//          0 to end the stream there, the last recv sets end_of_burst
+class ReplayStreamer : public SimStreamer {
+public:
+	ReplayStreamer (size_t numChannels, double rate, const uhd::device_addr_t& args, size_t firstChannel = 0)
+		: SimStreamer (numChannels, rate, args), loop (args.get("loop", "1") != "0") {
+		std::string prefix = args.get("file");
+		for (size_t ch = 0; ch < numChannels; ch++) {
+			std::string fileName (prefix + "_chan" + std::to_string(firstChannel + ch) + ".bin");
+			files.emplace_back(fileName, std::ifstream::binary);
+			if (not files.back()) {
+				throw std::runtime_error("cannot open replay file " + fileName);
+			}
+			// a file without a whole sample would never fill a block, looped or not
+			if (files.back().seekg(0, std::ifstream::end).tellg() < std::streamoff(sizeof(std::complex<short>))) {
+				throw std::runtime_error("replay file " + fileName + " holds no samples");
+			}
+			files.back().seekg(0);
+		}
+	}
+
+protected:
+	size_t fill (const buffs_type& buffs, size_t count) override {
+		size_t shortest = count;
+		for (size_t ch = 0; ch < numChannels; ch++) {
+			char* out = static_cast<char*>(buffs[ch]);
+			size_t done = 0;
+			while (done < count) {
+				files[ch].read(out + done * sizeof(std::complex<short>), (count - done) * sizeof(std::complex<short>));
+				done += files[ch].gcount() / sizeof(std::complex<short>);
+				if (done < count) {
+					if (not loop) {
+						ended = true;
+						break;
+					}
+					files[ch].clear();
+					files[ch].seekg(0);
+				}
+			}
+			shortest = std::min(shortest, done);
+		}
+		return shortest;
+	}
+
+private:
+	bool loop;
+	std::vector<std::ifstream> files;
+};
+
+//==============================================================================
+// Build the simulated source described by a --sim argument string, firstChannel is the
+// recording's number of the source's channel 0
+inline uhd::rx_streamer::sptr makeSimStreamer (const std::string& simArgs, size_t numChannels, double rate, size_t firstChannel = 0) {
+	uhd::device_addr_t args (simArgs);
+	std::string mode = args.get("mode", "synth");
+	if (mode == "synth") {
+		return uhd::rx_streamer::sptr (new SyntheticStreamer (numChannels, rate, args));
+	} else if (mode == "replay") {
+		return uhd::rx_streamer::sptr (new ReplayStreamer (numChannels, rate, args, firstChannel));
+	}
+	throw std::runtime_error("unknown simulated source mode: " + mode + " (synth, replay)");
+}
@@ -0,0 +1,457 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <complex>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+#include <cmath>
+#include <cstring>
+#include <cerrno>
+
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "sampleConvert.hpp"
+
+//==============================================================================
+// Live spectrum of every channel while recording, so signal presence can be
+// checked without stopping the recorder to run rx_ascii_art_dft.
+//
+// The writer threads offer each block to the monitor. Only when a capture is
+// pending for the channel do they copy its first FFT-size samples, otherwise
+// an offer is a single atomic load. A low priority thread arms a capture on
+// every channel, windows and transforms it, and averages the power over a few
+// captures. Each result is published as one frame in a small shared file
+// (usually in /dev/shm) that usrpSpectrum renders in a terminal:
+//
+//   SpectrumFrameHeader
+//   double   centre frequency of each channel [Hz]
+//   float    power of each channel and bin [dBFS], lowest frequency first
+//
+// The frame is rewritten in place under a sequence counter that is odd while
+// it changes, so readers retry instead of seeing a half-updated spectrum.
+
+struct SpectrumFrameHeader {
+	char magic[4];			// "SPC1"
+	uint32_t numChannels;
+	uint32_t numBins;		// FFT size, bins run from -rate/2 to +rate/2 around each centre
+	uint32_t averages;		// captures averaged per frame
+	double sampleRate;
+	uint64_t sequence;		// odd while the frame is being written, bumped by two per frame
+	uint64_t sampleOffset;	// first sample of the last capture in the frame
+	int64_t updated;		// system time of the frame [s since the epoch]
+	uint64_t reserved;
+};
+
+static_assert(sizeof(SpectrumFrameHeader) == 56, "spectrum frame header layout changed");
+
+namespace spectrum {
+
+// one radix-2 pass over h butterflies: a += w * b, b = a - w * b
+inline void butterfliesScalar (float* aRe, float* aIm, float* bRe, float* bIm, const float* wRe, const float* wIm, size_t h) {
+	for (size_t j = 0; j < h; j++) {
+		float tRe = bRe[j] * wRe[j] - bIm[j] * wIm[j];
+		float tIm = bRe[j] * wIm[j] + bIm[j] * wRe[j];
+		bRe[j] = aRe[j] - tRe;
+		bIm[j] = aIm[j] - tIm;
+		aRe[j] += tRe;
+		aIm[j] += tIm;
+	}
+}
+
+// |x|^2 added to the running power
+inline void accumulateScalar (const float* re, const float* im, double* power, size_t n) {
+	for (size_t k = 0; k < n; k++) {
+		power[k] += re[k] * re[k] + im[k] * im[k];
+	}
+}
+
+#ifdef SAMPLE_CONVERT_X86
+__attribute__((target("avx2")))
+inline void butterfliesAvx2 (float* aRe, float* aIm, float* bRe, float* bIm, const float* wRe, const float* wIm, size_t h) {
+	size_t j = 0;
+	for (; j + 8 <= h; j += 8) {
+		__m256 br = _mm256_loadu_ps(bRe + j), bi = _mm256_loadu_ps(bIm + j);
+		__m256 wr = _mm256_loadu_ps(wRe + j), wi = _mm256_loadu_ps(wIm + j);
+		__m256 ar = _mm256_loadu_ps(aRe + j), ai = _mm256_loadu_ps(aIm + j);
+		__m256 tr = _mm256_sub_ps(_mm256_mul_ps(br, wr), _mm256_mul_ps(bi, wi));
+		__m256 ti = _mm256_add_ps(_mm256_mul_ps(br, wi), _mm256_mul_ps(bi, wr));
+		_mm256_storeu_ps(bRe + j, _mm256_sub_ps(ar, tr));
+		_mm256_storeu_ps(bIm + j, _mm256_sub_ps(ai, ti));
+		_mm256_storeu_ps(aRe + j, _mm256_add_ps(ar, tr));
+		_mm256_storeu_ps(aIm + j, _mm256_add_ps(ai, ti));
+	}
+	butterfliesScalar(aRe + j, aIm + j, bRe + j, bIm + j, wRe + j, wIm + j, h - j);
+}
+
+__attribute__((target("avx2")))
+inline void accumulateAvx2 (const float* re, const float* im, double* power, size_t n) {
+	size_t k = 0;
+	for (; k + 4 <= n; k += 4) {
+		__m128 r = _mm_loadu_ps(re + k), i = _mm_loadu_ps(im + k);
+		__m256d magnitude = _mm256_cvtps_pd(_mm_add_ps(_mm_mul_ps(r, r), _mm_mul_ps(i, i)));
+		_mm256_storeu_pd(power + k, _mm256_add_pd(_mm256_loadu_pd(power + k), magnitude));
+	}
+	accumulateScalar(re + k, im + k, power + k, n - k);
+}
+#endif
+
+#ifdef SAMPLE_CONVERT_NEON
+inline void butterfliesNeon (float* aRe, float* aIm, float* bRe, float* bIm, const float* wRe, const float* wIm, size_t h) {
+	size_t j = 0;
+	for (; j + 4 <= h; j += 4) {
+		float32x4_t br = vld1q_f32(bRe + j), bi = vld1q_f32(bIm + j);
+		float32x4_t wr = vld1q_f32(wRe + j), wi = vld1q_f32(wIm + j);
+		float32x4_t ar = vld1q_f32(aRe + j), ai = vld1q_f32(aIm + j);
+		float32x4_t tr = vmlsq_f32(vmulq_f32(br, wr), bi, wi);
+		float32x4_t ti = vmlaq_f32(vmulq_f32(br, wi), bi, wr);
+		vst1q_f32(bRe + j, vsubq_f32(ar, tr));
+		vst1q_f32(bIm + j, vsubq_f32(ai, ti));
+		vst1q_f32(aRe + j, vaddq_f32(ar, tr));
+		vst1q_f32(aIm + j, vaddq_f32(ai, ti));
+	}
+	butterfliesScalar(aRe + j, aIm + j, bRe + j, bIm + j, wRe + j, wIm + j, h - j);
+}
+#endif
+
+//==============================================================================
+// In-place radix-2 FFT on split real and imaginary arrays. The split layout
+// turns every pass into straight vector loads, so the wide passes run on AVX2
+// or NEON and only the first three, with fewer than eight butterflies per
+// group, stay scalar.
+class Fft {
+public:
+	explicit Fft (size_t size, bool vectorized = true) : n (size), reversed (size), twiddleRe (size), twiddleIm (size) {
+		if (n < 2 or (n & (n - 1)) != 0) {
+			throw std::runtime_error("FFT size must be a power of two, not " + std::to_string(n));
+		}
+		unsigned bits = __builtin_ctzl(n);
+		for (size_t k = 0; k < n; k++) {
+			size_t r = 0;
+			for (unsigned b = 0; b < bits; b++) {
+				r |= ((k >> b) & 1) << (bits - 1 - b);
+			}
+			reversed[k] = r;
+		}
+		// the twiddles of the pass with h butterflies per group start at index h
+		for (size_t h = 1; h < n; h <<= 1) {
+			for (size_t j = 0; j < h; j++) {
+				twiddleRe[h + j] = std::cos(-M_PI * j / h);
+				twiddleIm[h + j] = std::sin(-M_PI * j / h);
+			}
+		}
+		butterflies = butterfliesScalar;
+		name = "scalar";
+		if (vectorized) {
+#if defined(SAMPLE_CONVERT_X86)
+			if (convert::haveAvx2()) {
+				butterflies = butterfliesAvx2;
+				name = "avx2";
+			}
+#elif defined(SAMPLE_CONVERT_NEON)
+			butterflies = butterfliesNeon;
+			name = "neon";
+#endif
+		}
+	}
+
+	void transform (float* re, float* im) const {
+		for (size_t k = 0; k < n; k++) {
+			if (reversed[k] > k) {
+				std::swap(re[k], re[reversed[k]]);
+				std::swap(im[k], im[reversed[k]]);
+			}
+		}
+		for (size_t h = 1; h < n; h <<= 1) {
+			for (size_t first = 0; first < n; first += 2 * h) {
+				butterflies(re + first, im + first, re + first + h, im + first + h, twiddleRe.data() + h, twiddleIm.data() + h, h);
+			}
+		}
+	}
+
+	size_t size () const { return n; }
+	const char* kernel () const { return name; }
+
+private:
+	size_t n;
+	std::vector<size_t> reversed;
+	std::vector<float> twiddleRe, twiddleIm;
+	void (*butterflies) (float*, float*, float*, float*, const float*, const float*, size_t);
+	const char* name;
+};
+
+inline void accumulate (const float* re, const float* im, double* power, size_t n) {
+#if defined(SAMPLE_CONVERT_X86)
+	if (convert::haveAvx2()) {
+		return accumulateAvx2(re, im, power, n);
+	}
+#endif
+	accumulateScalar(re, im, power, n);
+}
+
+} // namespace spectrum
+
+//==============================================================================
+// Maps a published spectrum frame, for the monitor and the viewer alike
+class SpectrumFrame {
+public:
+	// writable creates (or replaces) the file for numChannels x numBins, otherwise an existing frame is opened read-only
+	SpectrumFrame (const std::string& path, bool writable, size_t numChannels = 0, size_t numBins = 0) {
+		fd = ::open(path.c_str(), writable ? O_RDWR | O_CREAT | O_TRUNC : O_RDONLY, 0644);
+		if (fd < 0) {
+			throw std::runtime_error("cannot open " + path + ": " + std::strerror(errno));
+		}
+		if (writable) {
+			length = sizeof(SpectrumFrameHeader) + numChannels * (sizeof(double) + numBins * sizeof(float));
+			if (ftruncate(fd, length) != 0) {
+				int err = errno;
+				::close(fd);
+				throw std::runtime_error("cannot size " + path + ": " + std::strerror(err));
+			}
+		} else {
+			off_t size = lseek(fd, 0, SEEK_END);
+			length = size < 0 ? 0 : size;
+			if (length < sizeof(SpectrumFrameHeader)) {
+				::close(fd);
+				throw std::runtime_error(path + " is not a spectrum frame");
+			}
+		}
+		void* ptr = mmap(nullptr, length, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+		if (ptr == MAP_FAILED) {
+			int err = errno;
+			::close(fd);
+			throw std::runtime_error("cannot map " + path + ": " + std::strerror(err));
+		}
+		base = static_cast<char*>(ptr);
+		if (writable) {
+			SpectrumFrameHeader& header = *reinterpret_cast<SpectrumFrameHeader*>(base);
+			memcpy(header.magic, "SPC1", 4);
+			header.numChannels = numChannels;
+			header.numBins = numBins;
+		} else if (memcmp(base, "SPC1", 4) != 0 or length < sizeof(SpectrumFrameHeader)
+				   + info().numChannels * (sizeof(double) + size_t(info().numBins) * sizeof(float))) {
+			munmap(base, length);
+			::close(fd);
+			throw std::runtime_error(path + " is not a spectrum frame");
+		}
+	}
+
+	~SpectrumFrame () {
+		munmap(base, length);
+		::close(fd);
+	}
+
+	SpectrumFrame (const SpectrumFrame&) = delete;
+	SpectrumFrame& operator= (const SpectrumFrame&) = delete;
+
+	const SpectrumFrameHeader& info () const { return *reinterpret_cast<const SpectrumFrameHeader*>(base); }
+
+	// writer side: replace the whole frame
+	void publish (const SpectrumFrameHeader& header, const std::vector<double>& frequencies, const std::vector<float>& power) {
+		SpectrumFrameHeader& shared = *reinterpret_cast<SpectrumFrameHeader*>(base);
+		uint64_t sequence = __atomic_load_n(&shared.sequence, __ATOMIC_RELAXED);
+		__atomic_store_n(&shared.sequence, sequence + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		shared.averages = header.averages;
+		shared.sampleRate = header.sampleRate;
+		shared.sampleOffset = header.sampleOffset;
+		shared.updated = header.updated;
+		memcpy(base + sizeof(SpectrumFrameHeader), frequencies.data(), frequencies.size() * sizeof(double));
+		memcpy(base + sizeof(SpectrumFrameHeader) + frequencies.size() * sizeof(double), power.data(), power.size() * sizeof(float));
+		__atomic_store_n(&shared.sequence, sequence + 2, __ATOMIC_RELEASE);
+	}
+
+	// reader side: copy a consistent frame, false if none has been published yet
+	bool read (SpectrumFrameHeader& header, std::vector<double>& frequencies, std::vector<float>& power) const {
+		const SpectrumFrameHeader& shared = info();
+		for (int attempt = 0; attempt < 1000; attempt++) {
+			uint64_t before = __atomic_load_n(&shared.sequence, __ATOMIC_ACQUIRE);
+			if (before == 0) {
+				return false;
+			}
+			if (before & 1) {
+				std::this_thread::sleep_for(std::chrono::microseconds(100));
+				continue;
+			}
+			memcpy(&header, &shared, sizeof(header));
+			frequencies.resize(header.numChannels);
+			power.resize(size_t(header.numChannels) * header.numBins);
+			memcpy(frequencies.data(), base + sizeof(SpectrumFrameHeader), frequencies.size() * sizeof(double));
+			memcpy(power.data(), base + sizeof(SpectrumFrameHeader) + frequencies.size() * sizeof(double), power.size() * sizeof(float));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&shared.sequence, __ATOMIC_RELAXED) == before) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+private:
+	int fd = -1;
+	char* base = nullptr;
+	size_t length = 0;
+};
+
+//==============================================================================
+// Taps the writer threads for captures and publishes averaged spectra
+class SpectrumMonitor {
+public:
+	// a frame of averages captures every interval seconds, frequencies are the channels' centre frequencies
+	SpectrumMonitor (const std::string& path, size_t numChannels, size_t fftSize, size_t averages, double interval, double rate,
+					 const std::vector<double>& frequencies)
+		: frame (path, true, numChannels, fftSize), fft (fftSize), averages (std::max<size_t>(averages, 1)),
+		  interval (interval), rate (rate), frequencies (frequencies), window (fftSize) {
+		double windowSum = 0.0;
+		for (size_t k = 0; k < fftSize; k++) {
+			// Hann, divided by the coherent gain so a full-scale tone reads 0 dBFS
+			window[k] = 0.5 - 0.5 * std::cos(2 * M_PI * k / fftSize);
+			windowSum += window[k];
+		}
+		for (size_t k = 0; k < fftSize; k++) {
+			window[k] /= windowSum * 32768.0;
+		}
+		for (size_t ch = 0; ch < numChannels; ch++) {
+			captures.emplace_back(new Capture (fftSize));
+		}
+		this->frequencies.resize(numChannels, 0.0);
+		thread = std::thread (&SpectrumMonitor::run, this);
+	}
+
+	~SpectrumMonitor () {
+		finish();
+	}
+
+	SpectrumMonitor (const SpectrumMonitor&) = delete;
+	SpectrumMonitor& operator= (const SpectrumMonitor&) = delete;
+
+	// called by the thread that owns the channel, copies only while a capture is armed and never waits
+	void offer (size_t channel, const std::complex<short>* samples, size_t numSamples, uint64_t sampleOffset) {
+		Capture& capture = *captures[channel];
+		if (capture.state.load(std::memory_order_acquire) != ARMED or numSamples == 0) {
+			return;
+		}
+		if (capture.filled == 0) {
+			capture.sampleOffset = sampleOffset;
+		}
+		size_t count = std::min(numSamples, capture.samples.size() - capture.filled);
+		memcpy(capture.samples.data() + capture.filled, samples, count * sizeof(std::complex<short>));
+		capture.filled += count;
+		if (capture.filled == capture.samples.size()) {
+			capture.state.store(FULL, std::memory_order_release);
+		}
+	}
+
+	// stop the monitor thread, the last frame stays in the file
+	void finish () {
+		stopping = true;
+		if (thread.joinable()) {
+			thread.join();
+		}
+	}
+
+	size_t frames () const { return numFrames; }
+	double cpuTime () const { return cpuSeconds; }
+	const char* kernel () const { return fft.kernel(); }
+
+private:
+	enum {IDLE, ARMED, FULL};
+
+	struct Capture {
+		explicit Capture (size_t fftSize) : samples (fftSize) {}
+		std::atomic<int> state {IDLE};
+		size_t filled = 0;
+		uint64_t sampleOffset = 0;
+		std::vector<std::complex<short>> samples;
+	};
+
+	void run () {
+		// the recording comes first, this thread only gets what is left
+		pthread_setname_np(pthread_self(), "spectrum");
+		setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+		const size_t numChannels = captures.size(), n = fft.size();
+		std::vector<double> power (numChannels * n);
+		std::vector<float> re (n), im (n), dbfs (numChannels * n);
+		auto due = std::chrono::steady_clock::now();
+		while (not stopping) {
+			std::this_thread::sleep_until(due);
+			due += std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(interval));
+			std::fill(power.begin(), power.end(), 0.0);
+			uint64_t sampleOffset = 0;
+			size_t captured = 0;
+			for (size_t a = 0; a < averages and not stopping; a++) {
+				for (auto& capture : captures) {
+					capture->filled = 0;
+					capture->state.store(ARMED, std::memory_order_release);
+				}
+				// the next block of every channel fills its capture
+				for (auto& capture : captures) {
+					while (capture->state.load(std::memory_order_acquire) != FULL and not stopping) {
+						std::this_thread::sleep_for(std::chrono::milliseconds(1));
+					}
+				}
+				if (stopping) {
+					break;
+				}
+				timespec start, end;
+				clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+				for (size_t ch = 0; ch < numChannels; ch++) {
+					Capture& capture = *captures[ch];
+					for (size_t k = 0; k < n; k++) {
+						re[k] = capture.samples[k].real() * window[k];
+						im[k] = capture.samples[k].imag() * window[k];
+					}
+					sampleOffset = capture.sampleOffset;
+					capture.state.store(IDLE, std::memory_order_release);
+					fft.transform(re.data(), im.data());
+					spectrum::accumulate(re.data(), im.data(), power.data() + ch * n, n);
+				}
+				clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+				cpuSeconds = cpuSeconds + (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+				captured++;
+			}
+			if (captured == 0) {
+				break;
+			}
+			// DC in the middle, lowest frequency first
+			for (size_t ch = 0; ch < numChannels; ch++) {
+				for (size_t k = 0; k < n; k++) {
+					double mean = power[ch * n + k] / captured;
+					dbfs[ch * n + (k + n / 2) % n] = 10.0 * std::log10(std::max(mean, 1e-20));
+				}
+			}
+			SpectrumFrameHeader header;
+			header.averages = captured;
+			header.sampleRate = rate;
+			header.sampleOffset = sampleOffset;
+			header.updated = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+			frame.publish(header, frequencies, dbfs);
+			numFrames++;
+		}
+		for (auto& capture : captures) {
+			capture->state.store(IDLE, std::memory_order_release);
+		}
+	}
+
+	SpectrumFrame frame;
+	spectrum::Fft fft;
+	size_t averages;
+	double interval;
+	double rate;
+	std::vector<double> frequencies;
+	std::vector<float> window;
+	std::vector<std::unique_ptr<Capture>> captures;
+	std::atomic<bool> stopping {false};
+	std::atomic<size_t> numFrames {0};
+	std::atomic<double> cpuSeconds {0.0};
+	std::thread thread;
+};
@@ -0,0 +1,258 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+
+#include <poll.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <boost/format.hpp>
+
+//==============================================================================
+// Run-time metrics of the recorder. Every counter and histogram has exactly
+// one thread that records into it, so recording is a relaxed load and store
+// with no lock and no read-modify-write; the server thread only reads. The
+// metrics are served as Prometheus-style text on a Unix socket or on a
+// localhost TCP port, to curl, a scraper or a plain `socat - UNIX:<path>`.
+namespace telemetry {
+
+// a count only its owner thread adds to
+class Counter {
+public:
+	void add (uint64_t n = 1) {
+		count.store(count.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+	uint64_t value () const { return count.load(std::memory_order_relaxed); }
+
+private:
+	std::atomic<uint64_t> count {0};
+};
+
+// power-of-two buckets, bucket k holds the values below 2^k that did not fit in bucket k-1
+class Histogram {
+public:
+	static const size_t BUCKETS = 32;
+
+	void record (uint64_t value) {
+		size_t bucket = value == 0 ? 0 : std::min<size_t>(64 - __builtin_clzll(value), BUCKETS - 1);
+		counts[bucket].store(counts[bucket].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		sum.store(sum.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+	}
+
+	// of every value recorded
+	uint64_t total () const { return sum.load(std::memory_order_relaxed); }
+
+	// cumulative buckets up to the highest one in use, then +Inf, _sum and _count
+	void write (std::ostream& out, const std::string& name, const std::string& labels) const {
+		uint64_t snapshot[BUCKETS];
+		size_t last = 0;
+		for (size_t k = 0; k < BUCKETS; k++) {
+			snapshot[k] = counts[k].load(std::memory_order_relaxed);
+			if (snapshot[k] > 0) {
+				last = k;
+			}
+		}
+		const std::string separator = labels.empty() ? "" : ",";
+		uint64_t cumulative = 0;
+		for (size_t k = 0; k <= last; k++) {
+			cumulative += snapshot[k];
+			// the top bucket also takes everything larger, it only shows up as +Inf
+			if (k + 1 < BUCKETS) {
+				out << boost::format("%s_bucket{%s%sle=\"%i\"} %i\n") % name % labels % separator % ((uint64_t(1) << k) - 1) % cumulative;
+			}
+		}
+		out << boost::format("%s_bucket{%s%sle=\"+Inf\"} %i\n") % name % labels % separator % cumulative;
+		out << boost::format("%s_sum{%s} %i\n") % name % labels % sum.load(std::memory_order_relaxed);
+		out << boost::format("%s_count{%s} %i\n") % name % labels % cumulative;
+	}
+
+private:
+	std::atomic<uint64_t> counts[BUCKETS] = {};
+	std::atomic<uint64_t> sum {0};
+};
+
+// microseconds between two steady clock points
+inline uint64_t micros (std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to) {
+	return std::chrono::duration_cast<std::chrono::microseconds>(to - from).count();
+}
+
+// name the calling thread for ps, top and the per-thread CPU metrics, at most 15 characters
+inline void nameThread (const std::string& name) {
+	pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+}
+
+// CPU seconds of every thread of this process by name, from /proc/self/task
+inline void writeThreadCpu (std::ostream& out, const std::string& metric) {
+	const double ticks = sysconf(_SC_CLK_TCK);
+	DIR* tasks = opendir("/proc/self/task");
+	if (not tasks) {
+		return;
+	}
+	while (dirent* entry = readdir(tasks)) {
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+		std::ifstream in (std::string("/proc/self/task/") + entry->d_name + "/stat");
+		std::string stat;
+		std::getline(in, stat);
+		// the name is in parentheses and may contain spaces, the fields after it are fixed
+		size_t nameStart = stat.find('('), nameEnd = stat.rfind(')');
+		if (nameStart == std::string::npos or nameEnd == std::string::npos) {
+			continue;
+		}
+		std::istringstream fields (stat.substr(nameEnd + 2));
+		std::string field;
+		unsigned long long utime = 0, stime = 0;
+		// state is field 3, utime and stime are fields 14 and 15
+		for (int k = 3; k <= 15 and fields >> field; k++) {
+			if (k == 14) {
+				utime = std::stoull(field);
+			} else if (k == 15) {
+				stime = std::stoull(field);
+			}
+		}
+		out << boost::format("%s{thread=\"%s\",tid=\"%s\"} %.2f\n") % metric % stat.substr(nameStart + 1, nameEnd - nameStart - 1) % entry->d_name % ((utime + stime) / ticks);
+	}
+	closedir(tasks);
+}
+
+//==============================================================================
+// Serves render() to every connection. The endpoint is a Unix socket path or
+// a TCP port that is only bound on 127.0.0.1. An HTTP request gets an HTTP
+// answer, a client that sends nothing gets the bare text after 100 ms.
+class Server {
+public:
+	Server (const std::string& endpoint, std::function<std::string ()> render)
+		: render (render) {
+		bool isPort = not endpoint.empty() and endpoint.find_first_not_of("0123456789") == std::string::npos;
+		if (isPort) {
+			listenFd = socket(AF_INET, SOCK_STREAM, 0);
+			int reuse = 1;
+			setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+			sockaddr_in address = {};
+			address.sin_family = AF_INET;
+			address.sin_port = htons(std::stoi(endpoint));
+			address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			if (listenFd < 0 or bind(listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+				fail("cannot listen on 127.0.0.1:" + endpoint);
+			}
+			description = "http://127.0.0.1:" + endpoint + "/metrics";
+		} else {
+			listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+			sockaddr_un address = {};
+			address.sun_family = AF_UNIX;
+			if (endpoint.size() >= sizeof(address.sun_path)) {
+				errno = ENAMETOOLONG;
+				fail("socket path too long: " + endpoint);
+			}
+			strncpy(address.sun_path, endpoint.c_str(), sizeof(address.sun_path) - 1);
+			// a socket left behind by an earlier run would make bind fail
+			unlink(endpoint.c_str());
+			if (listenFd < 0 or bind(listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+				fail("cannot listen on " + endpoint);
+			}
+			socketPath = endpoint;
+			description = endpoint;
+		}
+		if (listen(listenFd, 8) != 0) {
+			fail("cannot listen on " + description);
+		}
+		thread = std::thread (&Server::run, this);
+	}
+
+	~Server () {
+		stopping = true;
+		if (thread.joinable()) {
+			thread.join();
+		}
+		close(listenFd);
+		if (not socketPath.empty()) {
+			unlink(socketPath.c_str());
+		}
+	}
+
+	Server (const Server&) = delete;
+	Server& operator= (const Server&) = delete;
+
+	const std::string& address () const { return description; }
+	size_t requests () const { return numRequests; }
+
+private:
+	void fail (const std::string& message) {
+		int err = errno;
+		if (listenFd >= 0) {
+			close(listenFd);
+		}
+		throw std::runtime_error(message + ": " + std::strerror(err));
+	}
+
+	void run () {
+		nameThread("telemetry");
+		// a scrape must never take a core from the recv or writer threads
+		setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+		while (not stopping) {
+			pollfd waiting = {listenFd, POLLIN, 0};
+			if (poll(&waiting, 1, 200) <= 0) {
+				continue;
+			}
+			int client = accept(listenFd, nullptr, nullptr);
+			if (client < 0) {
+				continue;
+			}
+			answer(client);
+			close(client);
+			numRequests++;
+		}
+	}
+
+	void answer (int client) {
+		char request[1024];
+		ssize_t length = 0;
+		pollfd readable = {client, POLLIN, 0};
+		if (poll(&readable, 1, 100) > 0) {
+			length = ::recv(client, request, sizeof(request), 0);
+		}
+		std::string body = render();
+		std::string response;
+		if (length >= 4 and std::strncmp(request, "GET ", 4) == 0) {
+			response = (boost::format("HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %i\r\nConnection: close\r\n\r\n") % body.size()).str();
+		}
+		response += body;
+		for (size_t done = 0; done < response.size(); ) {
+			ssize_t ret = ::send(client, response.data() + done, response.size() - done, MSG_NOSIGNAL);
+			if (ret <= 0) {
+				break;
+			}
+			done += ret;
+		}
+	}
+
+	std::function<std::string ()> render;
+	int listenFd = -1;
+	std::string socketPath;
+	std::string description;
+	std::atomic<bool> stopping {false};
+	std::atomic<size_t> numRequests {0};
+	std::thread thread;
+};
+
+}
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <boost/format.hpp>
+
+//==============================================================================
+// Which motherboard, daughterboard frontend and antenna port each logical
+// channel uses, with its own frequency and gain. Channels are numbered the way
+// UHD numbers them, motherboard by motherboard in subdev spec order, so channel
+// i here is channel i of multi_usrp and of the rx streams.
+//
+// The standard layout is the TwinRX one the recorder always used: four
+// channels per X300 on A:0 A:1 B:0 B:1 with RX1 and RX2 alternating, filling
+// motherboard 0 first. Anything else comes from a file with one channel per
+// line:
+//   # mboard  frontend  antenna  [freq=<Hz>]  [gain=<dB>]
+//   0 A:0 RX1 freq=223.936e6 gain=62
+//   0 A:1 RX2
+//   1 A:0 RX1 gain=58
+struct ChannelPort {
+	size_t mboard = 0;
+	std::string frontend;	// daughterboard slot and frontend, e.g. "A:0"
+	std::string antenna;	// e.g. "RX1"
+	double freq = 0.0;		// centre frequency in Hz
+	double gain = 0.0;		// dB
+};
+
+struct Topology {
+	static const size_t CHANNELS_PER_MBOARD = 4;
+
+	std::vector<ChannelPort> channels;
+
+	static Topology standard (size_t numChannels, double freq, double gain) {
+		static const char* frontends[CHANNELS_PER_MBOARD] = {"A:0", "A:1", "B:0", "B:1"};
+		Topology topology;
+		for (size_t i = 0; i < numChannels; i++) {
+			ChannelPort port;
+			port.mboard = i / CHANNELS_PER_MBOARD;
+			port.frontend = frontends[i % CHANNELS_PER_MBOARD];
+			port.antenna = i % 2 ? "RX2" : "RX1";
+			port.freq = freq;
+			port.gain = gain;
+			topology.channels.push_back(port);
+		}
+		return topology;
+	}
+
+	// freq and gain are used for the channels that do not set their own
+	static Topology load (const std::string& fileName, double freq, double gain) {
+		std::ifstream in (fileName);
+		if (not in) {
+			throw std::runtime_error("cannot open topology " + fileName);
+		}
+		Topology topology;
+		std::string line;
+		for (size_t lineNumber = 1; std::getline(in, line); lineNumber++) {
+			line = line.substr(0, line.find('#'));
+			std::istringstream fields (line);
+			ChannelPort port;
+			if (not (fields >> port.mboard)) {
+				continue;
+			}
+			const std::string where = fileName + ":" + std::to_string(lineNumber) + ": ";
+			if (not (fields >> port.frontend >> port.antenna)) {
+				throw std::runtime_error(where + "expected a motherboard, a frontend and an antenna");
+			}
+			port.freq = freq;
+			port.gain = gain;
+			std::string option;
+			while (fields >> option) {
+				size_t equals = option.find('=');
+				std::string key = option.substr(0, equals);
+				try {
+					if (equals != std::string::npos and key == "freq") {
+						port.freq = std::stod(option.substr(equals + 1));
+					} else if (equals != std::string::npos and key == "gain") {
+						port.gain = std::stod(option.substr(equals + 1));
+					} else {
+						throw std::invalid_argument(option);
+					}
+				} catch (const std::logic_error&) {
+					throw std::runtime_error(where + "cannot use " + option + " (freq=<Hz> or gain=<dB>)");
+				}
+			}
+			topology.channels.push_back(port);
+		}
+		topology.check();
+		return topology;
+	}
+
+	size_t size () const { return channels.size(); }
+	ChannelPort& operator[] (size_t channel) { return channels[channel]; }
+	const ChannelPort& operator[] (size_t channel) const { return channels[channel]; }
+
+	size_t numMboards () const {
+		return channels.empty() ? 0 : channels.back().mboard + 1;
+	}
+
+	size_t firstChannelOn (size_t mboard) const {
+		size_t first = 0;
+		while (first < channels.size() and channels[first].mboard < mboard) {
+			first++;
+		}
+		return first;
+	}
+
+	size_t channelsOn (size_t mboard) const {
+		size_t count = 0;
+		for (const ChannelPort& port : channels) {
+			count += port.mboard == mboard;
+		}
+		return count;
+	}
+
+	// the subdev spec of a motherboard, e.g. "A:0 A:1 B:0"
+	std::string subdevSpec (size_t mboard) const {
+		std::string spec;
+		for (const ChannelPort& port : channels) {
+			if (port.mboard == mboard) {
+				spec += (spec.empty() ? "" : " ") + port.frontend;
+			}
+		}
+		return spec;
+	}
+
+	// comma separated values per channel, an empty entry keeps the channel's value
+	void setGains (const std::string& list) {
+		apply(list, "--gains", &ChannelPort::gain);
+	}
+	void setFreqs (const std::string& list) {
+		apply(list, "--freqs", &ChannelPort::freq);
+	}
+
+	// channels have to come motherboard by motherboard, every motherboard needs one and a frontend is used once
+	void check () const {
+		if (channels.empty()) {
+			throw std::runtime_error("the topology has no channels");
+		}
+		for (size_t i = 0; i < channels.size(); i++) {
+			if (i > 0 and channels[i].mboard < channels[i - 1].mboard) {
+				throw std::runtime_error((boost::format("channel %i is on motherboard %i after a channel on motherboard %i, list the channels motherboard by motherboard")
+										  % i % channels[i].mboard % channels[i - 1].mboard).str());
+			}
+			for (size_t j = 0; j < i; j++) {
+				if (channels[j].mboard == channels[i].mboard and channels[j].frontend == channels[i].frontend) {
+					throw std::runtime_error((boost::format("channels %i and %i both use %s on motherboard %i") % j % i % channels[i].frontend % channels[i].mboard).str());
+				}
+			}
+		}
+		for (size_t mboard = 0; mboard < numMboards(); mboard++) {
+			if (channelsOn(mboard) == 0) {
+				throw std::runtime_error((boost::format("motherboard %i has no channels") % mboard).str());
+			}
+		}
+	}
+
+private:
+	void apply (const std::string& list, const std::string& option, double ChannelPort::* field) {
+		std::stringstream in (list);
+		std::string item;
+		for (size_t i = 0; std::getline(in, item, ','); i++) {
+			if (i >= channels.size()) {
+				throw std::runtime_error((boost::format("%s has more values than the %i channels") % option % channels.size()).str());
+			}
+			if (not item.empty()) {
+				try {
+					channels[i].*field = std::stod(item);
+				} catch (const std::logic_error&) {
+					throw std::runtime_error(option + ": cannot read " + item);
+				}
+			}
+		}
+	}
+};
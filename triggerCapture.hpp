@@ -0,0 +1,433 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <complex>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+
+#include <time.h>
+
+#include <boost/format.hpp>
+
+#include <uhd/types/time_spec.hpp>
+
+#include "sampleQueue.hpp"
+#include "bufferPool.hpp"
+#include "fileWriter.hpp"
+#include "sampleConvert.hpp"
+
+//==============================================================================
+// Triggered capture: every channel streams into a fixed-size RAM ring and a
+// power detector watches the stream. When the power of a detection window
+// rises a threshold above the noise floor, the pre-trigger seconds still in
+// the ring and the post-trigger seconds that follow are written out as one
+// event:
+//   <file>_event<k>_chan<N>.bin   interleaved IQ shorts like a normal recording
+//   <file>_event<k>.txt           trigger time, first sample time, power, floor
+//
+// The detector and the ring copy run on the pipeline's writer thread. The
+// event files are written by a separate dump thread that reads from the ring,
+// so a burst of disk writes never holds up the blocks behind it.
+
+namespace detect {
+
+// sum of I*I + Q*Q over numValues shorts
+inline uint64_t powerScalar (const int16_t* in, size_t numValues) {
+	uint64_t sum = 0;
+	for (size_t k = 0; k < numValues; k++) {
+		sum += int32_t(in[k]) * in[k];
+	}
+	return sum;
+}
+
+#ifdef SAMPLE_CONVERT_X86
+__attribute__((target("avx2")))
+inline uint64_t powerAvx2 (const int16_t* in, size_t numValues) {
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc = zero;
+	size_t k = 0;
+	for (; k + 16 <= numValues; k += 16) {
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + k));
+		// I*I + Q*Q per sample fits in 32 bits unsigned, widen before adding up
+		__m256i squares = _mm256_madd_epi16(v, v);
+		acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(squares, zero));
+		acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(squares, zero));
+	}
+	uint64_t lanes[4];
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), acc);
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] + powerScalar(in + k, numValues - k);
+}
+#endif
+
+#ifdef SAMPLE_CONVERT_NEON
+inline uint64_t powerNeon (const int16_t* in, size_t numValues) {
+	uint64x2_t acc = vdupq_n_u64(0);
+	size_t k = 0;
+	for (; k + 8 <= numValues; k += 8) {
+		int16x8_t v = vld1q_s16(in + k);
+		int32x4_t low = vmull_s16(vget_low_s16(v), vget_low_s16(v));
+		int32x4_t high = vmull_s16(vget_high_s16(v), vget_high_s16(v));
+		acc = vpadalq_u32(acc, vreinterpretq_u32_s32(low));
+		acc = vpadalq_u32(acc, vreinterpretq_u32_s32(high));
+	}
+	return vgetq_lane_u64(acc, 0) + vgetq_lane_u64(acc, 1) + powerScalar(in + k, numValues - k);
+}
+#endif
+
+inline uint64_t power (const std::complex<short>* samples, size_t numSamples) {
+	const int16_t* in = reinterpret_cast<const int16_t*>(samples);
+#if defined(SAMPLE_CONVERT_X86)
+	if (convert::haveAvx2()) {
+		return powerAvx2(in, 2 * numSamples);
+	}
+#elif defined(SAMPLE_CONVERT_NEON)
+	return powerNeon(in, 2 * numSamples);
+#endif
+	return powerScalar(in, 2 * numSamples);
+}
+
+} // namespace detect
+
+//==============================================================================
+// Mean power per window, compared against a running noise floor. Watches one
+// channel, the sum of all channels, or every channel on its own (any).
+class PowerDetector {
+public:
+	static const int ANY = -2;
+	static const int SUM = -1;
+
+	// channel is ANY, SUM or a channel number; the floor tracks the quietest windows and rises over floorSeconds
+	PowerDetector (size_t numChannels, int channel, size_t windowSamples, double thresholdDb, double rate, double floorSeconds)
+		: numChannels (numChannels), channel (channel), windowSamples (std::max<size_t>(windowSamples, 1)),
+		  threshold (std::pow(10.0, thresholdDb / 10.0)),
+		  floorWindows (std::max(1.0, floorSeconds * rate / this->windowSamples)),
+		  noiseFloor (channel == ANY ? numChannels : 1, 0.0) {
+		if (channel >= int(numChannels)) {
+			throw std::runtime_error("trigger channel " + std::to_string(channel) + " is not recorded");
+		}
+	}
+
+	// parse "any", "sum" or a channel number
+	static int parseChannel (const std::string& name) {
+		if (name == "any") {
+			return ANY;
+		} else if (name == "sum") {
+			return SUM;
+		}
+		return std::stoi(name);
+	}
+
+	// offset in the block of the first window above the threshold, -1 if there is none
+	// or armed is false. The noise floor keeps learning from quiet windows either way.
+	long scan (const SampleBlock& block, bool armed) {
+		long hit = -1;
+		for (size_t start = 0; start < block.numSamples; start += windowSamples) {
+			size_t count = std::min(windowSamples, block.numSamples - start);
+			for (size_t s = 0; s < noiseFloor.size(); s++) {
+				double p;
+				if (channel == SUM) {
+					p = 0.0;
+					for (size_t ch = 0; ch < numChannels; ch++) {
+						p += detect::power(block.buffPtrs[ch] + start, count);
+					}
+				} else {
+					size_t ch = channel == ANY ? s : channel;
+					p = detect::power(block.buffPtrs[ch] + start, count);
+				}
+				p /= count;
+				bool warm = windows >= floorWindows;
+				if (warm and p > noiseFloor[s] * threshold) {
+					if (armed and hit < 0) {
+						hit = start;
+						lastPower = p;
+						lastFloor = noiseFloor[s];
+						lastSignal = channel == ANY ? int(s) : channel;
+					}
+				} else if (windows == 0 or p < noiseFloor[s]) {
+					// follow quiet windows down at once so a burst during warm up does not raise the floor
+					noiseFloor[s] = p;
+				} else {
+					// and up slowly, over floorSeconds
+					noiseFloor[s] += (p - noiseFloor[s]) / floorWindows;
+				}
+			}
+			windows++;
+			if (hit >= 0) {
+				break;
+			}
+		}
+		return hit;
+	}
+
+	// power and floor of the last trigger in dB relative to a full scale complex sample
+	double triggerPowerDbfs () const { return dbfs(lastPower); }
+	double triggerFloorDbfs () const { return dbfs(lastFloor); }
+	// channel that fired for ANY, otherwise the configured channel or SUM
+	int triggerChannel () const { return lastSignal; }
+	bool warmedUp () const { return windows >= floorWindows; }
+
+private:
+	static double dbfs (double p) {
+		return 10.0 * std::log10(std::max(p, 1e-3) / (2.0 * 32768.0 * 32768.0));
+	}
+
+	size_t numChannels;
+	int channel;
+	size_t windowSamples;
+	double threshold;
+	double floorWindows;
+	std::vector<double> noiseFloor;
+	double windows = 0;
+	double lastPower = 0.0;
+	double lastFloor = 0.0;
+	int lastSignal = 0;
+};
+
+//==============================================================================
+// The RAM ring and the event writer. process() is called for every block by
+// a single thread, finish() once after the last block.
+class TriggeredRecorder {
+public:
+	TriggeredRecorder (const std::string& prefix, size_t numChannels, double rate, double preSeconds, double postSeconds,
+					   const PowerDetector& detector, ChannelWriter::Mode writeMode, size_t ioSize)
+		: prefix (prefix), numChannels (numChannels), rate (rate),
+		  preSamples (std::llround(preSeconds * rate)), postSamples (std::llround(postSeconds * rate)),
+		  // a second of slack for the dump thread to get going before the oldest pre-trigger samples are overwritten
+		  ringSamples ((preSamples + postSamples + uint64_t(rate) + PAGE_SAMPLES - 1) / PAGE_SAMPLES * PAGE_SAMPLES),
+		  ring (numChannels * ringSamples * sizeof(std::complex<short>)),
+		  detector (detector), writeMode (writeMode), ioSize (ioSize) {
+		dumper = std::thread (&TriggeredRecorder::dumpLoop, this);
+	}
+
+	~TriggeredRecorder () {
+		finish();
+	}
+
+	TriggeredRecorder (const TriggeredRecorder&) = delete;
+	TriggeredRecorder& operator= (const TriggeredRecorder&) = delete;
+
+	void process (const SampleBlock& block) {
+		if (block.numSamples == 0) {
+			return;
+		}
+		const uint64_t first = block.sampleOffset;
+		if (block.metadata.has_time_spec) {
+			blockTimes.push_back(std::make_pair(first, block.metadata.time_spec));
+			while (blockTimes.size() > 1 and blockTimes[1].first + ringSamples < first) {
+				blockTimes.pop_front();
+			}
+		}
+
+		timespec start, end;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+		long hit = detector.scan(block, first >= eventEnd);
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+		detectorSeconds += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+
+		// copy into the ring, wrapping at the end; the end of what is being overwritten goes out first,
+		// so a dump reading the old samples there sees that they were torn
+		writing.store(first + block.numSamples, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		size_t position = first % ringSamples;
+		size_t head = std::min<uint64_t>(block.numSamples, ringSamples - position);
+		for (size_t ch = 0; ch < numChannels; ch++) {
+			memcpy(ringChannel(ch) + position, block.buffPtrs[ch], head * sizeof(std::complex<short>));
+			memcpy(ringChannel(ch), block.buffPtrs[ch] + head, (block.numSamples - head) * sizeof(std::complex<short>));
+		}
+		written.store(first + block.numSamples, std::memory_order_release);
+
+		if (hit >= 0) {
+			Event event;
+			event.id = numEvents++;
+			event.trigger = first + hit;
+			uint64_t oldest = first + block.numSamples > ringSamples ? first + block.numSamples - ringSamples : 0;
+			event.first = std::max(event.trigger > preSamples ? event.trigger - preSamples : 0, oldest);
+			event.end = event.trigger + postSamples;
+			event.hasTime = timeOf(event.trigger, event.triggerTime) and timeOf(event.first, event.firstTime);
+			event.powerDbfs = detector.triggerPowerDbfs();
+			event.floorDbfs = detector.triggerFloorDbfs();
+			event.channel = detector.triggerChannel();
+			eventEnd = event.end;
+			std::cout << boost::format("\nEvent %i: %.1f dBFS over a %.1f dBFS floor at device time %.6f s")
+						 % event.id % event.powerDbfs % event.floorDbfs % (event.hasTime ? event.triggerTime.get_real_secs() : 0.0) << std::endl;
+			std::lock_guard<std::mutex> guard (lock);
+			events.push_back(event);
+			wake.notify_one();
+		}
+	}
+
+	// write what is left of the queued events and stop the dump thread
+	void finish () {
+		if (not dumper.joinable()) {
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> guard (lock);
+			stopping = true;
+			wake.notify_one();
+		}
+		dumper.join();
+	}
+
+	size_t triggered () const { return numEvents; }
+	size_t incomplete () const { return numIncomplete; }
+	double detectorCpuTime () const { return detectorSeconds; }
+	size_t ringBytes () const { return ring.size(); }
+	double ringSeconds () const { return ringSamples / rate; }
+	bool warmedUp () const { return detector.warmedUp(); }
+
+private:
+	static const size_t PAGE_SAMPLES = ChannelWriter::ALIGNMENT / sizeof(std::complex<short>);
+	static const size_t DUMP_SAMPLES = 1 << 18;
+
+	struct Event {
+		size_t id;
+		uint64_t first, trigger, end;
+		bool hasTime;
+		uhd::time_spec_t firstTime, triggerTime;
+		double powerDbfs, floorDbfs;
+		int channel;
+	};
+
+	std::complex<short>* ringChannel (size_t ch) const {
+		return reinterpret_cast<std::complex<short>*>(ring.data()) + ch * ringSamples;
+	}
+
+	// device time of a stream sample from the block it was received in
+	bool timeOf (uint64_t sample, uhd::time_spec_t& time) const {
+		for (auto it = blockTimes.rbegin(); it != blockTimes.rend(); ++it) {
+			if (it->first <= sample) {
+				time = it->second + uhd::time_spec_t::from_ticks(sample - it->first, rate);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void dumpLoop () {
+		pthread_setname_np(pthread_self(), "trigger-dump");
+		while (true) {
+			Event event;
+			{
+				std::unique_lock<std::mutex> guard (lock);
+				wake.wait(guard, [this] { return stopping or not events.empty(); });
+				if (events.empty()) {
+					return;
+				}
+				event = events.front();
+				events.pop_front();
+			}
+			try {
+				dump(event);
+			} catch (const std::exception& e) {
+				std::cerr << "\nEvent " << event.id << ": " << e.what() << std::endl;
+				numIncomplete++;
+			}
+		}
+	}
+
+	void dump (const Event& event) {
+		std::string name = prefix + "_event" + std::to_string(event.id);
+		std::vector<std::unique_ptr<ChannelWriter>> files;
+		for (size_t ch = 0; ch < numChannels; ch++) {
+			files.emplace_back(new ChannelWriter (name + "_chan" + std::to_string(ch) + ".bin", writeMode, ioSize, 8,
+												  (event.end - event.first) * sizeof(std::complex<short>)));
+		}
+		uint64_t position = event.first;
+		bool overrun = false;
+		while (position < event.end) {
+			uint64_t available = written.load(std::memory_order_acquire);
+			if (available <= position) {
+				std::unique_lock<std::mutex> guard (lock);
+				if (stopping) {
+					break;
+				}
+				// samples arrive a block at a time, no need to be woken for each one
+				wake.wait_for(guard, std::chrono::milliseconds(5));
+				continue;
+			}
+			if (writing.load(std::memory_order_acquire) > position + ringSamples) {
+				overrun = true;
+				break;
+			}
+			size_t count = std::min<uint64_t>(std::min(available, event.end) - position, uint64_t(DUMP_SAMPLES));
+			size_t offset = position % ringSamples;
+			size_t head = std::min<uint64_t>(count, ringSamples - offset);
+			for (size_t ch = 0; ch < numChannels; ch++) {
+				files[ch]->write(ringChannel(ch) + offset, head * sizeof(std::complex<short>));
+				if (count > head) {
+					files[ch]->write(ringChannel(ch), (count - head) * sizeof(std::complex<short>));
+				}
+				files[ch]->sync();
+			}
+			// the capture thread may have started overwriting these samples while they were being written
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (writing.load(std::memory_order_relaxed) > position + ringSamples) {
+				overrun = true;
+				break;
+			}
+			position += count;
+		}
+		for (size_t ch = 0; ch < numChannels; ch++) {
+			files[ch]->close();
+		}
+		if (position < event.end) {
+			numIncomplete++;
+		}
+
+		std::ofstream info (name + ".txt");
+		info << boost::format("Event: %i") % event.id << std::endl;
+		info << boost::format("Trigger: %s") % (event.channel == PowerDetector::SUM ? std::string("sum of all channels") : "channel " + std::to_string(event.channel)) << std::endl;
+		info << boost::format("Power: %.2f [dBFS], noise floor: %.2f [dBFS]") % event.powerDbfs % event.floorDbfs << std::endl;
+		if (event.hasTime) {
+			info << boost::format("Trigger device time: %i + %.9f [s]") % event.triggerTime.get_full_secs() % event.triggerTime.get_frac_secs() << std::endl;
+			info << boost::format("First sample device time: %i + %.9f [s]") % event.firstTime.get_full_secs() % event.firstTime.get_frac_secs() << std::endl;
+		}
+		info << boost::format("Trigger sample: %i (%i in the event files)") % event.trigger % (event.trigger - event.first) << std::endl;
+		info << boost::format("First stream sample: %i") % event.first << std::endl;
+		info << boost::format("Samples: %i") % (position - event.first) << std::endl;
+		info << boost::format("Fs: %f [Msps]") % (rate / 1e6) << std::endl;
+		info << boost::format("Channels: %i") % numChannels << std::endl;
+		if (overrun) {
+			info << "Incomplete: the ring was overwritten before the event was written, the disk is too slow" << std::endl;
+		} else if (position < event.end) {
+			info << "Incomplete: the recording ended during the event" << std::endl;
+		}
+	}
+
+	std::string prefix;
+	size_t numChannels;
+	double rate;
+	uint64_t preSamples;
+	uint64_t postSamples;
+	uint64_t ringSamples;
+	HugePageBuffer ring;
+	PowerDetector detector;
+	ChannelWriter::Mode writeMode;
+	size_t ioSize;
+
+	// capture thread only
+	std::deque<std::pair<uint64_t, uhd::time_spec_t>> blockTimes;
+	uint64_t eventEnd = 0;
+	size_t numEvents = 0;
+	double detectorSeconds = 0.0;
+
+	// shared with the dump thread
+	std::atomic<uint64_t> written {0};		// samples in the ring
+	std::atomic<uint64_t> writing {0};		// end of the block being copied in, ahead of written during the copy
+	std::mutex lock;
+	std::condition_variable wake;
+	std::deque<Event> events;
+	bool stopping = false;
+	std::atomic<size_t> numIncomplete {0};
+	std::thread dumper;
+};
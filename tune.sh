@@ -1,3 +1,4 @@
 #!/bin/bash
 
-./gainTuner --file="/mnt/fatty/DABtune" --tuneMin="50" --tuneMax="90" --freq="223.936e6" --rate="2.5e6" --wait="0" --ref="internal" --pps="internal" --nsamps="100000" --step="1"
+# Calibrate all six channels at once, writes /mnt/fatty/DABtune_gains.txt for usrpMultiRecord --gainprofile
+./gainTuner --dev="addr0=192.168.40.2, addr1=192.168.50.2" --chan="6" --file="/mnt/fatty/DABtune" --tuneMin="50" --tuneMax="90" --coarse="6" --freq="223.936e6" --rate="2.5e6" --wait="0" --ref="internal" --pps="internal" --nsamps="100000" --step="1"
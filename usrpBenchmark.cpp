@@ -0,0 +1,237 @@
+#include <iostream>
+#include <vector>
+#include <complex>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+#include <boost/program_options.hpp>
+#include <boost/format.hpp>
+
+#include <uhd/stream.hpp>
+#include <uhd/types/metadata.hpp>
+
+#include "sampleQueue.hpp"
+#include "fileWriter.hpp"
+#include "simStreamer.hpp"
+#include "sampleCodec.hpp"
+#include "sampleConvert.hpp"
+#include "chunkChecksum.hpp"
+
+namespace po = boost::program_options;
+//==============================================================================
+// Runs the usrpMultiRecord receive/write pipeline against a simulated source
+// so it can be measured on any Linux box without an X300 attached.
+
+static double percentile (std::vector<double>& values, double p) {
+	if (values.empty()) {
+		return 0.0;
+	}
+	size_t index = std::min(values.size() - 1, size_t(p / 100.0 * values.size()));
+	std::nth_element(values.begin(), values.begin() + index, values.end());
+	return values[index];
+}
+
+// time every storage conversion and the checksum, scalar and vectorized, on one block of synthetic samples
+static void benchmarkKernels (size_t samplesPerBlock, double seconds) {
+	uhd::rx_streamer::sptr source = makeSimStreamer("mode=synth,realtime=0,noise=300", 1, 12.5e6);
+	std::vector<std::complex<short>> samples (samplesPerBlock);
+	std::vector<char> out (samplesPerBlock * storeBytesPerSample(STORE_FC32) + CONVERT_SLACK);
+	uhd::rx_metadata_t md;
+	source->issue_stream_cmd(uhd::stream_cmd_t::STREAM_MODE_START_CONTINUOUS);
+	source->recv(std::vector<void*> {samples.data()}, samplesPerBlock, md);
+
+	for (StoreFormat format : {STORE_SC16, STORE_SC12, STORE_SC8, STORE_FC32}) {
+		for (bool vectorized : {false, true}) {
+			SampleConverter converter (format, 2, vectorized);
+			if (format == STORE_SC16 and vectorized) {
+				continue;
+			}
+			size_t blocks = 0;
+			auto start = std::chrono::steady_clock::now();
+			double elapsed = 0.0;
+			while (elapsed < seconds) {
+				for (int k = 0; k < 16; k++) {
+					converter.convert(samples.data(), samplesPerBlock, out.data());
+				}
+				blocks += 16;
+				elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			}
+			std::cout << boost::format("%-5s %-6s %8.1f MS/s, %6.1f MB/s in, %6.1f MB/s out")
+						 % storeFormatName(format) % converter.kernel() % (blocks * samplesPerBlock / elapsed / 1e6)
+						 % (blocks * samplesPerBlock * sizeof(std::complex<short>) / elapsed / 1e6)
+						 % (blocks * samplesPerBlock * storeBytesPerSample(format) / elapsed / 1e6) << std::endl;
+		}
+	}
+	// the checksums of the written bytes, sc16 here, each kernel's CRC of the same block printed to compare them
+	const size_t blockBytes = samplesPerBlock * sizeof(std::complex<short>);
+	for (bool accelerated : {false, true}) {
+		uint32_t blockCrc = 0;
+		size_t blocks = 0;
+		auto start = std::chrono::steady_clock::now();
+		double elapsed = 0.0;
+		while (elapsed < seconds) {
+			for (int k = 0; k < 16; k++) {
+				blockCrc = crc32c::checksum(samples.data(), blockBytes, accelerated);
+			}
+			blocks += 16;
+			elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		}
+		std::cout << boost::format("%-5s %-6s %8.1f MS/s, %6.1f MB/s in, crc32c of the block %08x")
+					 % "crc" % crc32c::kernel(accelerated) % (blocks * samplesPerBlock / elapsed / 1e6)
+					 % (blocks * blockBytes / elapsed / 1e6) % blockCrc << std::endl;
+	}
+}
+
+int main (int argc, char* argv[]){
+	//variables to be set by po
+	std::string file, simArgs, ioMode, format;
+	size_t numChannels, numBlocks, numWriters, ioSize, ioDepth;
+	double rate, total_time, spb;
+
+	//setup the program options
+	po::options_description desc("Allowed options");
+	desc.add_options()
+		("help", "help message")
+		("kernels", "only time the storage format conversion and checksum kernels (see sampleConvert.hpp and chunkChecksum.hpp)")
+		("file", po::value<std::string>(&file)->default_value(""), "prefix of the files to write, empty to measure the pipeline without disk writes")
+		("sim", po::value<std::string>(&simArgs)->default_value("mode=synth,realtime=0"), "simulated source arguments (see simStreamer.hpp), realtime=1 paces at --rate and reports overflows")
+		("chan", po::value<size_t>(&numChannels)->default_value(8), "number of channels")
+		("rate", po::value<double>(&rate)->default_value(12.5e6), "sample rate of the simulated source")
+		("duration", po::value<double>(&total_time)->default_value(10), "seconds of samples to push through the pipeline")
+		("spb", po::value<double>(&spb)->default_value(10), "buffer multiplier")
+		("blocks", po::value<size_t>(&numBlocks)->default_value(256), "number of receive blocks buffered between recv and the writers")
+		("writers", po::value<size_t>(&numWriters)->default_value(1), "number of writer threads (0 writes on the recv thread)")
+		("format", po::value<std::string>(&format)->default_value("bin"), "bin writes raw samples, compressed runs the lossless compressor first (also without --file)")
+		("io", po::value<std::string>(&ioMode)->default_value("buffered"), "file write mode (buffered, direct, uring)")
+		("iosize", po::value<size_t>(&ioSize)->default_value(4 << 20), "bytes per disk write for direct and uring, rounded up to 4096")
+		("iodepth", po::value<size_t>(&ioDepth)->default_value(8), "disk writes in flight per channel for uring")
+	;
+	po::variables_map vm;
+	po::store(po::parse_command_line(argc, argv, desc), vm);
+	po::notify(vm);
+
+	//print the help message
+	if (vm.count("help")) {
+		std::cout << boost::format("USRP recording pipeline benchmark %s") % desc << std::endl;
+		std::cout << std::endl << "This application measures the sustained rate and block latency of the recording pipeline without hardware.\n" << std::endl;
+		return ~0;
+	}
+
+	if (vm.count("kernels")) {
+		benchmarkKernels(20480, 1.0);
+		return 0;
+	}
+
+	const bool compress = format == "compressed";
+	if (not compress and format != "bin") {
+		std::cerr << "Please select a valid output format (bin, compressed)" << std::endl;
+		return ~0;
+	}
+	uhd::rx_streamer::sptr rxStream;
+	std::vector<std::unique_ptr<ChannelWriter>> outfiles;
+	try {
+		rxStream = makeSimStreamer(simArgs, numChannels, rate);
+		if (not file.empty()) {
+			ChannelWriter::Mode writeMode = ChannelWriter::parseMode(ioMode);
+			for (unsigned int i = 0; i < numChannels; i++) {
+				std::string fileName(file + "_chan" + std::to_string (i) + (compress ? ".sc16z" : ".bin"));
+				outfiles.emplace_back(new ChannelWriter (fileName, writeMode, ioSize, ioDepth, compress ? 0 : rate * total_time * sizeof(std::complex<short>)));
+			}
+		}
+	} catch (const std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return ~0;
+	}
+
+	const size_t pageSamples = ChannelWriter::ALIGNMENT / sizeof(std::complex<short>);
+	const size_t samplesPerBuffer = (size_t(rxStream->get_max_num_samps()*spb) + pageSamples - 1) / pageSamples * pageSamples;
+	const double totalSamplesToReceive = rate * total_time;
+
+	std::vector<std::unique_ptr<ChannelCompressor>> compressors;
+	for (size_t i = 0; compress and i < numChannels; i++) {
+		compressors.emplace_back(new ChannelCompressor (samplesPerBuffer));
+	}
+
+	// latencies from recv() returning to the block being written, one list per writer so no locking is needed
+	std::vector<std::vector<double>> latencies (numChannels);
+	for (size_t i = 0; i < numChannels; i++) {
+		latencies[i].reserve(size_t(totalSamplesToReceive / samplesPerBuffer) + 1);
+	}
+
+	BlockPipeline pipeline (numChannels, samplesPerBuffer, numBlocks, numWriters,
+		[&](const SampleBlock& block, size_t firstChannel, size_t endChannel) {
+			if (compress) {
+				for (size_t i = firstChannel; i < endChannel and block.numSamples > 0; i++) {
+					size_t frameBytes;
+					const char* frame = compressors[i]->compress(block.buffPtrs[i], block.numSamples, block.sampleOffset, frameBytes);
+					if (not outfiles.empty()) {
+						outfiles[i]->write(frame, frameBytes);
+					}
+				}
+			} else if (not outfiles.empty()) {
+				for (size_t i = firstChannel; i < endChannel; i++) {
+					outfiles[i]->write(block.buffPtrs[i], block.numSamples * sizeof (std::complex<short>));
+				}
+				for (size_t i = firstChannel; i < endChannel; i++) {
+					outfiles[i]->sync();
+				}
+			}
+			std::chrono::duration<double, std::milli> latency = std::chrono::steady_clock::now() - block.received;
+			latencies[firstChannel].push_back(latency.count());
+		});
+
+	std::cout << boost::format("Channels: %i, block: %i samples, %i blocks, %i writer threads, %s, %s")
+				 % numChannels % samplesPerBuffer % numBlocks % pipeline.numWriterThreads() % (file.empty() ? "no disk writes" : ioMode) % format << std::endl;
+
+	uhd::stream_cmd_t startCmd = uhd::stream_cmd_t::STREAM_MODE_START_CONTINUOUS;
+	startCmd.stream_now = true;
+	rxStream->issue_stream_cmd(startCmd);
+
+	double numSamplesReceived = 0;
+	size_t numErrors = 0;
+	uhd::rx_metadata_t rxMetadata;
+	auto start = std::chrono::steady_clock::now();
+	while (numSamplesReceived < totalSamplesToReceive) {
+		size_t numSamplesForThisBlock = std::min<double>(totalSamplesToReceive - numSamplesReceived, samplesPerBuffer);
+		SampleBlock* block = pipeline.acquire();
+		size_t numNewSamples = rxStream->recv(block->buffPtrs, numSamplesForThisBlock, rxMetadata);
+		if (rxMetadata.error_code != uhd::rx_metadata_t::ERROR_CODE_NONE) {
+			numErrors++;
+		}
+		block->numSamples = numNewSamples;
+		block->sampleOffset = numSamplesReceived;
+		block->metadata = rxMetadata;
+		block->received = std::chrono::steady_clock::now();
+		pipeline.submit(block);
+		numSamplesReceived += numNewSamples;
+	}
+	pipeline.finish();
+	for (size_t i = 0; i < outfiles.size(); i++) {
+		outfiles[i]->close();
+	}
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	std::vector<double> all;
+	for (size_t i = 0; i < numChannels; i++) {
+		all.insert(all.end(), latencies[i].begin(), latencies[i].end());
+	}
+	PipelineStats stats = pipeline.stats();
+	SimStreamer* sim = dynamic_cast<SimStreamer*>(rxStream.get());
+
+	std::cout << boost::format("Received: %.0f samples per channel in %.3f s") % numSamplesReceived % elapsed << std::endl;
+	std::cout << boost::format("Sustained: %.2f MS/s per channel, %.1f MB/s total")
+				 % (numSamplesReceived / elapsed / 1e6) % (numSamplesReceived * numChannels * sizeof(std::complex<short>) / elapsed / 1e6) << std::endl;
+	std::cout << boost::format("Block latency recv -> written [ms]: p50 %.3f, p90 %.3f, p99 %.3f, p99.9 %.3f, max %.3f")
+				 % percentile(all, 50) % percentile(all, 90) % percentile(all, 99) % percentile(all, 99.9)
+				 % (all.empty() ? 0.0 : *std::max_element(all.begin(), all.end())) << std::endl;
+	std::cout << boost::format("Queue high-water mark: %i/%i, recv stalls: %i, stream errors: %i, overflows: %i")
+				 % stats.queueHighWater % stats.queueCapacity % stats.poolStalls % numErrors % (sim ? sim->overflows() : 0) << std::endl;
+	for (size_t i = 0; i < compressors.size(); i++) {
+		std::cout << boost::format("Channel %i compression: ratio %.2f, %.2f s CPU, %.1f MS/s per core, %.1f%% of a core at %.2f MS/s")
+					 % i % compressors[i]->ratio() % compressors[i]->cpuTime()
+					 % (numSamplesReceived / std::max(compressors[i]->cpuTime(), 1e-9) / 1e6)
+					 % (100.0 * compressors[i]->cpuTime() * rate / std::max(numSamplesReceived, 1.0)) % (rate / 1e6) << std::endl;
+	}
+	return 0;
+}
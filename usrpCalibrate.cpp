@@ -0,0 +1,301 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <complex>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+
+#include <boost/program_options.hpp>
+#include <boost/format.hpp>
+
+#include "recordingReader.hpp"
+#include "crossCorrelation.hpp"
+#include "topology.hpp"
+
+namespace po = boost::program_options;
+//==============================================================================
+// Computes the array calibration from a recording of a common signal, such as
+// the 60 s calibrate.sh records. Every channel is cross-correlated against a
+// reference channel block by block, on every core. That gives the delay in
+// samples, the phase and the gain of every channel for every block. A
+// straight line through the blocks gives each channel's calibration and how
+// fast it drifts, written for downstream processing (crossCorrelation.hpp
+// reads it back). Blocks in which all channels of another motherboard jump
+// together against their usual delay are flagged: the boards were out of sync
+// there.
+
+struct BlockResult {
+	double time = 0.0;
+	bool recorded = false;		// every channel had the whole block
+	std::vector<ChannelEstimate> estimates;
+	std::vector<bool> slipped;	// per motherboard
+};
+
+// least squares line y = a + b * x
+static void fitLine (const std::vector<double>& x, const std::vector<double>& y, double& a, double& b) {
+	const double n = x.size();
+	if (n < 2) {
+		a = n ? y[0] : 0.0;
+		b = 0.0;
+		return;
+	}
+	double mx = std::accumulate(x.begin(), x.end(), 0.0) / n, my = std::accumulate(y.begin(), y.end(), 0.0) / n;
+	double sxy = 0.0, sxx = 0.0;
+	for (size_t i = 0; i < x.size(); i++) {
+		sxy += (x[i] - mx) * (y[i] - my);
+		sxx += (x[i] - mx) * (x[i] - mx);
+	}
+	b = sxx > 0 ? sxy / sxx : 0.0;
+	a = my - b * mx;
+}
+
+static double median (std::vector<double> values) {
+	if (values.empty()) {
+		return 0.0;
+	}
+	std::nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+	return values[values.size() / 2];
+}
+
+int main (int argc, char* argv[]){
+	//variables to be set by po
+	std::string file, channelList, topologyFile, out;
+	size_t reference, blockSamples, maxLag, numThreads;
+	double start, duration, spacing, rate, syncTolerance, minCoherence;
+
+	//setup the program options
+	po::options_description desc("Allowed options");
+	desc.add_options()
+		("help", "help message")
+		("file", po::value<std::string>(&file), "the recording's --file, e.g. /mnt/speedy/20200101120000/calibration")
+		("ref", po::value<size_t>(&reference)->default_value(0), "reference channel")
+		("channels", po::value<std::string>(&channelList)->default_value(""), "comma separated channels to calibrate, empty for all")
+		("topology", po::value<std::string>(&topologyFile)->default_value(""), "the recording's --topology file, for which channels share a motherboard (default four per X300)")
+		("block", po::value<size_t>(&blockSamples)->default_value(65536), "samples per correlation, a power of two")
+		("maxlag", po::value<size_t>(&maxLag)->default_value(64), "largest delay searched, in samples")
+		("start", po::value<double>(&start)->default_value(0), "seconds into the recording to start at")
+		("duration", po::value<double>(&duration)->default_value(0), "seconds to use, 0 for the rest of the recording")
+		("spacing", po::value<double>(&spacing)->default_value(0), "seconds from one block to the next, 0 for back to back")
+		("rate", po::value<double>(&rate)->default_value(0), "sample rate of a recording without an index")
+		("synctol", po::value<double>(&syncTolerance)->default_value(0.25), "samples a motherboard's channels have to jump together to flag the block")
+		("mincoherence", po::value<double>(&minCoherence)->default_value(0.3), "blocks of a channel correlating less than this are left out of its calibration")
+		("threads", po::value<size_t>(&numThreads)->default_value(0), "threads, 0 for every core")
+		("out", po::value<std::string>(&out)->default_value(""), "calibration file, <file>_calibration.txt when empty")
+	;
+	po::variables_map vm;
+	po::store(po::parse_command_line(argc, argv, desc), vm);
+	po::notify(vm);
+
+	//print the help message
+	if (vm.count("help") or file.empty()) {
+		std::cout << boost::format("USRP Calibrate %s") % desc << std::endl;
+		std::cout << std::endl << "This application computes the delay, phase and gain of every channel against a reference channel.\n" << std::endl;
+		return ~0;
+	}
+	if (out.empty()) {
+		out = file + "_calibration.txt";
+	}
+	const std::string trackFile = out.substr(0, out.rfind(".txt")) + "_track.txt";
+
+	try {
+		RecordingReader reader (file, numThreads);
+		if (reader.rate() > 0) {
+			rate = reader.rate();
+		} else if (rate <= 0) {
+			throw std::runtime_error("the recording has no index, give its --rate");
+		}
+		if (reference >= reader.channels()) {
+			throw std::runtime_error((boost::format("reference channel %i is not in the recording (%i channels)") % reference % reader.channels()).str());
+		}
+		std::vector<size_t> channels {reference};
+		std::stringstream list (channelList);
+		std::string item;
+		while (std::getline(list, item, ',')) {
+			if (std::stoul(item) != reference) {
+				channels.push_back(std::stoul(item));
+			}
+		}
+		for (size_t channel = 0; channelList.empty() and channel < reader.channels(); channel++) {
+			if (channel != reference) {
+				channels.push_back(channel);
+			}
+		}
+		if (channels.size() < 2) {
+			throw std::runtime_error("nothing to calibrate against the reference");
+		}
+		Topology topology = topologyFile.empty() ? Topology::standard(reader.channels(), 0.0, 0.0) : Topology::load(topologyFile, 0.0, 0.0);
+		if (topology.size() < reader.channels()) {
+			throw std::runtime_error((boost::format("the topology has %i channels, the recording %i") % topology.size() % reader.channels()).str());
+		}
+
+		// blocks go by device time when the index has it, so boards recorded as separate streams line up
+		double first = 0.0, end = reader.samples() / rate;
+		double timedFirst, timedEnd;
+		const bool timed = reader.timeRange(timedFirst, timedEnd);
+		if (timed) {
+			first = timedFirst;
+			end = timedEnd;
+		}
+		const double blockTime = blockSamples / rate, step = std::max(spacing, blockTime);
+		const double available = end - first - start;
+		const size_t numBlocks = std::max(0.0, std::floor(((duration > 0 ? std::min(duration, available) : available) - blockTime) / step + 1));
+		if (numBlocks == 0) {
+			throw std::runtime_error("the recording is shorter than one block");
+		}
+		Correlator correlator (blockSamples, maxLag);
+		WorkerPool pool (numThreads);
+		std::cout << boost::format("Calibrating %i channels against channel %i: %i blocks of %i samples (%.1f ms) every %.3f s, %i threads, %s FFTs%s")
+					 % (channels.size() - 1) % reference % numBlocks % blockSamples % (blockTime * 1e3) % step % pool.size() % correlator.kernel()
+					 % (timed ? "" : ", no device time") << std::endl;
+
+		// a few blocks per thread are read at once, then estimated in parallel
+		std::vector<BlockResult> results (numBlocks);
+		const size_t batch = 2 * pool.size();
+		std::vector<std::complex<float>> window (batch * channels.size() * blockSamples);
+		for (size_t firstBlock = 0; firstBlock < numBlocks; firstBlock += batch) {
+			const size_t count = std::min(batch, numBlocks - firstBlock);
+			for (size_t b = 0; b < count; b++) {
+				BlockResult& result = results[firstBlock + b];
+				result.time = first + start + (firstBlock + b) * step;
+				std::complex<float>* samples = window.data() + b * channels.size() * blockSamples;
+				size_t valid = timed ? reader.readTime(result.time, blockSamples, channels, samples)
+									 : reader.readSamples(std::llround((start + (firstBlock + b) * step) * rate), blockSamples, channels, samples);
+				result.recorded = valid == blockSamples;
+			}
+			pool.run(count, [&](size_t b) {
+				BlockResult& result = results[firstBlock + b];
+				if (not result.recorded) {
+					return;
+				}
+				const std::complex<float>* samples = window.data() + b * channels.size() * blockSamples;
+				Correlator::Scratch scratch (correlator.fftSize());
+				correlator.reference(samples, scratch);
+				for (size_t c = 1; c < channels.size(); c++) {
+					result.estimates.push_back(correlator.estimate(samples + c * blockSamples, scratch));
+				}
+			});
+			std::cout << boost::format("Block %i of %i\r") % std::min(firstBlock + batch, numBlocks) % numBlocks << std::flush;
+		}
+		std::cout << std::endl;
+
+		// a motherboard whose channels all jump the same way against their usual delay has slipped against the reference's
+		const size_t numChannels = channels.size() - 1;
+		std::vector<double> usualDelay (numChannels);
+		for (size_t c = 0; c < numChannels; c++) {
+			std::vector<double> delays;
+			for (const BlockResult& result : results) {
+				if (result.recorded and result.estimates[c].coherence >= minCoherence) {
+					delays.push_back(result.estimates[c].delay);
+				}
+			}
+			usualDelay[c] = median(delays);
+		}
+		const size_t referenceBoard = topology[reference].mboard;
+		std::vector<size_t> slips (topology.numMboards(), 0);
+		for (BlockResult& result : results) {
+			result.slipped.assign(topology.numMboards(), false);
+			if (not result.recorded) {
+				continue;
+			}
+			for (size_t mboard = 0; mboard < topology.numMboards(); mboard++) {
+				if (mboard == referenceBoard) {
+					continue;
+				}
+				size_t onBoard = 0, ahead = 0, behind = 0;
+				for (size_t c = 0; c < numChannels; c++) {
+					if (topology[channels[c + 1]].mboard == mboard) {
+						onBoard++;
+						double deviation = result.estimates[c].delay - usualDelay[c];
+						ahead += deviation < -syncTolerance;
+						behind += deviation > syncTolerance;
+					}
+				}
+				if (onBoard > 0 and (ahead == onBoard or behind == onBoard)) {
+					result.slipped[mboard] = true;
+					slips[mboard]++;
+				}
+			}
+		}
+
+		// a line through the good blocks of each channel, the phase unwrapped from block to block
+		Calibration calibration;
+		calibration.time = results[0].time;
+		for (size_t c = 0; c < numChannels; c++) {
+			std::vector<double> times, delays, phases, gains, coherences;
+			for (const BlockResult& result : results) {
+				if (not result.recorded or result.slipped[topology[channels[c + 1]].mboard] or result.estimates[c].coherence < minCoherence) {
+					continue;
+				}
+				double phase = result.estimates[c].phase * 180.0 / M_PI;
+				if (not phases.empty()) {
+					phase -= 360.0 * std::round((phase - phases.back()) / 360.0);
+				}
+				times.push_back(result.time - calibration.time);
+				delays.push_back(result.estimates[c].delay);
+				phases.push_back(phase);
+				gains.push_back(result.estimates[c].gain);
+				coherences.push_back(result.estimates[c].coherence);
+			}
+			ChannelCalibration entry;
+			entry.channel = channels[c + 1];
+			if (times.empty()) {
+				std::cout << boost::format("Channel %i: no block correlated with the reference above %.2f, left out") % entry.channel % minCoherence << std::endl;
+				continue;
+			}
+			fitLine(times, delays, entry.delay, entry.delayDrift);
+			fitLine(times, phases, entry.phase, entry.phaseDrift);
+			// wrapped to +-180 at the reference time, the drift carries on from there
+			entry.phase -= 360.0 * std::round(entry.phase / 360.0);
+			entry.gain = std::accumulate(gains.begin(), gains.end(), 0.0) / gains.size();
+			entry.coherence = std::accumulate(coherences.begin(), coherences.end(), 0.0) / coherences.size();
+			double delayScatter = 0.0, phaseScatter = 0.0;
+			for (size_t i = 0; i < times.size(); i++) {
+				delayScatter += std::pow(delays[i] - entry.delayAt(times[i], 0.0), 2);
+				phaseScatter += std::pow(phases[i] - entry.phaseAt(times[i], 0.0), 2);
+			}
+			std::cout << boost::format("Channel %i (motherboard %i): delay %+.4f samples (%+.2f ns) +- %.4f, phase %+.2f deg +- %.2f, gain %+.2f dB, coherence %.3f, drift %+.3g samples/s %+.3g deg/s, %i of %i blocks")
+						 % entry.channel % topology[entry.channel].mboard % entry.delay % (entry.delay / rate * 1e9) % std::sqrt(delayScatter / times.size())
+						 % entry.phase % std::sqrt(phaseScatter / times.size()) % entry.gain % entry.coherence % entry.delayDrift % entry.phaseDrift
+						 % times.size() % numBlocks << std::endl;
+			calibration.channels.push_back(entry);
+		}
+		size_t unrecorded = std::count_if(results.begin(), results.end(), [](const BlockResult& result) { return not result.recorded; });
+		if (unrecorded > 0) {
+			std::cout << boost::format("%i blocks fell on samples that were not recorded and were skipped") % unrecorded << std::endl;
+		}
+		for (size_t mboard = 0; mboard < topology.numMboards(); mboard++) {
+			if (mboard == referenceBoard) {
+				continue;
+			}
+			std::cout << boost::format("Motherboard %i against motherboard %i: ") % mboard % referenceBoard;
+			if (slips[mboard] == 0) {
+				std::cout << "in sync in every block" << std::endl;
+				continue;
+			}
+			std::cout << boost::format("OUT OF SYNC in %i blocks, first at device time %.3f") % slips[mboard]
+						 % std::find_if(results.begin(), results.end(), [&](const BlockResult& result) { return result.slipped[mboard]; })->time << std::endl;
+		}
+
+		std::ostringstream comment;
+		comment << boost::format("# usrpCalibrate of %s: reference channel %i, %.6f Msps, %i blocks of %i samples every %.3f s\n")
+				   % file % reference % (rate / 1e6) % numBlocks % blockSamples % step;
+		calibration.save(out, comment.str());
+		std::ofstream track (trackFile);
+		track << "# time[s]\tchannel\tdelay[samples]\tphase[deg]\tgain[dB]\tcoherence\tslipped\n";
+		for (const BlockResult& result : results) {
+			for (size_t c = 0; result.recorded and c < numChannels; c++) {
+				const ChannelEstimate& estimate = result.estimates[c];
+				track << boost::format("%.6f\t%i\t%.5f\t%.3f\t%.3f\t%.4f\t%i\n") % result.time % channels[c + 1] % estimate.delay
+						 % (estimate.phase * 180.0 / M_PI) % estimate.gain % estimate.coherence % int(result.slipped[topology[channels[c + 1]].mboard]);
+			}
+		}
+		std::cout << "Calibration written to " << out << ", every block to " << trackFile << std::endl;
+	} catch (const std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return ~0;
+	}
+	return 0;
+}
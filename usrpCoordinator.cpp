@@ -0,0 +1,225 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+
+#include <boost/program_options.hpp>
+#include <boost/format.hpp>
+
+#include "coordination.hpp"
+
+namespace po = boost::program_options;
+//==============================================================================
+// Starts one recording on several hosts. Every host runs usrpMultiRecord
+// --agent=<port> with its own devices and options; this connects to all of
+// them, arms them under one session ID once their devices are up, starts them
+// at the same whole second of device time and follows their progress until
+// every agent has finished. The summary shows whether they all took their
+// first sample at the start time.
+
+struct AgentState {
+	std::string address;
+	std::unique_ptr<coord::Connection> connection;
+	coord::Message armed, progress, done;
+	std::chrono::steady_clock::time_point armedAt;
+	bool isArmed = false, finished = false, failed = false;
+	std::string error;
+
+	std::string name () const { return armed.get("host", address); }
+};
+
+int main (int argc, char* argv[]){
+	//variables to be set by po
+	std::string agentList, session, file;
+	double lead, connectTimeout, armTimeout, maxSkew;
+
+	//setup the program options
+	po::options_description desc("Allowed options");
+	desc.add_options()
+		("help", "help message")
+		("agents", po::value<std::string>(&agentList), "comma separated host:port of every usrpMultiRecord --agent (e.g. rec1:7700,rec2:7700)")
+		("session", po::value<std::string>(&session)->default_value(""), "session ID every agent writes into its metadata, the UTC start of the coordinator when empty")
+		("lead", po::value<double>(&lead)->default_value(2.0), "seconds from the last agent arming to the start, at least the time a start command takes to reach every device")
+		("connect", po::value<double>(&connectTimeout)->default_value(30.0), "seconds to keep trying to reach an agent")
+		("wait", po::value<double>(&armTimeout)->default_value(300.0), "seconds for all agents to bring up their devices, GPS lock included")
+		("maxskew", po::value<double>(&maxSkew)->default_value(0.5), "largest disagreement between the agents' device times before the start is called off")
+		("file", po::value<std::string>(&file)->default_value(""), "write the session summary to <file>_session.txt")
+	;
+	po::variables_map vm;
+	po::store(po::parse_command_line(argc, argv, desc), vm);
+	po::notify(vm);
+
+	//print the help message
+	if (vm.count("help") or agentList.empty()) {
+		std::cout << boost::format("USRP Coordinator %s") % desc << std::endl;
+		std::cout << std::endl << "This application starts usrpMultiRecord agents on several hosts at the same device time.\n" << std::endl;
+		return ~0;
+	}
+	if (session.empty()) {
+		char stamp[32];
+		time_t now = time(nullptr);
+		strftime(stamp, sizeof(stamp), "%Y%m%dT%H%M%SZ", gmtime(&now));
+		session = stamp;
+	}
+	if (session.find_first_of(" \t\n") != std::string::npos) {
+		std::cerr << "The session ID cannot contain spaces" << std::endl;
+		return ~0;
+	}
+
+	std::vector<AgentState> agents;
+	std::stringstream addresses (agentList);
+	std::string address;
+	while (std::getline(addresses, address, ',')) {
+		agents.emplace_back();
+		agents.back().address = address;
+	}
+
+	// tell the agents that are still up why the session ends
+	auto abortAll = [&](const std::string& reason) {
+		std::cerr << "Aborting session " << session << ": " << reason << std::endl;
+		std::string word (reason);
+		std::replace(word.begin(), word.end(), ' ', '_');
+		for (auto& agent : agents) {
+			try {
+				if (agent.connection) {
+					agent.connection->send("ABORT reason=" + word);
+				}
+			} catch (const std::exception&) {
+			}
+		}
+		return ~0;
+	};
+
+	std::cout << boost::format("Session %s with %i agents") % session % agents.size() << std::endl;
+	try {
+		for (auto& agent : agents) {
+			agent.connection = coord::Connection::connectTo(agent.address, connectTimeout);
+			agent.connection->send("ARM session=" + session);
+			std::cout << "Connected to " << agent.address << std::endl;
+		}
+	} catch (const std::exception& e) {
+		return abortAll(e.what());
+	}
+
+	// every agent answers once its devices are set up, which takes as long as its GPS lock
+	auto armStart = std::chrono::steady_clock::now();
+	for (size_t numArmed = 0; numArmed < agents.size(); ) {
+		if (std::chrono::duration<double>(std::chrono::steady_clock::now() - armStart).count() > armTimeout) {
+			return abortAll((boost::format("only %i of %i agents armed within %.0f s") % numArmed % agents.size() % armTimeout).str());
+		}
+		for (auto& agent : agents) {
+			std::string line;
+			try {
+				if (agent.isArmed or not agent.connection->receive(line, 0.05)) {
+					continue;
+				}
+			} catch (const std::exception& e) {
+				return abortAll(agent.address + " " + e.what() + " while bringing up its devices");
+			}
+			coord::Message message = coord::parse(line);
+			if (message.command != "ARMED") {
+				return abortAll(agent.address + " sent " + line);
+			}
+			agent.armed = message;
+			agent.armedAt = std::chrono::steady_clock::now();
+			agent.isArmed = true;
+			numArmed++;
+			std::cout << boost::format("Armed %s: %i channels at %.3f Msps, device time %.3f")
+						 % agent.name() % message.number("channels") % (message.number("rate") / 1e6) % message.number("time") << std::endl;
+		}
+	}
+
+	// the device times of all agents brought to the same moment, they may only differ by what NTP and the PPS leave
+	auto now = std::chrono::steady_clock::now();
+	double earliest = INFINITY, latest = -INFINITY;
+	for (auto& agent : agents) {
+		double deviceTime = agent.armed.number("time") + std::chrono::duration<double>(now - agent.armedAt).count();
+		earliest = std::min(earliest, deviceTime);
+		latest = std::max(latest, deviceTime);
+	}
+	if (latest - earliest > maxSkew) {
+		return abortAll((boost::format("the agents' device times differ by %.3f s, are they on GPS time?") % (latest - earliest)).str());
+	}
+	// a whole second is a PPS edge on every device
+	const double startTime = std::ceil(latest + lead);
+	try {
+		for (auto& agent : agents) {
+			agent.connection->send((boost::format("START at=%.0f") % startTime).str());
+		}
+	} catch (const std::exception& e) {
+		return abortAll(e.what());
+	}
+	std::cout << boost::format("Starting at device time %.0f, in %.1f s, device times agree within %.3f s")
+				 % startTime % (startTime - latest) % (latest - earliest) << std::endl << std::endl;
+
+	// follow the agents until every one has finished or gone
+	auto lastPrint = std::chrono::steady_clock::now();
+	while (not std::all_of(agents.begin(), agents.end(), [](const AgentState& agent) { return agent.finished or agent.failed; })) {
+		for (auto& agent : agents) {
+			std::string line;
+			try {
+				while (not agent.finished and not agent.failed and agent.connection->receive(line, 0.02)) {
+					coord::Message message = coord::parse(line);
+					if (message.command == "PROGRESS") {
+						agent.progress = message;
+					} else if (message.command == "DONE") {
+						agent.done = message;
+						agent.finished = true;
+					} else if (message.command == "ABORT") {
+						agent.failed = true;
+						agent.error = message.get("reason");
+					}
+				}
+			} catch (const std::exception& e) {
+				agent.failed = true;
+				agent.error = e.what();
+				std::cout << std::endl << agent.name() << ": " << agent.error << std::endl;
+			}
+		}
+		if (std::chrono::steady_clock::now() - lastPrint >= std::chrono::seconds(1)) {
+			lastPrint = std::chrono::steady_clock::now();
+			std::cout << "Progress:";
+			for (auto& agent : agents) {
+				const coord::Message& status = agent.finished ? agent.done : agent.progress;
+				std::cout << boost::format(" %s %.0f%% ovf %i") % agent.name()
+							 % (100.0 * status.number("samples") / std::max(agent.progress.number("total", 1.0), 1.0)) % status.number("overflows");
+			}
+			std::cout << " \r" << std::flush;
+		}
+	}
+
+	// the first sample of every agent should carry the start time itself
+	std::ostringstream summary;
+	summary << boost::format("Session: %s") % session << std::endl;
+	summary << boost::format("Start: device time %.0f") % startTime << std::endl;
+	bool allGood = true, aligned = true;
+	for (auto& agent : agents) {
+		if (agent.failed) {
+			summary << boost::format("%s (%s): failed, %s") % agent.name() % agent.address % agent.error << std::endl;
+			allGood = false;
+			continue;
+		}
+		const coord::Message& done = agent.done;
+		const long long offset = std::llround((done.number("first", -1.0) - startTime) * agent.armed.number("rate"));
+		aligned = aligned and offset == 0;
+		allGood = allGood and done.number("failed") == 0;
+		summary << boost::format("%s (%s): %i channels, %.0f samples, %i overflows, %i timeouts, %i errors, %i samples lost, %i recv stalls, first sample %+i samples from the start%s")
+				   % agent.name() % agent.address % agent.armed.number("channels") % done.number("samples") % done.number("overflows")
+				   % done.number("timeouts") % done.number("errors") % done.number("lost") % done.number("stalls") % offset
+				   % (done.number("failed") ? ", WRITE FAILED" : "") << std::endl;
+	}
+	summary << (aligned ? "All agents started on the same sample" : "The agents did NOT start together") << std::endl;
+	std::cout << std::endl << std::endl << summary.str();
+	if (not file.empty()) {
+		std::ofstream out (file + "_session.txt");
+		out << summary.str();
+	}
+	return allGood and aligned ? 0 : ~0;
+}
@@ -0,0 +1,158 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <complex>
+#include <thread>
+#include <chrono>
+
+#include <unistd.h>
+
+#include <boost/program_options.hpp>
+#include <boost/format.hpp>
+
+#include "sampleCodec.hpp"
+#include "volumeSet.hpp"
+#include "recordingReader.hpp"
+
+namespace po = boost::program_options;
+//==============================================================================
+// Turns the <file>_chanN.sc16z files of a usrpMultiRecord --format=compressed
+// run back into the usual <file>_chanN.bin, one thread per channel. Frames
+// are decoded one at a time, so memory use does not depend on the file size.
+// A segmented run given by its prefix is decoded one segment after another,
+// every segment listed in <file>_segments.txt.
+// Files spread over several --volumes are found by segment and channel in
+// <file>_placement.txt and decompressed where they are, or next to <file>
+// once they have been offloaded or moved from their volume.
+
+struct ChannelResult {
+	uint64_t samples = 0;
+	uint64_t compressedBytes = 0;
+	std::string error;
+};
+
+static void decompressChannel (const std::string& inName, const std::string& outName, ChannelResult& result) {
+	try {
+		std::ifstream in (inName, std::ifstream::binary);
+		if (not in) {
+			throw std::runtime_error("cannot open " + inName);
+		}
+		std::ofstream out (outName, std::ofstream::binary | std::ofstream::trunc);
+		if (not out) {
+			throw std::runtime_error("cannot open " + outName);
+		}
+		FrameReader reader (in);
+		std::vector<std::complex<short>> samples;
+		// segments of a --segment run start at their first sample in the recording
+		uint64_t sampleOffset, firstOffset = 0;
+		while (reader.next(samples, sampleOffset)) {
+			if (result.samples == 0) {
+				firstOffset = sampleOffset;
+			}
+			if (sampleOffset != firstOffset + result.samples) {
+				throw std::runtime_error((boost::format("%s: frame at sample %i, expected %i") % inName % sampleOffset % (firstOffset + result.samples)).str());
+			}
+			out.write(reinterpret_cast<const char*>(samples.data()), samples.size() * sizeof(std::complex<short>));
+			result.samples += samples.size();
+		}
+		if (not out) {
+			throw std::runtime_error("write to " + outName + " failed");
+		}
+		result.compressedBytes = reader.bytesRead();
+	} catch (const std::exception& e) {
+		result.error = e.what();
+	}
+}
+
+int main (int argc, char* argv[]){
+	//variables to be set by po
+	std::string file;
+	size_t numChannels;
+
+	//setup the program options
+	po::options_description desc("Allowed options");
+	desc.add_options()
+		("help", "help message")
+		("file", po::value<std::string>(&file), "prefix of the recording, as passed to usrpMultiRecord --file (every segment of a segmented run), or <file>_segNNNN for one segment")
+		("chan", po::value<size_t>(&numChannels)->default_value(1), "number of channels to decompress")
+	;
+	po::variables_map vm;
+	po::store(po::parse_command_line(argc, argv, desc), vm);
+	po::notify(vm);
+
+	//print the help message
+	if (vm.count("help") or not vm.count("file")) {
+		std::cout << boost::format("USRP compressed recording to raw samples %s") % desc << std::endl;
+		return ~0;
+	}
+
+	// a single segment is looked up in the placement of its recording, the prefix of a segmented run stands for all its segments
+	std::string recording = file;
+	std::vector<size_t> segments;
+	const size_t suffix = recording.rfind("_seg");
+	if (suffix != std::string::npos and recording.size() == suffix + 8 and recording.find_first_not_of("0123456789", suffix + 4) == std::string::npos) {
+		segments.push_back(std::stoul(recording.substr(suffix + 4)));
+		recording.erase(suffix);
+	}
+	const size_t numSegments = RecordingReader::segmentCount(recording);
+	const bool wholeRun = segments.empty();
+	for (size_t segment = 0; wholeRun and segment < std::max<size_t>(numSegments, 1); segment++) {
+		segments.push_back(segment);
+	}
+	const bool segmented = not wholeRun or numSegments > 0;
+	std::vector<Placement> placement;
+	try {
+		placement = loadPlacement(recording);
+	} catch (const std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return ~0;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	int status = 0;
+	uint64_t totalSamples = 0;
+	std::vector<ChannelResult> channelTotals (numChannels);
+	// one segment after another, the channels of a segment in parallel
+	for (size_t segment : segments) {
+		std::vector<ChannelResult> results (numChannels);
+		std::vector<std::thread> threads;
+		for (size_t i = 0; i < numChannels; i++) {
+			// where a --volumes run put the file, or the name as it is
+			std::string inName = placedFile(placement, segment, i);
+			if (inName.empty()) {
+				inName = segmented ? (boost::format("%s_seg%04i_chan%i.sc16z") % recording % segment % i).str() : file + "_chan" + std::to_string(i) + ".sc16z";
+			} else if (access(inName.c_str(), F_OK) != 0) {
+				inName = besidePrefix(recording, inName);
+			}
+			std::string prefix (inName.substr(0, inName.size() - 6));
+			threads.emplace_back(decompressChannel, inName, prefix + ".bin", std::ref(results[i]));
+		}
+		for (auto& thread : threads) {
+			thread.join();
+		}
+		for (size_t i = 0; i < numChannels; i++) {
+			if (not results[i].error.empty()) {
+				std::cerr << results[i].error << std::endl;
+				channelTotals[i].error = results[i].error;
+				status = ~0;
+				continue;
+			}
+			channelTotals[i].samples += results[i].samples;
+			channelTotals[i].compressedBytes += results[i].compressedBytes;
+			totalSamples += results[i].samples;
+		}
+	}
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	for (size_t i = 0; i < numChannels; i++) {
+		const ChannelResult& result = channelTotals[i];
+		std::cout << boost::format("Channel %i: %i samples%s, ratio %.2f") % i % result.samples
+					 % (wholeRun and segmented ? (boost::format(" in %i segments") % segments.size()).str() : std::string())
+					 % (result.compressedBytes ? double(result.samples * sizeof(std::complex<short>)) / result.compressedBytes : 0.0)
+				  << (result.error.empty() ? "" : ", incomplete") << std::endl;
+	}
+	std::cout << boost::format("Decompressed %.1f MB in %.2f s (%.1f MS/s)")
+				 % (totalSamples * sizeof(std::complex<short>) / 1e6) % elapsed % (totalSamples / elapsed / 1e6) << std::endl;
+	return status;
+}
@@ -0,0 +1,147 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <csignal>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/program_options.hpp>
+#include <boost/format.hpp>
+
+#include "liveRing.hpp"
+
+namespace po = boost::program_options;
+//==============================================================================
+// Follows one channel of a running usrpMultiRecord --live. The samples go to
+// a file or stdout as sc16, so a decoder can read them from a pipe while the
+// recording runs, and a status line on stderr shows the rate, the level and
+// whether the reader keeps up. A reader that falls a ring behind loses blocks,
+// the recording does not wait for it.
+
+static volatile std::sig_atomic_t stopRequested = 0;
+
+static void handleSignal (int) {
+	stopRequested = 1;
+}
+
+int main (int argc, char* argv[]){
+	//variables to be set by po
+	std::string file, output;
+	size_t channel;
+	double duration, wait, interval;
+
+	//setup the program options
+	po::options_description desc("Allowed options");
+	desc.add_options()
+		("help", "help message")
+		("file", po::value<std::string>(&file)->default_value("/dev/shm/usrpLive"), "live ring, as passed to usrpMultiRecord --live")
+		("channel", po::value<size_t>(&channel)->default_value(0), "channel to follow")
+		("output", po::value<std::string>(&output)->default_value(""), "write the samples as sc16 to this file, - for stdout, nothing when empty")
+		("oldest", "start with the oldest block still in the ring instead of the next one")
+		("duration", po::value<double>(&duration)->default_value(0), "seconds of samples to read, 0 until the recording ends")
+		("wait", po::value<double>(&wait)->default_value(0), "seconds to wait for the recorder to set up the ring")
+		("interval", po::value<double>(&interval)->default_value(1.0), "seconds between status lines, 0 for none")
+	;
+	po::variables_map vm;
+	po::store(po::parse_command_line(argc, argv, desc), vm);
+	po::notify(vm);
+
+	//print the help message
+	if (vm.count("help")) {
+		std::cout << boost::format("Live samples of a running recording %s") % desc << std::endl;
+		return ~0;
+	}
+
+	std::signal(SIGINT, handleSignal);
+	std::signal(SIGTERM, handleSignal);
+	std::signal(SIGPIPE, SIG_IGN);
+	int out = -1;
+	if (output == "-") {
+		out = STDOUT_FILENO;
+	} else if (not output.empty()) {
+		out = ::open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (out < 0) {
+			std::cerr << "Cannot open " << output << ": " << std::strerror(errno) << std::endl;
+			return ~0;
+		}
+	}
+
+	try {
+		// the recorder creates the ring once its devices are up
+		std::unique_ptr<LiveSubscriber> live;
+		auto waitStart = std::chrono::steady_clock::now();
+		while (not live) {
+			try {
+				live.reset(new LiveSubscriber (file, channel, vm.count("oldest")));
+			} catch (const std::exception&) {
+				if (stopRequested or std::chrono::duration<double>(std::chrono::steady_clock::now() - waitStart).count() >= wait) {
+					throw;
+				}
+				std::this_thread::sleep_for(std::chrono::milliseconds(200));
+			}
+		}
+		std::cerr << boost::format("Following channel %i of %s: %.6f MHz at %.3f Msps, %i blocks of %i samples in the ring")
+					 % channel % file % (live->frequency() / 1e6) % (live->sampleRate() / 1e6) % live->info().numSlots % live->info().slotSamples << std::endl;
+
+		const uint64_t maxSamples = duration > 0 ? duration * live->sampleRate() : 0;
+		uint64_t numSamples = 0, torn = 0, intervalSamples = 0, intervalSkipped = 0;
+		double intervalPower = 0.0, peak = 0.0;
+		auto lastStatus = std::chrono::steady_clock::now();
+		LiveBlock block;
+		while (not stopRequested and (maxSamples == 0 or numSamples < maxSamples)) {
+			if (not live->next(block, 0.25)) {
+				if (live->finished()) {
+					break;
+				}
+			} else {
+				size_t count = maxSamples ? std::min<uint64_t>(block.numSamples, maxSamples - numSamples) : block.numSamples;
+				if (out >= 0) {
+					const char* data = reinterpret_cast<const char*>(block.samples);
+					for (size_t done = 0, length = count * sizeof(std::complex<short>); done < length; ) {
+						ssize_t ret = ::write(out, data + done, length - done);
+						if (ret <= 0) {
+							throw std::runtime_error(std::string("cannot write the samples: ") + std::strerror(errno));
+						}
+						done += ret;
+					}
+				}
+				if (interval > 0) {
+					for (size_t k = 0; k < count; k++) {
+						double power = double(block.samples[k].real()) * block.samples[k].real() + double(block.samples[k].imag()) * block.samples[k].imag();
+						intervalPower += power;
+						peak = std::max(peak, power);
+					}
+				}
+				// a reader that stalls mid-block can find the block rewritten under it
+				if (not live->valid(block)) {
+					torn++;
+				}
+				numSamples += count;
+				intervalSamples += count;
+				intervalSkipped += block.skipped;
+			}
+			if (interval > 0 and std::chrono::steady_clock::now() - lastStatus >= std::chrono::duration<double>(interval)) {
+				double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - lastStatus).count();
+				lastStatus = std::chrono::steady_clock::now();
+				std::cerr << boost::format("%.3f Msps, RMS %.1f dBFS, peak %.1f dBFS, %i blocks skipped, %i behind   \r")
+							 % (intervalSamples / seconds / 1e6) % (10 * std::log10(std::max(intervalPower / std::max<uint64_t>(intervalSamples, 1), 1e-3) / (32768.0 * 32768.0)))
+							 % (10 * std::log10(std::max(peak, 1e-3) / (32768.0 * 32768.0))) % intervalSkipped % live->behind() << std::flush;
+				intervalSamples = intervalSkipped = 0;
+				intervalPower = peak = 0.0;
+			}
+		}
+		std::cerr << std::endl << boost::format("%i samples read, %i blocks skipped, %i overwritten while in use") % numSamples % live->skipped() % torn << std::endl;
+	} catch (const std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return ~0;
+	}
+	if (out >= 0 and out != STDOUT_FILENO) {
+		::close(out);
+	}
+	return 0;
+}
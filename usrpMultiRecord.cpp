@@ -3,9 +3,12 @@
 #include <complex>
 #include <thread>
 #include <fstream>
+#include <sstream>
+#include <deque>
 #include <csignal>
 #include <chrono>
 #include <ctime>
+#include <numeric>
 
 #include <boost/program_options.hpp>
 #include <boost/format.hpp>
@@ -16,21 +19,81 @@
 #include <uhd/types/device_addr.hpp>
 #include <uhd/utils/thread.hpp>
 
+#include "sampleQueue.hpp"
+#include "fileWriter.hpp"
+#include "simStreamer.hpp"
+#include "blockIndex.hpp"
+#include "containerFile.hpp"
+#include "gpsFix.hpp"
+#include "sampleCodec.hpp"
+#include "sampleConvert.hpp"
+#include "triggerCapture.hpp"
+#include "offloader.hpp"
+#include "numaPlacement.hpp"
+#include "spectrumMonitor.hpp"
+#include "gainProfile.hpp"
+#include "topology.hpp"
+#include "bringUp.hpp"
+#include "telemetry.hpp"
+#include "coordination.hpp"
+#include "channelizer.hpp"
+#include "liveRing.hpp"
+#include "preflight.hpp"
+#include "volumeSet.hpp"
+#include "chunkChecksum.hpp"
+
 namespace po = boost::program_options;
 //==============================================================================
+// One rx streamer with its recv loop, block pipeline and index. Normally a
+// single stream covers every channel. With --perboard every motherboard gets
+// its own, so each 10GbE link is drained by a thread on the NIC's NUMA node.
+struct BoardStream {
+	size_t mboard = 0;
+	size_t firstChannel = 0;
+	size_t numChannels = 0;
+	uhd::rx_streamer::sptr rxStream;
+	std::unique_ptr<BlockPipeline> pipeline;
+	std::unique_ptr<IndexWriter> index;
+	int numaNode = -1;
+	int cpu = -1;
+	std::thread thread;
+	// samples received so far, for the progress display while the recv thread runs
+	std::atomic<uint64_t> progress {0};
+	std::atomic<bool> finished {false};
+	// owned by the recv loop until it has finished
+	double numSamplesReceived = 0;
+	size_t numOverflows = 0, numTimeouts = 0, numErrors = 0;
+	bool haveStartTime = false;
+	uhd::time_spec_t startTime;
+	// seconds from launch to the first sample on the host
+	double firstSampleAfter = 0.0;
+	double recvCpuTime = 0.0;
+	double recvWallTime = 0.0;
+	// recorded by the recv loop, read by the telemetry server
+	telemetry::Histogram recvMicros, recvSamples;
+	telemetry::Counter recvCalls, recvSampleCount, recvOverflows, recvLate, recvTimeouts, recvErrors;
+};
+
+// per-channel write metrics, each recorded only by the writer thread that owns the channel
+struct ChannelMetrics {
+	telemetry::Histogram queueMicros;	// recv returning the block to the writer starting on it
+	telemetry::Histogram writeMicros;	// conversion or compression plus the write call
+	telemetry::Histogram syncMicros;	// waiting for writes still in flight
+	telemetry::Histogram liveMicros;	// copying the block into the live ring
+	telemetry::Histogram checksumMicros;// CRC32C of the bytes written
+	telemetry::Counter bytes;
+};
+
 
 int main (int argc, char* argv[]){
+	bringup::PhaseTimer bringUpTimer;
 	uhd::set_thread_priority_safe();
 	
-    // Network adapters need some configuration to work with x300. This script does all that. Proved to work for GNU Radio 100 times before.
-    std::cout << "Configuring network adapter settings" << std::endl;
-	// NB: This file should be used to set ALL variables
-    system("./usrp_x300_init.sh");
-
 	//variables to be set by po
-    std::string devAddresses, file, ref, pps, print_time;
-    size_t total_num_samps, numChannels;
-    double rate, freq, gainAll, gain0, gain1, gain2, gain3, gain4, gain5, gain6, gain7, bw, total_time, spb, setup_time, wait_for_lock;
+    std::string devAddresses, file, ref, pps, print_time, ioMode, simArgs, format, otw, cpu, store, triggerChannel, offloadPath, offloadMode, nics, recvCpus, spectrumPath, gainProfile, telemetryEndpoint, topologyFile, gainList, freqList, subBandList, livePath, preflightMode, volumeList;
+    int agentPort;
+    size_t total_num_samps, numChannels, numBlocks, numWriters, ioSize, ioDepth, chunkSamples, storeShift, triggerWindow, fftSize, spectrumAverages;
+    double rate, freq, gainAll, bw, total_time, spb, setup_time, wait_for_lock, triggerDb, preTrigger, postTrigger, floorTime, segmentTime, segmentSize, offloadRate, spectrumInterval, liveSeconds, preflightMargin, preflightAge, reserveGb, spillover, checksumMb;
 	uhd::rx_metadata_t md;
 	
     //setup the program options
@@ -38,28 +101,68 @@ int main (int argc, char* argv[]){
     desc.add_options()
         ("help", "help message")
         ("dev", po::value<std::string>(&devAddresses)->default_value("addr0=192.168.40.2"), "multi uhd device address args (dev=addr0=192.168.40.2, addr1=192.168.50.2)")
+        ("sim", po::value<std::string>(&simArgs), "use a simulated sample source instead of a device (mode=synth or mode=replay,file=<prefix>, see simStreamer.hpp)")
         ("file", po::value<std::string>(&file)->default_value("usrp_samples.bin"), "name of the file to write binary samples to")
         ("nsamps", po::value<size_t>(&total_num_samps), "total number of samples to receive")
-		("chan", po::value<size_t>(&numChannels)->default_value(1), "number of channels to record")
+		("chan", po::value<size_t>(&numChannels)->default_value(1), "number of channels to record, four per motherboard on A:0 A:1 B:0 B:1 unless --topology says otherwise")
+		("topology", po::value<std::string>(&topologyFile)->default_value(""), "file with the motherboard, frontend, antenna and optionally freq and gain of every channel (see topology.hpp)")
         ("duration", po::value<double>(&total_time)->default_value(0), "total number of seconds to receive")
         ("spb", po::value<double>(&spb)->default_value(1), "buffer multiplier")
+		("blocks", po::value<size_t>(&numBlocks)->default_value(256), "number of receive blocks buffered between recv and the writers")
+		("writers", po::value<size_t>(&numWriters)->default_value(1), "number of writer threads (0 writes on the recv thread)")
+		("perboard", "one rx streamer and recv thread per motherboard, each on its NIC's NUMA node")
+		("nics", po::value<std::string>(&nics)->default_value("ens5f0,ens5f1"), "network interface of each motherboard, for NUMA placement with --perboard")
+		("recvcpus", po::value<std::string>(&recvCpus)->default_value(""), "CPU of each motherboard's recv thread with --perboard, picked on the NIC's node when empty")
+		("format", po::value<std::string>(&format)->default_value("bin"), "output format (bin: one _chanN.bin per channel, container: all channels in one chunked .usrp file, compressed: losslessly compressed _chanN.sc16z per channel)")
+		("chunk", po::value<size_t>(&chunkSamples)->default_value(262144), "samples per channel per chunk in the container format")
+		("otw", po::value<std::string>(&otw)->default_value("sc16"), "over the wire format between device and host (sc16, sc8)")
+		("cpu", po::value<std::string>(&cpu)->default_value("sc16"), "host format recv delivers, the receive pipeline holds sc16 (sc16)")
+		("store", po::value<std::string>(&store)->default_value("sc16"), "format written to the _chanN.bin files (sc16, sc12, sc8, fc32)")
+		("storeshift", po::value<size_t>(&storeShift)->default_value(0), "bits to shift samples right before storing as sc12 or sc8")
+		("trigger", po::value<double>(&triggerDb)->default_value(0), "dB above the noise floor that starts an event, 0 records continuously")
+		("trigchan", po::value<std::string>(&triggerChannel)->default_value("sum"), "what the trigger watches (sum of all channels, any channel, or a channel number)")
+		("pre", po::value<double>(&preTrigger)->default_value(1.0), "seconds kept before the trigger")
+		("post", po::value<double>(&postTrigger)->default_value(2.0), "seconds written after the trigger")
+		("trigwindow", po::value<size_t>(&triggerWindow)->default_value(1024), "samples per power detector window")
+		("trigfloor", po::value<double>(&floorTime)->default_value(1.0), "seconds the noise floor is averaged over")
+		("segment", po::value<double>(&segmentTime)->default_value(0), "start new channel files every this many seconds, 0 for one file per channel")
+		("segmentsize", po::value<double>(&segmentSize)->default_value(0), "start new channel files every this many GB of samples (all channels), 0 for no limit")
+		("offload", po::value<std::string>(&offloadPath)->default_value(""), "directory finished files are offloaded to in the background (e.g. /mnt/fatty/Day2)")
+		("offloadrate", po::value<double>(&offloadRate)->default_value(0), "offload bandwidth limit in MB/s, 0 for no limit")
+		("offloadmode", po::value<std::string>(&offloadMode)->default_value("move"), "move (like backupToFatty.sh) or copy")
+		("spectrum", po::value<std::string>(&spectrumPath)->default_value(""), "publish a live spectrum of every channel to this file for usrpSpectrum (e.g. /dev/shm/usrpSpectrum)")
+		("fftsize", po::value<size_t>(&fftSize)->default_value(1024), "FFT size of the live spectrum, a power of two")
+		("specavg", po::value<size_t>(&spectrumAverages)->default_value(16), "FFTs averaged per live spectrum frame")
+		("specinterval", po::value<double>(&spectrumInterval)->default_value(0.5), "seconds between live spectrum frames")
+		("live", po::value<std::string>(&livePath)->default_value(""), "publish the samples of every channel to this shared ring for local subscribers such as usrpLive (e.g. /dev/shm/usrpLive)")
+		("liveseconds", po::value<double>(&liveSeconds)->default_value(0.5), "seconds of samples the live ring holds, a subscriber further behind loses blocks")
+		("subbands", po::value<std::string>(&subBandList)->default_value(""), "record only these sub-bands, mixed down and decimated on the host, as channel:centre_Hz:bandwidth_Hz,... (e.g. 0:223.936e6:1.536e6)")
+		("telemetry", po::value<std::string>(&telemetryEndpoint)->default_value(""), "serve run-time metrics on this Unix socket path or localhost TCP port (e.g. /tmp/usrpMultiRecord.sock or 9100)")
+		("io", po::value<std::string>(&ioMode)->default_value("buffered"), "file write mode (buffered, direct, uring)")
+		("iosize", po::value<size_t>(&ioSize)->default_value(4 << 20), "bytes per disk write for direct and uring, rounded up to 4096")
+		("iodepth", po::value<size_t>(&ioDepth)->default_value(8), "disk writes in flight per channel for uring")
+		("preflight", po::value<std::string>(&preflightMode)->default_value("refuse"), "check write bandwidth, free space and CPU headroom before arming and refuse a run short of --margin, only warn, or off")
+		("margin", po::value<double>(&preflightMargin)->default_value(1.2), "how many times what the run needs the disk, its free space and the CPU have to manage")
+		("preflightage", po::value<double>(&preflightAge)->default_value(24), "hours a write measurement of a mount is reused for, 0 to measure on every start")
+		("volumes", po::value<std::string>(&volumeList)->default_value(""), "comma separated directories the channel files are spread over by write bandwidth, in place of the directory of --file (e.g. /mnt/speedy/Day2,/mnt/fatty/Day2)")
+		("reserve", po::value<double>(&reserveGb)->default_value(5), "GB left free on every volume, new files go elsewhere once a volume gets there")
+		("spillover", po::value<double>(&spillover)->default_value(0.5), "new files avoid a volume whose blocks took longer than this share of the time the writers have per block during the last segment")
+		("checksum", po::value<double>(&checksumMb)->default_value(16), "MB per CRC32C chunk of the channel files, listed in <file>_manifest.txt for usrpVerify, 0 for none")
         ("rate", po::value<double>(&rate)->default_value(0.0), "rate of incoming samples")
         ("freq", po::value<double>(&freq)->default_value(0.0), "RF center frequency in Hz")
 		("wait", po::value<double>(&wait_for_lock)->default_value(120), "wait time for gps lock")
         ("gainAll", po::value<double>(&gainAll)->default_value(0.0), "gain for the entire RF chain")
-		("gain0", po::value<double>(&gain0), "gain for ch0")
-		("gain1", po::value<double>(&gain1), "gain for ch1")
-		("gain2", po::value<double>(&gain2), "gain for ch2")
-		("gain3", po::value<double>(&gain3), "gain for ch3")
-		("gain4", po::value<double>(&gain4), "gain for ch4")
-		("gain5", po::value<double>(&gain5), "gain for ch5")
-		("gain6", po::value<double>(&gain6), "gain for ch6")
-		("gain7", po::value<double>(&gain7), "gain for ch7")
+		("gains", po::value<std::string>(&gainList)->default_value(""), "comma separated gain of each channel in dB, an empty entry keeps the channel's gain (e.g. 60,,58)")
+		("freqs", po::value<std::string>(&freqList)->default_value(""), "comma separated centre frequency of each channel in Hz, an empty entry keeps --freq")
+		("gainprofile", po::value<std::string>(&gainProfile)->default_value(""), "per-channel gains written by usrpTune --chan, --gains still overrides a channel")
         ("bw", po::value<double>(&bw)->default_value(0.0), "analog frontend filter bandwidth in Hz")
         ("pps", po::value<std::string>(&pps)->default_value("internal"), "pps source (gpsdo, internal, external)")
 		("ref", po::value<std::string>(&ref)->default_value("internal"), "reference source (gpsdo, internal, external)")
 		("print", po::value<std::string>(&print_time)->default_value("N"), "y/N")
         ("setup", po::value<double>(&setup_time)->default_value(1.0), "seconds of setup time")
+		("fast", "fast start: GPS lock on all boards at once, one PPS edge for all, channel settings as timed commands, no readbacks")
+		("netinit", "run usrp_x300_init.sh even when the network is already set up")
+		("agent", po::value<int>(&agentPort)->default_value(0), "record as an agent of usrpCoordinator: listen on this TCP port, start at the time and with the session ID it sends, report progress to it")
     ;
     po::variables_map vm;
     po::store(po::parse_command_line(argc, argv, desc), vm);
@@ -72,286 +175,1077 @@ int main (int argc, char* argv[]){
         return ~0;
     }
 	
-	if (devAddresses.length() > 20 and numChannels < 5) {
-		std::cout << "\nYou have specified two USRPs but using less than 4 channels please select a single USRP\n" << std::endl;
+	// which port every channel records from, with its frequency and gain: --gainAll and --freq, then the
+	// topology file, then a calibrated gain profile, then --gains and --freqs, each overriding the one before
+	Topology topology;
+	try {
+		if (topologyFile.empty()) {
+			topology = Topology::standard(numChannels, freq, gainAll);
+		} else {
+			topology = Topology::load(topologyFile, freq, gainAll);
+			if (not vm["chan"].defaulted() and numChannels != topology.size()) {
+				std::cerr << boost::format("--chan=%i but %s has %i channels") % numChannels % topologyFile % topology.size() << std::endl;
+				return ~0;
+			}
+			numChannels = topology.size();
+		}
+		topology.check();
+		if (not gainProfile.empty()) {
+			for (const auto& entry : loadGainProfile(gainProfile)) {
+				if (entry.first < topology.size()) {
+					topology[entry.first].gain = entry.second;
+				}
+			}
+		}
+		topology.setGains(gainList);
+		topology.setFreqs(freqList);
+	} catch (const std::exception& e) {
+		std::cerr << e.what() << std::endl;
 		return ~0;
 	}
 	
-    // construct a multi usrp from the device adresses
-    std::cout << "\nConstructing the multi USRP object" << std::endl;
-    uhd::usrp::multi_usrp::sptr usrp = uhd::usrp::multi_usrp::make (devAddresses);
-	
-	// setup the sub device and antenna ports to be used with each channel
-	// subdev_spec_t((daughterboard, daughterboard channel),URSP Number))
-	// set_rx_antenna(port, system channel)
-	if (numChannels == 1) {
-		usrp->set_rx_subdev_spec(uhd::usrp::subdev_spec_t("A:0"), 0);
-		usrp->set_rx_antenna ("RX1",0);	
-	} else if (numChannels == 2) {
-		usrp->set_rx_subdev_spec(uhd::usrp::subdev_spec_t("A:0 A:1"), 0);
-		usrp->set_rx_antenna ("RX1",0);
-		usrp->set_rx_antenna ("RX2",1);	
-	} else if (numChannels == 3) {
-		usrp->set_rx_subdev_spec(uhd::usrp::subdev_spec_t("A:0 A:1 B:0"), 0);
-		usrp->set_rx_antenna ("RX1",0);
-		usrp->set_rx_antenna ("RX2",1);
-		usrp->set_rx_antenna ("RX1",2);
-	} else if (numChannels == 4) {
-		usrp->set_rx_subdev_spec(uhd::usrp::subdev_spec_t("A:0 A:1 B:0 B:1"), 0);
-		usrp->set_rx_antenna ("RX1",0);
-		usrp->set_rx_antenna ("RX2",1);
-		usrp->set_rx_antenna ("RX1",2);
-		usrp->set_rx_antenna ("RX2",3);
-	} else if (numChannels == 5) {
-		usrp->set_rx_subdev_spec(uhd::usrp::subdev_spec_t("A:0 A:1 B:0 B:1"), 0);
-		usrp->set_rx_subdev_spec(uhd::usrp::subdev_spec_t("A:0"), 1);
-		usrp->set_rx_antenna ("RX1",0);
-		usrp->set_rx_antenna ("RX2",1);
-		usrp->set_rx_antenna ("RX1",2);
-		usrp->set_rx_antenna ("RX2",3);
-		usrp->set_rx_antenna ("RX1",4);
-	} else if (numChannels == 6) {
-		usrp->set_rx_subdev_spec(uhd::usrp::subdev_spec_t("A:0 A:1 B:0 B:1"), 0);
-		usrp->set_rx_subdev_spec(uhd::usrp::subdev_spec_t("A:0 A:1"), 1);
-		usrp->set_rx_antenna ("RX1",0);
-		usrp->set_rx_antenna ("RX2",1);
-		usrp->set_rx_antenna ("RX1",2);
-		usrp->set_rx_antenna ("RX2",3);	
-		usrp->set_rx_antenna ("RX1",4);
-		usrp->set_rx_antenna ("RX2",5);
-	} else if (numChannels == 7) {
-		usrp->set_rx_subdev_spec(uhd::usrp::subdev_spec_t("A:0 A:1 B:0 B:1"), 0);
-		usrp->set_rx_subdev_spec(uhd::usrp::subdev_spec_t("A:0 A:1 B:0"), 1);
-		usrp->set_rx_antenna ("RX1",0);
-		usrp->set_rx_antenna ("RX2",1);
-		usrp->set_rx_antenna ("RX1",2);
-		usrp->set_rx_antenna ("RX2",3);
-		usrp->set_rx_antenna ("RX1",4);
-		usrp->set_rx_antenna ("RX2",5);
-		usrp->set_rx_antenna ("RX1",6);
-	} else if (numChannels == 8) {
-		usrp->set_rx_subdev_spec(uhd::usrp::subdev_spec_t("A:0 A:1 B:0 B:1"), 0);
-		usrp->set_rx_subdev_spec(uhd::usrp::subdev_spec_t("A:0 A:1 B:0 B:1"), 1);
-		usrp->set_rx_antenna ("RX1",0);
-		usrp->set_rx_antenna ("RX2",1);
-		usrp->set_rx_antenna ("RX1",2);
-		usrp->set_rx_antenna ("RX2",3);
-		usrp->set_rx_antenna ("RX1",4);
-		usrp->set_rx_antenna ("RX2",5);
-		usrp->set_rx_antenna ("RX1",6);
-		usrp->set_rx_antenna ("RX2",7);
-	} else {
-		std::cout << "\nPlease select a valid number of channels\n" << std::endl;
+	// conversions to the storage format run on the writer threads, recv always hands over sc16
+	StoreFormat storeFormat;
+	try {
+		storeFormat = parseStoreFormat(store);
+		SampleConverter check (storeFormat, storeShift);
+	} catch (const std::exception& e) {
+		std::cerr << e.what() << std::endl;
 		return ~0;
 	}
-
-	double mcr0 = usrp->get_master_clock_rate(0);
-	std::cout << "\nMaster clock for USRP 1: " << mcr0 << std::endl;
-	if (numChannels > 4) {
-		double mcr1 = usrp->get_master_clock_rate(1);
-		std::cout << "Master clock for USRP 2: " << mcr1 << std::endl << std::endl;
+	if (cpu != "sc16") {
+		std::cerr << "Only --cpu=sc16 is supported, use --store=fc32 to record floats" << std::endl;
+		return ~0;
+	}
+	if (otw != "sc16" and otw != "sc8") {
+		std::cerr << "Please select a valid wire format (sc16, sc8)" << std::endl;
+		return ~0;
+	}
+	if (triggerDb > 0 and (storeFormat != STORE_SC16 or format != "bin")) {
+		std::cerr << "Triggered capture writes sc16 event files, --format and --store do not apply" << std::endl;
+		return ~0;
+	}
+	const bool perBoard = vm.count("perboard");
+	if (perBoard and triggerDb > 0) {
+		std::cerr << "Triggered capture needs every channel in one stream, drop --perboard" << std::endl;
+		return ~0;
+	}
+	if ((segmentTime > 0 or segmentSize > 0) and (triggerDb > 0 or format == "container")) {
+		std::cerr << "Segments need --format=bin or compressed" << std::endl;
+		return ~0;
+	}
+	if (not subBandList.empty() and (triggerDb > 0 or format != "bin" or storeFormat != STORE_SC16 or segmentTime > 0 or segmentSize > 0)) {
+		std::cerr << "Sub-bands are written as sc16 _chanN_subK.bin files, --trigger, --format, --store and segments do not apply" << std::endl;
+		return ~0;
+	}
+	std::vector<std::string> volumeDirs;
+	std::stringstream volumeStream (volumeList);
+	std::string volumeDir;
+	while (std::getline(volumeStream, volumeDir, ',')) {
+		if (not volumeDir.empty()) {
+			volumeDirs.push_back(volumeDir);
+		}
+	}
+	if (not volumeDirs.empty() and (triggerDb > 0 or (format != "bin" and format != "compressed") or not subBandList.empty())) {
+		std::cerr << "Volumes take the _chanN files of --format=bin or compressed, --trigger, the container and sub-bands do not apply" << std::endl;
+		return ~0;
+	}
+	if (preflightMode != "refuse" and preflightMode != "warn" and preflightMode != "off") {
+		std::cerr << "Please select a valid preflight mode (refuse, warn, off)" << std::endl;
+		return ~0;
+	}
+	if (offloadMode != "move" and offloadMode != "copy") {
+		std::cerr << "Please select a valid offload mode (move, copy)" << std::endl;
+		return ~0;
+	}
+	if (storeFormat != STORE_SC16 and format != "bin") {
+		std::cerr << "--store=" << store << " needs --format=bin" << std::endl;
+		return ~0;
+	}
+	// the checksums cover the _chanN files, runs without them go without unless --checksum was asked for
+	if (triggerDb > 0 or (format != "bin" and format != "compressed") or not subBandList.empty()) {
+		if (not vm["checksum"].defaulted() and checksumMb > 0) {
+			std::cerr << "Checksums cover the _chanN files of --format=bin or compressed, --trigger, the container and sub-bands do not apply" << std::endl;
+			return ~0;
+		}
+		checksumMb = 0;
 	}
 	
-	// clocking and syncing
-	if(ref == "gpsdo" or pps == "gpsdo") {
-		size_t num_mboards    = usrp->get_num_mboards();
-		size_t num_gps_locked = 0;
-		for (size_t mboard = 0; mboard < num_mboards; mboard++) {
-			std::cout << "Synchronizing mboard " << mboard << ": " << usrp->get_mboard_name(mboard) << std::endl;			
-			// Wait for GPS lock
-			uhd::sensor_value_t gps_locked = usrp->get_mboard_sensor("gps_locked", mboard);
-			// Wait 2 minutes for the clock to settle
-			std::cout << "\nWaiting for GPS lock\n" << std::flush;
-			for (int i = 0; i < wait_for_lock and not gps_locked.to_bool(); i++) {
-				gps_locked = usrp->get_mboard_sensor("gps_locked", mboard);
-				if (gps_locked.to_bool()) {
-					num_gps_locked++;
-				} else {
-					std::cout << i+1 << "/" << wait_for_lock << "\r" << std::flush;
-					std::this_thread::sleep_for(std::chrono::seconds(1));
+	const bool fastStart = vm.count("fast");
+	// listening before the devices come up lets the coordinator connect to every host as soon as it likes
+	std::unique_ptr<coord::Agent> agent;
+	if (agentPort > 0) {
+		try {
+			agent.reset(new coord::Agent (agentPort));
+		} catch (const std::exception& e) {
+			std::cerr << e.what() << std::endl;
+			return ~0;
+		}
+		// simulated agents on one host share its clock the way agents with GPSDOs share GPS time
+		if (not simArgs.empty() and simArgs.find("clock=") == std::string::npos) {
+			simArgs += ",clock=host";
+		}
+	}
+	// the boards' NICs in order, for the network check and the NUMA placement
+	std::vector<std::string> interfaces;
+	std::stringstream nicList (nics);
+	std::string nic;
+	while (std::getline(nicList, nic, ',')) {
+		interfaces.push_back(nic);
+	}
+	
+	uhd::usrp::multi_usrp::sptr usrp;
+	std::deque<BoardStream> boards;
+	if (not simArgs.empty()) {
+		// hardware-free run, the simulated source stands in for the device's rx streamer
+		if (rate <= 0.0){
+			std::cerr << "Please specify a valid sample rate" << std::endl;
+			return ~0;
+		}
+		if (bw <= 0.0) {
+			bw = rate;
+		}
+		std::cout << "\nUsing simulated sample source: " << simArgs << std::endl;
+		try {
+			// a simulated motherboard per motherboard of the topology, all in one stream without --perboard
+			const size_t numSources = perBoard ? topology.numMboards() : 1;
+			for (size_t mboard = 0; mboard < numSources; mboard++) {
+				boards.emplace_back();
+				boards.back().mboard = mboard;
+				boards.back().firstChannel = perBoard ? topology.firstChannelOn(mboard) : 0;
+				boards.back().rxStream = makeSimStreamer(simArgs, perBoard ? topology.channelsOn(mboard) : topology.size(), rate, boards.back().firstChannel);
+			}
+			bringUpTimer.mark("source");
+		} catch (const std::exception& e) {
+			std::cerr << e.what() << std::endl;
+			return ~0;
+		}
+	} else {
+	    // Network adapters need some configuration to work with x300. This script does all that. Proved to work for GNU Radio 100 times before.
+		// Its sudo calls take seconds, so it only runs when something it sets is missing
+		std::vector<std::string> networkProblems = bringup::networkProblems(interfaces);
+		if (networkProblems.empty() and not vm.count("netinit")) {
+			std::cout << "Network adapters already configured" << std::endl;
+		} else {
+		    std::cout << "Configuring network adapter settings" << std::endl;
+			for (const std::string& problem : networkProblems) {
+				std::cout << "  " << problem << std::endl;
+			}
+			// NB: This file should be used to set ALL variables
+		    system("./usrp_x300_init.sh");
+		}
+		bringUpTimer.mark("network");
+
+	    // construct a multi usrp from the device adresses
+	    std::cout << "\nConstructing the multi USRP object" << std::endl;
+	    usrp = uhd::usrp::multi_usrp::make (devAddresses);
+		bringUpTimer.mark("device");
+	
+		// every motherboard gets the frontends of its channels in channel order, then each channel its antenna port
+		try {
+			if (topology.numMboards() != usrp->get_num_mboards()) {
+				throw std::runtime_error((boost::format("the topology has %i motherboards but --dev has %i") % topology.numMboards() % usrp->get_num_mboards()).str());
+			}
+			for (size_t mboard = 0; mboard < topology.numMboards(); mboard++) {
+				usrp->set_rx_subdev_spec(uhd::usrp::subdev_spec_t(topology.subdevSpec(mboard)), mboard);
+			}
+			for (size_t i = 0; i < topology.size(); i++) {
+				usrp->set_rx_antenna (topology[i].antenna, i);
+			}
+		} catch (const std::exception& e) {
+			std::cerr << e.what() << std::endl;
+			return ~0;
+		}
+
+		std::cout << std::endl;
+		for (size_t mboard = 0; mboard < usrp->get_num_mboards(); mboard++) {
+			std::cout << boost::format("Master clock for USRP %i: %f") % (mboard + 1) % usrp->get_master_clock_rate(mboard) << std::endl;
+		}
+		std::cout << std::endl;
+	
+		// clocking and syncing
+		// the device time set on the PPS edge after the one just seen: 0 for a recording of its own, absolute seconds for
+		// an agent so the coordinator's start time means the same moment on every host, GPS seconds with a GPSDO and
+		// otherwise the host's UTC second, which NTP keeps well inside a second on hosts sharing an external PPS
+		auto nextPpsTime = [&](size_t mboard) {
+			if (not agent) {
+				return uhd::time_spec_t(0.0);
+			} else if (ref == "gpsdo" or pps == "gpsdo") {
+				return uhd::time_spec_t(double(usrp->get_mboard_sensor("gps_time", mboard).to_int() + 1));
+			}
+			return uhd::time_spec_t(double(std::time(nullptr) + 1));
+		};
+		if (fastStart) {
+			// every board waits for lock at the same time, then all of them take their time from the same PPS edge
+			if (ref == "gpsdo" or pps == "gpsdo") {
+				std::cout << "\nWaiting for GPS lock on all motherboards\n" << std::flush;
+				std::vector<bool> locked = bringup::waitForGpsLock(usrp, wait_for_lock);
+				for (size_t mboard = 0; mboard < locked.size(); mboard++) {
+					if (not locked[mboard] or not usrp->get_mboard_sensor("ref_locked", mboard).to_bool()) {
+						std::cout << "\nNO GPS LOCK on mboard: " << mboard << std::endl << std::endl;
+						return ~0;
+					}
 				}
 			}
+			usrp->set_clock_source(ref);
+			usrp->set_time_source(pps);
+			if (agent) {
+				// the seconds of the next edge have to be known, so wait for one and set every board on the edge after it
+				const uhd::time_spec_t last_pps_time = usrp->get_time_last_pps();
+				while (last_pps_time == usrp->get_time_last_pps()) {
+					std::this_thread::sleep_for (std::chrono::milliseconds(10));
+				}
+				usrp->set_time_next_pps(nextPpsTime(0));
+				const uhd::time_spec_t setAt = usrp->get_time_last_pps();
+				while (setAt == usrp->get_time_last_pps()) {
+					std::this_thread::sleep_for (std::chrono::milliseconds(10));
+				}
+			} else {
+				// returns once the time is set on every board, so there is nothing left to wait for
+				usrp->set_time_unknown_pps(uhd::time_spec_t(0.0));
+			}
+		} else if(ref == "gpsdo" or pps == "gpsdo") {
+			size_t num_mboards    = usrp->get_num_mboards();
+			size_t num_gps_locked = 0;
+			for (size_t mboard = 0; mboard < num_mboards; mboard++) {
+				std::cout << "Synchronizing mboard " << mboard << ": " << usrp->get_mboard_name(mboard) << std::endl;			
+				// Wait for GPS lock
+				uhd::sensor_value_t gps_locked = usrp->get_mboard_sensor("gps_locked", mboard);
+				// Wait 2 minutes for the clock to settle
+				std::cout << "\nWaiting for GPS lock\n" << std::flush;
+				for (int i = 0; i < wait_for_lock and not gps_locked.to_bool(); i++) {
+					gps_locked = usrp->get_mboard_sensor("gps_locked", mboard);
+					if (gps_locked.to_bool()) {
+						num_gps_locked++;
+					} else {
+						std::cout << i+1 << "/" << wait_for_lock << "\r" << std::flush;
+						std::this_thread::sleep_for(std::chrono::seconds(1));
+					}
+				}
 			
-			// check for gps and reference clock lock
-			gps_locked = usrp->get_mboard_sensor("gps_locked", mboard);
-			uhd::sensor_value_t ref_locked = usrp->get_mboard_sensor("ref_locked", mboard);
+				// check for gps and reference clock lock
+				gps_locked = usrp->get_mboard_sensor("gps_locked", mboard);
+				uhd::sensor_value_t ref_locked = usrp->get_mboard_sensor("ref_locked", mboard);
 			
-			if (gps_locked.to_bool() and ref_locked.to_bool()) {
-				// Set to GPS time
-				std::cout << "\nGPS LOCKED on mboard: " << mboard << std::endl << std::endl;
-				usrp->set_time_source(pps, mboard);
-				usrp->set_clock_source(ref, mboard);
+				if (gps_locked.to_bool() and ref_locked.to_bool()) {
+					// Set to GPS time
+					std::cout << "\nGPS LOCKED on mboard: " << mboard << std::endl << std::endl;
+					usrp->set_time_source(pps, mboard);
+					usrp->set_clock_source(ref, mboard);
+				
+					const uhd::time_spec_t last_pps_time = usrp->get_time_last_pps();
+					while (last_pps_time == usrp->get_time_last_pps()){
+						//sleep 100 milliseconds (give or take)
+						std::this_thread::sleep_for (std::chrono::milliseconds(50));
+					}
+					// Sync the GPS and USRP clocks
+					// TODO: I am not sure if we need to actually set this manually or whether the driver handles this for you??
+					// As I understand it from the documentation, its automatic: https://files.ettus.com/manual/page_sync.html
 				
+					// TODO: THIS DOES NOT WORK PROPERLY
+					// uhd::time_spec_t gps_time = uhd::time_spec_t(int64_t(usrp->get_mboard_sensor("gps_time", mboard).to_int()));
+					// usrp->set_time_next_pps(gps_time + 1, mboard);
+					// usrp->set_time_next_pps(uhd::time_spec_t(usrp->get_mboard_sensor("gps_time").to_int()+1.0), mboard);
+				
+					const uhd::time_spec_t ppsTime = nextPpsTime(mboard);
+					usrp->set_time_next_pps(ppsTime, mboard);
+				
+					// TODO: This resyncs the two boards but this needs to be improved
+					if (mboard == 1) {
+						usrp->set_time_next_pps(ppsTime, 0);
+						usrp->set_time_next_pps(ppsTime, 1);
+					}
+
+				} else {
+					// Set to unsynced time.
+					std::cout << "\nNO GPS LOCK\n" << std::endl;
+					return ~0;
+				}
+			}	
+		} else {
+			size_t num_mboards = usrp->get_num_mboards();
+			for (size_t mboard = 0; mboard < num_mboards; mboard++) {
+				std::cout << "Setting device timestamp" << std::endl;
+				std::cout << "Synchronizing mboard " << mboard << ": " << usrp->get_mboard_name(mboard) << std::endl;
+				usrp->set_clock_source(ref, mboard);
+				usrp->set_time_source(pps, mboard);
+				// set_sync_source(device_addr_t("clock_source=$CLOCK_SOURCE,time_source=$TIME_SOURCE"))
 				const uhd::time_spec_t last_pps_time = usrp->get_time_last_pps();
 				while (last_pps_time == usrp->get_time_last_pps()){
 					//sleep 100 milliseconds (give or take)
 					std::this_thread::sleep_for (std::chrono::milliseconds(50));
 				}
-				// Sync the GPS and USRP clocks
-				// TODO: I am not sure if we need to actually set this manually or whether the driver handles this for you??
-				// As I understand it from the documentation, its automatic: https://files.ettus.com/manual/page_sync.html
-				
-				// TODO: THIS DOES NOT WORK PROPERLY
-				// uhd::time_spec_t gps_time = uhd::time_spec_t(int64_t(usrp->get_mboard_sensor("gps_time", mboard).to_int()));
-				// usrp->set_time_next_pps(gps_time + 1, mboard);
-				// usrp->set_time_next_pps(uhd::time_spec_t(usrp->get_mboard_sensor("gps_time").to_int()+1.0), mboard);
-				
-				usrp->set_time_next_pps(uhd::time_spec_t(0.0), mboard);
-				
+				// This command will be processed fairly soon after the last PPS edge:
+				const uhd::time_spec_t ppsTime = nextPpsTime(mboard);
+				usrp->set_time_next_pps(ppsTime, mboard);
 				// TODO: This resyncs the two boards but this needs to be improved
 				if (mboard == 1) {
-					usrp->set_time_next_pps(uhd::time_spec_t(0.0), 0);
-					usrp->set_time_next_pps(uhd::time_spec_t(0.0), 1);
+					usrp->set_time_next_pps(ppsTime, 0);
+					usrp->set_time_next_pps(ppsTime, 1);
 				}
-
-			} else {
-				// Set to unsynced time.
-				std::cout << "\nNO GPS LOCK\n" << std::endl;
-				return ~0;
-			}
-		}	
-	} else {
-		size_t num_mboards = usrp->get_num_mboards();
-		for (size_t mboard = 0; mboard < num_mboards; mboard++) {
-			std::cout << "Setting device timestamp" << std::endl;
-			std::cout << "Synchronizing mboard " << mboard << ": " << usrp->get_mboard_name(mboard) << std::endl;
-			usrp->set_clock_source(ref, mboard);
-			usrp->set_time_source(pps, mboard);
-			// set_sync_source(device_addr_t("clock_source=$CLOCK_SOURCE,time_source=$TIME_SOURCE"))
-			const uhd::time_spec_t last_pps_time = usrp->get_time_last_pps();
-			while (last_pps_time == usrp->get_time_last_pps()){
-				//sleep 100 milliseconds (give or take)
-				std::this_thread::sleep_for (std::chrono::milliseconds(50));
-			}
-			// This command will be processed fairly soon after the last PPS edge:
-			usrp->set_time_next_pps(uhd::time_spec_t(0.0), mboard);
-			// TODO: This resyncs the two boards but this needs to be improved
-			if (mboard == 1) {
-				usrp->set_time_next_pps(uhd::time_spec_t(0.0), 0);
-				usrp->set_time_next_pps(uhd::time_spec_t(0.0), 1);
 			}
 		}
-	}
 	
-	// Once set, we need to wait for the settings to propagate through the system
-	std::this_thread::sleep_for (std::chrono::seconds(1));
+		// Once set, we need to wait for the settings to propagate through the system
+		if (not fastStart) {
+			std::this_thread::sleep_for (std::chrono::seconds(1));
+		}
+		bringUpTimer.mark("clocks");
 	
-	//set the center frequency
-    std::cout << boost::format("\nSetting RX Freq: %f MHz...") % (freq/1e6) << std::endl << std::endl;
-    uhd::tune_request_t tune_request(freq);
-    if(vm.count("int-n")) {
-		tune_request.args = uhd::device_addr_t("mode_n=integer");
-	}
-	// We need to address and setup each channel
-	for (unsigned int i = 0; i < numChannels; i++) {
-		usrp->set_rx_freq(tune_request,i);
-		std::cout << boost::format("Actual Ch %i RX Freq: %f MHz...") % i % (usrp->get_rx_freq(i)/1e6) << std::endl;
-	} std::cout << std::endl;
+	    // the same rate and bandwidth for every channel, the frequency and gain of each from the topology
+	    if (rate <= 0.0){
+	        std::cerr << "Please specify a valid sample rate" << std::endl;
+	        return ~0;
+	    }
+		// by default the IF filter bandwidth is set to the sampling rate
+		if (bw <= 0.0) {
+			bw = rate;
+		}
+	    auto tuneRequest = [&](size_t channel) {
+			uhd::tune_request_t tune_request(topology[channel].freq);
+			if(vm.count("int-n")) {
+				tune_request.args = uhd::device_addr_t("mode_n=integer");
+			}
+			return tune_request;
+		};
+		if (fastStart) {
+			// the rate in one call for every channel, the tune and the gains as timed commands so every channel
+			// switches at the same moment; the settings are read back once, for the metadata
+			std::cout << boost::format("\nSetting RX Rate: %f Msps, Bandwidth: %f MHz on %i channels") % (rate/1e6) % (bw/1e6) % numChannels << std::endl;
+			for (unsigned int i = 0; i < numChannels; i++) {
+				std::cout << boost::format("Ch %i RX Freq: %f MHz, Gain: %f dB") % i % (topology[i].freq/1e6) % topology[i].gain << std::endl;
+			}
+			usrp->set_rx_rate(rate);
+			for (unsigned int i = 0; i < numChannels; i++) {
+				usrp->set_rx_bandwidth(bw,i);
+			}
+			const uhd::time_spec_t commandTime = usrp->get_time_now() + uhd::time_spec_t(bringup::COMMAND_LEAD);
+			usrp->set_command_time(commandTime);
+			for (unsigned int i = 0; i < numChannels; i++) {
+				usrp->set_rx_freq(tuneRequest(i),i);
+				usrp->set_rx_gain (topology[i].gain,i);
+			}
+			usrp->clear_command_time();
+			// the streams can be set up once the commands have run
+			while (usrp->get_time_now() < commandTime) {
+				std::this_thread::sleep_for (std::chrono::milliseconds(5));
+			}
+		} else {
+			//set the center frequency
+		    std::cout << "\nSetting RX Freq..." << std::endl << std::endl;
+			// We need to address and setup each channel
+			for (unsigned int i = 0; i < numChannels; i++) {
+				std::cout << boost::format("Setting Ch %i RX Freq: %f MHz...") % i % (topology[i].freq/1e6) << std::endl;
+				usrp->set_rx_freq(tuneRequest(i),i);
+				std::cout << boost::format("Actual Ch %i RX Freq: %f MHz...") % i % (usrp->get_rx_freq(i)/1e6) << std::endl;
+			} std::cout << std::endl;
 
-    //set the sample rate
-    if (rate <= 0.0){
-        std::cerr << "Please specify a valid sample rate" << std::endl;
-        return ~0;
-    }
-    std::cout << boost::format("Setting RX Rate: %f Msps...") % (rate/1e6) << std::endl << std::endl;
-	// We need to address and setup each channel
-	for (unsigned int i = 0; i < numChannels; i++) {
-		usrp->set_rx_rate(rate,i);
-		std::cout << boost::format("Actual Ch %i RX Rate: %f Msps...") % i % (usrp->get_rx_rate(i)/1e6) << std::endl;
-	} std::cout << std::endl;
+		    //set the sample rate
+		    std::cout << boost::format("Setting RX Rate: %f Msps...") % (rate/1e6) << std::endl << std::endl;
+			// We need to address and setup each channel
+			for (unsigned int i = 0; i < numChannels; i++) {
+				usrp->set_rx_rate(rate,i);
+				std::cout << boost::format("Actual Ch %i RX Rate: %f Msps...") % i % (usrp->get_rx_rate(i)/1e6) << std::endl;
+			} std::cout << std::endl;
 	
-	//set the IF filter bandwidth, by default it is set to the sampling rate
-	if (bw <= 0.0) {
-		bw = rate;
-	}
-	std::cout << boost::format("Setting RX Bandwidth: %f MHz...") % (bw/1e6) << std::endl << std::endl;
-	for (unsigned int i = 0; i < numChannels; i++) {
-		usrp->set_rx_bandwidth(bw,i);
-		std::cout << boost::format("Actual Ch %i RX Bandwidth: %f MHz...") % i % (usrp->get_rx_bandwidth(i)/1e6) << std::endl;
-	} std::cout << std::endl;
+			//set the IF filter bandwidth, by default it is set to the sampling rate
+			std::cout << boost::format("Setting RX Bandwidth: %f MHz...") % (bw/1e6) << std::endl << std::endl;
+			for (unsigned int i = 0; i < numChannels; i++) {
+				usrp->set_rx_bandwidth(bw,i);
+				std::cout << boost::format("Actual Ch %i RX Bandwidth: %f MHz...") % i % (usrp->get_rx_bandwidth(i)/1e6) << std::endl;
+			} std::cout << std::endl;
 		
-    //set the rf gain for each channel
-	if(vm.count("gain0") == false) {
-		gain0 = gainAll;
+			for (unsigned int i = 0; i < numChannels; i++) {
+				std::cout << boost::format("Setting Ch %i RX Gain: %f dB...") % i % topology[i].gain << std::endl << std::endl;
+				usrp->set_rx_gain (topology[i].gain,i);
+				std::cout << boost::format("Actual RX Gain: %f dB...") % usrp->get_rx_gain(i) << std::endl;
+			} std::cout << std::endl;
+
+		   // give the device a little bit of time to configure
+		    std::this_thread::sleep_for (std::chrono::milliseconds(100));
+		}
+		bringUpTimer.mark("channels");
+    
+	    // this will map the subdevice inputs to the input channels and create the input stream, one per motherboard with --perboard
+	    const size_t numStreams = perBoard ? usrp->get_num_mboards() : 1;
+	    for (size_t mboard = 0, first = 0; mboard < numStreams; mboard++) {
+			const size_t count = perBoard ? topology.channelsOn(mboard) : numChannels;
+			uhd::stream_args_t rxStreamArgs (cpu, otw);
+			for (size_t i = first; i < first + count; i++) {
+				rxStreamArgs.channels.push_back(i);
+			}
+			boards.emplace_back();
+			boards.back().mboard = mboard;
+			boards.back().firstChannel = first;
+			boards.back().rxStream = usrp->get_rx_stream (rxStreamArgs);
+			first += count;
+		}
+		bringUpTimer.mark("streams");
 	}
-	if(vm.count("gain1") == false) {
-		gain1 = gainAll;
+	
+    // print some general information
+    unsigned int numRxChannels = 0;
+    for (auto& board : boards) {
+		board.numChannels = board.rxStream->get_num_channels();
+		numRxChannels += board.numChannels;
 	}
-	if(vm.count("gain2") == false) {
-		gain2 = gainAll;
+    if (boards.size() > 1) {
+		std::cout << boost::format("Set up %i RX streams, one per motherboard. Num input channels: %i") % boards.size() % numRxChannels << std::endl;
+	} else {
+		std::cout << "Set up RX stream. Num input channels: " << numRxChannels << std::endl;
 	}
-	if(vm.count("gain3") == false) {
-		gain3 = gainAll;
+    if (usrp) {
+		std::cout << usrp->get_pp_string();
 	}
-	if(vm.count("gain4") == false) {
-		gain4 = gainAll;
+    
+    // with a stream per board, each recv thread gets a core of its own on the node its NIC is attached to
+    std::vector<int> recvCores;
+    if (perBoard) {
+		std::vector<int> requestedCpus = numa::parseCpuList(recvCpus);
+		for (auto& board : boards) {
+			board.numaNode = board.mboard < interfaces.size() ? numa::interfaceNode(interfaces[board.mboard]) : -1;
+			if (board.mboard < requestedCpus.size()) {
+				board.cpu = requestedCpus[board.mboard];
+			} else {
+				// the highest free core of the node, the low ones tend to get the interrupts and housekeeping
+				std::vector<int> cpus = numa::nodeCpus(board.numaNode);
+				board.cpu = cpus.back();
+				for (auto cpu = cpus.rbegin(); cpu != cpus.rend(); ++cpu) {
+					if (std::find(recvCores.begin(), recvCores.end(), *cpu) == recvCores.end()) {
+						board.cpu = *cpu;
+						break;
+					}
+				}
+			}
+			recvCores.push_back(board.cpu);
+		}
 	}
-	if(vm.count("gain5") == false) {
-		gain5 = gainAll;
+    
+    // allocate buffers to receive with samples (one buffer per channel)
+    // whole pages per block so every full block can go to disk without being copied
+    const size_t pageSamples = ChannelWriter::ALIGNMENT / sizeof(std::complex<short>);
+    const int samplesPerBuffer = (size_t(boards[0].rxStream->get_max_num_samps()*spb) + pageSamples - 1) / pageSamples * pageSamples;
+    
+	// set the total number of samples to receive
+	double totalSamplesToReceive = rate * total_time;
+	if (vm.count("nsamps")) {
+		totalSamplesToReceive = total_num_samps;
 	}
-	if(vm.count("gain6") == false) {
-		gain6 = gainAll;
+    
+    // open and preallocate every channel file once, each one is only ever written by the writer thread that owns the channel
+    std::vector<std::unique_ptr<ChannelWriter>> outfiles;
+    std::unique_ptr<ContainerWriter> container;
+    std::vector<std::unique_ptr<ChannelCompressor>> compressors;
+    std::vector<std::unique_ptr<SampleConverter>> converters;
+    std::vector<std::vector<char>> convertBuffers;
+    std::vector<size_t> clipped (numRxChannels, 0);
+    std::deque<ChannelMetrics> channelMetrics (numRxChannels);
+    const size_t storeBytes = storeBytesPerSample(storeFormat);
+    std::unique_ptr<TriggeredRecorder> trigger;
+    
+    // a segment starts with the first block at or past its boundary, so every segment begins with a block timestamp
+    uint64_t segmentSamples = 0;
+    if (segmentTime > 0) {
+		segmentSamples = segmentTime * (usrp ? usrp->get_rx_rate(0) : rate);
 	}
-	if(vm.count("gain7") == false) {
-		gain7 = gainAll;
+	if (segmentSize > 0) {
+		uint64_t sizeSamples = segmentSize * 1e9 / (numRxChannels * storeBytes);
+		segmentSamples = segmentSamples > 0 ? std::min(segmentSamples, sizeSamples) : sizeSamples;
 	}
+	std::vector<size_t> segmentIndex (numRxChannels, 0);
+	std::vector<uint64_t> segmentStart (numRxChannels, 0);
+	std::vector<uint64_t> closedBytes (numRxChannels, 0), closedCopied (numRxChannels, 0);
+	const std::string channelExtension = format == "compressed" ? ".sc16z" : ".bin";
+	auto channelFileName = [&](size_t channel, size_t segment) {
+		std::string filePath (file);
+		if (segmentSamples == 0) {
+			return filePath + "_chan" + std::to_string (channel) + channelExtension;
+		}
+		return (boost::format("%s_seg%04i_chan%i%s") % filePath % segment % channel % channelExtension).str();
+	};
+	// with --volumes every channel file goes to the volume the set picks, the paths of the open ones are kept for the offloader
+	std::unique_ptr<VolumeSet> volumes;
+	std::vector<std::string> channelPaths (numRxChannels);
+	std::vector<size_t> channelVolume (numRxChannels, 0);
+	// CRC32C of every chunk of the channel files, taken by the writer threads
+	std::unique_ptr<ChecksumManifest> manifest;
+	std::vector<std::unique_ptr<ChunkChecksum>> checksums;
+	auto openChannel = [&](size_t channel, size_t segment, uint64_t firstSample) {
+		// the compressed size is not known up front, so compressed files are not preallocated
+		double expectedSamples = segmentSamples > 0 ? std::min<double>(totalSamplesToReceive, segmentSamples + samplesPerBuffer) : totalSamplesToReceive;
+		std::string fileName = channelFileName(channel, segment);
+		if (volumes) {
+			const std::string baseName = fileName.substr(fileName.rfind('/') + 1);
+			channelVolume[channel] = volumes->place(channel, segment, firstSample, expectedSamples * storeBytes, baseName, fileName);
+		}
+		channelPaths[channel] = fileName;
+		std::unique_ptr<ChannelWriter> writer (new ChannelWriter (fileName, ChannelWriter::parseMode(ioMode), ioSize, ioDepth,
+																  format == "compressed" ? 0 : expectedSamples * storeBytes));
+		if (writer->preallocateErrno() != 0) {
+			std::cout << "Could not preallocate " << fileName << ": " << strerror(writer->preallocateErrno()) << std::endl;
+		}
+		return writer;
+	};
 	
-	double gain [8] = {gain0, gain1, gain2, gain3, gain4, gain5, gain6, gain7};
-	for (unsigned int i = 0; i < numChannels; i++) {
-		std::cout << boost::format("Setting RX Gain: %f dB...") % gain[i] << std::endl << std::endl;
-		usrp->set_rx_gain (gain[i],i);
-		std::cout << boost::format("Actual RX Gain: %f dB...") % usrp->get_rx_gain(i) << std::endl;
-	} std::cout << std::endl;
+	// before anything is written, check that the disk, its free space and the CPU can take the run
+	std::vector<preflight::Check> preflightChecks;
+	std::vector<double> volumeRates;
+	if (preflightMode != "off") {
+		try {
+			const double channelRate = usrp ? usrp->get_rx_rate(0) : rate;
+			const std::string filePath (file);
+			const size_t slash = filePath.rfind('/');
+			const std::string directory = slash == std::string::npos ? "." : slash == 0 ? "/" : filePath.substr(0, slash);
+			// compressed and triggered runs are counted at their worst, every sample written
+			const double sampleBytes = format == "bin" ? storeBytes : sizeof(std::complex<short>);
+			double diskRate = channelRate * numRxChannels * sampleBytes;
+			size_t numFiles = format == "container" ? 1 : numRxChannels;
+			size_t blockBytes = format == "container" ? chunkSamples * numRxChannels * sampleBytes : samplesPerBuffer * sampleBytes;
+			if (not subBandList.empty()) {
+				diskRate = 0.0;
+				numFiles = 0;
+				for (const SubBandSpec& spec : parseSubBands(subBandList)) {
+					if (spec.channel < numRxChannels) {
+						SubBandDdc band (spec, usrp ? usrp->get_rx_freq(spec.channel) : topology[spec.channel].freq, channelRate);
+						diskRate += band.outputRate() * sizeof(std::complex<short>);
+						blockBytes = samplesPerBuffer / band.decimationFactor() * sizeof(std::complex<short>);
+						numFiles++;
+					}
+				}
+			}
+			const double runBytes = diskRate * totalSamplesToReceive / channelRate;
+			double spaceNeeded = runBytes;
+			if (offloadMode == "move" and not offloadPath.empty() and segmentSamples > 0) {
+				// moved segments give their space back, only those not moved yet take room
+				const double segmentBytes = diskRate * segmentSamples / channelRate;
+				const double backlog = offloadRate > 0 ? std::max(0.0, diskRate - offloadRate * 1e6) * totalSamplesToReceive / channelRate : 0.0;
+				spaceNeeded = std::min(runBytes, 2 * segmentBytes + backlog);
+			}
 
-   // give the device a little bit of time to configure
-    std::this_thread::sleep_for (std::chrono::milliseconds(100));
-    
-    // this will map the subdevice inputs to the input channels and create the input stream
-    uhd::stream_args_t rxStreamArgs ("sc16");
-	for (unsigned int i = 0; i < numChannels; i++) {
-		rxStreamArgs.channels.push_back(i);
+			// with volumes each one is measured with its share of the files, and takes the run's bytes in proportion to its bandwidth
+			std::vector<std::string> directories = volumeDirs.empty() ? std::vector<std::string> {directory} : volumeDirs;
+			const size_t volumeFiles = (numFiles + directories.size() - 1) / directories.size();
+			std::vector<preflight::Mount> mounts;
+			std::vector<uint64_t> freeSpaces;
+			preflight::WriteCache cache;
+			for (const std::string& volume : directories) {
+				Offloader::makeDirectories(volume);
+				const preflight::Mount mount = preflight::mountOf(volume);
+				const uint64_t freeSpace = preflight::freeBytes(volume);
+				const std::string key = preflight::WriteCache::key(mount, ioMode, ioSize, blockBytes, volumeFiles);
+				double writeRate, age;
+				std::string measured = "now";
+				if (preflightAge > 0 and cache.find(key, preflightAge * 3600, writeRate, age)) {
+					measured = age < 3600 ? (boost::format("%.0f min ago") % (age / 60)).str() : (boost::format("%.1f h ago") % (age / 3600)).str();
+				} else {
+					std::cout << boost::format("Preflight: measuring %s writes to %s...") % ioMode % mount.point << std::flush;
+					writeRate = preflight::measureWrite(volume, ChannelWriter::parseMode(ioMode), ioSize, ioDepth, blockBytes, volumeFiles,
+														std::min<uint64_t>(preflight::WRITE_BYTES, freeSpace / 20), preflight::WRITE_SECONDS);
+					std::cout << std::endl;
+					cache.store(key, writeRate);
+				}
+				volumeRates.push_back(writeRate);
+				mounts.push_back(mount);
+				freeSpaces.push_back(freeSpace);
+				preflight::Check write;
+				write.name = volumeDirs.empty() ? std::string("write") : "write" + std::to_string(volumeRates.size() - 1);
+				write.measured = volumeDirs.empty() ? (boost::format("%.0f MB/s, %i files of %.1f kB blocks, measured %s") % (writeRate / 1e6) % volumeFiles % (blockBytes / 1024.0) % measured).str()
+												   : (boost::format("%.0f MB/s to %s, %i files, measured %s") % (writeRate / 1e6) % volume % volumeFiles % measured).str();
+				preflightChecks.push_back(write);
+			}
+			// volumes on the same filesystem share its bandwidth and its free space
+			const double totalRate = std::accumulate(volumeRates.begin(), volumeRates.end(), 0.0);
+			double freeSpace = 0.0;
+			std::string where;
+			for (size_t v = 0; v < directories.size(); v++) {
+				double share = 0.0;
+				bool first = true;
+				for (size_t w = 0; w < directories.size(); w++) {
+					if (mounts[w].point == mounts[v].point) {
+						share += volumeRates[w] / totalRate;
+						first = first and w >= v;
+					}
+				}
+				preflight::Check& write = preflightChecks[preflightChecks.size() - directories.size() + v];
+				write.needed = (boost::format("%.0f MB/s") % (share * diskRate / 1e6)).str();
+				write.margin = volumeRates[v] / (share * diskRate);
+				if (first) {
+					where += (where.empty() ? "" : ", ") + (boost::format("%s (%s, %s)") % mounts[v].point % mounts[v].device % mounts[v].type).str();
+					freeSpace += volumeDirs.empty() ? freeSpaces[v] : std::max(0.0, freeSpaces[v] - reserveGb * 1e9);
+				}
+			}
+			preflight::Check space;
+			space.name = "space";
+			space.measured = (boost::format(volumeDirs.empty() ? "%.1f GB free" : "%.1f GB free over the reserve") % (freeSpace / 1e9)).str();
+			space.needed = (boost::format("%.1f GB") % (spaceNeeded / 1e9)).str();
+			space.margin = freeSpace / std::max(spaceNeeded, 1.0);
+			preflightChecks.push_back(space);
+
+			// the writers share the work, on cores of their own at best
+			const size_t writers = std::max<size_t>(1, std::min<size_t>({numWriters, numRxChannels, std::thread::hardware_concurrency()}));
+			const double rawRate = channelRate * numRxChannels;
+			// buffered writes are copied into the page cache, the container gathers its chunks, the live ring copies every block
+			const double copyNeeded = (ioMode == "buffered" ? diskRate : 0.0)
+									  + ((format == "container") + (not livePath.empty())) * rawRate * sizeof(std::complex<short>);
+			const double copyRate = preflight::measureCopy(samplesPerBuffer * sizeof(std::complex<short>), preflight::CPU_SECONDS);
+			preflight::Check copy;
+			copy.name = "copy";
+			copy.measured = (boost::format("%.0f MB/s per core, %i writer threads") % (copyRate / 1e6) % writers).str();
+			copy.needed = (boost::format("%.0f MB/s") % (copyNeeded / 1e6)).str();
+			if (copyNeeded > 0) {
+				copy.margin = copyRate * writers / copyNeeded;
+			}
+			preflightChecks.push_back(copy);
+			if (format == "compressed" or storeFormat != STORE_SC16) {
+				const double storeRate = preflight::measureStore(storeFormat, storeShift, format == "compressed", samplesPerBuffer, preflight::CPU_SECONDS);
+				preflight::Check convert;
+				convert.name = format == "compressed" ? "compress" : "convert";
+				convert.measured = (boost::format("%.1f MS/s per core (%s), %i writer threads") % (storeRate / 1e6)
+									% (format == "compressed" ? "sc16z" : store) % writers).str();
+				convert.needed = (boost::format("%.1f MS/s") % (rawRate / 1e6)).str();
+				convert.margin = storeRate * writers / rawRate;
+				preflightChecks.push_back(convert);
+			}
+			if (checksumMb > 0) {
+				const double checksumRate = preflight::measureChecksum(blockBytes, preflight::CPU_SECONDS);
+				preflight::Check checksum;
+				checksum.name = "checksum";
+				checksum.measured = (boost::format("%.0f MB/s per core (%s), %i writer threads") % (checksumRate / 1e6) % crc32c::kernel() % writers).str();
+				checksum.needed = (boost::format("%.0f MB/s") % (diskRate / 1e6)).str();
+				checksum.margin = checksumRate * writers / diskRate;
+				preflightChecks.push_back(checksum);
+			}
+
+			double worst = std::numeric_limits<double>::infinity();
+			for (const preflight::Check& check : preflightChecks) {
+				worst = std::min(worst, check.margin);
+			}
+			std::cout << boost::format("Preflight of %s for %.0f s at %.2f Msps on %i channels, margin %.2f required:")
+						 % where % (totalSamplesToReceive / channelRate) % (channelRate / 1e6) % numRxChannels % preflightMargin << std::endl;
+			preflight::printReport(std::cout, preflightChecks, preflightMargin);
+			if (worst < preflightMargin) {
+				if (preflightMode == "refuse") {
+					std::cerr << boost::format("This run needs more than the host can give with a margin of %.2f, see the report above. "
+											   "Record less, somewhere else, or add --preflight=warn to record anyway") % preflightMargin << std::endl;
+					return ~0;
+				}
+				std::cout << "Recording anyway (--preflight=warn)" << std::endl;
+			}
+		} catch (const std::exception& e) {
+			std::cerr << "Preflight failed: " << e.what() << std::endl;
+			return ~0;
+		}
+		bringUpTimer.mark("preflight");
 	}
-    uhd::rx_streamer::sptr rxStream = usrp->get_rx_stream (rxStreamArgs);
 	
-    // print some general information
-    unsigned int numRxChannels = rxStream->get_num_channels();
-    std::cout << "Set up RX stream. Num input channels: " << numRxChannels << std::endl;
-    std::cout << usrp->get_pp_string();
-    
-    // allocate buffers to receive with samples (one buffer per channel)
-    const int samplesPerBuffer = rxStream->get_max_num_samps()*spb;
-    std::vector<std::vector<std::complex<short>>> buffs (numRxChannels, std::vector<std::complex<short>> (samplesPerBuffer));
-    std::cout << "Allocated " << numRxChannels << " buffers with " << samplesPerBuffer << " complex short samples" << std::endl;
-
-    // create a vector of pointers to point to each of the channel buffers
-    std::vector<std::complex<short> *> buffPtrs;
-    for (unsigned int i = 0; i < buffs.size(); i++) {
-        //buffPtrs.push_back(buffs[i].data());
-		buffPtrs.push_back(&buffs[i].front());
-	}
-        
-    // allocate one big plain short buffer per channel for the final channels to store to disk
-	int numSamplesToReceive = samplesPerBuffer;
-//    if (vm.count("spb")) {
-//		numSamplesToReceive = spb;
-//	}
+	// finished files go to a second volume while the recording continues
+	std::unique_ptr<Offloader> offloader;
+	// low duty cycle spectrum for checking the signal while recording
+	std::unique_ptr<SpectrumMonitor> monitor;
+	// the sub-bands that are written in place of the wide channels
+	std::unique_ptr<Channelizer> channelizer;
+	// the samples for other processes on this host
+	std::unique_ptr<LivePublisher> live;
+	std::ofstream segmentList;
+    try {
+		if (not offloadPath.empty()) {
+			offloader.reset(new Offloader (offloadPath, offloadRate * 1e6, offloadMode == "move"));
+		}
+		if (not spectrumPath.empty()) {
+			std::vector<double> frequencies;
+			for (unsigned int i = 0; i < numRxChannels; i++) {
+				frequencies.push_back(usrp ? usrp->get_rx_freq(i) : topology[i].freq);
+			}
+			monitor.reset(new SpectrumMonitor (spectrumPath, numRxChannels, fftSize, spectrumAverages, spectrumInterval,
+											   usrp ? usrp->get_rx_rate(0) : rate, frequencies));
+		}
+		if (not livePath.empty()) {
+			std::vector<double> frequencies;
+			for (unsigned int i = 0; i < numRxChannels; i++) {
+				frequencies.push_back(usrp ? usrp->get_rx_freq(i) : topology[i].freq);
+			}
+			const double liveRate = usrp ? usrp->get_rx_rate(0) : rate;
+			live.reset(new LivePublisher (livePath, numRxChannels, samplesPerBuffer, std::ceil(liveSeconds * liveRate / samplesPerBuffer), liveRate, frequencies));
+		}
+		if (segmentSamples > 0) {
+			std::string filePath (file);
+			segmentList.open(filePath + "_segments.txt");
+		}
+		if (not volumeDirs.empty()) {
+			// a block of every channel has to be written in the time the writers share, one block's worth of samples
+			const double channelRate = usrp ? usrp->get_rx_rate(0) : rate;
+			const size_t writers = std::max<size_t>(1, std::min<size_t>(numWriters, numRxChannels));
+			std::string filePath (file);
+			volumes.reset(new VolumeSet (volumeDirs, volumeRates, filePath + "_placement.txt", reserveGb * 1e9,
+										 samplesPerBuffer / channelRate * writers / numRxChannels, spillover));
+		}
+		if (checksumMb > 0) {
+			std::string filePath (file);
+			manifest.reset(new ChecksumManifest (filePath + "_manifest.txt", checksumMb * 1e6));
+		}
+		if (triggerDb > 0) {
+			// one thread sees every channel, so the detector can combine them
+			if (numWriters > 1) {
+				numWriters = 1;
+			}
+			std::string filePath (file);
+			PowerDetector detector (numRxChannels, PowerDetector::parseChannel(triggerChannel), triggerWindow, triggerDb, usrp ? usrp->get_rx_rate(0) : rate, floorTime);
+			trigger.reset(new TriggeredRecorder (filePath, numRxChannels, usrp ? usrp->get_rx_rate(0) : rate, preTrigger, postTrigger,
+												 detector, ChannelWriter::parseMode(ioMode), ioSize));
+		} else if (format == "container") {
+			// whole pages per channel per chunk
+			chunkSamples = (chunkSamples + pageSamples - 1) / pageSamples * pageSamples;
+			std::string filePath (file);
+			container.reset(new ContainerWriter (filePath + ".usrp", numRxChannels, chunkSamples, usrp ? usrp->get_rx_rate(0) : rate, totalSamplesToReceive));
+			if (container->preallocateErrno() != 0) {
+				std::cout << "Could not preallocate " << filePath << ".usrp: " << strerror(container->preallocateErrno()) << std::endl;
+			}
+		} else if (not subBandList.empty()) {
+			std::vector<double> frequencies;
+			for (unsigned int i = 0; i < numRxChannels; i++) {
+				frequencies.push_back(usrp ? usrp->get_rx_freq(i) : topology[i].freq);
+			}
+			std::string filePath (file);
+			channelizer.reset(new Channelizer (parseSubBands(subBandList), frequencies, usrp ? usrp->get_rx_rate(0) : rate, filePath,
+											   ChannelWriter::parseMode(ioMode), ioSize, ioDepth, totalSamplesToReceive));
+		} else if (format == "bin" or format == "compressed") {
+			for (unsigned int i = 0; i < numRxChannels; i++) {
+				outfiles.push_back(openChannel(i, 0, 0));
+				if (manifest) {
+					checksums.emplace_back(new ChunkChecksum (*manifest, i));
+					checksums.back()->open(channelPaths[i]);
+				}
+				if (format == "compressed") {
+					compressors.emplace_back(new ChannelCompressor (samplesPerBuffer));
+				} else if (storeFormat != STORE_SC16) {
+					converters.emplace_back(new SampleConverter (storeFormat, storeShift));
+					convertBuffers.emplace_back(samplesPerBuffer * storeBytes + CONVERT_SLACK);
+				}
+			}
+		} else {
+			std::cerr << "Please select a valid output format (bin, container, compressed)" << std::endl;
+			return ~0;
+		}
+	} catch (const std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return ~0;
+	}
+	if (trigger) {
+		std::cout << boost::format("Triggering %.1f dB above the noise floor (%s), keeping %.1f s before and %.1f s after in a %.1f s ring (%.1f MB)")
+					 % triggerDb % triggerChannel % preTrigger % postTrigger % trigger->ringSeconds() % (trigger->ringBytes() / 1e6) << std::endl;
+	} else if (container) {
+		std::cout << boost::format("Writing all channels to %s.usrp in chunks of %i samples") % file % chunkSamples << std::endl;
+	} else if (channelizer) {
+		for (size_t k = 0; k < channelizer->size(); k++) {
+			const SubBandDdc& band = channelizer->subBand(k);
+			std::cout << boost::format("Sub-band %i: channel %i, %.6f MHz, %.3f MHz wide, decimated by %i to %.6f Msps with %i taps (%s) into %s")
+						 % k % band.specification().channel % (band.specification().freq / 1e6) % (band.specification().bandwidth / 1e6)
+						 % band.decimationFactor() % (band.outputRate() / 1e6) % band.numTaps() % band.kernel() % channelizer->fileName(k) << std::endl;
+		}
+	} else {
+		std::cout << boost::format("Writing %s with %i byte writes") % ioMode % ioSize << std::endl;
+	}
+	if (segmentSamples > 0) {
+		std::cout << boost::format("New segment every %i samples (%.1f s)") % segmentSamples % (segmentSamples / (usrp ? usrp->get_rx_rate(0) : rate)) << std::endl;
+	}
+	if (volumes) {
+		for (size_t v = 0; v < volumes->size(); v++) {
+			const VolumeSet::Volume& volume = volumes->volume(v);
+			std::cout << boost::format("Volume %i: %s, %s, %i channel files so far") % v % volume.directory
+						 % (volumeRates.empty() ? std::string("equal share (not measured)") : (boost::format("weight %.0f MB/s") % (volume.bandwidth / 1e6)).str()) % volume.files << std::endl;
+		}
+		std::cout << boost::format("Placement of the channel files in %s_placement.txt") % file << std::endl;
+	}
+	if (manifest) {
+		std::cout << boost::format("CRC32C (%s) of every %.0f MB of the channel files in %s_manifest.txt") % crc32c::kernel() % checksumMb % file << std::endl;
+	}
+	if (offloader) {
+		std::cout << boost::format("Offloading (%s) to %s%s") % offloadMode % offloadPath
+					 % (offloadRate > 0 ? (boost::format(" at up to %.0f MB/s") % offloadRate).str() : std::string()) << std::endl;
+	}
+	if (monitor) {
+		std::cout << boost::format("Live spectrum in %s: %i point FFTs (%s), %i averaged every %.1f s, view with usrpSpectrum --file=%s")
+					 % spectrumPath % fftSize % monitor->kernel() % spectrumAverages % spectrumInterval % spectrumPath << std::endl;
+	}
+	if (live) {
+		std::cout << boost::format("Live samples in %s: %.2f s per channel (%.1f MB), read with usrpLive --file=%s")
+					 % livePath % live->seconds() % (live->bytes() / 1e6) % livePath << std::endl;
+	}
+	if (not converters.empty()) {
+		std::cout << boost::format("Storing %s with the %s kernel") % store % converters[0]->kernel()
+				  << (storeFormat == STORE_FC32 ? std::string() : (boost::format(", shifted %i bits") % storeShift).str()) << std::endl;
+	}
 	
-    std::vector<std::vector<short>> fileBuffers (numRxChannels, std::vector<short> (2*numSamplesToReceive));
+	// one index entry per block with its sample offset, device time and error flags, per stream since each has its own blocks
+	try {
+		std::string filePath (file);
+		for (auto& board : boards) {
+			std::string indexName = board.mboard == 0 ? filePath + "_index.bin" : (boost::format("%s_index_mb%i.bin") % filePath % board.mboard).str();
+			board.index.reset(new IndexWriter (indexName, usrp ? usrp->get_rx_rate(0) : rate, board.numChannels, storeBytes));
+		}
+	} catch (const std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return ~0;
+	}
+	
+    // the recv thread fills pre-allocated blocks and the writer threads write them to disk as they are,
+    // channels are numbered across all boards and the block holds those of its own board
+    std::atomic<bool> writeFailed (false);
+    auto writeBlock = [&](BoardStream& board, const SampleBlock& block, size_t firstChannel, size_t endChannel) {
+			if (writeFailed) {
+				return;
+			}
+			try {
+				// the writer with the first channel keeps the index, startup timeouts carry nothing worth indexing
+				if (firstChannel == board.firstChannel and (block.numSamples > 0 or block.metadata.error_code != uhd::rx_metadata_t::ERROR_CODE_TIMEOUT)) {
+					board.index->append(block.sampleOffset, block.numSamples, block.numRequested, block.metadata);
+				}
+				if (block.numSamples > 0) {
+					const uint64_t waited = telemetry::micros(block.received, std::chrono::steady_clock::now());
+					for (size_t i = firstChannel; i < endChannel; i++) {
+						channelMetrics[i].queueMicros.record(waited);
+					}
+				}
+				if (monitor) {
+					for (size_t i = firstChannel; i < endChannel; i++) {
+						monitor->offer(i, block.buffPtrs[i - board.firstChannel], block.numSamples, block.sampleOffset);
+					}
+				}
+				// the same copy whether or not anyone subscribes, and subscribers are never waited for
+				if (live) {
+					for (size_t i = firstChannel; i < endChannel and block.numSamples > 0; i++) {
+						auto liveStart = std::chrono::steady_clock::now();
+						live->publish(i, block.buffPtrs[i - board.firstChannel], block.numSamples, block.sampleOffset, block.metadata);
+						channelMetrics[i].liveMicros.record(telemetry::micros(liveStart, std::chrono::steady_clock::now()));
+					}
+				}
+				if (trigger) {
+					trigger->process(block);
+					return;
+				}
+				if (channelizer) {
+					for (size_t i = firstChannel; i < endChannel and block.numSamples > 0; i++) {
+						auto writeStart = std::chrono::steady_clock::now();
+						channelizer->process(i, block.buffPtrs[i - board.firstChannel], block.numSamples);
+						channelMetrics[i].writeMicros.record(telemetry::micros(writeStart, std::chrono::steady_clock::now()));
+					}
+					return;
+				}
+				if (container) {
+					for (size_t i = firstChannel; i < endChannel; i++) {
+						auto writeStart = std::chrono::steady_clock::now();
+						container->write(i, block.sampleOffset, block.buffPtrs[i - board.firstChannel], block.numSamples);
+						channelMetrics[i].writeMicros.record(telemetry::micros(writeStart, std::chrono::steady_clock::now()));
+						channelMetrics[i].bytes.add(block.numSamples * sizeof (std::complex<short>));
+					}
+					return;
+				}
+				if (segmentSamples > 0 and block.numSamples > 0) {
+					// every writer sees every block, so all channels roll over on the same one
+					for (size_t i = firstChannel; i < endChannel; i++) {
+						// boundaries stay on a fixed grid, so segments do not drift by the block rounding
+						if (block.sampleOffset >= (segmentIndex[i] + 1) * segmentSamples) {
+							outfiles[i]->close();
+							closedBytes[i] += outfiles[i]->size();
+							closedCopied[i] += outfiles[i]->bytesCopied();
+							if (offloader) {
+								offloader->add(channelPaths[i]);
+							}
+							segmentIndex[i]++;
+							segmentStart[i] = block.sampleOffset;
+							outfiles[i] = openChannel(i, segmentIndex[i], block.sampleOffset);
+							if (not checksums.empty()) {
+								checksums[i]->open(channelPaths[i]);
+							}
+						}
+					}
+					if (firstChannel == 0 and block.sampleOffset == segmentStart[0]) {
+						segmentList << boost::format("Segment %i: first sample %i") % segmentIndex[0] % block.sampleOffset;
+						if (block.metadata.has_time_spec) {
+							segmentList << boost::format(", device time %i + %.9f [s]") % block.metadata.time_spec.get_full_secs() % block.metadata.time_spec.get_frac_secs();
+						}
+						segmentList << std::endl;
+					}
+				}
+				for (size_t i = firstChannel; i < endChannel and block.numSamples > 0; i++) {
+					auto writeStart = std::chrono::steady_clock::now();
+					size_t numBytes;
+					const void* data;
+					if (not compressors.empty()) {
+						data = compressors[i]->compress(block.buffPtrs[i - board.firstChannel], block.numSamples, block.sampleOffset, numBytes);
+					} else if (not converters.empty()) {
+						clipped[i] += converters[i]->convert(block.buffPtrs[i - board.firstChannel], block.numSamples, convertBuffers[i].data());
+						data = convertBuffers[i].data();
+						numBytes = block.numSamples * storeBytes;
+					} else {
+						data = block.buffPtrs[i - board.firstChannel];
+						numBytes = block.numSamples * sizeof (std::complex<short>);
+					}
+					outfiles[i]->write(data, numBytes);
+					const auto writeEnd = std::chrono::steady_clock::now();
+					const uint64_t writeMicros = telemetry::micros(writeStart, writeEnd);
+					channelMetrics[i].writeMicros.record(writeMicros);
+					if (volumes) {
+						volumes->record(channelVolume[i], writeMicros, 1);
+					}
+					// direct and uring writes are still in flight, the bytes are checksummed while they are in the cache
+					if (not checksums.empty()) {
+						checksums[i]->add(data, numBytes, block.sampleOffset, block.numSamples);
+						channelMetrics[i].checksumMicros.record(telemetry::micros(writeEnd, std::chrono::steady_clock::now()));
+					}
+					channelMetrics[i].bytes.add(numBytes);
+				}
+				// the block and the frame/conversion buffers are reused once this returns, so wait for any writes still using them
+				for (size_t i = firstChannel; i < endChannel; i++) {
+					auto syncStart = std::chrono::steady_clock::now();
+					outfiles[i]->sync();
+					const uint64_t syncMicros = telemetry::micros(syncStart, std::chrono::steady_clock::now());
+					channelMetrics[i].syncMicros.record(syncMicros);
+					if (volumes) {
+						volumes->record(channelVolume[i], syncMicros, 0);
+					}
+				}
+			} catch (const std::exception& e) {
+				std::cerr << "\n" << e.what() << std::endl;
+				writeFailed = true;
+			}
+		};
+    size_t poolBytes = 0, numWriterThreads = 0;
+    bool hugePages = true;
+    const std::vector<int> mainCpus = numa::threadCpus();
+    for (auto& board : boards) {
+		// a board's writers get its share of --writers, 0 still writes on the recv thread
+		size_t boardWriters = numWriters == 0 ? 0 : std::max<size_t>(1, (numWriters * board.numChannels + numRxChannels - 1) / numRxChannels);
+		if (perBoard) {
+			// writer threads inherit the mask of the thread that starts them, keep them on the board's node but off the recv cores
+			std::vector<int> writerCpus, cpus = numa::nodeCpus(board.numaNode);
+			for (int cpu : cpus) {
+				if (std::find(recvCores.begin(), recvCores.end(), cpu) == recvCores.end()) {
+					writerCpus.push_back(cpu);
+				}
+			}
+			numa::pinThread(writerCpus.empty() ? cpus : writerCpus);
+		}
+		BoardStream* boardPtr = &board;
+		board.pipeline.reset(new BlockPipeline (board.numChannels, samplesPerBuffer, numBlocks, boardWriters,
+			[&writeBlock, boardPtr](const SampleBlock& block, size_t firstChannel, size_t endChannel) {
+				writeBlock(*boardPtr, block, boardPtr->firstChannel + firstChannel, boardPtr->firstChannel + endChannel);
+			}, board.numaNode, (boost::format("w%i.") % board.mboard).str()));
+		poolBytes += board.pipeline->poolBytes();
+		numWriterThreads += board.pipeline->numWriterThreads();
+		hugePages = hugePages and board.pipeline->hugePages();
+	}
+	if (perBoard) {
+		numa::pinThread(mainCpus);
+	}
+    std::cout << "Allocated " << numBlocks << " blocks of " << numRxChannels << " buffers with " << samplesPerBuffer << " complex short samples ("
+			  << boost::format("%.1f MB") % (poolBytes / 1e6) << (hugePages ? " in huge pages" : "") << ")" << std::endl;
+    std::cout << boost::format("Writer threads: %i, buffering: %.3f s") % numWriterThreads % (numBlocks * samplesPerBuffer / rate) << std::endl;
+    if (perBoard) {
+		for (auto& board : boards) {
+			std::cout << boost::format("Motherboard %i: channels %i-%i, recv thread on CPU %i, NUMA node %i%s, %i writer threads")
+						 % board.mboard % board.firstChannel % (board.firstChannel + board.numChannels - 1) % board.cpu % board.numaNode
+						 % (board.pipeline->numaBound() ? " (buffers on the node)" : "") % board.pipeline->numWriterThreads() << std::endl;
+		}
+	}
 
-	// set the total number of samples to receive
-	double totalSamplesToReceive = rate * total_time;
-	if (vm.count("nsamps")) {
-		totalSamplesToReceive = total_num_samps;
+	// metrics for watching a long unattended run, served on a thread of their own
+	std::unique_ptr<telemetry::Server> telemetryServer;
+	if (not telemetryEndpoint.empty()) {
+		auto render = [&]() {
+			std::ostringstream out;
+			out << "# usrpMultiRecord run-time metrics, latencies in microseconds\n";
+			out << boost::format("usrp_uptime_seconds %.3f\n") % bringUpTimer.elapsed();
+			out << boost::format("usrp_write_failed %i\n") % int(writeFailed.load());
+			for (auto& board : boards) {
+				const std::string labels = (boost::format("board=\"%i\"") % board.mboard).str();
+				out << boost::format("usrp_recv_calls_total{%s} %i\n") % labels % board.recvCalls.value();
+				out << boost::format("usrp_recv_samples_total{%s} %i\n") % labels % board.recvSampleCount.value();
+				out << boost::format("usrp_recv_overflows_total{%s} %i\n") % labels % board.recvOverflows.value();
+				out << boost::format("usrp_recv_late_total{%s} %i\n") % labels % board.recvLate.value();
+				out << boost::format("usrp_recv_timeouts_total{%s} %i\n") % labels % board.recvTimeouts.value();
+				out << boost::format("usrp_recv_errors_total{%s} %i\n") % labels % board.recvErrors.value();
+				board.recvMicros.write(out, "usrp_recv_latency_us", labels);
+				board.recvSamples.write(out, "usrp_recv_samples_per_call", labels);
+				// how close the writers are to holding up recv
+				PipelineStats stats = board.pipeline->stats();
+				out << boost::format("usrp_queue_depth{%s} %i\n") % labels % stats.queueDepth;
+				out << boost::format("usrp_queue_high_water{%s} %i\n") % labels % stats.queueHighWater;
+				out << boost::format("usrp_queue_capacity{%s} %i\n") % labels % (stats.queueCapacity ? stats.queueCapacity : stats.numBlocks);
+				out << boost::format("usrp_blocks_submitted_total{%s} %i\n") % labels % stats.blocksSubmitted;
+				out << boost::format("usrp_pool_stalls_total{%s} %i\n") % labels % stats.poolStalls;
+			}
+			for (size_t i = 0; i < channelMetrics.size(); i++) {
+				const std::string labels = (boost::format("channel=\"%i\"") % i).str();
+				out << boost::format("usrp_channel_bytes_written_total{%s} %i\n") % labels % channelMetrics[i].bytes.value();
+				channelMetrics[i].queueMicros.write(out, "usrp_channel_queue_us", labels);
+				channelMetrics[i].writeMicros.write(out, "usrp_channel_write_us", labels);
+				channelMetrics[i].syncMicros.write(out, "usrp_channel_sync_us", labels);
+				if (live) {
+					channelMetrics[i].liveMicros.write(out, "usrp_channel_live_us", labels);
+				}
+				if (manifest) {
+					channelMetrics[i].checksumMicros.write(out, "usrp_channel_checksum_us", labels);
+				}
+			}
+			if (live) {
+				uint64_t blocksRead, blocksSkipped;
+				out << boost::format("usrp_live_subscribers %i\n") % live->subscribers(&blocksRead, &blocksSkipped);
+				out << boost::format("usrp_live_blocks_read_total %i\n") % blocksRead;
+				out << boost::format("usrp_live_blocks_skipped_total %i\n") % blocksSkipped;
+			}
+			telemetry::writeThreadCpu(out, "usrp_thread_cpu_seconds");
+			return out.str();
+		};
+		try {
+			telemetryServer.reset(new telemetry::Server (telemetryEndpoint, render));
+		} catch (const std::exception& e) {
+			std::cerr << e.what() << std::endl;
+			return ~0;
+		}
+		std::cout << "Telemetry on " << telemetryServer->address() << std::endl;
 	}
-    
+
 	// create the start command
     uhd::stream_cmd_t startCmd = uhd::stream_cmd_t::STREAM_MODE_START_CONTINUOUS;
     startCmd.stream_now = false;
     startCmd.time_spec = uhd::time_spec_t (1.9);
-    rxStream->issue_stream_cmd(startCmd);
+    if (usrp and fastStart) {
+		// as soon as the command has reached every board and the metadata is written
+		startCmd.time_spec = usrp->get_time_now() + uhd::time_spec_t (bringup::START_LEAD);
+	} else if (usrp and boards.size() > 1) {
+		// separate streams line up because they start at the same device time, give every board time to get the command
+		startCmd.time_spec = uhd::time_spec_t (std::ceil(usrp->get_time_now().get_real_secs() + setup_time));
+	}
+    bringUpTimer.mark("files and buffers");
+    if (agent) {
+		// every agent starts at the coordinator's time, on the same PPS edge
+		auto deviceTime = [&]() {
+			if (usrp) {
+				return usrp->get_time_now().get_real_secs();
+			}
+			auto sim = std::dynamic_pointer_cast<SimStreamer>(boards[0].rxStream);
+			return sim ? sim->deviceTime() : 0.0;
+		};
+		char hostName[256] = "";
+		gethostname(hostName, sizeof(hostName) - 1);
+		try {
+			startCmd.time_spec = uhd::time_spec_t (agent->waitForStart([&]() {
+				return (boost::format("host=%s channels=%i rate=%.0f time=%.6f") % hostName % numRxChannels
+						% (usrp ? usrp->get_rx_rate(0) : rate) % deviceTime()).str();
+			}));
+		} catch (const std::exception& e) {
+			std::cerr << e.what() << std::endl;
+			return ~0;
+		}
+		std::cout << boost::format("Session %s starts at device time %.0f") % agent->session() % startCmd.time_spec.get_real_secs() << std::endl;
+		bringUpTimer.mark("coordinator");
+	}
+    for (auto& board : boards) {
+		board.rxStream->issue_stream_cmd(startCmd);
+	}
+    std::cout << "Bring-up: " << bringUpTimer.report() << std::endl;
     
-    double numSamplesReceived = 0;
-    uhd::rx_metadata_t rxMetadata;
     std::cout << "Starting to receive\n" << std::endl;
 	    
     // Start receiving
@@ -361,91 +1255,507 @@ int main (int argc, char* argv[]){
 	std::string fileName(filePath + "_metadata.txt");
 	metadata.open(fileName);
 	
-	// TODO: Need the EPOCH parser
-	uhd::sensor_value_t gps_locked = usrp->get_mboard_sensor("gps_locked");
-	uhd::sensor_value_t NMEA = usrp->get_mboard_sensor("gps_gpgga");
+	// the same information, machine-readable, goes into the container header
+	boost::property_tree::ptree runInfo;
+	runInfo.put("recorder", "usrpMultiRecord");
+	runInfo.put("datatype", "ci16_le");
+	runInfo.put("sample_rate", usrp ? usrp->get_rx_rate(0) : rate);
+	runInfo.put("num_channels", numRxChannels);
+	runInfo.put("clock_source", ref);
+	runInfo.put("time_source", pps);
+	runInfo.put("device", usrp ? devAddresses : "simulated (" + simArgs + ")");
+	runInfo.put("start.device_time", startCmd.time_spec.get_real_secs());
+	if (agent) {
+		runInfo.put("session", agent->session());
+	}
+	
 	// Current system time
 	auto timenow = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
 	metadata << boost::format("System time at start: %s") % ctime(&timenow) << std::endl;
-	metadata << boost::format("Device: %s") % devAddresses << std::endl;
-	metadata << boost::format("Clock Reference: %s") % ref << std::endl;
-	if (gps_locked.to_bool()) {
-		uhd::sensor_value_t gps_time = usrp->get_mboard_sensor("gps_time");
-		metadata << boost::format("Start %s") % gps_time.to_pp_string() << std::endl;
+	metadata << boost::format("Bring-up: %s") % bringUpTimer.report() << std::endl;
+	if (agent) {
+		metadata << boost::format("Session: %s, started at device time %.0f") % agent->session() % startCmd.time_spec.get_real_secs() << std::endl;
+	}
+	runInfo.put("start.system_time", int64_t(timenow));
+	if (usrp) {
+		// TODO: Need the EPOCH parser
+		uhd::sensor_value_t gps_locked = usrp->get_mboard_sensor("gps_locked");
+		uhd::sensor_value_t NMEA = usrp->get_mboard_sensor("gps_gpgga");
+		metadata << boost::format("Device: %s") % devAddresses << std::endl;
+		metadata << boost::format("Clock Reference: %s") % ref << std::endl;
+		if (gps_locked.to_bool()) {
+			// gps_time is the GPS second of the last PPS edge, read the device time of that edge on both sides to catch a PPS in between
+			const uhd::time_spec_t last_pps_time = usrp->get_time_last_pps();
+			uhd::sensor_value_t gps_time = usrp->get_mboard_sensor("gps_time");
+			if (last_pps_time == usrp->get_time_last_pps()) {
+				for (auto& board : boards) {
+					board.index->setGpsOffset(gps_time.to_int() - std::llround(last_pps_time.get_real_secs()));
+				}
+				runInfo.put("start.gps_time", gps_time.to_int() - std::llround(last_pps_time.get_real_secs()) + startCmd.time_spec.get_real_secs());
+			}
+			metadata << boost::format("Start %s") % gps_time.to_pp_string() << std::endl;
+		} else {
+			uhd::time_spec_t gps_time = usrp->get_time_last_pps();
+			// TODO: This needs to be fixed to display the correct CPU
+			metadata << boost::format("Start time: %0.9f") % gps_time.get_real_secs() << std::endl;
+		}
+		metadata << boost::format("%s") % gps_locked.to_pp_string() << std::endl;
+		metadata << boost::format("GPS NMEA: %s") % NMEA.to_pp_string() << std::endl;
+		GpsFix fix = parseGpgga(NMEA.value);
+		if (fix.valid) {
+			metadata << boost::format("Lat: %.6f") % fix.latitude << std::endl;
+			metadata << boost::format("Lon: %.6f") % fix.longitude << std::endl;
+			metadata << boost::format("Alt: %.1f [m]") % fix.altitude << std::endl;
+		}
+		runInfo.put("gps.locked", gps_locked.to_bool());
+		runInfo.put("gps.fix", fix.valid);
+		runInfo.put("gps.utc", fix.utc);
+		runInfo.put("gps.latitude", fix.latitude);
+		runInfo.put("gps.longitude", fix.longitude);
+		runInfo.put("gps.altitude", fix.altitude);
+		runInfo.put("gps.satellites", fix.satellites);
+		runInfo.put("gps.hdop", fix.hdop);
 	} else {
-		uhd::time_spec_t gps_time = usrp->get_time_last_pps();
-		// TODO: This needs to be fixed to display the correct CPU
-		metadata << boost::format("Start time: %0.9f") % gps_time.get_real_secs() << std::endl;
-	}
-	metadata << boost::format("%s") % gps_locked.to_pp_string() << std::endl;
-	// TODO: parse NMEA data
-	metadata << boost::format("GPS NMEA: %s") % NMEA.to_pp_string() << std::endl;
-	//metadata << boost::format("Lat: %s") % NMEA.to_pp_string() << std::endl;
-	//metadata << boost::format("Lon: %s") % NMEA.to_pp_string() << std::endl;
+		metadata << boost::format("Device: simulated (%s)") % simArgs << std::endl;
+	}
 	metadata << boost::format("Duration: %i [s]") % total_time << std::endl;
 	metadata << boost::format("Total samples: %i") % totalSamplesToReceive << std::endl;
-	metadata << boost::format("Sample Type: Interleaved IQ Shorts") << std::endl;
+	for (const preflight::Check& check : preflightChecks) {
+		metadata << boost::format("Preflight %s: %s, need %s") % check.name % check.measured % check.needed << std::endl;
+		runInfo.put("preflight." + check.name + ".measured", check.measured);
+		runInfo.put("preflight." + check.name + ".needed", check.needed);
+		if (not std::isinf(check.margin)) {
+			runInfo.put("preflight." + check.name + ".margin", check.margin);
+		}
+	}
+	if (volumes) {
+		metadata << boost::format("Placement: %s_placement.txt") % filePath << std::endl;
+		runInfo.put("placement", filePath + "_placement.txt");
+		for (size_t v = 0; v < volumes->size(); v++) {
+			const VolumeSet::Volume& volume = volumes->volume(v);
+			metadata << boost::format("Volume %i: %s, %s") % v % volume.directory
+						% (volumeRates.empty() ? std::string("equal share (not measured)") : (boost::format("%.0f MB/s") % (volume.bandwidth / 1e6)).str()) << std::endl;
+			runInfo.put("volumes.volume" + std::to_string(v) + ".directory", volume.directory);
+			if (not volumeRates.empty()) {
+				runInfo.put("volumes.volume" + std::to_string(v) + ".bandwidth", volume.bandwidth);
+			}
+		}
+	}
+	if (manifest) {
+		metadata << boost::format("Checksums: CRC32C of every %.0f MB, %s_manifest.txt") % checksumMb % filePath << std::endl;
+		runInfo.put("checksums.algorithm", "crc32c");
+		runInfo.put("checksums.chunk_bytes", manifest->chunkBytes());
+		runInfo.put("checksums.manifest", filePath + "_manifest.txt");
+	}
+	static const char* sampleTypes[] = {"Interleaved IQ Shorts", "Packed 12 bit IQ (3 bytes per sample)", "Interleaved IQ Bytes", "Interleaved IQ Floats"};
+	metadata << boost::format("Sample Type: %s") % sampleTypes[storeFormat] << std::endl;
+	if (storeFormat == STORE_SC12 or storeFormat == STORE_SC8) {
+		metadata << boost::format("Storage shift: %i [bits]") % storeShift << std::endl;
+	}
+	metadata << boost::format("Wire format: %s") % otw << std::endl;
+	if (boards.size() > 1) {
+		metadata << boost::format("Receive streams: %i, one per motherboard, index of motherboard k > 0 in _index_mb<k>.bin") % boards.size() << std::endl;
+	}
+	if (trigger) {
+		metadata << boost::format("Triggered capture: %.1f dB above the noise floor (%s), %.3f s before, %.3f s after, see _event<k>.txt")
+					% triggerDb % triggerChannel % preTrigger % postTrigger << std::endl;
+	}
 	metadata << boost::format("Channels: %i") % numRxChannels << std::endl;
+	boost::property_tree::ptree channelList;
 	for (unsigned int i = 0; i < numRxChannels; i++) {
+		double chanFreq = usrp ? usrp->get_rx_freq(i) : topology[i].freq;
+		double chanBw = usrp ? usrp->get_rx_bandwidth(i) : bw;
+		double chanRate = usrp ? usrp->get_rx_rate(i) : rate;
+		double chanGain = usrp ? usrp->get_rx_gain(i) : topology[i].gain;
 		metadata << boost::format("Channel %i parameters:") % i << std::endl;
-		metadata << boost::format("Fc: %f [MHz]") % (usrp->get_rx_freq(i)/1e6) << std::endl;
-		metadata << boost::format("BW: %f [MHz]") % (usrp->get_rx_bandwidth(i)/1e6) << std::endl;
-		metadata << boost::format("Fs: %f [Msps]") % (usrp->get_rx_rate(i)/1e6) << std::endl;
-		metadata << boost::format("Gain: %f [dB]") % (usrp->get_rx_gain(i)) << std::endl;	
+		metadata << boost::format("Port: motherboard %i %s %s") % topology[i].mboard % topology[i].frontend % topology[i].antenna << std::endl;
+		metadata << boost::format("Fc: %f [MHz]") % (chanFreq/1e6) << std::endl;
+		metadata << boost::format("BW: %f [MHz]") % (chanBw/1e6) << std::endl;
+		metadata << boost::format("Fs: %f [Msps]") % (chanRate/1e6) << std::endl;
+		metadata << boost::format("Gain: %f [dB]") % (chanGain) << std::endl;
+		boost::property_tree::ptree channel;
+		channel.put("index", i);
+		channel.put("mboard", topology[i].mboard);
+		channel.put("frontend", topology[i].frontend);
+		channel.put("antenna", topology[i].antenna);
+		channel.put("frequency", chanFreq);
+		channel.put("bandwidth", chanBw);
+		channel.put("sample_rate", chanRate);
+		channel.put("gain", chanGain);
+		channelList.push_back(std::make_pair("", channel));
+	}
+	runInfo.add_child("channels", channelList);
+	if (channelizer) {
+		// a sub-band sample k is the filter output centred on wide sample k * decimation - delay
+		boost::property_tree::ptree subBandTree;
+		for (size_t k = 0; k < channelizer->size(); k++) {
+			const SubBandDdc& band = channelizer->subBand(k);
+			metadata << boost::format("Sub-band %i parameters:") % k << std::endl;
+			metadata << boost::format("File: %s") % channelizer->fileName(k) << std::endl;
+			metadata << boost::format("Channel: %i") % band.specification().channel << std::endl;
+			metadata << boost::format("Fc: %f [MHz]") % (band.specification().freq/1e6) << std::endl;
+			metadata << boost::format("BW: %f [MHz]") % (band.specification().bandwidth/1e6) << std::endl;
+			metadata << boost::format("Fs: %f [Msps]") % (band.outputRate()/1e6) << std::endl;
+			metadata << boost::format("Decimation: %i, %i taps, delay %.1f input samples") % band.decimationFactor() % band.numTaps() % band.groupDelay() << std::endl;
+			boost::property_tree::ptree subBand;
+			subBand.put("index", k);
+			subBand.put("file", channelizer->fileName(k));
+			subBand.put("channel", band.specification().channel);
+			subBand.put("frequency", band.specification().freq);
+			subBand.put("bandwidth", band.specification().bandwidth);
+			subBand.put("sample_rate", band.outputRate());
+			subBand.put("decimation", band.decimationFactor());
+			subBand.put("taps", band.numTaps());
+			subBand.put("delay", band.groupDelay());
+			subBandTree.push_back(std::make_pair("", subBand));
+		}
+		runInfo.add_child("subbands", subBandTree);
 	}
 	metadata.close();
+	if (container) {
+		container->setMetadata(runInfo);
+	}
 	
 	timenow = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
 	std::cout << ctime(&timenow) << std::endl;
 	std::cout << "Total recording time: " << total_time << "s" << std::endl;
+	if (agent) {
+		// the telemetry counters are safe to read from the reporting thread
+		agent->report(1.0, [&]() {
+			uint64_t samples = 0, overflows = 0, timeouts = 0, errors = 0;
+			size_t highWater = 0;
+			for (auto& board : boards) {
+				samples = std::max<uint64_t>(samples, board.progress.load(std::memory_order_relaxed));
+				overflows += board.recvOverflows.value();
+				timeouts += board.recvTimeouts.value();
+				errors += board.recvErrors.value() + board.recvLate.value();
+				highWater = std::max(highWater, board.pipeline->stats().queueHighWater);
+			}
+			return (boost::format("samples=%i total=%.0f overflows=%i timeouts=%i errors=%i queue=%i failed=%i")
+					% samples % totalSamplesToReceive % overflows % timeouts % errors % highWater % int(writeFailed.load())).str();
+		});
+	}
 
-    while (numSamplesReceived < totalSamplesToReceive) {
-        double numSamplesForThisBlock = totalSamplesToReceive - numSamplesReceived;
-        // receive a complete buffer or the last missing samples
-        if (numSamplesForThisBlock > samplesPerBuffer) {
-            numSamplesForThisBlock = samplesPerBuffer;
-		}
+    auto receive = [&](BoardStream& board) {
+		timespec cpuStart, cpuEnd;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuStart);
+		auto wallStart = std::chrono::steady_clock::now();
+		double& numSamplesReceived = board.numSamplesReceived;
+		uhd::rx_metadata_t rxMetadata;
+		// the first samples only arrive at the start time, after that a block should never take long
+		double recvTimeout = 3.0;
 		
-		if (print_time == "y") {	
-			float progress = roundf(numSamplesReceived/totalSamplesToReceive*100);
-			std::cout << "Recording Progress: " << progress << "% \r" << std::flush;
-		}
-		
-		// request new data from the uhd driver
-        size_t numNewSamples = rxStream->recv(buffPtrs, numSamplesForThisBlock, rxMetadata);
-        // copy the received samples to the file buffer
-        for (unsigned int i = 0; i < numRxChannels; i++) {
-            // copying complex<short> values to a plain short vector - so 2 shorts to copy for each complex sample
-			short* pDestination 			= fileBuffers[i].data();
-			std::complex<short>* pSource	= buffPtrs[i];
-			memcpy (pDestination, pSource, 2 * numNewSamples * sizeof(short));
+		while (numSamplesReceived < totalSamplesToReceive and not writeFailed) {
+			double numSamplesForThisBlock = totalSamplesToReceive - numSamplesReceived;
+			// receive a complete buffer or the last missing samples
+			if (numSamplesForThisBlock > samplesPerBuffer) {
+				numSamplesForThisBlock = samplesPerBuffer;
+			}
 			
-			// write buffer to file
-			// NOTE: currently this is a terrible implementation and will just append to any existing file, this should be fixed
-			std::string filePath (file);
-			std::ofstream outfile;
-			std::string fileName(filePath + "_chan" + std::to_string (i) + ".bin"); 
-			outfile.open(fileName, std::ofstream::app);
-			outfile.write(reinterpret_cast<char*> (fileBuffers[i].data()), 2 * numNewSamples * sizeof (short));
-		}
+			if (print_time == "y" and boards.size() == 1) {	
+				float progress = roundf(numSamplesReceived/totalSamplesToReceive*100);
+				PipelineStats stats = board.pipeline->stats();
+				std::cout << "Recording Progress: " << progress << "% queue " << stats.queueDepth << "/" << stats.queueCapacity
+						  << " (max " << stats.queueHighWater << ") \r" << std::flush;
+			}
+			
+			// request new data from the uhd driver straight into a free block
+			SampleBlock* block = board.pipeline->acquire();
+			auto recvStart = std::chrono::steady_clock::now();
+			size_t numNewSamples = board.rxStream->recv(block->buffPtrs, numSamplesForThisBlock, rxMetadata, recvTimeout);
+			block->numSamples = numNewSamples;
+			block->numRequested = numSamplesForThisBlock;
+			block->sampleOffset = numSamplesReceived;
+			block->metadata = rxMetadata;
+			block->received = std::chrono::steady_clock::now();
+			board.recvMicros.record(telemetry::micros(recvStart, block->received));
+			board.recvSamples.record(numNewSamples);
+			board.recvCalls.add();
+			board.recvSampleCount.add(numNewSamples);
+			// hand the block to the writer threads and go straight back to recv
+			board.pipeline->submit(block);
 
 /*
-		// Write the time to file for sync purposes
-        uhd::sensor_value_t gps_time = usrp->get_mboard_sensor("gps_time");
-		// uhd::sensor_value_t NMEA = usrp->get_mboard_sensor("gps_gpgga");
-		
-		std::string filePath (file);
-		std::ofstream gps_data;
-		std::string fileName(filePath + "_gpsData.txt");
-		gps_data.open(fileName, std::ofstream::app);
-		gps_data << boost::format("%s") % gps_time.to_pp_string() << std::endl;
-		gps_data.close();		
+			// Write the time to file for sync purposes
+			uhd::sensor_value_t gps_time = usrp->get_mboard_sensor("gps_time");
+			// uhd::sensor_value_t NMEA = usrp->get_mboard_sensor("gps_gpgga");
+			
+			std::string filePath (file);
+			std::ofstream gps_data;
+			std::string fileName(filePath + "_gpsData.txt");
+			gps_data.open(fileName, std::ofstream::app);
+			gps_data << boost::format("%s") % gps_time.to_pp_string() << std::endl;
+			gps_data.close();		
 */
 
-        // increase the received samples count
-		// NOTE: for some reason, this does not always update, this should be investigated
-		numSamplesReceived += numNewSamples;
-    }
+			// recv returns 0 samples on a timeout or overflow, the index records where it happened
+			if (rxMetadata.error_code == uhd::rx_metadata_t::ERROR_CODE_OVERFLOW) {
+				board.numOverflows++;
+				board.recvOverflows.add();
+			} else if (rxMetadata.error_code == uhd::rx_metadata_t::ERROR_CODE_TIMEOUT) {
+				if (numSamplesReceived > 0) {
+					board.numTimeouts++;
+					board.recvTimeouts.add();
+				}
+			} else if (rxMetadata.error_code != uhd::rx_metadata_t::ERROR_CODE_NONE) {
+				board.numErrors++;
+				if (rxMetadata.error_code == uhd::rx_metadata_t::ERROR_CODE_LATE_COMMAND) {
+					board.recvLate.add();
+				} else {
+					board.recvErrors.add();
+				}
+				std::cerr << boost::format("\nReceive error on motherboard %i at sample %i: %s") % board.mboard % numSamplesReceived % rxMetadata.strerror() << std::endl;
+			}
+			if (numNewSamples > 0) {
+				recvTimeout = 0.1;
+				// the device time of the first sample shows whether the boards started together
+				if (not board.haveStartTime and rxMetadata.has_time_spec) {
+					board.startTime = rxMetadata.time_spec;
+					board.haveStartTime = true;
+					board.firstSampleAfter = bringUpTimer.elapsed();
+				}
+			}
+
+			// increase the received samples count
+			numSamplesReceived += numNewSamples;
+			board.progress.store(numSamplesReceived, std::memory_order_relaxed);
+			// a replayed recording that has run out (--sim loop=0) ends the run early
+			if (rxMetadata.end_of_burst) {
+				std::cout << boost::format("\nThe source of motherboard %i ended after %.0f samples") % board.mboard % numSamplesReceived << std::endl;
+				break;
+			}
+		}
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuEnd);
+		board.recvCpuTime = (cpuEnd.tv_sec - cpuStart.tv_sec) + (cpuEnd.tv_nsec - cpuStart.tv_nsec) * 1e-9;
+		board.recvWallTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+		board.finished = true;
+	};
+	
+	if (boards.size() == 1) {
+		receive(boards[0]);
+	} else {
+		for (auto& board : boards) {
+			BoardStream* boardPtr = &board;
+			board.thread = std::thread ([&receive, boardPtr] {
+				uhd::set_thread_priority_safe();
+				numa::pinThread(std::vector<int> {boardPtr->cpu});
+				telemetry::nameThread("recv" + std::to_string(boardPtr->mboard));
+				receive(*boardPtr);
+			});
+		}
+		// the main thread only reports progress while the boards receive
+		while (not std::all_of(boards.begin(), boards.end(), [](const BoardStream& board) { return board.finished.load(); })) {
+			if (print_time == "y") {
+				std::cout << "Recording Progress:";
+				for (auto& board : boards) {
+					PipelineStats stats = board.pipeline->stats();
+					std::cout << boost::format(" mb%i %.0f%% queue %i/%i (max %i)") % board.mboard % (board.progress.load() / totalSamplesToReceive * 100)
+								 % stats.queueDepth % stats.queueCapacity % stats.queueHighWater;
+				}
+				std::cout << " \r" << std::flush;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		}
+		for (auto& board : boards) {
+			board.thread.join();
+		}
+	}
+	
+	// a board that lost samples to overflows still counts them, so the longest stream is the recording length
+	double numSamplesReceived = 0;
+	size_t numOverflows = 0, numTimeouts = 0, numErrors = 0;
+	for (auto& board : boards) {
+		numSamplesReceived = std::max(numSamplesReceived, board.numSamplesReceived);
+		numOverflows += board.numOverflows;
+		numTimeouts += board.numTimeouts;
+		numErrors += board.numErrors;
+		board.pipeline->finish();
+	}
+	// flush the last partial writes and trim the preallocated files
+	try {
+		for (unsigned int i = 0; i < outfiles.size(); i++) {
+			outfiles[i]->close();
+		}
+		for (auto& checksum : checksums) {
+			checksum->finish();
+		}
+		if (manifest) {
+			manifest->close();
+		}
+		if (container) {
+			container->close(numSamplesReceived);
+		}
+		if (trigger) {
+			trigger->finish();
+		}
+		if (monitor) {
+			monitor->finish();
+		}
+		if (channelizer) {
+			channelizer->finish();
+		}
+		if (live) {
+			live->finish();
+		}
+	} catch (const std::exception& e) {
+		std::cerr << e.what() << std::endl;
+	}
+	size_t numGaps = 0, numDropped = 0, numEntries = 0;
+	PipelineStats stats;
+	for (auto& board : boards) {
+		board.index->close();
+		numGaps += board.index->gaps();
+		numDropped += board.index->dropped();
+		numEntries += board.index->entries();
+		PipelineStats boardStats = board.pipeline->stats();
+		stats.blocksSubmitted += boardStats.blocksSubmitted;
+		stats.queueHighWater = std::max(stats.queueHighWater, boardStats.queueHighWater);
+		stats.queueCapacity = boardStats.queueCapacity;
+		stats.poolStalls += boardStats.poolStalls;
+	}
+	segmentList.close();
+	std::cout << boost::format("\nOverflows: %i, timeouts: %i, other receive errors: %i, gaps: %i (%i samples lost), index entries: %i")
+				 % numOverflows % numTimeouts % numErrors % numGaps % numDropped % numEntries << std::endl;
+	if (boards.size() > 1) {
+		// per board, so it shows whether one recv thread per link keeps up where a single one did not
+		for (auto& board : boards) {
+			double seconds = std::max(board.numSamplesReceived / (usrp ? usrp->get_rx_rate(0) : rate), 1e-9);
+			std::cout << boost::format("Motherboard %i: %i overflows (%.3f/s), %i timeouts, %i errors, %i samples lost, recv thread %.1f%% busy on CPU %i")
+						 % board.mboard % board.numOverflows % (board.numOverflows / seconds) % board.numTimeouts % board.numErrors
+						 % board.index->dropped() % (100.0 * board.recvCpuTime / std::max(board.recvWallTime, 1e-9)) % board.cpu;
+			if (board.haveStartTime and boards[0].haveStartTime) {
+				std::cout << boost::format(", first sample at %.9f s (%+i samples from motherboard 0)") % board.startTime.get_real_secs()
+							 % ((board.startTime - boards[0].startTime).to_ticks(usrp ? usrp->get_rx_rate(0) : rate));
+			}
+			std::cout << std::endl;
+		}
+	}
+	// launch to the last board's first sample, the figure --fast is there to bring down
+	double firstSampleAfter = 0.0;
+	for (auto& board : boards) {
+		firstSampleAfter = std::max(firstSampleAfter, board.firstSampleAfter);
+	}
+	if (firstSampleAfter > 0.0) {
+		std::cout << boost::format("Time to first sample: %.3f s (%s)") % firstSampleAfter % bringUpTimer.report() << std::endl;
+	}
+	std::cout << boost::format("\nWriter queue: %i blocks written, high-water mark %i/%i, %i recv stalls waiting for a free block")
+				 % stats.blocksSubmitted % stats.queueHighWater % stats.queueCapacity % stats.poolStalls << std::endl;
+	if (agent) {
+		// the first sample's device time lets the coordinator check that every host started on the same edge
+		agent->finish((boost::format("samples=%.0f overflows=%i timeouts=%i errors=%i lost=%i stalls=%i failed=%i first=%.9f")
+					   % numSamplesReceived % numOverflows % numTimeouts % numErrors % numDropped % stats.poolStalls % int(writeFailed.load())
+					   % (boards[0].haveStartTime ? boards[0].startTime.get_real_secs() : -1.0)).str());
+	}
+	if (trigger) {
+		double recordedTime = std::max(numSamplesReceived / (usrp ? usrp->get_rx_rate(0) : rate), 1e-9);
+		std::cout << boost::format("Events: %i triggered, %i incomplete%s; detector %.2f s CPU, %.1f%% of a core")
+					 % trigger->triggered() % trigger->incomplete() % (trigger->warmedUp() ? "" : " (the noise floor was still being learnt)")
+					 % trigger->detectorCpuTime() % (100.0 * trigger->detectorCpuTime() / recordedTime) << std::endl;
+	}
+	if (monitor) {
+		double recordedTime = std::max(numSamplesReceived / (usrp ? usrp->get_rx_rate(0) : rate), 1e-9);
+		std::cout << boost::format("Live spectrum: %i frames, %.2f s CPU, %.2f%% of a core")
+					 % monitor->frames() % monitor->cpuTime() % (100.0 * monitor->cpuTime() / recordedTime) << std::endl;
+	}
+	if (live) {
+		uint64_t blocksRead, blocksSkipped;
+		size_t subscribers = live->subscribers(&blocksRead, &blocksSkipped);
+		std::cout << boost::format("Live ring: %i blocks per channel published, %i subscribers still attached, all subscribers read %i blocks and missed %i")
+					 % live->blocks(0) % subscribers % blocksRead % blocksSkipped << std::endl;
+	}
+	if (channelizer) {
+		// the share of a core each sub-band needs, and what the decimation saved on disk
+		double recordedTime = std::max(numSamplesReceived / (usrp ? usrp->get_rx_rate(0) : rate), 1e-9);
+		for (size_t k = 0; k < channelizer->size(); k++) {
+			const SubBandDdc& band = channelizer->subBand(k);
+			std::cout << boost::format("Sub-band %i: %i samples at %.6f Msps (%.1f MB, 1/%i of the channel), %i values clipped, %.2f s CPU, %.1f%% of a core")
+						 % k % band.samplesOut() % (band.outputRate() / 1e6) % (band.samplesOut() * sizeof(std::complex<short>) / 1e6) % band.decimationFactor()
+						 % band.clippedValues() % channelizer->cpuTime(k) % (100.0 * channelizer->cpuTime(k) / recordedTime) << std::endl;
+		}
+	}
+	// anything other than 0 here means some blocks were not page-aligned and had to be gathered first
+	uint64_t bytesWritten = 0, bytesCopied = 0;
+	for (unsigned int i = 0; i < outfiles.size(); i++) {
+		bytesWritten += closedBytes[i] + outfiles[i]->size();
+		bytesCopied += closedCopied[i] + outfiles[i]->bytesCopied();
+	}
+	if (not compressors.empty()) {
+		// CPU cost relative to the recorded time is the share of one core each channel needs
+		double recordingTime = std::max(numSamplesReceived / (usrp ? usrp->get_rx_rate(0) : rate), 1e-9);
+		for (unsigned int i = 0; i < compressors.size(); i++) {
+			std::cout << boost::format("Channel %i compression: ratio %.2f (%.1f MB -> %.1f MB), %.2f s CPU, %.1f%% of a core, %.1f MS/s")
+						 % i % compressors[i]->ratio() % (compressors[i]->inputBytes() / 1e6) % (compressors[i]->outputBytes() / 1e6)
+						 % compressors[i]->cpuTime() % (100.0 * compressors[i]->cpuTime() / recordingTime)
+						 % (compressors[i]->inputBytes() / sizeof(std::complex<short>) / std::max(compressors[i]->cpuTime(), 1e-9) / 1e6) << std::endl;
+		}
+	} else if (not outfiles.empty()) {
+		for (unsigned int i = 0; i < converters.size(); i++) {
+			if (clipped[i] > 0) {
+				std::cout << boost::format("Channel %i: %i I/Q values clipped storing %s, consider a larger --storeshift") % i % clipped[i] % store << std::endl;
+			}
+		}
+		std::cout << boost::format("Bytes copied on the write path: %i of %i") % bytesCopied % bytesWritten << std::endl;
+	}
+	if (manifest) {
+		// the checksums' share of a core, from the writer threads
+		double recordedTime = std::max(numSamplesReceived / (usrp ? usrp->get_rx_rate(0) : rate), 1e-9), checksumTime = 0.0;
+		for (unsigned int i = 0; i < numRxChannels; i++) {
+			checksumTime += channelMetrics[i].checksumMicros.total() / 1e6;
+		}
+		std::cout << boost::format("Checksums: %i chunks in %s_manifest.txt, %.2f s CPU (%s), %.1f%% of a core, verify with usrpVerify --file=%s")
+					 % manifest->numChunks() % file % checksumTime % crc32c::kernel() % (100.0 * checksumTime / recordedTime) % file << std::endl;
+	}
+	if (volumes) {
+		volumes->close();
+		for (size_t v = 0; v < volumes->size(); v++) {
+			const VolumeSet::Volume& volume = volumes->volume(v);
+			std::cout << boost::format("Volume %i (%s): %i files, %.2f GB placed, %i of them taken over from a slow or full volume, %.0f us per block")
+						 % v % volume.directory % volume.files % (volume.placedBytes / 1e9) % volume.spills
+						 % (double(volume.writeMicros) / std::max<uint64_t>(volume.blocks, 1)) << std::endl;
+		}
+	}
+	
+	if (offloader) {
+		// the last segment and the run's own files
+		std::string filePath (file);
+		for (unsigned int i = 0; i < outfiles.size(); i++) {
+			offloader->add(channelPaths[i]);
+		}
+		if (container) {
+			offloader->add(filePath + ".usrp");
+		}
+		offloader->add(filePath + "_index.bin");
+		for (size_t mboard = 1; mboard < boards.size(); mboard++) {
+			offloader->add((boost::format("%s_index_mb%i.bin") % filePath % mboard).str());
+		}
+		for (size_t k = 0; channelizer and k < channelizer->size(); k++) {
+			offloader->add(channelizer->fileName(k));
+		}
+		offloader->add(filePath + "_metadata.txt");
+		if (segmentSamples > 0) {
+			offloader->add(filePath + "_segments.txt");
+		}
+		if (volumes) {
+			offloader->add(filePath + "_placement.txt");
+		}
+		if (manifest) {
+			offloader->add(filePath + "_manifest.txt");
+		}
+		std::cout << boost::format("Waiting for %i files to offload to %s") % offloader->pending() % offloadPath << std::endl;
+		offloader->finish();
+		std::cout << boost::format("Offloaded %i files (%.1f MB, %.1f MB/s), %i failed")
+					 % offloader->filesDone() % (offloader->bytesDone() / 1e6) % (offloader->bytesDone() / 1e6 / std::max(offloader->busyTime(), 1e-9))
+					 % offloader->filesFailed() << std::endl;
+	}
+	// runEttus.sh and cron only see the exit status
+	if (writeFailed) {
+		std::cerr << "\nRecording stopped early, the samples could not be written" << std::endl;
+		return ~0;
+	}
+	if (offloader and offloader->filesFailed() > 0) {
+		std::cerr << boost::format("\nRecording finished, but %i files could not be offloaded") % offloader->filesFailed() << std::endl;
+		return ~0;
+	}
 	std::cout << "\nFinished Recording" << std::endl;
     return 0;
 }
\ No newline at end of file
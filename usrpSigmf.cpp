@@ -0,0 +1,287 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <complex>
+#include <sstream>
+#include <ctime>
+#include <cmath>
+#include <algorithm>
+#include <cstdint>
+
+#include <boost/program_options.hpp>
+#include <boost/format.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+#include "containerFile.hpp"
+
+namespace po = boost::program_options;
+//==============================================================================
+// Exports channels of a usrpMultiRecord container (<file>.usrp) as SigMF
+// recordings: one <out>_chanN.sigmf-data/.sigmf-meta pair per channel plus a
+// <out>.sigmf-collection tying them together, which lists every stream with
+// the SHA-512 of its .sigmf-meta. The data files are plain ci16_le samples, so
+// they are also readable with readData.m.
+
+// ISO 8601 UTC time as SigMF wants it
+static std::string isoTime (double seconds) {
+	time_t whole = time_t(std::floor(seconds));
+	char text[32];
+	strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%S", gmtime(&whole));
+	return (boost::format("%s.%06iZ") % text % int((seconds - whole) * 1e6)).str();
+}
+
+// property_tree writes every value as a string and empty lists as "", SigMF wants
+// numbers, booleans and arrays
+static std::string fixTypes (const std::string& json) {
+	std::string out;
+	std::vector<char> nesting;
+	char previous = 0;
+	for (size_t pos = 0; pos < json.size(); pos++) {
+		char c = json[pos];
+		if (c != '"') {
+			if (c == '{' or c == '[') {
+				nesting.push_back(c);
+			} else if (c == '}' or c == ']') {
+				nesting.pop_back();
+			}
+			if (not isspace(c)) {
+				previous = c;
+			}
+			out += c;
+			continue;
+		}
+		size_t close = pos + 1;
+		while (json[close] != '"') {
+			close += json[close] == '\\' ? 2 : 1;
+		}
+		std::string value = json.substr(pos + 1, close - pos - 1);
+		// object keys follow { or , inside an object, everything else is a value
+		bool isValue = previous == ':' or (not nesting.empty() and nesting.back() == '[');
+		char* end = nullptr;
+		strtod(value.c_str(), &end);
+		if (isValue and not value.empty() and *end == '\0') {
+			out += value;
+		} else if (isValue and (value == "true" or value == "false")) {
+			out += value;
+		} else if (isValue and value.empty()) {
+			out += "[]";
+		} else {
+			out += json.substr(pos, close - pos + 1);
+		}
+		previous = '"';
+		pos = close;
+	}
+	return out;
+}
+
+// the text written, for the collection's hashes
+static std::string writeJson (const std::string& fileName, const boost::property_tree::ptree& tree) {
+	std::ostringstream json;
+	boost::property_tree::write_json(json, tree);
+	const std::string text = fixTypes(json.str());
+	std::ofstream out (fileName);
+	out << text;
+	if (not out) {
+		throw std::runtime_error("cannot write " + fileName);
+	}
+	return text;
+}
+
+// SHA-512 (FIPS 180-4) in lower case hex, as a collection's core:streams hash
+static std::string sha512 (const std::string& message) {
+	static const uint64_t K[80] = {
+		0x428a2f98d728ae22, 0x7137449123ef65cd, 0xb5c0fbcfec4d3b2f, 0xe9b5dba58189dbbc, 0x3956c25bf348b538, 0x59f111f1b605d019,
+		0x923f82a4af194f9b, 0xab1c5ed5da6d8118, 0xd807aa98a3030242, 0x12835b0145706fbe, 0x243185be4ee4b28c, 0x550c7dc3d5ffb4e2,
+		0x72be5d74f27b896f, 0x80deb1fe3b1696b1, 0x9bdc06a725c71235, 0xc19bf174cf692694, 0xe49b69c19ef14ad2, 0xefbe4786384f25e3,
+		0x0fc19dc68b8cd5b5, 0x240ca1cc77ac9c65, 0x2de92c6f592b0275, 0x4a7484aa6ea6e483, 0x5cb0a9dcbd41fbd4, 0x76f988da831153b5,
+		0x983e5152ee66dfab, 0xa831c66d2db43210, 0xb00327c898fb213f, 0xbf597fc7beef0ee4, 0xc6e00bf33da88fc2, 0xd5a79147930aa725,
+		0x06ca6351e003826f, 0x142929670a0e6e70, 0x27b70a8546d22ffc, 0x2e1b21385c26c926, 0x4d2c6dfc5ac42aed, 0x53380d139d95b3df,
+		0x650a73548baf63de, 0x766a0abb3c77b2a8, 0x81c2c92e47edaee6, 0x92722c851482353b, 0xa2bfe8a14cf10364, 0xa81a664bbc423001,
+		0xc24b8b70d0f89791, 0xc76c51a30654be30, 0xd192e819d6ef5218, 0xd69906245565a910, 0xf40e35855771202a, 0x106aa07032bbd1b8,
+		0x19a4c116b8d2d0c8, 0x1e376c085141ab53, 0x2748774cdf8eeb99, 0x34b0bcb5e19b48a8, 0x391c0cb3c5c95a63, 0x4ed8aa4ae3418acb,
+		0x5b9cca4f7763e373, 0x682e6ff3d6b2b8a3, 0x748f82ee5defb2fc, 0x78a5636f43172f60, 0x84c87814a1f0ab72, 0x8cc702081a6439ec,
+		0x90befffa23631e28, 0xa4506cebde82bde9, 0xbef9a3f7b2c67915, 0xc67178f2e372532b, 0xca273eceea26619c, 0xd186b8c721c0c207,
+		0xeada7dd6cde0eb1e, 0xf57d4f7fee6ed178, 0x06f067aa72176fba, 0x0a637dc5a2c898a6, 0x113f9804bef90dae, 0x1b710b35131c471b,
+		0x28db77f523047d84, 0x32caab7b40c72493, 0x3c9ebe0a15c9bebc, 0x431d67c49c100d4c, 0x4cc5d4becb3e42b6, 0x597f299cfc657e2a,
+		0x5fcb6fab3ad6faec, 0x6c44198c4a475817};
+	uint64_t h[8] = {0x6a09e667f3bcc908, 0xbb67ae8584caa73b, 0x3c6ef372fe94f82b, 0xa54ff53a5f1d36f1,
+					 0x510e527fade682d1, 0x9b05688c2b3e6c1f, 0x1f83d9abfb41bd6b, 0x5be0cd19137e2179};
+	auto rotate = [](uint64_t x, int n) { return (x >> n) | (x << (64 - n)); };
+	// a 1 bit, zeros up to 112 mod 128 bytes, then the length in bits as a 128 bit big endian number
+	std::string padded = message + '\x80';
+	padded.append((240 - padded.size() % 128) % 128, '\0');
+	const uint64_t bits = uint64_t(message.size()) * 8;
+	padded.append(8, '\0');
+	for (int k = 7; k >= 0; k--) {
+		padded += char(bits >> (8 * k));
+	}
+	for (size_t block = 0; block < padded.size(); block += 128) {
+		uint64_t w[80];
+		for (int t = 0; t < 16; t++) {
+			w[t] = 0;
+			for (int k = 0; k < 8; k++) {
+				w[t] = (w[t] << 8) | uint8_t(padded[block + 8 * t + k]);
+			}
+		}
+		for (int t = 16; t < 80; t++) {
+			const uint64_t s0 = rotate(w[t - 15], 1) ^ rotate(w[t - 15], 8) ^ (w[t - 15] >> 7);
+			const uint64_t s1 = rotate(w[t - 2], 19) ^ rotate(w[t - 2], 61) ^ (w[t - 2] >> 6);
+			w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+		}
+		uint64_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+		for (int t = 0; t < 80; t++) {
+			const uint64_t t1 = hh + (rotate(e, 14) ^ rotate(e, 18) ^ rotate(e, 41)) + ((e & f) ^ (~e & g)) + K[t] + w[t];
+			const uint64_t t2 = (rotate(a, 28) ^ rotate(a, 34) ^ rotate(a, 39)) + ((a & b) ^ (a & c) ^ (b & c));
+			hh = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+		const uint64_t state[8] = {a, b, c, d, e, f, g, hh};
+		for (int k = 0; k < 8; k++) {
+			h[k] += state[k];
+		}
+	}
+	std::string hex;
+	for (uint64_t word : h) {
+		hex += (boost::format("%016x") % word).str();
+	}
+	return hex;
+}
+
+int main (int argc, char* argv[]){
+	//variables to be set by po
+	std::string in, out, channelList;
+	double start, duration;
+
+	//setup the program options
+	po::options_description desc("Allowed options");
+	desc.add_options()
+		("help", "help message")
+		("in", po::value<std::string>(&in), "container written by usrpMultiRecord --format=container")
+		("out", po::value<std::string>(&out), "prefix of the SigMF files, defaults to the container name")
+		("channels", po::value<std::string>(&channelList)->default_value(""), "comma separated channels to export, empty for all")
+		("start", po::value<double>(&start)->default_value(0), "seconds from the start of the recording")
+		("duration", po::value<double>(&duration)->default_value(0), "seconds to export, 0 for everything after start")
+	;
+	po::variables_map vm;
+	po::store(po::parse_command_line(argc, argv, desc), vm);
+	po::notify(vm);
+
+	//print the help message
+	if (vm.count("help") or not vm.count("in")) {
+		std::cout << boost::format("USRP container to SigMF export %s") % desc << std::endl;
+		return ~0;
+	}
+	if (out.empty()) {
+		out = in.substr(0, in.rfind(".usrp"));
+	}
+
+	try {
+		ContainerReader container (in);
+		const ContainerHeader& info = container.info();
+		const boost::property_tree::ptree& runInfo = container.metadata();
+
+		std::vector<uint32_t> channels;
+		std::stringstream list (channelList);
+		std::string item;
+		while (std::getline(list, item, ',')) {
+			channels.push_back(std::stoul(item));
+		}
+		if (channels.empty()) {
+			for (uint32_t i = 0; i < info.numChannels; i++) {
+				channels.push_back(i);
+			}
+		}
+
+		uint64_t first = std::min<uint64_t>(std::llround(start * info.rate), info.numSamples);
+		uint64_t count = info.numSamples - first;
+		if (duration > 0) {
+			count = std::min<uint64_t>(count, std::llround(duration * info.rate));
+		}
+		std::cout << boost::format("Exporting %i samples from sample %i of %i channels") % count % first % channels.size() << std::endl;
+
+		// the capture starts at GPS time if the recorder could read the GPSDO, otherwise at the system time
+		boost::optional<double> gpsStart = runInfo.get_optional<double>("start.gps_time");
+		double captureStart = (gpsStart ? *gpsStart : runInfo.get<double>("start.system_time", 0)) + first / info.rate;
+
+		boost::property_tree::ptree collectionStreams;
+		std::vector<std::complex<short>> buffer (info.chunkSamples);
+		for (uint32_t channel : channels) {
+			if (channel >= info.numChannels) {
+				throw std::runtime_error("container has no channel " + std::to_string(channel));
+			}
+			std::string name = out + "_chan" + std::to_string(channel);
+			std::ofstream data (name + ".sigmf-data", std::ofstream::binary | std::ofstream::trunc);
+			uint64_t done = 0;
+			while (done < count) {
+				size_t n = container.read(channel, first + done, std::min<uint64_t>(buffer.size(), count - done), buffer.data());
+				data.write(reinterpret_cast<const char*>(buffer.data()), n * sizeof(std::complex<short>));
+				done += n;
+			}
+			if (not data) {
+				throw std::runtime_error("cannot write " + name + ".sigmf-data");
+			}
+
+			// find this channel's settings in the recorder metadata
+			boost::property_tree::ptree params;
+			for (const auto& entry : runInfo.get_child("channels", boost::property_tree::ptree())) {
+				if (entry.second.get<uint32_t>("index", ~0u) == channel) {
+					params = entry.second;
+				}
+			}
+
+			boost::property_tree::ptree meta, global, capture, captures, annotations;
+			global.put("core:datatype", "ci16_le");
+			global.put("core:sample_rate", info.rate);
+			global.put("core:version", "1.0.0");
+			global.put("core:num_channels", 1);
+			global.put("core:recorder", runInfo.get<std::string>("recorder", "usrpMultiRecord"));
+			global.put("core:hw", runInfo.get<std::string>("device", "") + " channel " + std::to_string(channel));
+			global.put("core:description", (boost::format("Gain %.1f dB, bandwidth %.0f Hz, clock %s, PPS %s")
+											% params.get<double>("gain", 0) % params.get<double>("bandwidth", 0)
+											% runInfo.get<std::string>("clock_source", "") % runInfo.get<std::string>("time_source", "")).str());
+			if (runInfo.get<bool>("gps.fix", false)) {
+				// GeoJSON point, longitude first
+				boost::property_tree::ptree geolocation, coordinates, value;
+				geolocation.put("type", "Point");
+				for (const char* key : {"gps.longitude", "gps.latitude", "gps.altitude"}) {
+					value.put("", runInfo.get<double>(key));
+					coordinates.push_back(std::make_pair("", value));
+				}
+				geolocation.add_child("coordinates", coordinates);
+				global.add_child("core:geolocation", geolocation);
+			}
+			capture.put("core:sample_start", 0);
+			capture.put("core:frequency", params.get<double>("frequency", 0));
+			capture.put("core:datetime", isoTime(captureStart));
+			captures.push_back(std::make_pair("", capture));
+			meta.add_child("global", global);
+			meta.add_child("captures", captures);
+			meta.add_child("annotations", annotations);
+			const std::string metaText = writeJson(name + ".sigmf-meta", meta);
+
+			boost::property_tree::ptree stream;
+			stream.put("name", name.substr(name.rfind('/') + 1));
+			stream.put("hash", sha512(metaText));
+			collectionStreams.push_back(std::make_pair("", stream));
+			std::cout << boost::format("Wrote %s.sigmf-data/.sigmf-meta") % name << std::endl;
+		}
+
+		boost::property_tree::ptree collection, collectionGlobal;
+		collectionGlobal.put("core:version", "1.0.0");
+		collectionGlobal.put("core:description", "usrpMultiRecord capture " + in);
+		collectionGlobal.add_child("core:streams", collectionStreams);
+		collection.add_child("collection", collectionGlobal);
+		writeJson(out + ".sigmf-collection", collection);
+	} catch (const std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return ~0;
+	}
+	return 0;
+}
@@ -0,0 +1,169 @@
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <csignal>
+#include <ctime>
+
+#include <boost/program_options.hpp>
+#include <boost/format.hpp>
+
+#include "spectrumMonitor.hpp"
+
+namespace po = boost::program_options;
+//==============================================================================
+// Terminal view of the live spectrum usrpMultiRecord --spectrum publishes,
+// in place of rx_ascii_art_dft which needs the device to itself. Every
+// channel gets a bar graph; the bins under each column are reduced to their
+// maximum so narrow carriers stay visible at any terminal width.
+
+static volatile std::sig_atomic_t stopRequested = 0;
+
+static void handleSignal (int) {
+	stopRequested = 1;
+}
+
+static std::string render (const SpectrumFrameHeader& header, const std::vector<double>& frequencies, const std::vector<float>& power,
+						   const std::vector<size_t>& channels, size_t width, size_t height, double floorDb, double ceilingDb, bool autoRange) {
+	const size_t numBins = header.numBins;
+	std::ostringstream out;
+	time_t updated = header.updated;
+	std::string when (std::ctime(&updated));
+	out << boost::format("%i averages, frame at sample %i, %s") % header.averages % header.sampleOffset % when.substr(0, when.find('\n')) << "\n";
+	for (size_t ch : channels) {
+		const float* bins = power.data() + ch * numBins;
+		std::vector<float> columns (width, -1e9f);
+		for (size_t k = 0; k < numBins; k++) {
+			size_t column = k * width / numBins;
+			columns[column] = std::max(columns[column], bins[k]);
+		}
+		// columns narrower than a bin repeat the one they fall in
+		for (size_t column = 0; column < width; column++) {
+			if (columns[column] < -1e8f) {
+				columns[column] = bins[std::min(numBins - 1, (2 * column + 1) * numBins / (2 * width))];
+			}
+		}
+		size_t peak = std::max_element(bins, bins + numBins) - bins;
+		std::vector<float> sorted (bins, bins + numBins);
+		std::nth_element(sorted.begin(), sorted.begin() + numBins / 2, sorted.end());
+		float median = sorted[numBins / 2];
+		double low = floorDb, high = ceilingDb;
+		if (autoRange) {
+			// the median bin is a good enough noise floor, leave some of it visible
+			low = std::floor((median - 10.0) / 10.0) * 10.0;
+			high = std::max(low + 20.0, std::ceil((bins[peak] + 5.0) / 10.0) * 10.0);
+		}
+		double binWidth = header.sampleRate / numBins;
+		double peakFrequency = frequencies[ch] + (double(peak) - numBins / 2.0) * binWidth;
+		out << boost::format("Ch %i  Fc %.4f MHz  peak %.1f dBFS at %.4f MHz  noise %.1f dBFS/bin")
+			   % ch % (frequencies[ch] / 1e6) % bins[peak] % (peakFrequency / 1e6) % median << "\n";
+		for (size_t row = 0; row < height; row++) {
+			double level = high - (high - low) * (row + 0.5) / height;
+			out << boost::format("%7.1f |") % (high - (high - low) * row / height);
+			for (size_t column = 0; column < width; column++) {
+				out << (columns[column] >= level ? '*' : ' ');
+			}
+			out << "\n";
+		}
+		std::string left = (boost::format("%.3f") % ((frequencies[ch] - header.sampleRate / 2) / 1e6)).str();
+		std::string centre = (boost::format("%.3f") % (frequencies[ch] / 1e6)).str();
+		std::string right = (boost::format("%.3f MHz") % ((frequencies[ch] + header.sampleRate / 2) / 1e6)).str();
+		std::string axis (width, ' ');
+		axis.replace(0, left.size(), left);
+		if (width > centre.size() + left.size() + right.size() + 2) {
+			axis.replace(width / 2 - centre.size() / 2, centre.size(), centre);
+			axis.replace(width - right.size(), right.size(), right);
+		}
+		out << "        " << axis << "\n";
+	}
+	return out.str();
+}
+
+int main (int argc, char* argv[]){
+	//variables to be set by po
+	std::string file, channelList;
+	size_t width, height;
+	double floorDb = -120.0, ceilingDb = 0.0, refresh;
+
+	//setup the program options
+	po::options_description desc("Allowed options");
+	desc.add_options()
+		("help", "help message")
+		("file", po::value<std::string>(&file)->default_value("/dev/shm/usrpSpectrum"), "spectrum file, as passed to usrpMultiRecord --spectrum")
+		("channels", po::value<std::string>(&channelList)->default_value(""), "comma separated channels to show, empty for all")
+		("width", po::value<size_t>(&width)->default_value(100), "columns of the bar graphs")
+		("height", po::value<size_t>(&height)->default_value(10), "rows per channel")
+		("min", po::value<double>(&floorDb), "bottom of the graphs in dBFS, automatic if neither --min nor --max is given")
+		("max", po::value<double>(&ceilingDb), "top of the graphs in dBFS")
+		("refresh", po::value<double>(&refresh)->default_value(0.5), "seconds between redraws")
+		("once", "print the current frame once and exit")
+	;
+	po::variables_map vm;
+	po::store(po::parse_command_line(argc, argv, desc), vm);
+	po::notify(vm);
+
+	//print the help message
+	if (vm.count("help")) {
+		std::cout << boost::format("Live spectrum of a running recording %s") % desc << std::endl;
+		return ~0;
+	}
+	const bool autoRange = not vm.count("min") and not vm.count("max");
+	if (not autoRange and ceilingDb <= floorDb) {
+		std::cerr << "--max has to be above --min" << std::endl;
+		return ~0;
+	}
+	width = std::max<size_t>(width, 10);
+	height = std::max<size_t>(height, 2);
+
+	std::signal(SIGINT, handleSignal);
+	std::signal(SIGTERM, handleSignal);
+	try {
+		SpectrumFrame frame (file, false);
+		std::vector<size_t> channels;
+		std::stringstream list (channelList);
+		std::string item;
+		while (std::getline(list, item, ',')) {
+			channels.push_back(std::stoul(item));
+		}
+		if (channels.empty()) {
+			for (size_t ch = 0; ch < frame.info().numChannels; ch++) {
+				channels.push_back(ch);
+			}
+		}
+		for (size_t ch : channels) {
+			if (ch >= frame.info().numChannels) {
+				throw std::runtime_error((boost::format("channel %i is not in %s (%i channels)") % ch % file % frame.info().numChannels).str());
+			}
+		}
+
+		SpectrumFrameHeader header;
+		std::vector<double> frequencies;
+		std::vector<float> power;
+		uint64_t shown = 0;
+		while (not stopRequested) {
+			if (not frame.read(header, frequencies, power)) {
+				if (vm.count("once")) {
+					throw std::runtime_error("no spectrum published in " + file + " yet");
+				}
+			} else if (header.sequence != shown) {
+				shown = header.sequence;
+				std::string text = render(header, frequencies, power, channels, width, height, floorDb, ceilingDb, autoRange);
+				if (vm.count("once")) {
+					std::cout << text << std::flush;
+					break;
+				}
+				// home and clear, then draw the whole frame in one write
+				std::cout << "\033[H\033[2J" << text << std::flush;
+			}
+			std::this_thread::sleep_for(std::chrono::duration<double>(refresh));
+		}
+	} catch (const std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return ~0;
+	}
+	return 0;
+}
@@ -5,6 +5,7 @@
 #include <fstream>
 #include <csignal>
 #include <chrono>
+#include <memory>
 
 #include <boost/program_options.hpp>
 #include <boost/format.hpp>
@@ -15,34 +16,68 @@
 #include <uhd/types/device_addr.hpp>
 #include <uhd/utils/thread.hpp>
 
+#include "fileWriter.hpp"
+#include "simStreamer.hpp"
+#include "levelStats.hpp"
+#include "topology.hpp"
+
 namespace po = boost::program_options;
 //==============================================================================
+// Gain sweep and calibration. A single stream of all --chan channels stays
+// open for a pass and every gain step is a timed command at a known sample
+// offset, so step k covers samples [k * stepSamples, (k + 1) * stepSamples) of
+// the pass. The first --settle seconds of each step are skipped and the rest is
+// measured as it arrives: RMS, peak, clipped values and an ADC code histogram
+// per step and channel go to <file>_sweep.txt and <file>_histogram.txt.
+//
+// Every channel picks the highest gain whose peak stays --headroom dB below
+// full scale with at most --maxclip of its values clipped, and the choices are
+// written to <file>_gains.txt for usrpMultiRecord --gainprofile. With --coarse
+// a first pass steps the whole range in coarse steps, and a second pass steps
+// each channel through the coarse step above its choice at --step, all
+// channels at once, so a 70 dB range at 1 dB takes about 20 steps instead of 71.
+
+// one gain step of a pass, the gain of every channel and what was measured with it
+struct SweepStep {
+	size_t pass;
+	std::vector<double> gains;
+	std::vector<LevelStats> stats;
+	size_t overflows = 0;
+};
 
 int main (int argc, char* argv[]){
 	uhd::set_thread_priority_safe();
 	
-    // Network adapters need some configuration to work with x300. This script does all that. Proved to work for GNU Radio 100 times before.
-    std::cout << "Configuring network adapter settings" << std::endl;
-	// NB: This file should be used to set ALL variables
-    system("./usrp_x300_init.sh");
-
 	//variables to be set by po
-    std::string devAddresses, file, ref, pps;
-    size_t spb;
-    double rate, freq, bw, setup_time, wait_for_lock, tuneMin, tuneMax, stepSize, total_num_samps;
+    std::string devAddresses, file, ref, pps, ioMode, simArgs, profileName, topologyFile;
+    size_t spb, ioSize, lookahead, numChannels;
+    double rate, freq, bw, setup_time, wait_for_lock, tuneMin, tuneMax, stepSize, coarseSize, total_num_samps, settleTime, clipLevel, maxClip, headroom;
 	uhd::rx_metadata_t md;
 	
     //setup the program options
     po::options_description desc("Allowed options");
     desc.add_options()
         ("help", "help message")
-        ("dev", po::value<std::string>(&devAddresses)->default_value("addr0=192.168.40.2"), "multi uhd device address args")
-        ("file", po::value<std::string>(&file)->default_value("usrp_samples.bin"), "name of the file to write binary samples to")
-        ("spb", po::value<size_t>(&spb), "samples per buffer")
+        ("dev", po::value<std::string>(&devAddresses)->default_value("addr0=192.168.40.2"), "multi uhd device address args (dev=addr0=192.168.40.2, addr1=192.168.50.2)")
+        ("sim", po::value<std::string>(&simArgs), "use a simulated sample source instead of a device, with a simulated front-end gain (see simStreamer.hpp)")
+        ("file", po::value<std::string>(&file)->default_value("usrp_samples.bin"), "prefix of the sweep result files")
+		("chan", po::value<size_t>(&numChannels)->default_value(1), "number of channels to calibrate at once, in usrpMultiRecord's channel order")
+		("topology", po::value<std::string>(&topologyFile)->default_value(""), "the channel topology usrpMultiRecord --topology records with, its gains are swept over (see topology.hpp)")
+        ("spb", po::value<size_t>(&spb), "samples per recv call")
+        ("raw", "also write the raw samples of the whole sweep to <file>_chanN.bin")
+		("io", po::value<std::string>(&ioMode)->default_value("buffered"), "file write mode for --raw (buffered, direct, uring)")
+		("iosize", po::value<size_t>(&ioSize)->default_value(1 << 20), "bytes per disk write for direct and uring, rounded up to 4096")
 		("tuneMin", po::value<double>(&tuneMin)->default_value(0.0), "Minimum tune range")
 		("tuneMax", po::value<double>(&tuneMax)->default_value(70.0), "Maximum tune range")
 		("step", po::value<double>(&stepSize)->default_value(1.0), "Setp size")
-		("nsamps", po::value<double>(&total_num_samps)->default_value(100.0), "total number of samples to receive")
+		("coarse", po::value<double>(&coarseSize)->default_value(0.0), "step of a first coarse pass, refined per channel at --step in a second pass, 0 for a single pass")
+		("nsamps", po::value<double>(&total_num_samps)->default_value(100.0), "samples measured per gain step")
+		("settle", po::value<double>(&settleTime)->default_value(0.01), "seconds skipped after every gain change")
+		("clip", po::value<double>(&clipLevel)->default_value(32000), "|I| or |Q| counted as clipped from this code up")
+		("maxclip", po::value<double>(&maxClip)->default_value(0.0), "largest share of clipped I/Q values a chosen gain may have")
+		("headroom", po::value<double>(&headroom)->default_value(1.0), "dB the peak of a chosen gain stays below full scale")
+		("profile", po::value<std::string>(&profileName)->default_value(""), "gain profile to write, <file>_gains.txt when empty")
+		("lookahead", po::value<size_t>(&lookahead)->default_value(2), "gain steps queued on the device ahead of the samples")
         ("rate", po::value<double>(&rate)->default_value(0.0), "rate of incoming samples")
         ("freq", po::value<double>(&freq)->default_value(0.0), "RF center frequency in Hz")
 		("wait", po::value<double>(&wait_for_lock)->default_value(120), "wait time for gps lock")
@@ -58,193 +93,236 @@ int main (int argc, char* argv[]){
     //print the help message
     if (vm.count("help")) {
         std::cout << boost::format("USRP Tune Gain %s") % desc << std::endl;
-        std::cout << std::endl << "This application tunes a single USRP channel for the correct gain.\n" << std::endl;
+        std::cout << std::endl << "This application finds the gain of any number of USRP channels at once.\n" << std::endl;
         return ~0;
     }
+    if (total_num_samps < 1 or clipLevel < 1 or clipLevel > 32768) {
+		std::cerr << "Please specify a positive --nsamps and a --clip level between 1 and 32768" << std::endl;
+		return ~0;
+	}
+	// the same ports as usrpMultiRecord records from, the frequencies included
+	Topology topology;
+	try {
+		topology = topologyFile.empty() ? Topology::standard(numChannels, freq, 0.0) : Topology::load(topologyFile, freq, 0.0);
+		topology.check();
+		numChannels = topology.size();
+	} catch (const std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return ~0;
+	}
+	if (stepSize <= 0 or tuneMax < tuneMin) {
+		std::cerr << "Please specify a positive --step and --tuneMax at or above --tuneMin" << std::endl;
+		return ~0;
+	}
+	std::string filePath (file);
+	if (profileName.empty()) {
+		profileName = filePath + "_gains.txt";
+	}
 	
-    // construct a multi usrp from the device adresses
-    std::cout << "\nConstructing the multi USRP object" << std::endl;
-    uhd::usrp::multi_usrp::sptr usrp = uhd::usrp::multi_usrp::make (devAddresses);
+	uhd::usrp::multi_usrp::sptr usrp;
+	uhd::rx_streamer::sptr rxStream;
+	std::shared_ptr<SimStreamer> simStream;
+	if (not simArgs.empty()) {
+		// hardware-free run to try the sweep engine, the simulated front end applies the gains
+		if (rate <= 0.0){
+			std::cerr << "Please specify a valid sample rate" << std::endl;
+			return ~0;
+		}
+		std::cout << "\nUsing simulated sample source: " << simArgs << std::endl;
+		try {
+			rxStream = makeSimStreamer(simArgs, numChannels, rate);
+			simStream = std::dynamic_pointer_cast<SimStreamer>(rxStream);
+		} catch (const std::exception& e) {
+			std::cerr << e.what() << std::endl;
+			return ~0;
+		}
+	} else {
+	    // Network adapters need some configuration to work with x300. This script does all that. Proved to work for GNU Radio 100 times before.
+	    std::cout << "Configuring network adapter settings" << std::endl;
+		// NB: This file should be used to set ALL variables
+	    system("./usrp_x300_init.sh");
 	
-	// setup the sub device and antenna ports to be used with each channel
-	// subdev_spec_t((daughterboard, daughterboard channel),URSP Number))
-	// set_rx_antenna(port, system channel)
-	usrp->set_rx_subdev_spec(uhd::usrp::subdev_spec_t("A:0"), 0);
-	usrp->set_rx_antenna ("RX1",0);	
+	    // construct a multi usrp from the device adresses
+	    std::cout << "\nConstructing the multi USRP object" << std::endl;
+	    usrp = uhd::usrp::multi_usrp::make (devAddresses);
+		
+		// setup the sub device and antenna ports to be used with each channel, the same as usrpMultiRecord
+		for (size_t mboard = 0; mboard < topology.numMboards(); mboard++) {
+			usrp->set_rx_subdev_spec(uhd::usrp::subdev_spec_t(topology.subdevSpec(mboard)), mboard);
+		}
+		for (size_t i = 0; i < numChannels; i++) {
+			usrp->set_rx_antenna (topology[i].antenna, i);
+		}
 
-	double mcr0 = usrp->get_master_clock_rate(0);
-	std::cout << "\nMaster clock for USRP 1: " << mcr0 << std::endl;
+		for (size_t mboard = 0; mboard < topology.numMboards(); mboard++) {
+			std::cout << boost::format("\nMaster clock for USRP %i: %f") % (mboard + 1) % usrp->get_master_clock_rate(mboard) << std::endl;
+		}
 	
-	// clocking and syncing
-	if(ref == "gpsdo" or pps == "gpsdo") {
-		size_t num_mboards    = usrp->get_num_mboards();
-		size_t num_gps_locked = 0;
-		for (size_t mboard = 0; mboard < num_mboards; mboard++) {
-			std::cout << "Synchronizing mboard " << mboard << ": " << usrp->get_mboard_name(mboard) << std::endl;			
-			// Wait for GPS lock
-			uhd::sensor_value_t gps_locked = usrp->get_mboard_sensor("gps_locked", mboard);
-			// Wait 2 minutes for the clock to settle
-			std::cout << "\nWaiting for GPS lock\n" << std::flush;
-			for (int i = 0; i < wait_for_lock and not gps_locked.to_bool(); i++) {
-				gps_locked = usrp->get_mboard_sensor("gps_locked", mboard);
-				if (gps_locked.to_bool()) {
-					num_gps_locked++;
-				} else {
-					std::cout << i+1 << "/" << wait_for_lock << "\r" << std::flush;
-					std::this_thread::sleep_for(std::chrono::seconds(1));
+		// clocking and syncing
+		if(ref == "gpsdo" or pps == "gpsdo") {
+			size_t num_mboards    = usrp->get_num_mboards();
+			size_t num_gps_locked = 0;
+			for (size_t mboard = 0; mboard < num_mboards; mboard++) {
+				std::cout << "Synchronizing mboard " << mboard << ": " << usrp->get_mboard_name(mboard) << std::endl;			
+				// Wait for GPS lock
+				uhd::sensor_value_t gps_locked = usrp->get_mboard_sensor("gps_locked", mboard);
+				// Wait 2 minutes for the clock to settle
+				std::cout << "\nWaiting for GPS lock\n" << std::flush;
+				for (int i = 0; i < wait_for_lock and not gps_locked.to_bool(); i++) {
+					gps_locked = usrp->get_mboard_sensor("gps_locked", mboard);
+					if (gps_locked.to_bool()) {
+						num_gps_locked++;
+					} else {
+						std::cout << i+1 << "/" << wait_for_lock << "\r" << std::flush;
+						std::this_thread::sleep_for(std::chrono::seconds(1));
+					}
 				}
-			}
 			
-			// check for gps and reference clock lock
-			gps_locked = usrp->get_mboard_sensor("gps_locked", mboard);
-			uhd::sensor_value_t ref_locked = usrp->get_mboard_sensor("ref_locked", mboard);
+				// check for gps and reference clock lock
+				gps_locked = usrp->get_mboard_sensor("gps_locked", mboard);
+				uhd::sensor_value_t ref_locked = usrp->get_mboard_sensor("ref_locked", mboard);
 			
-			if (gps_locked.to_bool() and ref_locked.to_bool()) {
-				// Set to GPS time
-				std::cout << "\nGPS LOCKED on mboard: " << mboard << std::endl << std::endl;
-				usrp->set_time_source(pps, mboard);
-				usrp->set_clock_source(ref, mboard);
+				if (gps_locked.to_bool() and ref_locked.to_bool()) {
+					// Set to GPS time
+					std::cout << "\nGPS LOCKED on mboard: " << mboard << std::endl << std::endl;
+					usrp->set_time_source(pps, mboard);
+					usrp->set_clock_source(ref, mboard);
+				
+					const uhd::time_spec_t last_pps_time = usrp->get_time_last_pps();
+					while (last_pps_time == usrp->get_time_last_pps()){
+						//sleep 100 milliseconds (give or take)
+						std::this_thread::sleep_for (std::chrono::milliseconds(50));
+					}
+					// Sync the GPS and USRP clocks
+					// TODO: I am not sure if we need to actually set this manually or whether the driver handles this for you??
+					// As I understand it from the documentation, its automatic: https://files.ettus.com/manual/page_sync.html
 				
+					// TODO: THIS DOES NOT WORK PROPERLY
+					// uhd::time_spec_t gps_time = uhd::time_spec_t(int64_t(usrp->get_mboard_sensor("gps_time", mboard).to_int()));
+					// usrp->set_time_next_pps(gps_time + 1, mboard);
+					// usrp->set_time_next_pps(uhd::time_spec_t(usrp->get_mboard_sensor("gps_time").to_int()+1.0), mboard);
+				
+					usrp->set_time_next_pps(uhd::time_spec_t(0.0), mboard);
+				
+					// TODO: This resyncs the two boards but this needs to be improved
+					if (mboard == 1) {
+						usrp->set_time_next_pps(uhd::time_spec_t(0.0), 0);
+						usrp->set_time_next_pps(uhd::time_spec_t(0.0), 1);
+					}
+
+				} else {
+					// Set to unsynced time.
+					std::cout << "\nNO GPS LOCK\n" << std::endl;
+					return ~0;
+				}
+			}	
+		} else {
+			size_t num_mboards = usrp->get_num_mboards();
+			for (size_t mboard = 0; mboard < num_mboards; mboard++) {
+				std::cout << "Setting device timestamp" << std::endl;
+				std::cout << "Synchronizing mboard " << mboard << ": " << usrp->get_mboard_name(mboard) << std::endl;
+				usrp->set_clock_source(ref, mboard);
+				usrp->set_time_source(pps, mboard);
+				// set_sync_source(device_addr_t("clock_source=$CLOCK_SOURCE,time_source=$TIME_SOURCE"))
 				const uhd::time_spec_t last_pps_time = usrp->get_time_last_pps();
 				while (last_pps_time == usrp->get_time_last_pps()){
 					//sleep 100 milliseconds (give or take)
 					std::this_thread::sleep_for (std::chrono::milliseconds(50));
 				}
-				// Sync the GPS and USRP clocks
-				// TODO: I am not sure if we need to actually set this manually or whether the driver handles this for you??
-				// As I understand it from the documentation, its automatic: https://files.ettus.com/manual/page_sync.html
-				
-				// TODO: THIS DOES NOT WORK PROPERLY
-				// uhd::time_spec_t gps_time = uhd::time_spec_t(int64_t(usrp->get_mboard_sensor("gps_time", mboard).to_int()));
-				// usrp->set_time_next_pps(gps_time + 1, mboard);
-				// usrp->set_time_next_pps(uhd::time_spec_t(usrp->get_mboard_sensor("gps_time").to_int()+1.0), mboard);
-				
+				// This command will be processed fairly soon after the last PPS edge:
 				usrp->set_time_next_pps(uhd::time_spec_t(0.0), mboard);
-				
 				// TODO: This resyncs the two boards but this needs to be improved
 				if (mboard == 1) {
 					usrp->set_time_next_pps(uhd::time_spec_t(0.0), 0);
 					usrp->set_time_next_pps(uhd::time_spec_t(0.0), 1);
 				}
-
-			} else {
-				// Set to unsynced time.
-				std::cout << "\nNO GPS LOCK\n" << std::endl;
-				return ~0;
-			}
-		}	
-	} else {
-		size_t num_mboards = usrp->get_num_mboards();
-		for (size_t mboard = 0; mboard < num_mboards; mboard++) {
-			std::cout << "Setting device timestamp" << std::endl;
-			std::cout << "Synchronizing mboard " << mboard << ": " << usrp->get_mboard_name(mboard) << std::endl;
-			usrp->set_clock_source(ref, mboard);
-			usrp->set_time_source(pps, mboard);
-			// set_sync_source(device_addr_t("clock_source=$CLOCK_SOURCE,time_source=$TIME_SOURCE"))
-			const uhd::time_spec_t last_pps_time = usrp->get_time_last_pps();
-			while (last_pps_time == usrp->get_time_last_pps()){
-				//sleep 100 milliseconds (give or take)
-				std::this_thread::sleep_for (std::chrono::milliseconds(50));
-			}
-			// This command will be processed fairly soon after the last PPS edge:
-			usrp->set_time_next_pps(uhd::time_spec_t(0.0), mboard);
-			// TODO: This resyncs the two boards but this needs to be improved
-			if (mboard == 1) {
-				usrp->set_time_next_pps(uhd::time_spec_t(0.0), 0);
-				usrp->set_time_next_pps(uhd::time_spec_t(0.0), 1);
 			}
 		}
-	}
 	
-	// Once set, we need to wait for the settings to propagate through the system
-	std::this_thread::sleep_for (std::chrono::seconds(1));
-	
-	//set the center frequency
-    std::cout << boost::format("\nSetting RX Freq: %f MHz...") % (freq/1e6) << std::endl;
-    uhd::tune_request_t tune_request(freq);
-    if(vm.count("int-n")) {
-		tune_request.args = uhd::device_addr_t("mode_n=integer");
-	}
-	// We need to address and setup each channel
-	usrp->set_rx_freq(tune_request);
-	std::cout << boost::format("Actual RX Freq: %f MHz...") % (usrp->get_rx_freq()/1e6) << std::endl << std::endl;
-
-    //set the sample rate
-    if (rate <= 0.0){
-        std::cerr << "Please specify a valid sample rate" << std::endl;
-        return ~0;
-    }
-    std::cout << boost::format("Setting RX Rate: %f Msps...") % (rate/1e6) << std::endl;
-	// We need to address and setup each channel
-	usrp->set_rx_rate(rate);
-	std::cout << boost::format("Actual RX Rate: %f Msps...") % (usrp->get_rx_rate()/1e6) << std::endl << std::endl;
+		// Once set, we need to wait for the settings to propagate through the system
+		std::this_thread::sleep_for (std::chrono::seconds(1));
 	
-	//set the IF filter bandwidth, by default it is set to the sampling rate
-	if (bw <= 0.0) {
-		bw = rate;
-	}
-	std::cout << boost::format("Setting RX Bandwidth: %f MHz...") % (bw/1e6) << std::endl;
-	usrp->set_rx_bandwidth(bw);
-	std::cout << boost::format("Actual RX Bandwidth: %f MHz...") % (usrp->get_rx_bandwidth()/1e6) << std::endl << std::endl;
+		//set the center frequency
+	    std::cout << "\nSetting RX Freq..." << std::endl;
+		// We need to address and setup each channel
+		for (size_t i = 0; i < numChannels; i++) {
+			uhd::tune_request_t tune_request(topology[i].freq);
+			if(vm.count("int-n")) {
+				tune_request.args = uhd::device_addr_t("mode_n=integer");
+			}
+			usrp->set_rx_freq(tune_request, i);
+			std::cout << boost::format("Actual Ch %i RX Freq: %f MHz...") % i % (usrp->get_rx_freq(i)/1e6) << std::endl;
+		} std::cout << std::endl;
 
-	double gain = tuneMin;
-	std::cout << "Starting calibration" << std::endl;
-	while (gain <= tuneMax) {
-		//set the rf gain for each channel
-		std::cout << boost::format("\nSetting RX Gain: %f dB...") % gain << std::endl;
-		usrp->set_rx_gain (gain);
-		std::cout << boost::format("Actual RX Gain: %f dB...") % usrp->get_rx_gain() << std::endl << std::endl;
+	    //set the sample rate
+	    if (rate <= 0.0){
+	        std::cerr << "Please specify a valid sample rate" << std::endl;
+	        return ~0;
+	    }
+	    std::cout << boost::format("Setting RX Rate: %f Msps...") % (rate/1e6) << std::endl;
+		for (size_t i = 0; i < numChannels; i++) {
+			usrp->set_rx_rate(rate, i);
+			std::cout << boost::format("Actual Ch %i RX Rate: %f Msps...") % i % (usrp->get_rx_rate(i)/1e6) << std::endl;
+		} std::cout << std::endl;
 	
-		// give the device a little bit of time to configure
-		std::this_thread::sleep_for (std::chrono::milliseconds(100));
+		//set the IF filter bandwidth, by default it is set to the sampling rate
+		if (bw <= 0.0) {
+			bw = rate;
+		}
+		std::cout << boost::format("Setting RX Bandwidth: %f MHz...") % (bw/1e6) << std::endl;
+		for (size_t i = 0; i < numChannels; i++) {
+			usrp->set_rx_bandwidth(bw, i);
+			std::cout << boost::format("Actual Ch %i RX Bandwidth: %f MHz...") % i % (usrp->get_rx_bandwidth(i)/1e6) << std::endl;
+		} std::cout << std::endl;
 		
-		// this will map the subdevice inputs to the input channels and create the input stream
+		// one stream of every channel for each pass
 		uhd::stream_args_t rxStreamArgs ("sc16");
-		rxStreamArgs.channels.push_back(0);
-		uhd::rx_streamer::sptr rxStream = usrp->get_rx_stream (rxStreamArgs);
-		
-		// print some general information
-		unsigned int numRxChannels = rxStream->get_num_channels();
-		
-		// allocate buffers to receive with samples (one buffer per channel)
-		const int samplesPerBuffer = rxStream->get_max_num_samps();
-		std::vector<std::vector<std::complex<short>>> buffs (numRxChannels, std::vector<std::complex<short>> (samplesPerBuffer));
-		std::cout << "Allocated " << numRxChannels << " buffers with " << samplesPerBuffer << " complex short samples" << std::endl;
-
-		// create a vector of pointers to point to each of the channel buffers
-		std::vector<std::complex<short> *> buffPtrs;
-		for (unsigned int i = 0; i < buffs.size(); i++) {
-			//buffPtrs.push_back(buffs[i].data());
-			buffPtrs.push_back(&buffs[i].front());
+		for (size_t i = 0; i < numChannels; i++) {
+			rxStreamArgs.channels.push_back(i);
 		}
-			
-		// allocate one big plain short buffer per channel for the final channels to store to disk
-		int numSamplesToReceive = samplesPerBuffer;
-		if (vm.count("spb")) {
-			numSamplesToReceive = spb;
+		rxStream = usrp->get_rx_stream (rxStreamArgs);
+	}
+	
+	// a gain as the device will apply it
+	auto deviceGain = [&](double gain) {
+		return usrp ? usrp->get_rx_gain_range(0).clip(gain) : gain;
+	};
+	const double sampleRate = usrp ? usrp->get_rx_rate(0) : rate;
+	const uint64_t settleSamples = std::llround(settleTime * sampleRate);
+	const uint64_t measureSamples = total_num_samps;
+	const uint64_t stepSamples = settleSamples + measureSamples;
+	const size_t samplesPerBuffer = vm.count("spb") ? spb : 10 * rxStream->get_max_num_samps();
+	std::vector<std::vector<std::complex<short>>> buffers (numChannels, std::vector<std::complex<short>> (samplesPerBuffer));
+	std::vector<void*> buffPtrs;
+	for (auto& buffer : buffers) {
+		buffPtrs.push_back(buffer.data());
+	}
+	
+	// the first pass, every channel at the same gain
+	std::vector<SweepStep> steps;
+	const double firstStep = coarseSize > stepSize ? coarseSize : stepSize;
+	for (double gain = tuneMin; gain <= tuneMax + 1e-9; gain += firstStep) {
+		steps.push_back(SweepStep {0, std::vector<double> (numChannels, deviceGain(gain)), std::vector<LevelStats> (numChannels)});
+	}
+	const size_t fineSteps = coarseSize > stepSize ? size_t(std::ceil(coarseSize / stepSize - 1e-9)) - 1 : 0;
+	const size_t maxSteps = steps.size() + fineSteps;
+	
+	// the raw samples are optional now that the statistics are computed here
+	std::vector<std::unique_ptr<ChannelWriter>> outfiles;
+	try {
+		for (size_t i = 0; vm.count("raw") and i < numChannels; i++) {
+			outfiles.emplace_back(new ChannelWriter (filePath + "_chan" + std::to_string(i) + ".bin", ChannelWriter::parseMode(ioMode), ioSize, 8,
+													 maxSteps * stepSamples * sizeof(std::complex<short>)));
 		}
-		
-		std::vector<std::vector<short>> fileBuffers (numRxChannels, std::vector<short> (2*numSamplesToReceive));
-
-		// set the total number of samples to receive
-		int totalSamplesToReceive = total_num_samps;
-		
-		// create the start command
-		uhd::stream_cmd_t startCmd = uhd::stream_cmd_t::STREAM_MODE_START_CONTINUOUS;
-		startCmd.stream_now = false;
-		startCmd.time_spec = uhd::time_spec_t (1.9);
-		rxStream->issue_stream_cmd(startCmd);
-		
-		int numSamplesReceived = 0;
-		uhd::rx_metadata_t rxMetadata;
-		
-		// Start receiving
-		// Write metadata to file	
-		std::string filePath (file);
-		std::ofstream metadata;
-		std::string fileName(filePath + "_metadata.txt");
-		metadata.open(fileName);
-		
+	} catch (const std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return ~0;
+	}
+	
+	// Write metadata to file	
+	std::ofstream metadata;
+	metadata.open(filePath + "_metadata.txt");
+	if (usrp) {
 		// TODO: Need the EPOCH parser
 		uhd::sensor_value_t gps_locked = usrp->get_mboard_sensor("gps_locked");
 		uhd::sensor_value_t NMEA = usrp->get_mboard_sensor("gps_gpgga");
@@ -259,67 +337,223 @@ int main (int argc, char* argv[]){
 			metadata << boost::format("Start time: %0.9f") % gps_time.get_real_secs() << std::endl;
 		}
 		metadata << boost::format("%s") % gps_locked.to_pp_string() << std::endl;
-		metadata << boost::format("Total samples per step: %i") % totalSamplesToReceive << std::endl;
-		// TODO: parse NMEA data
-		metadata << boost::format("Lat: %s") % NMEA.to_pp_string() << std::endl;
-		metadata << boost::format("Lon: %s") % NMEA.to_pp_string() << std::endl;
-		metadata << boost::format("Channels: %i") % numRxChannels << std::endl;
-		for (unsigned int i = 0; i < numRxChannels; i++) {
-			metadata << boost::format("Channel %i parameters:") % i << std::endl;
-			metadata << boost::format("Fc: %f [MHz]") % (usrp->get_rx_freq(i)/1e6) << std::endl;
-			metadata << boost::format("BW: %f [MHz]") % (usrp->get_rx_bandwidth(i)/1e6) << std::endl;
-			metadata << boost::format("Fs: %f [Msps]") % (usrp->get_rx_rate(i)/1e6) << std::endl;
-			metadata << boost::format("Min Gain: %f [dB]") % (tuneMin) << std::endl;
-			metadata << boost::format("Max Gain: %f [dB]") % (tuneMax) << std::endl;
-			metadata << boost::format("Step Size: %f [dB]") % (stepSize) << std::endl;
+		metadata << boost::format("GPS NMEA: %s") % NMEA.to_pp_string() << std::endl;
+	} else {
+		metadata << boost::format("Device: simulated (%s)") % simArgs << std::endl;
+	}
+	metadata << boost::format("Total samples per step: %i") % stepSamples << std::endl;
+	metadata << boost::format("Settle samples per step: %i") % settleSamples << std::endl;
+	metadata << boost::format("Channels: %i") % numChannels << std::endl;
+	for (size_t i = 0; i < numChannels; i++) {
+		metadata << boost::format("Channel %i parameters:") % i << std::endl;
+		metadata << boost::format("Port: motherboard %i %s %s") % topology[i].mboard % topology[i].frontend % topology[i].antenna << std::endl;
+		metadata << boost::format("Fc: %f [MHz]") % ((usrp ? usrp->get_rx_freq(i) : topology[i].freq)/1e6) << std::endl;
+		metadata << boost::format("BW: %f [MHz]") % ((usrp ? usrp->get_rx_bandwidth(i) : (bw > 0 ? bw : rate))/1e6) << std::endl;
+		metadata << boost::format("Fs: %f [Msps]") % (sampleRate/1e6) << std::endl;
+	}
+	metadata << boost::format("Min Gain: %f [dB]") % (tuneMin) << std::endl;
+	metadata << boost::format("Max Gain: %f [dB]") % (tuneMax) << std::endl;
+	metadata << boost::format("Step Size: %f [dB]") % (stepSize) << std::endl;
+	metadata << boost::format("Coarse Step Size: %f [dB]") % (coarseSize) << std::endl;
+	metadata << boost::format("Results: %s_sweep.txt, %s_histogram.txt, %s") % filePath % filePath % profileName << std::endl;
+	metadata.close();
+	
+	// runs steps [first, end) as one pass of the stream, returns false if the samples stopped coming
+	auto runPass = [&](size_t first, size_t end) {
+		// gain changes are timed commands on the sample grid, only a few are queued so the device command queue never fills
+		const uhd::time_spec_t startTime = usrp ? usrp->get_time_now() + uhd::time_spec_t(setup_time) : uhd::time_spec_t(setup_time);
+		auto scheduleGains = [&](size_t step, bool timed) {
+			const uhd::time_spec_t at = startTime + uhd::time_spec_t::from_ticks((step - first) * stepSamples, sampleRate);
+			if (usrp and timed) {
+				usrp->set_command_time(at);
+			}
+			for (size_t i = 0; i < numChannels; i++) {
+				if (usrp) {
+					usrp->set_rx_gain(steps[step].gains[i], i);
+				} else if (simStream) {
+					simStream->setGain(i, steps[step].gains[i], at.get_real_secs());
+				}
+			}
+			if (usrp and timed) {
+				usrp->clear_command_time();
+			}
+		};
+		scheduleGains(first, false);
+		size_t scheduled = first;
+		while (scheduled + 1 < end and scheduled < first + lookahead) {
+			scheduleGains(++scheduled, true);
 		}
-		metadata.close();
-				
-		while (numSamplesReceived < totalSamplesToReceive) {
-			int numSamplesForThisBlock = totalSamplesToReceive - numSamplesReceived;
-			// receive a complete buffer or the last missing samples
-			if (numSamplesForThisBlock > samplesPerBuffer) {
-				numSamplesForThisBlock = samplesPerBuffer;
+		
+		uhd::stream_cmd_t startCmd = uhd::stream_cmd_t::STREAM_MODE_START_CONTINUOUS;
+		startCmd.stream_now = false;
+		startCmd.time_spec = startTime;
+		rxStream->issue_stream_cmd(startCmd);
+		
+		const uint64_t passSamples = (end - first) * stepSamples;
+		uint64_t position = 0;
+		uhd::rx_metadata_t rxMetadata;
+		// the first samples only arrive at the start time
+		double recvTimeout = setup_time + 1.0;
+		bool complete = true;
+		while (position < passSamples) {
+			size_t numNewSamples = rxStream->recv(buffPtrs, std::min<uint64_t>(samplesPerBuffer, passSamples - position), rxMetadata, recvTimeout);
+			if (rxMetadata.error_code == uhd::rx_metadata_t::ERROR_CODE_TIMEOUT) {
+				std::cerr << boost::format("\nTimed out at sample %i of %i") % position % passSamples << std::endl;
+				complete = false;
+				break;
+			} else if (rxMetadata.error_code == uhd::rx_metadata_t::ERROR_CODE_OVERFLOW) {
+				// the next block's time puts the sweep back on the grid
+				steps[first + std::min<uint64_t>(position / stepSamples, end - first - 1)].overflows++;
+				continue;
+			} else if (rxMetadata.error_code != uhd::rx_metadata_t::ERROR_CODE_NONE) {
+				std::cerr << boost::format("\nReceive error at sample %i: %s") % position % rxMetadata.strerror() << std::endl;
+				continue;
+			}
+			recvTimeout = 0.1;
+			if (rxMetadata.has_time_spec) {
+				long long ticks = (rxMetadata.time_spec - startTime).to_ticks(sampleRate);
+				position = std::max<long long>(ticks, 0);
 			}
 			
-			// request new data from the uhd driver
-			size_t numNewSamples = rxStream->recv(buffPtrs, numSamplesForThisBlock, rxMetadata);
-			// copy the received samples to the file buffer
-			for (unsigned int i = 0; i < numRxChannels; i++) {
-				// copying complex<short> values to a plain short vector - so 2 shorts to copy for each complex sample
-				short* pDestination 			= fileBuffers[i].data();
-				std::complex<short>* pSource	= buffPtrs[i];
-				memcpy (pDestination, pSource, 2 * numNewSamples * sizeof(short));
-				
-				// write buffer to file
-				// NOTE: currently this is a terrible implementation and will just append to any existing file, this should be fixed
-				std::string filePath (file);
-				std::ofstream outfile;
-				std::string fileName(filePath + "_chan" + std::to_string (i) + ".bin"); 
-				outfile.open(fileName, std::ofstream::app);
-				outfile.write(reinterpret_cast<char*> (fileBuffers[i].data()), 2 * numNewSamples * sizeof (short));
+			// split the block on the step boundaries and skip the start of every step while the gain settles
+			for (uint64_t done = 0; done < numNewSamples and position + done < passSamples; ) {
+				const uint64_t at = position + done;
+				const size_t step = first + at / stepSamples;
+				const uint64_t inStep = at % stepSamples;
+				const uint64_t count = std::min<uint64_t>(numNewSamples - done, stepSamples - inStep);
+				if (inStep + count > settleSamples) {
+					const uint64_t skip = inStep < settleSamples ? settleSamples - inStep : 0;
+					for (size_t i = 0; i < numChannels; i++) {
+						steps[step].stats[i].add(buffers[i].data() + done + skip, count - skip, clipLevel);
+					}
+				}
+				done += count;
 			}
-
-	/*
-			// Write the time to file for sync purposes
-			uhd::sensor_value_t gps_time = usrp->get_mboard_sensor("gps_time");
-			// uhd::sensor_value_t NMEA = usrp->get_mboard_sensor("gps_gpgga");
+			for (size_t i = 0; i < outfiles.size(); i++) {
+				try {
+					outfiles[i]->write(buffers[i].data(), numNewSamples * sizeof(std::complex<short>));
+					// the buffer is reused by the next recv
+					outfiles[i]->sync();
+				} catch (const std::exception& e) {
+					std::cerr << e.what() << std::endl;
+					outfiles.clear();
+					complete = false;
+				}
+			}
+			position += numNewSamples;
 			
-			std::string filePath (file);
-			std::ofstream gps_data;
-			std::string fileName(filePath + "_gpsData.txt");
-			gps_data.open(fileName, std::ofstream::app);
-			gps_data << boost::format("%s") % gps_time.to_pp_string() << std::endl;
-			gps_data.close();		
-	*/
-
-			// increase the received samples count
-			// NOTE: for some reason, this does not always update, this should be investigated
-			numSamplesReceived += numNewSamples;
+			// keep the command queue a few steps ahead of the samples
+			while (scheduled + 1 < end and scheduled < first + position / stepSamples + lookahead) {
+				scheduleGains(++scheduled, true);
+			}
+		}
+		uhd::stream_cmd_t stopCmd = uhd::stream_cmd_t::STREAM_MODE_STOP_CONTINUOUS;
+		stopCmd.stream_now = true;
+		rxStream->issue_stream_cmd(stopCmd);
+		// drop whatever was still in flight
+		while (rxStream->recv(buffPtrs, samplesPerBuffer, rxMetadata, 0.1) > 0) {}
+		return complete;
+	};
+	
+	// the highest gain of a channel that meets the clipping and headroom limits, -1 if none does
+	auto choose = [&](size_t channel) {
+		int best = -1;
+		for (size_t step = 0; step < steps.size(); step++) {
+			const LevelStats& stats = steps[step].stats[channel];
+			if (stats.numSamples > 0 and stats.clipRatio() <= maxClip and stats.peakDbfs() <= -headroom
+				and (best < 0 or steps[step].gains[channel] > steps[best].gains[channel])) {
+				best = step;
+			}
+		}
+		return best;
+	};
+	
+	std::cout << boost::format("Sweeping %i channels over %.1f to %.1f dB in %.1f dB steps, %i samples per step after %i settle samples (%.3f s per step)")
+				 % numChannels % tuneMin % tuneMax % firstStep % measureSamples % settleSamples % (stepSamples / sampleRate) << std::endl;
+	auto sweepStart = std::chrono::steady_clock::now();
+	int status = 0;
+	if (not runPass(0, steps.size())) {
+		status = ~0;
+	} else if (fineSteps > 0) {
+		// each channel steps through the coarse step above its choice, those below tuneMin start at tuneMin
+		const size_t first = steps.size();
+		std::vector<double> base (numChannels);
+		for (size_t i = 0; i < numChannels; i++) {
+			int best = choose(i);
+			base[i] = best < 0 ? tuneMin - stepSize : steps[best].gains[i];
+		}
+		for (size_t k = 1; k <= fineSteps; k++) {
+			steps.push_back(SweepStep {1, std::vector<double> (numChannels), std::vector<LevelStats> (numChannels)});
+			for (size_t i = 0; i < numChannels; i++) {
+				steps.back().gains[i] = deviceGain(std::max(tuneMin, std::min(tuneMax, base[i] + k * stepSize)));
+			}
+		}
+		std::cout << boost::format("Refining every channel in %i steps of %.1f dB") % fineSteps % stepSize << std::endl;
+		if (not runPass(first, steps.size())) {
+			status = ~0;
+		}
+	}
+	double sweepTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - sweepStart).count();
+	
+	try {
+		for (auto& outfile : outfiles) {
+			outfile->close();
+		}
+	} catch (const std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		status = ~0;
+	}
+	
+	// results table, one line per step and channel
+	std::ofstream table (filePath + "_sweep.txt");
+	std::ofstream histogram (filePath + "_histogram.txt");
+	table << boost::format("# usrpTune gain sweep: Fc %f MHz, Fs %f Msps, %i samples per step after %i settle samples, clip level %i")
+			 % ((usrp ? usrp->get_rx_freq(0) : topology[0].freq) / 1e6) % (sampleRate / 1e6) % measureSamples % settleSamples % clipLevel << std::endl;
+	table << "# step\tpass\tchannel\tgain_dB\tsamples\trms_dBFS\tpeak_dBFS\tclipped\tclipped_pct\tbits_used\toverflows" << std::endl;
+	histogram << boost::format("# ADC code histogram per step and channel: step, channel, gain_dB, then %i bins of 1024 codes from -32768 up")
+				 % size_t(LevelStats::HISTOGRAM_BINS) << std::endl;
+	for (size_t step = 0; step < steps.size(); step++) {
+		for (size_t i = 0; i < numChannels; i++) {
+			const LevelStats& stats = steps[step].stats[i];
+			table << boost::format("%i\t%i\t%i\t%.2f\t%i\t%.2f\t%.2f\t%i\t%.4f\t%.1f\t%i")
+					 % step % steps[step].pass % i % steps[step].gains[i] % stats.numSamples % stats.rmsDbfs() % stats.peakDbfs()
+					 % stats.clipped % (100.0 * stats.clipRatio()) % stats.bitsUsed() % steps[step].overflows << std::endl;
+			histogram << boost::format("%i\t%i\t%.2f") % step % i % steps[step].gains[i];
+			for (size_t bin = 0; bin < LevelStats::HISTOGRAM_BINS; bin++) {
+				histogram << "\t" << stats.histogram[bin];
+			}
+			histogram << std::endl;
+		}
+	}
+	if (numChannels == 1) {
+		std::cout << boost::format("\n%6s %10s %10s %9s %8s %6s %9s") % "Gain" % "RMS dBFS" % "Peak dBFS" % "Clipped" % "%" % "Bits" % "Overflows" << std::endl;
+		for (const SweepStep& step : steps) {
+			const LevelStats& stats = step.stats[0];
+			std::cout << boost::format("%6.1f %10.2f %10.2f %9i %8.4f %6.1f %9i")
+						 % step.gains[0] % stats.rmsDbfs() % stats.peakDbfs() % stats.clipped % (100.0 * stats.clipRatio()) % stats.bitsUsed() % step.overflows << std::endl;
+		}
+	}
+	
+	// the profile usrpMultiRecord loads with --gainprofile
+	std::ofstream profile (profileName);
+	profile << boost::format("# usrpTune gain profile: Fc %f MHz, Fs %f Msps, headroom %.1f dB, max clipped %g")
+			   % ((usrp ? usrp->get_rx_freq(0) : topology[0].freq) / 1e6) % (sampleRate / 1e6) % headroom % maxClip << std::endl;
+	profile << "# channel\tgain_dB\trms_dBFS\tpeak_dBFS" << std::endl;
+	std::cout << boost::format("\n%7s %8s %10s %10s") % "Channel" % "Gain" % "RMS dBFS" % "Peak dBFS" << std::endl;
+	for (size_t i = 0; i < numChannels; i++) {
+		int best = choose(i);
+		if (best < 0) {
+			// still write the lowest gain, the recording is better off than at a default
+			std::cout << boost::format("%7i %8s  every gain clipped or lacked headroom, lower --tuneMin") % i % "-" << std::endl;
+			profile << boost::format("%i\t%.2f\tnan\tnan") % i % deviceGain(tuneMin) << std::endl;
+			status = ~0;
+			continue;
 		}
-		std::cout << boost::format("\nGain: %f dB complete") % gain << std::endl;
-		gain = gain + stepSize;
-		std::this_thread::sleep_for (std::chrono::milliseconds(200));
+		const LevelStats& stats = steps[best].stats[i];
+		std::cout << boost::format("%7i %8.1f %10.2f %10.2f") % i % steps[best].gains[i] % stats.rmsDbfs() % stats.peakDbfs() << std::endl;
+		profile << boost::format("%i\t%.2f\t%.2f\t%.2f") % i % steps[best].gains[i] % stats.rmsDbfs() % stats.peakDbfs() << std::endl;
 	}
-    return 0;
-}
\ No newline at end of file
+	std::cout << boost::format("\nSweep of %i steps took %.2f s, results in %s_sweep.txt and %s_histogram.txt, gains in %s")
+				 % steps.size() % sweepTime % filePath % filePath % profileName << std::endl;
+    return status;
+}
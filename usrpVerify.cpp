@@ -0,0 +1,261 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <map>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <boost/program_options.hpp>
+#include <boost/format.hpp>
+
+#include "chunkChecksum.hpp"
+#include "blockIndex.hpp"
+
+namespace po = boost::program_options;
+//==============================================================================
+// Checks a recording against the CRC32C of every chunk usrpMultiRecord wrote
+// to <file>_manifest.txt, for instance after backupToNAS.sh has moved it.
+// Chunks are read and checksummed on every core. The cached pages of a chunk
+// are dropped before it is read, so what is checked is what is on the disk.
+// Bad chunks are reported as sample and device time ranges of their
+// channel, from the recording's index when it is there.
+//
+// A file is looked for where the recorder wrote it and then next to the
+// manifest, which is where it is after a move to another volume.
+
+enum ChunkState {CHUNK_UNCHECKED, CHUNK_OK, CHUNK_BAD, CHUNK_SHORT, CHUNK_MISSING};
+
+static const char* stateNames[] = {"not checked", "ok", "checksum mismatch", "file too short", "file missing"};
+
+struct VerifyFile {
+	std::string path;		// where it was found, empty if nowhere
+	int fd = -1;
+	uint64_t size = 0;
+	uint64_t covered = 0;	// bytes the manifest has checksums for
+};
+
+int main (int argc, char* argv[]){
+	//variables to be set by po
+	std::string file, manifestName;
+	size_t numThreads;
+
+	//setup the program options
+	po::options_description desc("Allowed options");
+	desc.add_options()
+		("help", "help message")
+		("file", po::value<std::string>(&file), "the recording's --file, e.g. /mnt/nas/Bure2020/ettus/20200101120000/DAB")
+		("manifest", po::value<std::string>(&manifestName)->default_value(""), "manifest to check against, <file>_manifest.txt when empty")
+		("threads", po::value<size_t>(&numThreads)->default_value(0), "threads, 0 for every core")
+	;
+	po::variables_map vm;
+	po::store(po::parse_command_line(argc, argv, desc), vm);
+	po::notify(vm);
+
+	//print the help message
+	if (vm.count("help") or file.empty()) {
+		std::cout << boost::format("USRP Verify %s") % desc << std::endl;
+		std::cout << std::endl << "This application checks the channel files of a recording against the checksums taken while recording.\n" << std::endl;
+		return ~0;
+	}
+	if (manifestName.empty()) {
+		manifestName = file + "_manifest.txt";
+	}
+	if (numThreads == 0) {
+		numThreads = std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	std::vector<ManifestEntry> entries;
+	try {
+		entries = loadManifest(manifestName);
+	} catch (const std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return ~0;
+	}
+	if (entries.empty()) {
+		std::cerr << manifestName << " has no chunks" << std::endl;
+		return ~0;
+	}
+
+	// every file once, where it was written or else next to the manifest
+	const size_t slash = manifestName.rfind('/');
+	const std::string manifestDirectory = slash == std::string::npos ? "." : manifestName.substr(0, slash);
+	std::map<std::string, VerifyFile> files;
+	for (const ManifestEntry& entry : entries) {
+		auto known = files.find(entry.file);
+		if (known != files.end()) {
+			known->second.covered = std::max(known->second.covered, entry.offset + entry.bytes);
+			continue;
+		}
+		VerifyFile& found = files[entry.file];
+		found.covered = entry.offset + entry.bytes;
+		for (const std::string& candidate : {entry.file, manifestDirectory + "/" + entry.file.substr(entry.file.rfind('/') + 1)}) {
+			found.fd = ::open(candidate.c_str(), O_RDONLY);
+			if (found.fd >= 0) {
+				struct stat st;
+				fstat(found.fd, &st);
+				found.size = st.st_size;
+				found.path = candidate;
+				break;
+			}
+		}
+		if (found.fd < 0) {
+			std::cerr << "Cannot find " << entry.file << std::endl;
+		}
+	}
+	uint64_t totalBytes = 0, largest = 0;
+	for (const ManifestEntry& entry : entries) {
+		totalBytes += entry.bytes;
+		largest = std::max(largest, entry.bytes);
+	}
+
+	// the chunks go to the threads in manifest order, which is close to the order they were written in
+	std::vector<ChunkState> states (entries.size(), CHUNK_UNCHECKED);
+	std::atomic<size_t> next (0);
+	std::atomic<uint64_t> bytesDone (0);
+	std::atomic<bool> failed (false);
+	std::atomic<size_t> threadsDone (0);
+	auto verify = [&]() {
+		void* memory = nullptr;
+		if (posix_memalign(&memory, 4096, std::max<uint64_t>(largest, 1)) != 0) {
+			failed = true;
+			threadsDone++;
+			return;
+		}
+		std::unique_ptr<char, decltype(&free)> buffer (static_cast<char*>(memory), &free);
+		for (size_t k = next++; k < entries.size(); k = next++) {
+			const ManifestEntry& entry = entries[k];
+			const VerifyFile& found = files.at(entry.file);
+			if (found.fd < 0) {
+				states[k] = CHUNK_MISSING;
+				continue;
+			}
+			posix_fadvise(found.fd, entry.offset, entry.bytes, POSIX_FADV_DONTNEED);
+			uint64_t got = 0;
+			while (got < entry.bytes) {
+				ssize_t n = pread(found.fd, buffer.get() + got, entry.bytes - got, entry.offset + got);
+				if (n < 0 and errno == EINTR) {
+					continue;
+				}
+				if (n <= 0) {
+					break;
+				}
+				got += n;
+			}
+			posix_fadvise(found.fd, entry.offset, entry.bytes, POSIX_FADV_DONTNEED);
+			states[k] = got < entry.bytes ? CHUNK_SHORT : crc32c::checksum(buffer.get(), entry.bytes) == entry.crc ? CHUNK_OK : CHUNK_BAD;
+			bytesDone += entry.bytes;
+		}
+		threadsDone++;
+	};
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < numThreads; t++) {
+		threads.emplace_back(verify);
+	}
+	std::cout << boost::format("Verifying %i chunks of %i files (%.1f GB) with %i threads, CRC32C (%s)")
+				 % entries.size() % files.size() % (totalBytes / 1e9) % numThreads % crc32c::kernel() << std::endl;
+	while (threadsDone < numThreads) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		std::cout << boost::format("\r%.1f of %.1f GB") % (bytesDone / 1e9) % (totalBytes / 1e9) << std::flush;
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+	const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::cout << std::endl;
+	for (auto& found : files) {
+		if (found.second.fd >= 0) {
+			::close(found.second.fd);
+		}
+	}
+	if (failed) {
+		std::cerr << "Cannot allocate the read buffers" << std::endl;
+		return ~0;
+	}
+
+	// the indexes turn sample ranges into device times, channels are numbered across the boards
+	std::vector<std::unique_ptr<IndexReader>> indexes;
+	std::vector<size_t> firstChannels;
+	size_t numChannels = 0;
+	for (size_t mboard = 0; ; mboard++) {
+		std::string indexName = mboard == 0 ? file + "_index.bin" : (boost::format("%s_index_mb%i.bin") % file % mboard).str();
+		struct stat st;
+		if (stat(indexName.c_str(), &st) != 0) {
+			break;
+		}
+		try {
+			indexes.emplace_back(new IndexReader (indexName));
+		} catch (const std::exception& e) {
+			std::cerr << e.what() << std::endl;
+			break;
+		}
+		firstChannels.push_back(numChannels);
+		numChannels += indexes.back()->info().numChannels;
+	}
+	auto deviceTime = [&](size_t channel, uint64_t sample, double& seconds) {
+		for (size_t board = indexes.size(); board-- > 0; ) {
+			if (channel >= firstChannels[board]) {
+				return indexes[board]->deviceTimeForSample(sample, seconds);
+			}
+		}
+		return false;
+	};
+
+	// runs of bad chunks back to back in a file make one range
+	std::vector<size_t> order (entries.size());
+	for (size_t k = 0; k < order.size(); k++) {
+		order[k] = k;
+	}
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+		return entries[a].file < entries[b].file or (entries[a].file == entries[b].file and entries[a].offset < entries[b].offset);
+	});
+	size_t badChunks = 0;
+	uint64_t badBytes = 0;
+	for (size_t k = 0; k < order.size(); ) {
+		const ManifestEntry& first = entries[order[k]];
+		const ChunkState state = states[order[k]];
+		size_t end = k + 1;
+		uint64_t bytes = first.bytes;
+		while (end < order.size() and states[order[end]] == state and entries[order[end]].file == first.file
+			   and entries[order[end]].offset == entries[order[end - 1]].offset + entries[order[end - 1]].bytes) {
+			bytes += entries[order[end]].bytes;
+			end++;
+		}
+		if (state != CHUNK_OK) {
+			const ManifestEntry& last = entries[order[end - 1]];
+			const uint64_t endSample = last.firstSample + last.numSamples;
+			double from, to;
+			std::string when;
+			if (endSample > first.firstSample and deviceTime(first.channel, first.firstSample, from) and deviceTime(first.channel, endSample - 1, to)) {
+				when = (boost::format(", device time %.6f to %.6f s") % from % (to + 1.0 / indexes[0]->info().rate)).str();
+			}
+			std::cout << boost::format("Channel %i, %s: samples %i to %i%s, %i chunks (%.1f MB): %s")
+						 % first.channel % first.file % first.firstSample % endSample % when % (end - k) % (bytes / 1e6) % stateNames[state] << std::endl;
+			badChunks += end - k;
+			badBytes += bytes;
+		}
+		k = end;
+	}
+	for (const auto& found : files) {
+		if (found.second.fd >= 0 and found.second.size > found.second.covered) {
+			std::cout << boost::format("%s: %i bytes after the last chunk have no checksum") % found.second.path % (found.second.size - found.second.covered) << std::endl;
+		}
+	}
+	std::cout << boost::format("Verified %.1f GB in %.1f s (%.0f MB/s): ") % (bytesDone / 1e9) % elapsed % (bytesDone / 1e6 / std::max(elapsed, 1e-9));
+	if (badChunks == 0) {
+		std::cout << boost::format("all %i chunks intact") % entries.size() << std::endl;
+		return 0;
+	}
+	std::cout << boost::format("%i of %i chunks (%.1f MB) bad") % badChunks % entries.size() % (badBytes / 1e6) << std::endl;
+	return ~0;
+}
@@ -0,0 +1,233 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+
+#include <boost/format.hpp>
+
+#include "offloader.hpp"
+#include "preflight.hpp"
+
+//==============================================================================
+// Spreads the channel files of a recording over several directories, normally
+// on different disks (/mnt/speedy and /mnt/fatty). Each new file goes to the
+// volume furthest behind its share of the bytes so far, the shares being the
+// volumes' write bandwidths. A disk three times as fast takes three times the
+// files, and with segments a channel is striped over time as well.
+//
+// At every segment boundary each volume is looked at again. A volume whose
+// blocks took longer to write during the last segment than spillover times
+// what the writers can spend on a block is falling behind. A volume without
+// room for another file plus the reserve is full. Neither gets new files
+// while the others can take them, and a slow volume is tried again one
+// segment later. Files already open stay where they are, so without segments
+// the placement at the start is the only one.
+//
+// Every file goes into <file>_placement.txt with its segment, channel and first
+// sample, which is how readers find it again:
+//   # segment  channel  first sample  file  [why it is not on its usual volume]
+class VolumeSet {
+public:
+	struct Volume {
+		std::string directory;
+		double bandwidth = 1.0;		// bytes per second, only the ratios count
+		uint64_t placedBytes = 0;	// expected bytes of the files placed so far
+		uint64_t pendingBytes = 0;	// placed since the last look, maybe not preallocated yet
+		size_t files = 0, spills = 0;
+		std::atomic<uint64_t> writeMicros {0}, blocks {0};
+		uint64_t lastMicros = 0, lastBlocks = 0;
+		double latency = 0.0;		// seconds per block during the last segment
+		bool slow = false, full = false;
+	};
+
+	// blockBudget is the seconds the writers can spend on one block of one channel and keep up
+	VolumeSet (const std::vector<std::string>& directories, const std::vector<double>& bandwidths, const std::string& placementFile,
+			   uint64_t reserveBytes, double blockBudget, double spillover)
+		: reserve (reserveBytes), budget (blockBudget), spillover (spillover) {
+		if (directories.empty()) {
+			throw std::runtime_error("no volumes to record to");
+		}
+		for (size_t v = 0; v < directories.size(); v++) {
+			Offloader::makeDirectories(directories[v]);
+			volumes.emplace_back();
+			volumes.back().directory = directories[v];
+			volumes.back().bandwidth = v < bandwidths.size() and bandwidths[v] > 0 ? bandwidths[v] : 1.0;
+		}
+		placement.open(placementFile);
+		if (not placement) {
+			throw std::runtime_error("cannot open " + placementFile);
+		}
+		placement << "# segment\tchannel\tfirst sample\tfile\t[why it is not on its usual volume]" << std::endl;
+	}
+
+	VolumeSet (const VolumeSet&) = delete;
+	VolumeSet& operator= (const VolumeSet&) = delete;
+
+	// the volume for a new file of a channel's segment, expected to grow to expectedBytes, path set to its full name
+	size_t place (size_t channel, size_t segment, uint64_t firstSample, uint64_t expectedBytes, const std::string& baseName, std::string& path) {
+		std::lock_guard<std::mutex> guard (lock);
+		// the writers roll over one after another, only the first file of a new segment looks again
+		if (segment > lookedAt) {
+			lookAgain();
+			lookedAt = segment;
+		}
+		// the bandwidth-weighted choice, then the best of those that can take the file
+		size_t usual = 0, best = volumes.size();
+		double usualShare = std::numeric_limits<double>::infinity(), bestShare = usualShare;
+		for (size_t v = 0; v < volumes.size(); v++) {
+			Volume& volume = volumes[v];
+			double share = (volume.placedBytes + expectedBytes) / volume.bandwidth;
+			if (share < usualShare) {
+				usualShare = share;
+				usual = v;
+			}
+			volume.full = not roomFor(volume, expectedBytes);
+			if (not volume.slow and not volume.full and share < bestShare) {
+				bestShare = share;
+				best = v;
+			}
+		}
+		std::string why;
+		if (best == volumes.size()) {
+			// every volume is slow or full, the one with the most room left is still the best bet
+			uint64_t most = 0;
+			best = 0;
+			for (size_t v = 0; v < volumes.size(); v++) {
+				uint64_t room = freeBytes(volumes[v]);
+				if (room > most) {
+					most = room;
+					best = v;
+				}
+			}
+			why = "every volume is slow or full";
+		} else if (best != usual) {
+			why = volumes[usual].slow ? (boost::format("%s falls behind (%.2f ms per block, %.2f ms allowed)") % volumes[usual].directory
+										 % (volumes[usual].latency * 1e3) % (spillover * budget * 1e3)).str()
+									  : volumes[usual].directory + " is full";
+			volumes[best].spills++;
+		}
+		Volume& volume = volumes[best];
+		volume.placedBytes += expectedBytes;
+		volume.pendingBytes += expectedBytes;
+		volume.files++;
+		path = volume.directory + "/" + baseName;
+		placement << boost::format("%i\t%i\t%i\t%s") % segment % channel % firstSample % path;
+		if (not why.empty()) {
+			placement << "\t" << why;
+		}
+		placement << std::endl;
+		return best;
+	}
+
+	// the time a block of one channel took to write, from the writer thread of the channel
+	void record (size_t volume, uint64_t micros, uint64_t blocks) {
+		volumes[volume].writeMicros.fetch_add(micros, std::memory_order_relaxed);
+		volumes[volume].blocks.fetch_add(blocks, std::memory_order_relaxed);
+	}
+
+	size_t size () const { return volumes.size(); }
+	const Volume& volume (size_t v) const { return volumes[v]; }
+
+	void close () {
+		placement.close();
+	}
+
+private:
+	// at a segment boundary, how each volume did during the last segment
+	void lookAgain () {
+		for (Volume& volume : volumes) {
+			uint64_t micros = volume.writeMicros.load(std::memory_order_relaxed), blocks = volume.blocks.load(std::memory_order_relaxed);
+			const bool wasSlow = volume.slow;
+			if (blocks > volume.lastBlocks) {
+				volume.latency = (micros - volume.lastMicros) / 1e6 / (blocks - volume.lastBlocks);
+				volume.slow = volume.latency > spillover * budget;
+			} else {
+				// nothing written there last segment, try it again
+				volume.slow = false;
+			}
+			if (volume.slow and not wasSlow) {
+				std::cout << boost::format("\n%s is falling behind, %.2f ms per block where %.2f ms are allowed, new files go elsewhere")
+							 % volume.directory % (volume.latency * 1e3) % (spillover * budget * 1e3) << std::endl;
+			}
+			volume.lastMicros = micros;
+			volume.lastBlocks = blocks;
+			volume.pendingBytes = 0;
+		}
+	}
+
+	uint64_t freeBytes (const Volume& volume) const {
+		try {
+			return preflight::freeBytes(volume.directory);
+		} catch (const std::exception&) {
+			return 0;
+		}
+	}
+
+	// the file and the reserve fit next to what was placed there since the last look
+	bool roomFor (const Volume& volume, uint64_t bytes) const {
+		return freeBytes(volume) >= reserve + volume.pendingBytes + bytes;
+	}
+
+	std::deque<Volume> volumes;
+	std::ofstream placement;
+	std::mutex lock;
+	uint64_t reserve;
+	double budget;
+	double spillover;
+	size_t lookedAt = 0;
+};
+
+//==============================================================================
+// One line of <file>_placement.txt
+struct Placement {
+	size_t segment = 0;			// 0 for a run without segments
+	size_t channel = 0;
+	uint64_t firstSample = 0;
+	std::string file;			// full path, on whichever volume it went to
+};
+
+// every file the recording <prefix> placed, none if it was not spread over volumes
+inline std::vector<Placement> loadPlacement (const std::string& prefix) {
+	const std::string fileName = prefix + "_placement.txt";
+	std::ifstream in (fileName);
+	std::vector<Placement> placement;
+	std::string line;
+	for (size_t lineNumber = 1; std::getline(in, line); lineNumber++) {
+		if (line.empty() or line[0] == '#') {
+			continue;
+		}
+		std::istringstream fields (line);
+		Placement entry;
+		if (not (fields >> entry.segment >> entry.channel >> entry.firstSample) or fields.get() != '\t' or not std::getline(fields, entry.file, '\t')) {
+			throw std::runtime_error((boost::format("%s:%i: not a placement line") % fileName % lineNumber).str());
+		}
+		placement.push_back(entry);
+	}
+	return placement;
+}
+
+// where the placement put the file of a channel's segment, empty if it has no such file
+inline std::string placedFile (const std::vector<Placement>& placement, size_t segment, size_t channel) {
+	for (const Placement& entry : placement) {
+		if (entry.segment == segment and entry.channel == channel) {
+			return entry.file;
+		}
+	}
+	return std::string();
+}
+
+// where a placed file is once it has gone from its volume, moved by --offloadmode=move or a backup
+// together with the rest of the recording: next to the recording's prefix
+inline std::string besidePrefix (const std::string& prefix, const std::string& path) {
+	const size_t slash = prefix.rfind('/');
+	return (slash == std::string::npos ? std::string() : prefix.substr(0, slash + 1)) + path.substr(path.rfind('/') + 1);
+}